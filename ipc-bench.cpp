@@ -0,0 +1,360 @@
+/**
+ * Benchmark suite of ipc-utils library.
+ *
+ * It measures the shared memory and the message queue by the latency distribution of each operation:
+ *   shmem_write / shmem_read		ShMem::Write() and ShMem::Read() by the element size
+ *   shmem_contended_write / _read	one writer against several reader processes on the same element
+ *   shmem_subscribe			ShMem::Subscribe() of the last element by the number of elements
+ *   msgq_oneway / msgq_roundtrip	MsgQ ping-pong between two processes
+ *   msgq_throughput			MsgQ streaming by the payload size
+ *   log					Log() of a line with 3 arguments, the background writer formats it to /dev/null
+ *
+ * Each result is a line of JSON on stdout, all latencies are in nanoseconds. For example
+ *   {"bench":"shmem_read","size":64,"count":100000,"mean_ns":41,"p50_ns":39,"p99_ns":63,"p999_ns":191,"max_ns":9855}
+ * Keep the output of a known good build and compare the new one against it before the deployment.
+ *
+ * Usage: ipc-bench [iterations]	the iterations of each shared memory case, 100000 by default.
+ *									The message queue cases run 1/10 of them.
+ *
+ * Version 1.0
+ */
+
+#include "ipc-utils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define BENCH_SHMEM "ipc-bench" // the shared memory of the element cases
+#define BENCH_DIRECTORY "ipc-bench-dir" // the shared memory of the subscribe cases
+#define BENCH_RECEIVER "bnch-rx" // the channel of the receiver process
+#define BENCH_SENDER "bnch-tx" // the channel of the sender process
+#define BENCH_MSGSIZE 8192 // the max message size of the benchmark queues
+
+// print a result as a line of JSON
+// @param bench		the name of the case
+// @param param		the name of the parameter of the case, for example "size"
+// @param value		the value of the parameter
+// @param h			the latencies measured
+// @param extra		more fields in JSON appended to the line, starting with ','
+static void Report(const char* bench, const char* param, long value, LatencyHistogram& h, string extra = "")
+{
+	printf("{\"bench\":\"%s\",\"%s\":%ld,\"count\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu%s}\n",
+		bench, param, value,
+		static_cast<unsigned long long>(h.GetCount()),
+		static_cast<unsigned long long>(h.GetMean()),
+		static_cast<unsigned long long>(h.GetPercentile(50)),
+		static_cast<unsigned long long>(h.GetPercentile(99)),
+		static_cast<unsigned long long>(h.GetPercentile(99.9)),
+		static_cast<unsigned long long>(h.GetMax()),
+		extra.c_str());
+	fflush(stdout);
+}
+
+// wait for all the child processes
+static void WaitChildren()
+{
+	while (wait(NULL) > 0)
+	{
+	}
+}
+
+// ShMem::Write() and ShMem::Read() latency by the element size
+// @param iterations	the number of operations of each size
+static void BenchShMemElements(int iterations)
+{
+	const int sizes[] = {8, 64, 256, 1024, 4096, 16384};
+	char buf[16384];
+	memset(buf, 0x5A, sizeof(buf));
+
+	ShMem shm(BENCH_SHMEM);
+	for (int size : sizes)
+	{
+		int id = shm.CreatePublisher("size-" + to_string(size), size);
+		if (id <= 0)
+		{
+			fprintf(stderr, "cannot create the element of %d bytes: %s\n", size, shm.GetErrorMessage().c_str());
+			continue;
+		}
+
+		LatencyHistogram write, read;
+		for (int i = 0; i < iterations; i++)
+		{
+			uint64_t t0 = GetMonotonicTime();
+			shm.Write(id, buf);
+			uint64_t t1 = GetMonotonicTime();
+			shm.Read(id, buf);
+			uint64_t t2 = GetMonotonicTime();
+			write.Record(t1 - t0);
+			read.Record(t2 - t1);
+		}
+		Report("shmem_write", "size", size, write);
+		Report("shmem_read", "size", size, read);
+	}
+}
+
+// one writer against several reader processes on the same element
+// @param iterations	the number of operations of the writer and each reader
+static void BenchShMemContention(int iterations)
+{
+	const int readers[] = {1, 2, 4};
+	char buf[64];
+	memset(buf, 0x5A, sizeof(buf));
+
+	ShMem shm(BENCH_SHMEM);
+	int id = shm.CreatePublisher("contended", sizeof(buf));
+	if (id <= 0)
+	{
+		fprintf(stderr, "cannot create the contended element: %s\n", shm.GetErrorMessage().c_str());
+		return;
+	}
+
+	for (int n : readers)
+	{
+		for (int r = 0; r < n; r++)
+		{
+			if (fork() == 0)
+			{
+				ShMem reader(BENCH_SHMEM);
+				int rid = reader.Subscribe("contended");
+				LatencyHistogram read;
+				for (int i = 0; i < iterations; i++)
+				{
+					uint64_t t0 = GetMonotonicTime();
+					reader.Read(rid, buf);
+					read.Record(GetMonotonicTime() - t0);
+				}
+				Report("shmem_contended_read", "readers", n, read);
+				_exit(0);
+			}
+		}
+
+		LatencyHistogram write;
+		for (int i = 0; i < iterations; i++)
+		{
+			uint64_t t0 = GetMonotonicTime();
+			shm.Write(id, buf);
+			write.Record(GetMonotonicTime() - t0);
+		}
+		WaitChildren();
+		Report("shmem_contended_write", "readers", n, write);
+	}
+}
+
+// ShMem::Subscribe() of the last element by the number of elements
+// @param iterations	the number of lookups of each fill
+static void BenchShMemSubscribe(int iterations)
+{
+	const int fills[] = {1, 16, 64, 128, 250};
+
+	for (int fill : fills)
+	{
+		shm_unlink("/" BENCH_DIRECTORY);
+		ShMem shm(BENCH_DIRECTORY);
+		for (int i = 1; i <= fill; i++)
+		{
+			if (shm.CreatePublisher("element-" + to_string(i), sizeof(int)) <= 0)
+			{
+				fprintf(stderr, "cannot create element %d: %s\n", i, shm.GetErrorMessage().c_str());
+				break;
+			}
+		}
+
+		string last = "element-" + to_string(fill);
+		LatencyHistogram lookup;
+		for (int i = 0; i < iterations; i++)
+		{
+			uint64_t t0 = GetMonotonicTime();
+			int id = shm.Subscribe(last);
+			lookup.Record(GetMonotonicTime() - t0);
+			if (id != fill)
+			{
+				fprintf(stderr, "subscribe %s returns %d: %s\n", last.c_str(), id, shm.GetErrorMessage().c_str());
+				break;
+			}
+		}
+		Report("shmem_subscribe", "elements", fill, lookup);
+	}
+	shm_unlink("/" BENCH_DIRECTORY);
+}
+
+// start the receiver process of the message queue cases. It echoes MSG_QUERY, counts MSG_DATA, and reports the counting by MSG_STOP.
+// @param iterations	the number of ping-pong for the one-way latency report
+// @return				the pid of the receiver
+static pid_t StartReceiver(int iterations)
+{
+	pid_t pid = fork();
+	if (pid)
+	{
+		return pid;
+	}
+
+	MsgQ rx(BENCH_RECEIVER, 1000000L, MQ_DEFAULT_MAXMSG, BENCH_MSGSIZE);
+	rx.SendMsg(BENCH_SENDER, MSG_ONBOARD, 0, NULL);
+	LatencyHistogram oneway;
+	char buf[BENCH_MSGSIZE];
+	string sender;
+	int type = 0;
+	int len = 0;
+	int count = 0;
+	while (true)
+	{
+		int chn = rx.ReceiveMsg(&sender, &type, &len, buf, sizeof(buf));
+		if (chn <= 0)
+		{
+			continue;
+		}
+
+		if (type == MSG_QUERY)
+		{
+			uint64_t ts = 0;
+			memcpy(&ts, buf, sizeof(ts));
+			oneway.Record(GetMonotonicTime() - ts);
+			rx.SendMsg(chn, MSG_UPDATE, len, buf);
+			if (oneway.GetCount() == static_cast<uint64_t>(iterations))
+			{
+				Report("msgq_oneway", "size", len, oneway);
+			}
+		}
+		else if (type == MSG_DATA)
+		{
+			count++;
+		}
+		else if (type == MSG_STOP)
+		{
+			rx.SendMsg(chn, MSG_STOP, sizeof(count), &count, MSG_PRIORITY_LOW);
+			count = 0;
+		}
+		else if (type == MSG_DOWN)
+		{
+			break;
+		}
+	}
+	_exit(0);
+}
+
+// MsgQ one-way and round-trip latency, and the throughput by the payload size
+// @param iterations	the number of messages of each case
+static void BenchMsgQ(int iterations)
+{
+	const int sizes[] = {16, 256, 1024, 4096};
+	char buf[BENCH_MSGSIZE];
+	memset(buf, 0x5A, sizeof(buf));
+	string sender;
+	int type = 0;
+	int len = 0;
+
+	// the receiver is onboard after the sender queue is created
+	MsgQ tx(BENCH_SENDER, 1000000L, MQ_DEFAULT_MAXMSG, BENCH_MSGSIZE);
+	fflush(stdout);
+	pid_t pid = StartReceiver(iterations);
+	if (tx.ReceiveMsg(&sender, &type, &len, buf, sizeof(buf)) <= 0 || type != MSG_ONBOARD)
+	{
+		fprintf(stderr, "the receiver is not onboard: %s\n", tx.GetErrorMessage().c_str());
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	// ping-pong, the receiver reports the one-way latency from the timestamp in the data
+	LatencyHistogram roundtrip;
+	for (int i = 0; i < iterations; i++)
+	{
+		uint64_t t0 = GetMonotonicTime();
+		memcpy(buf, &t0, sizeof(t0));
+		if (tx.SendMsg(BENCH_RECEIVER, MSG_QUERY, sizeof(t0), buf) <= 0 || tx.ReceiveMsg(&sender, &type, &len, buf, sizeof(buf)) <= 0)
+		{
+			fprintf(stderr, "ping-pong fails: %s\n", tx.GetErrorMessage().c_str());
+			break;
+		}
+		roundtrip.Record(GetMonotonicTime() - t0);
+	}
+	Report("msgq_roundtrip", "size", sizeof(uint64_t), roundtrip);
+
+	// streaming, a sending timed out by the full queue of the receiver is retried and counted
+	for (int size : sizes)
+	{
+		LatencyHistogram send;
+		int retries = 0;
+		uint64_t start = GetMonotonicTime();
+		for (int i = 0; i < iterations; i++)
+		{
+			uint64_t t0 = GetMonotonicTime();
+			while (tx.SendMsg(BENCH_RECEIVER, MSG_DATA, size, buf, MSG_PRIORITY_LOW) <= 0)
+			{
+				retries++;
+			}
+			send.Record(GetMonotonicTime() - t0);
+		}
+
+		int count = 0;
+		while (tx.SendMsg(BENCH_RECEIVER, MSG_STOP, 0, NULL, MSG_PRIORITY_LOW) <= 0)
+		{
+			retries++;
+		}
+		while (tx.ReceiveMsg(&sender, &type, &len, &count, sizeof(count)) > 0 && type != MSG_STOP)
+		{
+		}
+		double secs = (GetMonotonicTime() - start) / 1e9;
+
+		char extra[160];
+		snprintf(extra, sizeof(extra), ",\"received\":%d,\"retries\":%d,\"msgs_per_sec\":%.0f,\"mb_per_sec\":%.1f",
+			count, retries, count / secs, count * static_cast<double>(size) / secs / 1e6);
+		Report("msgq_throughput", "size", size, send, extra);
+	}
+
+	tx.SendMsg(BENCH_RECEIVER, MSG_DOWN, 0, NULL, MSG_PRIORITY_LOW);
+	waitpid(pid, NULL, 0);
+}
+
+// Log() latency, in rounds that the ring of the thread never fills
+// @param iterations	the number of lines
+static void BenchLog(int iterations)
+{
+	if (StartLogger("/dev/null") < 0)
+	{
+		fprintf(stderr, "cannot start the logger\n");
+		return;
+	}
+
+	LatencyHistogram log;
+	for (int i = 0; i < iterations; i++)
+	{
+		uint64_t t0 = GetMonotonicTime();
+		Log("sample %d of %s at %f", i, "speed", i * 0.5);
+		log.Record(GetMonotonicTime() - t0);
+		if (i % 5000 == 4999)
+		{
+			usleep(LOG_INTERVAL * 5);
+		}
+	}
+	StopLogger();
+
+	char extra[64];
+	snprintf(extra, sizeof(extra), ",\"dropped\":%llu", static_cast<unsigned long long>(GetLogDropped()));
+	Report("log", "args", 3, log, extra);
+}
+
+int main(int argc, char* argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+	if (iterations <= 0)
+	{
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	shm_unlink("/" BENCH_SHMEM);
+	BenchShMemElements(iterations);
+	BenchShMemContention(iterations);
+	BenchShMemSubscribe(iterations);
+	BenchMsgQ(iterations / 10 > 0 ? iterations / 10 : 1);
+	BenchLog(iterations);
+	shm_unlink("/" BENCH_SHMEM);
+
+	return 0;
+}
@@ -0,0 +1,690 @@
+/**
+ * ipc-bridge mirrors ShMem elements and MsgQ channels of ipc-utils library to a peer bridge over a socket.
+ *
+ * Two bridges are connected by a UNIX domain socket or a loopback TCP connection, one listens and the other connects.
+ * The processes on both sides keep using ShMem and MsgQ as they are, the bridges make the remote ones look local.
+ *
+ * The exported elements are read at every wakeup, only the ones changed since last sent are sent. The writes between
+ * two wakeups are coalesced, the peer sees the latest value. The peer bridge creates the elements in its shared memory
+ * of the same title, and writes the values received into them.
+ *
+ * Every channel exported by -q is served by a proxy queue of the same name. The messages sent to the proxy are sent by
+ * the peer bridge to the real channel on its side, from a proxy queue named after the original sender. So the replies
+ * find their way back the same way, with the correlation IDs of the requests kept. Channel names shall be unique on
+ * both sides, a real channel and a proxy of the same name cannot live together.
+ *
+ * All the frames of one wakeup are batched into one socket write. The frames are in the byte order of the host, the
+ * bridges are meant for the same host or the same kind of hosts.
+ *
+ * Usage: ipc-bridge (-l address | -c address) [-e title/element]... [-q channel]... [-i interval]
+ *		-l	listen on the address for the peer bridge
+ *		-c	connect to the peer bridge at the address, retried every second
+ *		-e	export a shared element, the element may be created later
+ *		-q	export a message channel
+ *		-i	the interval in microseconds to check the exported elements, 1000 by default
+ * An address with a '/' is the path of a UNIX domain socket, otherwise it is "host:port" or "port" of TCP on 127.0.0.1
+ *
+ * Version 1.0
+ */
+
+#include "ipc-utils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+#define BRIDGE_ELEMENT 1 // the frame of a shared element
+#define BRIDGE_MESSAGE 2 // the frame of a message
+#define BRIDGE_RETRY_USEC 1000000 // the time to wait before the connecting is retried
+#define BRIDGE_MAX_PENDING 4194304 // the bytes waiting for the socket, the queues and the elements are left alone beyond it
+#define BRIDGE_SENDQUEUE 64 // the depth of the send queue of a proxy, the peer is never blocked by a slow receiver
+#define BRIDGE_READSIZE 65536 // the bytes read from the socket at once
+
+// the header of a frame, followed by the data
+struct bridge_frame
+{
+	uint32_t len; // the length of the data
+	uint16_t kind; // BRIDGE_ELEMENT or BRIDGE_MESSAGE
+	uint16_t type; // the size of an element, 0 for a string, or the type of a message
+	uint32_t corr; // the correlation ID of a request or a reply
+	uint16_t flags; // MQ_FLAG_REQUEST or MQ_FLAG_REPLY of a message
+	uint16_t priority; // the priority of a message
+	char dest[16]; // the title of an element, or the destnation of a message
+	char name[16]; // the name of an element, or the sender of a message
+};
+
+// an exported element
+struct bridge_export
+{
+	string title;
+	string name;
+	ShMem* shm = NULL;
+	int id = -1; // the publisher ID, negtive till the element is created
+	bool sent = false; // the value has been sent since connected
+	string value; // the last value sent
+};
+
+// the counters printed when the bridge exits
+struct bridge_stats
+{
+	uint64_t batches = 0; // the socket writes
+	uint64_t framesOut = 0;
+	uint64_t framesIn = 0;
+	uint64_t elementsOut = 0;
+	uint64_t elementsIn = 0;
+	uint64_t messagesOut = 0;
+	uint64_t messagesIn = 0;
+	uint64_t dropped = 0; // the messages from the peer that cannot be sent
+	uint64_t connects = 0;
+};
+
+static volatile sig_atomic_t s_stop = 0;
+
+static void OnSignal(int)
+{
+	s_stop = 1;
+}
+
+// copy a name into a frame field
+// @param field		the field of the frame, 16 characters
+// @param name		the name, cut to 15 characters
+static void SetName(char* field, const string& name)
+{
+	memset(field, 0, 16);
+	memcpy(field, name.data(), name.length() < 16 ? name.length() : 15);
+}
+
+// take a name from a frame field
+// @param field		the field of the frame, not always terminated
+// @return			the name
+static string GetName(const char* field)
+{
+	return string(field, strnlen(field, 16));
+}
+
+// append a frame to the output
+// @param out		the output
+// @param frame		the header of the frame, its len is the length of the data
+// @param data		the data
+static void AppendFrame(string* out, const bridge_frame& frame, const void* data)
+{
+	out->append(reinterpret_cast<const char*>(&frame), sizeof(frame));
+	out->append(static_cast<const char*>(data), frame.len);
+}
+
+// open a socket for the peer bridge
+// @param address	the path of a UNIX domain socket, or "host:port" or "port" of TCP
+// @param listening	true to listen on the address, false to connect to it
+// @return			the descriptor, negtive for error
+static int OpenSocket(const string& address, bool listening)
+{
+	bool tcp = address.find('/') == string::npos;
+	int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	sockaddr_storage addr;
+	socklen_t addrlen;
+	memset(&addr, 0, sizeof(addr));
+	if (tcp)
+	{
+		sockaddr_in* in = reinterpret_cast<sockaddr_in*>(&addr);
+		size_t colon = address.rfind(':');
+		string host = colon == string::npos ? "127.0.0.1" : address.substr(0, colon);
+		in->sin_family = AF_INET;
+		in->sin_port = htons(static_cast<uint16_t>(atoi(address.c_str() + (colon == string::npos ? 0 : colon + 1))));
+		if (inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1)
+		{
+			close(fd);
+			return -2;
+		}
+		addrlen = sizeof(sockaddr_in);
+
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	}
+	else
+	{
+		sockaddr_un* un = reinterpret_cast<sockaddr_un*>(&addr);
+		if (address.length() >= sizeof(un->sun_path))
+		{
+			close(fd);
+			return -2;
+		}
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, address.c_str());
+		addrlen = sizeof(sockaddr_un);
+
+		if (listening)
+		{
+			unlink(address.c_str()); // the socket left by last run
+		}
+	}
+
+	if (listening)
+	{
+		if (bind(fd, reinterpret_cast<sockaddr*>(&addr), addrlen) < 0 || listen(fd, 1) < 0)
+		{
+			close(fd);
+			return -3;
+		}
+	}
+	else if (connect(fd, reinterpret_cast<sockaddr*>(&addr), addrlen) < 0)
+	{
+		close(fd);
+		return -4;
+	}
+	return fd;
+}
+
+// get ready a connected socket, the Nagle's algorithm is turned off for the latency
+// @param fd		the connected socket
+static void SetupConnection(int fd)
+{
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // fails harmlessly for a UNIX domain socket
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// the bridge between the local ShMem and MsgQ and the peer bridge
+class Bridge
+{
+public:
+	Bridge() : m_buf(MAX_FRAGMENTEDLENGTH) {};
+	~Bridge();
+
+	// export an element, "title/element"
+	// @return			0 for success, negtive for an invalid name
+	int ExportElement(const string& spec);
+
+	// export a channel
+	// @return			0 for success, negtive for error
+	int ExportChannel(const string& name);
+
+	// run the bridge with a connected socket till it is closed or the bridge is stopped
+	// @param fd		the connected socket
+	// @param interval	the interval in microseconds to check the exported elements
+	void Run(int fd, long interval);
+
+	bridge_stats m_stats;
+
+private:
+	ShMem* GetShMem(const string& title);
+	MsgQ* GetProxy(const string& name);
+	void CollectMessages(string* out);
+	void CollectElements(string* out);
+	void Deliver(const bridge_frame& frame, const char* data);
+
+	vector<bridge_export> m_exports;
+	map<string, ShMem*> m_shms; // the shared memory by title
+	map<string, int> m_mirrors; // the publisher IDs of the elements received by "title/element"
+	map<string, MsgQ*> m_proxies; // the proxy queues by name
+	vector<char> m_buf; // the data of a message
+	string m_value; // the value of an element
+};
+
+Bridge::~Bridge()
+{
+	for (map<string, MsgQ*>::iterator it = m_proxies.begin(); it != m_proxies.end(); ++it)
+	{
+		delete it->second;
+	}
+	for (map<string, ShMem*>::iterator it = m_shms.begin(); it != m_shms.end(); ++it)
+	{
+		delete it->second;
+	}
+}
+
+int Bridge::ExportElement(const string& spec)
+{
+	size_t slash = spec.find('/');
+	if (slash == string::npos || slash == 0 || slash > 15 || spec.length() - slash - 1 == 0 || spec.length() - slash - 1 > 15)
+	{
+		return -1;
+	}
+
+	bridge_export e;
+	e.title = spec.substr(0, slash);
+	e.name = spec.substr(slash + 1);
+	e.shm = GetShMem(e.title);
+	m_exports.push_back(e);
+	return 0;
+}
+
+int Bridge::ExportChannel(const string& name)
+{
+	if (name.empty() || name.length() > 8)
+	{
+		return -1;
+	}
+	return GetProxy(name) ? 0 : -2;
+}
+
+ShMem* Bridge::GetShMem(const string& title)
+{
+	map<string, ShMem*>::iterator it = m_shms.find(title);
+	if (it != m_shms.end())
+	{
+		return it->second;
+	}
+	ShMem* shm = new ShMem(title);
+	m_shms[title] = shm;
+	return shm;
+}
+
+MsgQ* Bridge::GetProxy(const string& name)
+{
+	map<string, MsgQ*>::iterator it = m_proxies.find(name);
+	if (it != m_proxies.end())
+	{
+		return it->second;
+	}
+
+	MsgQ* q = new MsgQ(name);
+	if (q->GetReceiveFd() < 0)
+	{
+		fprintf(stderr, "cannot open the proxy queue %s, %s\n", name.c_str(), q->GetErrorMessage().c_str());
+		delete q;
+		return NULL;
+	}
+	q->EnableSendQueue(BRIDGE_SENDQUEUE, false);
+	m_proxies[name] = q;
+	return q;
+}
+
+// take the messages waiting in the proxy queues
+// @param out		the output the frames are appended to
+void Bridge::CollectMessages(string* out)
+{
+	string sender;
+	int type;
+	int len;
+	for (map<string, MsgQ*>::iterator it = m_proxies.begin(); it != m_proxies.end() && out->size() < BRIDGE_MAX_PENDING; ++it)
+	{
+		MsgQ* q = it->second;
+		while (out->size() < BRIDGE_MAX_PENDING && q->PollMsg(&sender, &type, &len, m_buf.data(), static_cast<int>(m_buf.size())) > 0)
+		{
+			bridge_frame frame;
+			memset(&frame, 0, sizeof(frame));
+			frame.len = static_cast<uint32_t>(len);
+			frame.kind = BRIDGE_MESSAGE;
+			frame.type = static_cast<uint16_t>(type);
+			frame.corr = q->GetMsgCorrelation();
+			frame.flags = static_cast<uint16_t>(q->GetMsgFlags() & (MQ_FLAG_REQUEST | MQ_FLAG_REPLY));
+			frame.priority = static_cast<uint16_t>(q->GetMsgPriority());
+			SetName(frame.dest, it->first);
+			SetName(frame.name, sender);
+			AppendFrame(out, frame, m_buf.data());
+			m_stats.framesOut++;
+			m_stats.messagesOut++;
+		}
+	}
+}
+
+// take the exported elements changed since last sent
+// @param out		the output the frames are appended to
+void Bridge::CollectElements(string* out)
+{
+	for (size_t i = 0; i < m_exports.size(); i++)
+	{
+		bridge_export& e = m_exports[i];
+		if (e.id <= 0)
+		{
+			e.id = e.shm->Subscribe(e.name.c_str());
+			if (e.id <= 0)
+			{
+				continue; // not created yet
+			}
+		}
+
+		int size = e.shm->GetElementSize(e.id);
+		if (size < 0)
+		{
+			continue;
+		}
+		if (size)
+		{
+			m_value.resize(size);
+			if (e.shm->Read(e.id, &m_value[0]) < 0)
+			{
+				continue; // written too fast, it is read again at next wakeup
+			}
+		}
+		else if (e.shm->Read(e.id, &m_value) < 0)
+		{
+			continue;
+		}
+
+		if (e.sent && e.value == m_value)
+		{
+			continue;
+		}
+		e.value = m_value;
+		e.sent = true;
+
+		bridge_frame frame;
+		memset(&frame, 0, sizeof(frame));
+		frame.len = static_cast<uint32_t>(m_value.length());
+		frame.kind = BRIDGE_ELEMENT;
+		frame.type = static_cast<uint16_t>(size);
+		SetName(frame.dest, e.title);
+		SetName(frame.name, e.name);
+		AppendFrame(out, frame, m_value.data());
+		m_stats.framesOut++;
+		m_stats.elementsOut++;
+	}
+}
+
+// deliver a frame from the peer
+// @param frame		the header of the frame
+// @param data		the data of the frame
+void Bridge::Deliver(const bridge_frame& frame, const char* data)
+{
+	string dest = GetName(frame.dest);
+	string name = GetName(frame.name);
+	m_stats.framesIn++;
+
+	if (frame.kind == BRIDGE_ELEMENT)
+	{
+		ShMem* shm = GetShMem(dest);
+		string key = dest + "/" + name;
+		map<string, int>::iterator it = m_mirrors.find(key);
+		int id = it == m_mirrors.end() ? shm->CreatePublisher(name, frame.type) : it->second;
+		if (id <= 0)
+		{
+			fprintf(stderr, "cannot create the element %s, %s\n", key.c_str(), shm->GetErrorMessage().c_str());
+			return;
+		}
+		m_mirrors[key] = id;
+
+		string value(data, frame.len);
+		if (frame.type)
+		{
+			if (value.length() != frame.type || shm->GetElementSize(id) != frame.type)
+			{
+				return; // an element of another size on this side
+			}
+			shm->Write(id, &value[0]);
+		}
+		else
+		{
+			shm->Write(id, value);
+		}
+		m_stats.elementsIn++;
+
+		// an element exported by both sides is not sent back
+		for (size_t i = 0; i < m_exports.size(); i++)
+		{
+			if (m_exports[i].title == dest && m_exports[i].name == name)
+			{
+				m_exports[i].value = value;
+				m_exports[i].sent = true;
+			}
+		}
+		return;
+	}
+
+	if (frame.kind != BRIDGE_MESSAGE)
+	{
+		return;
+	}
+
+	// the message is sent from the proxy of its sender, so the replies come back to the proxy
+	MsgQ* q = GetProxy(name);
+	int chn = q ? q->GetDestChannel(dest.c_str()) : -1;
+	int result = -1;
+	void* payload = const_cast<char*>(data);
+	if (chn > 0)
+	{
+		if (frame.flags & MQ_FLAG_REQUEST)
+		{
+			result = q->SendRequest(chn, frame.corr, frame.type, frame.len, payload, frame.priority);
+		}
+		else if (frame.flags & MQ_FLAG_REPLY)
+		{
+			result = q->SendReply(chn, frame.corr, frame.type, frame.len, payload, frame.priority);
+		}
+		else
+		{
+			result = q->SendMsg(chn, frame.type, frame.len, payload, frame.priority);
+		}
+	}
+
+	if (result < 0)
+	{
+		m_stats.dropped++;
+		return;
+	}
+	m_stats.messagesIn++;
+}
+
+void Bridge::Run(int fd, long interval)
+{
+	// everything is sent again to a new peer
+	for (size_t i = 0; i < m_exports.size(); i++)
+	{
+		m_exports[i].sent = false;
+	}
+
+	string out; // the bytes waiting for the socket
+	string in; // the bytes of the incomplete frame
+	vector<char> chunk(BRIDGE_READSIZE);
+	vector<pollfd> fds;
+	timespec timeout;
+	timeout.tv_sec = interval / 1000000;
+	timeout.tv_nsec = interval % 1000000 * 1000;
+
+	while (!s_stop)
+	{
+		// wake up for the peer, the messages to the proxies, or the interval of the elements
+		fds.clear();
+		pollfd p;
+		p.fd = fd;
+		p.events = static_cast<short>(POLLIN | (out.empty() ? 0 : POLLOUT));
+		p.revents = 0;
+		fds.push_back(p);
+		if (out.size() < BRIDGE_MAX_PENDING)
+		{
+			for (map<string, MsgQ*>::iterator it = m_proxies.begin(); it != m_proxies.end(); ++it)
+			{
+				p.fd = it->second->GetReceiveFd();
+				p.events = POLLIN;
+				fds.push_back(p);
+			}
+		}
+		if (ppoll(fds.data(), fds.size(), &timeout, NULL) < 0 && errno != EINTR)
+		{
+			break;
+		}
+
+		// the frames from the peer
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			ssize_t n = read(fd, chunk.data(), chunk.size());
+			if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+			{
+				break;
+			}
+			if (n > 0)
+			{
+				in.append(chunk.data(), n);
+				size_t pos = 0;
+				while (in.size() - pos >= sizeof(bridge_frame))
+				{
+					bridge_frame frame;
+					memcpy(&frame, in.data() + pos, sizeof(frame));
+					if (frame.len > MAX_FRAGMENTEDLENGTH)
+					{
+						fprintf(stderr, "invalid frame of %u bytes from the peer\n", frame.len);
+						return;
+					}
+					if (in.size() - pos < sizeof(frame) + frame.len)
+					{
+						break;
+					}
+					Deliver(frame, in.data() + pos + sizeof(frame));
+					pos += sizeof(frame) + frame.len;
+				}
+				in.erase(0, pos);
+			}
+		}
+
+		// the messages to the peer, and the elements changed, in one batch
+		if (out.size() < BRIDGE_MAX_PENDING)
+		{
+			CollectMessages(&out);
+			CollectElements(&out);
+		}
+		if (!out.empty())
+		{
+			ssize_t n = write(fd, out.data(), out.size());
+			if (n < 0 && errno != EAGAIN && errno != EINTR)
+			{
+				break;
+			}
+			if (n > 0)
+			{
+				out.erase(0, n);
+				m_stats.batches++;
+			}
+		}
+
+		// the messages to the slow receivers
+		for (map<string, MsgQ*>::iterator it = m_proxies.begin(); it != m_proxies.end(); ++it)
+		{
+			if (it->second->GetPendingSends())
+			{
+				it->second->FlushSendQueue();
+			}
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	string address;
+	bool listening = false;
+	long interval = 1000;
+	vector<string> elements;
+	vector<string> channels;
+	int opt;
+	while ((opt = getopt(argc, argv, "l:c:e:q:i:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'l':
+			listening = true;
+			address = optarg;
+			break;
+		case 'c':
+			address = optarg;
+			break;
+		case 'e':
+			elements.push_back(optarg);
+			break;
+		case 'q':
+			channels.push_back(optarg);
+			break;
+		case 'i':
+			interval = atol(optarg);
+			break;
+		default:
+			address.clear();
+			break;
+		}
+	}
+	if (address.empty() || interval <= 0)
+	{
+		fprintf(stderr, "Usage: %s (-l address | -c address) [-e title/element]... [-q channel]... [-i interval]\n", argv[0]);
+		return 1;
+	}
+
+	Bridge bridge;
+	for (size_t i = 0; i < elements.size(); i++)
+	{
+		if (bridge.ExportElement(elements[i]) < 0)
+		{
+			fprintf(stderr, "invalid element %s, title/element of 1-15 characters each\n", elements[i].c_str());
+			return 1;
+		}
+	}
+	for (size_t i = 0; i < channels.size(); i++)
+	{
+		if (bridge.ExportChannel(channels[i]) < 0)
+		{
+			fprintf(stderr, "cannot export the channel %s\n", channels[i].c_str());
+			return 1;
+		}
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = OnSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = -1;
+	if (listening)
+	{
+		listener = OpenSocket(address, true);
+		if (listener < 0)
+		{
+			fprintf(stderr, "cannot listen on %s, %s\n", address.c_str(), strerror(errno));
+			return 1;
+		}
+	}
+
+	while (!s_stop)
+	{
+		int fd = listening ? accept4(listener, NULL, NULL, SOCK_CLOEXEC) : OpenSocket(address, false);
+		if (fd < 0)
+		{
+			if (!listening)
+			{
+				usleep(BRIDGE_RETRY_USEC);
+			}
+			continue;
+		}
+
+		SetupConnection(fd);
+		bridge.m_stats.connects++;
+		fprintf(stderr, "connected to the peer at %s\n", address.c_str());
+		bridge.Run(fd, interval);
+		close(fd);
+		if (!s_stop)
+		{
+			fprintf(stderr, "disconnected from the peer at %s\n", address.c_str());
+		}
+	}
+
+	if (listener >= 0)
+	{
+		close(listener);
+		if (address.find('/') != string::npos)
+		{
+			unlink(address.c_str());
+		}
+	}
+
+	const bridge_stats& s = bridge.m_stats;
+	fprintf(stderr, "connects %llu, batches %llu, frames out %llu in %llu, elements out %llu in %llu, messages out %llu in %llu, dropped %llu\n",
+		(unsigned long long)s.connects, (unsigned long long)s.batches, (unsigned long long)s.framesOut, (unsigned long long)s.framesIn,
+		(unsigned long long)s.elementsOut, (unsigned long long)s.elementsIn, (unsigned long long)s.messagesOut,
+		(unsigned long long)s.messagesIn, (unsigned long long)s.dropped);
+	return 0;
+}
@@ -0,0 +1,487 @@
+#pragma once
+// C++20 coroutine API for MsgQ. The library itself stays C++11, this header is only compiled by C++20 users.
+//
+// 	1.	A MsgQExecutor runs many coroutines on one thread. A coroutine waiting for a queue is parked on the descriptor
+//		of the queue in an epoll set, so that thousands of conversations share one thread without blocking it.
+//	2.	A coroutine is a MsgQTask started by MsgQExecutor::Spawn(). It awaits AsyncMsgQ::Receive() and AsyncMsgQ::Send().
+//	3.	A MsgQ is not thread safe. Use it from the coroutines of one executor only. Run more executors on more threads.
+//	4.	A sending blocked by the credits of its destnation is retried every MQ_RETRY_INTERVAL, as the send queue does.
+//		Nothing signals the credits granted back by the receiver, and its queue stays writable while they are short.
+//
+//	5.	Pass the state of a coroutine as its parameters. The captures of a lambda coroutine are gone with the lambda.
+//
+//	MsgQTask Echo(AsyncMsgQ* q)
+//	{
+//		while (true)
+//		{
+//			MsgQMessage msg = co_await q->Receive();
+//			co_await q->Send(msg.chn, MSG_DATA, msg.len, msg.data.data());
+//		}
+//	}
+//
+//	MsgQExecutor ex;
+//	AsyncMsgQ q(&server);
+//	ex.Spawn(Echo(&q));
+//	ex.Run();
+
+#if __cplusplus >= 202002L
+
+#include <coroutine>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+#include <cerrno>
+#include <sys/epoll.h>
+#include "ipc-utils.h"
+
+class MsgQExecutor;
+
+// a coroutine started by MsgQExecutor::Spawn(). Its frame is destroyed when it finishes.
+struct MsgQTask
+{
+	struct promise_type
+	{
+		MsgQExecutor* executor = NULL;
+
+		MsgQTask get_return_object() {return MsgQTask{std::coroutine_handle<promise_type>::from_promise(*this)};};
+		std::suspend_always initial_suspend() noexcept {return {};};
+		auto final_suspend() noexcept;
+		void return_void() {};
+		void unhandled_exception() {std::terminate();};
+	};
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+// an operation waiting for a queue descriptor in MsgQExecutor
+struct msgq_waiter
+{
+	int fd; // the descriptor of the queue
+	uint32_t events; // EPOLLIN for receiving, EPOLLOUT for sending, 0 for retrying by the timer only
+	int64_t deadline; // the deadline in CLOCK_MONOTONIC nanoseconds, 0 for no timeout
+	int64_t retry = 0; // the time in CLOCK_MONOTONIC nanoseconds to try again a waiter without events
+	std::coroutine_handle<> handle;
+	std::multimap<int64_t, msgq_waiter*>::iterator timer;
+
+	virtual ~msgq_waiter() {};
+
+	// try the operation once the descriptor is ready
+	// @return			true when the operation is completed, false to keep waiting
+	virtual bool Try() = 0;
+
+	// complete the operation at its deadline
+	virtual void Expire() = 0;
+};
+
+// the executor running coroutines on the calling thread, parking them on queue descriptors with epoll
+class MsgQExecutor
+{
+public:
+	MsgQExecutor() {m_epoll = epoll_create1(EPOLL_CLOEXEC);};
+	~MsgQExecutor()
+	{
+		// the coroutines not finished are destroyed with their frames
+		std::vector<std::coroutine_handle<>> handles(m_ready.begin(), m_ready.end());
+		for (std::pair<const int, std::vector<msgq_waiter*>>& list : m_waiters)
+		{
+			for (msgq_waiter* w : list.second)
+			{
+				handles.push_back(w->handle);
+			}
+		}
+		for (std::pair<const int64_t, msgq_waiter*>& timer : m_timers)
+		{
+			if (!timer.second->events)
+			{
+				handles.push_back(timer.second->handle);
+			}
+		}
+		m_ready.clear();
+		m_waiters.clear();
+		m_timers.clear();
+		for (std::coroutine_handle<> h : handles)
+		{
+			h.destroy();
+		}
+		close(m_epoll);
+	};
+
+	MsgQExecutor(const MsgQExecutor&) = delete;
+	MsgQExecutor& operator=(const MsgQExecutor&) = delete;
+
+	// start a coroutine. It runs at the next Run() or RunOnce()
+	// @param task		the coroutine
+	void Spawn(MsgQTask task)
+	{
+		task.handle.promise().executor = this;
+		m_active++;
+		m_ready.push_back(task.handle);
+	};
+
+	// run the coroutines till all of them finish or Stop() is called
+	// @return			the number of coroutines still alive
+	int Run()
+	{
+		m_stopped = false;
+		while (m_active > 0 && !m_stopped)
+		{
+			RunOnce(-1);
+		}
+		return m_active;
+	};
+
+	// resume the ready coroutines, then wait for the descriptors once
+	// @param timeout_msec	the max time to wait, -1 for waiting till a descriptor is ready or a deadline expires
+	// @return				the number of coroutines still alive
+	int RunOnce(int timeout_msec)
+	{
+		while (!m_ready.empty())
+		{
+			std::coroutine_handle<> h = m_ready.front();
+			m_ready.pop_front();
+			h.resume();
+		}
+
+		if (m_active <= 0 || (m_waiters.empty() && m_timers.empty()))
+		{
+			return m_active;
+		}
+
+		// the nearest deadline limits the waiting
+		if (!m_timers.empty())
+		{
+			int64_t left = (m_timers.begin()->first - static_cast<int64_t>(GetMonotonicTime()) + 999999) / 1000000;
+			left = left < 0 ? 0 : (left > 3600000 ? 3600000 : left);
+			timeout_msec = timeout_msec < 0 || left < timeout_msec ? left : timeout_msec;
+		}
+
+		epoll_event events[64];
+		int n = epoll_wait(m_epoll, events, 64, timeout_msec);
+		for (int i = 0; i < n; i++)
+		{
+			Dispatch(events[i].data.fd, events[i].events);
+		}
+
+		int64_t now = static_cast<int64_t>(GetMonotonicTime());
+		while (!m_timers.empty() && m_timers.begin()->first <= now)
+		{
+			msgq_waiter* w = m_timers.begin()->second;
+			Remove(w);
+			if (w->events || (w->deadline && w->deadline <= now))
+			{
+				w->Expire();
+			}
+			else if (!w->Try())
+			{
+				Park(w);
+				continue;
+			}
+			m_ready.push_back(w->handle);
+		}
+		return m_active;
+	};
+
+	// stop Run() after the current round
+	void Stop() {m_stopped = true;};
+
+	// get the number of coroutines alive
+	// @return			the number of coroutines started and not finished yet
+	int GetActive() {return m_active;};
+
+	// park a waiter till its descriptor is ready and its operation completes, or its deadline expires. A waiter without
+	// events is tried again at its retry time instead.
+	// @param w			the waiter
+	void Park(msgq_waiter* w)
+	{
+		if (!w->events)
+		{
+			w->timer = m_timers.emplace(w->deadline && w->deadline < w->retry ? w->deadline : w->retry, w);
+			return;
+		}
+
+		std::vector<msgq_waiter*>& list = m_waiters[w->fd];
+		list.push_back(w);
+		w->timer = w->deadline ? m_timers.emplace(w->deadline, w) : m_timers.end();
+		Watch(w->fd);
+	};
+
+	// called by the final suspend of a coroutine
+	void Finish() {m_active--;};
+
+protected:
+	int m_epoll;
+	int m_active = 0; // the coroutines started and not finished
+	bool m_stopped = false;
+	std::deque<std::coroutine_handle<>> m_ready; // the coroutines to be resumed
+	std::map<int, std::vector<msgq_waiter*>> m_waiters; // the waiters parked on each descriptor
+	std::map<int, uint32_t> m_watched; // the events registered in epoll for each descriptor
+	std::multimap<int64_t, msgq_waiter*> m_timers; // the waiters with deadline
+
+	// update the events of a descriptor in epoll to the union of its waiters
+	// @param fd		the descriptor
+	void Watch(int fd)
+	{
+		uint32_t events = 0;
+		std::map<int, std::vector<msgq_waiter*>>::iterator it = m_waiters.find(fd);
+		if (it != m_waiters.end())
+		{
+			for (msgq_waiter* w : it->second)
+			{
+				events |= w->events;
+			}
+			if (!events)
+			{
+				m_waiters.erase(it);
+			}
+		}
+
+		uint32_t& watched = m_watched[fd];
+		if (events == watched)
+		{
+			if (!events)
+			{
+				m_watched.erase(fd);
+			}
+			return;
+		}
+
+		epoll_event ev;
+		ev.events = events;
+		ev.data.fd = fd;
+		epoll_ctl(m_epoll, !watched ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL, fd, &ev);
+		watched = events;
+		if (!events)
+		{
+			m_watched.erase(fd);
+		}
+	};
+
+	// remove a waiter from its descriptor and the timers
+	// @param w			the waiter
+	void Remove(msgq_waiter* w)
+	{
+		if (w->timer != m_timers.end())
+		{
+			m_timers.erase(w->timer);
+			w->timer = m_timers.end();
+		}
+		if (!w->events)
+		{
+			return;
+		}
+
+		std::vector<msgq_waiter*>& list = m_waiters[w->fd];
+		for (size_t i = 0; i < list.size(); i++)
+		{
+			if (list[i] == w)
+			{
+				list.erase(list.begin() + i);
+				break;
+			}
+		}
+		Watch(w->fd);
+	};
+
+	// try the waiters of a ready descriptor in order, the completed ones are resumed in next round
+	// @param fd		the descriptor
+	// @param events	the events reported by epoll
+	void Dispatch(int fd, uint32_t events)
+	{
+		std::map<int, std::vector<msgq_waiter*>>::iterator it = m_waiters.find(fd);
+		if (it == m_waiters.end())
+		{
+			return;
+		}
+
+		// the waiters after a failed one in the same direction would fail too, they wait for next readiness
+		std::vector<msgq_waiter*> list = it->second;
+		events |= events & (EPOLLERR | EPOLLHUP) ? EPOLLIN | EPOLLOUT : 0;
+		for (msgq_waiter* w : list)
+		{
+			if (!(w->events & events))
+			{
+				continue;
+			}
+
+			if (w->Try())
+			{
+				Remove(w);
+				m_ready.push_back(w->handle);
+			}
+			else
+			{
+				events &= ~w->events;
+			}
+		}
+	};
+};
+
+inline auto MsgQTask::promise_type::final_suspend() noexcept
+{
+	struct finisher
+	{
+		MsgQExecutor* executor;
+		bool await_ready() noexcept {return false;};
+		void await_suspend(std::coroutine_handle<promise_type> h) noexcept
+		{
+			MsgQExecutor* e = executor; // the finisher is gone with the frame
+			h.destroy();
+			if (e)
+			{
+				e->Finish();
+			}
+		};
+		void await_resume() noexcept {};
+	};
+	return finisher{executor};
+}
+
+// a message received by AsyncMsgQ::Receive()
+struct MsgQMessage
+{
+	int chn; // the sender channel, 0 for timeout, negtive for error code
+	std::string sender; // the sender name
+	int type;
+	int len;
+	std::vector<char> data; // the message data, resized to len
+};
+
+// the awaitable MsgQ, owned by the coroutines of one executor
+class AsyncMsgQ
+{
+public:
+	// @param q			the MsgQ, it shall live longer than the AsyncMsgQ
+	AsyncMsgQ(MsgQ* q) : m_q(q) {};
+
+	// the awaiter of receiving
+	struct ReceiveAwaiter : msgq_waiter
+	{
+		MsgQ* q;
+		MsgQMessage msg;
+
+		bool Try() override
+		{
+			msg.chn = q->PollMsg(&msg.sender, &msg.type, &msg.len, msg.data.data(), msg.data.size());
+			return msg.chn != 0;
+		};
+
+		void Expire() override {msg.chn = 0;};
+
+		bool await_ready()
+		{
+			msg.chn = fd < 0 ? -1 : 0;
+			return fd < 0 || Try();
+		};
+
+		template <typename Promise>
+		void await_suspend(std::coroutine_handle<Promise> h)
+		{
+			handle = h;
+			h.promise().executor->Park(this);
+		};
+
+		MsgQMessage await_resume()
+		{
+			msg.data.resize(msg.chn > 0 ? msg.len : 0);
+			return std::move(msg);
+		};
+	};
+
+	// the awaiter of sending
+	struct SendAwaiter : msgq_waiter
+	{
+		MsgQ* q;
+		int chn;
+		int type;
+		int len;
+		void* data;
+		int priority;
+		int result = 0;
+
+		bool Try() override
+		{
+			result = q->TrySendMsg(chn, type, len, data, priority);
+			retry = GetMonotonicTime() + MQ_RETRY_INTERVAL * 1000LL;
+			return result >= 0 || (errno != EAGAIN && errno != ETIMEDOUT);
+		};
+
+		void Expire() override {result = -1;};
+
+		// the sending never waits on the thread. A destnation in the directory is retried by the timer for its credits of
+		// the priority, one not in the directory has no credits counted and is retried once its descriptor is writable.
+		bool await_ready()
+		{
+			result = fd < 0 ? fd : 0;
+			if (fd < 0)
+			{
+				return true;
+			}
+
+			priority = priority == MSG_PRIORITY_DEFAULT ? GetDefaultPriority(type) : priority;
+			int credits = q->GetCredits(chn, priority);
+			events = credits < 0 ? static_cast<uint32_t>(EPOLLOUT) : 0;
+			retry = GetMonotonicTime() + MQ_RETRY_INTERVAL * 1000LL;
+			return credits != 0 && Try();
+		};
+
+		template <typename Promise>
+		void await_suspend(std::coroutine_handle<Promise> h)
+		{
+			handle = h;
+			h.promise().executor->Park(this);
+		};
+
+		int await_resume() {return result;};
+	};
+
+	// receive a message. The coroutine is parked till a message arrives or the timeout expires.
+	// @param size			the size of the data buffer. A longer message is dropped with its length reported in len
+	// @param timeout_usec	the timeout in microseconds, 0 for waiting forever
+	// @return				the awaiter, co_await gives the MsgQMessage
+	ReceiveAwaiter Receive(int size = MAX_MESSAGELENGTH, long timeout_usec = 0)
+	{
+		ReceiveAwaiter a;
+		a.q = m_q;
+		a.fd = m_q->GetReceiveFd();
+		a.events = EPOLLIN;
+		a.deadline = timeout_usec > 0 ? GetMonotonicTime() + timeout_usec * 1000 : 0;
+		a.msg.chn = 0;
+		a.msg.type = 0;
+		a.msg.len = 0;
+		a.msg.data.resize(size);
+		return a;
+	};
+
+	// send a message. The coroutine is parked while the destnation has no credits or no queue space.
+	// @param DestChn		the destnation channel, 0 for reply to last sender, 1 for main
+	// @param type			the type of the message
+	// @param len			the length of the message net data
+	// @param data			the pointer to the data to be sent, it shall be valid till the sending completes
+	// @param priority		the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+	// @param timeout_usec	the timeout in microseconds, 0 for waiting forever
+	// @return				the awaiter, co_await gives the result of SendMsg(), negtive for error code
+	SendAwaiter Send(int DestChn, int type, int len, void* data, int priority = MSG_PRIORITY_DEFAULT, long timeout_usec = 0)
+	{
+		SendAwaiter a;
+		a.q = m_q;
+		a.chn = DestChn;
+		a.type = type;
+		a.len = len;
+		a.data = data;
+		a.priority = priority;
+		a.fd = m_q->GetChannelFd(DestChn);
+		a.events = EPOLLOUT;
+		a.deadline = timeout_usec > 0 ? GetMonotonicTime() + timeout_usec * 1000 : 0;
+		return a;
+	};
+
+	// get the MsgQ
+	// @return			the MsgQ
+	MsgQ* GetMsgQ() {return m_q;};
+
+protected:
+	MsgQ* m_q;
+};
+
+#endif
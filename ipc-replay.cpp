@@ -0,0 +1,398 @@
+/**
+ * ipc-replay re-publishes a record log of ipc-utils library.
+ *
+ * The processes started with IPC_RECORD=<file> append every ShMem element update and every MsgQ message sent to the
+ * log file. The capacity of a new log is IPC_RECORD_MB megabytes, 256 by default. Delete the file to start a new log.
+ *
+ * The elements are written into the shared memory of the recorded titles with an optional prefix, so a fresh segment
+ * can be used side by side with the live one. The messages are sent by the queues of the recorded senders to the
+ * recorded destnations, so the receivers see the original sender names and their replies are taken and dropped.
+ * Run the stack under test and the replay in a new IPC namespace, "unshare --ipc", to keep the queues apart from the live ones.
+ *
+ * Usage: ipc-replay [-f] [-s speed] [-l loops] [-p prefix] [-d] file
+ *		-f	replay as fast as possible, the original timing is kept by default
+ *		-s	the speed of the original timing, 2 for twice as fast
+ *		-l	the number of times to replay the log, 1 by default
+ *		-p	the prefix of the shared memory titles
+ *		-d	dump the records instead of replaying them
+ *
+ * Version 1.0
+ */
+
+#include "ipc-utils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define REPLAY_SEND_TIMEOUT 1000000000ULL // the time in nanoseconds to retry a message to a full queue before it is dropped
+#define REPLAY_POLL_EVENTS 256 // the number of events between the pollings of the replies to the sender queues
+#define REPLAY_RESOLVE_INTERVAL 100000000ULL // the interval in nanoseconds to look up a missing destnation again
+
+// the target of a replayed element or message
+struct replay_target
+{
+	ShMem* shm = NULL; // the shared memory of an element
+	int id = 0; // the publisher ID of an element, or the destnation channel of a message
+	MsgQ* sender = NULL; // the queue of the sender of a message
+	string dest; // the destnation name of a message
+	uint64_t resolved = 0; // the time of the last looking up of the destnation
+	bool stalled = false; // a message to the destnation timed out, the next ones are tried once till one is sent
+};
+
+// a record to be replayed
+struct replay_event
+{
+	const ipc_record* record;
+	int target;
+};
+
+// take a name from a record
+// @param name		the name in the record, not always terminated
+// @param size		the size of the name in the record
+// @return			the name
+static string RecordName(const char* name, size_t size)
+{
+	return string(name, strnlen(name, size));
+}
+
+// sleep till a CLOCK_MONOTONIC time
+// @param ns		the time in nanoseconds
+static void WaitUntil(uint64_t ns)
+{
+	uint64_t now = GetMonotonicTime();
+	if (now >= ns)
+	{
+		return;
+	}
+
+	// the last 50us are spun for the accuracy
+	if (ns - now > 50000)
+	{
+		timespec t;
+		t.tv_sec = (ns - 50000) / 1000000000ULL;
+		t.tv_nsec = (ns - 50000) % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+	}
+	while (GetMonotonicTime() < ns)
+	{
+	}
+}
+
+// look up the destnation of a message
+// @param t			the target of the message
+// @return			the destnation channel, positive for success
+static int Resolve(replay_target& t)
+{
+	t.resolved = GetMonotonicTime();
+	t.id = t.sender->GetDestChannel(t.dest);
+	return t.id;
+}
+
+// send a recorded message, a full queue is retried unless the destnation is stalled
+// @param t			the target of the message
+// @param r			the record of the message
+// @return			true for the message sent
+static bool SendRecord(replay_target& t, const ipc_record* r)
+{
+	if (t.id <= 0 && (GetMonotonicTime() - t.resolved < REPLAY_RESOLVE_INTERVAL || Resolve(t) <= 0))
+	{
+		return false;
+	}
+
+	void* data = const_cast<ipc_record*>(r + 1);
+	uint64_t timeout = t.stalled ? 0 : GetMonotonicTime() + REPLAY_SEND_TIMEOUT;
+	while (true)
+	{
+		int ret;
+		if (r->flags & MQ_FLAG_REQUEST)
+		{
+			ret = t.sender->SendRequest(t.id, r->corr, r->type, r->len, data, r->priority);
+		}
+		else if (r->flags & MQ_FLAG_REPLY)
+		{
+			ret = t.sender->SendReply(t.id, r->corr, r->type, r->len, data, r->priority);
+		}
+		else
+		{
+			ret = t.sender->SendMsg(t.id, r->type, r->len, data, r->priority);
+		}
+
+		if (ret > 0)
+		{
+			t.stalled = false;
+			return true;
+		}
+		if (errno != EAGAIN && errno != ETIMEDOUT)
+		{
+			return false;
+		}
+		if (GetMonotonicTime() > timeout)
+		{
+			t.stalled = true;
+			return false;
+		}
+	}
+}
+
+// print a record
+// @param r			the record
+// @param t0		the time of the first record
+static void DumpRecord(const ipc_record* r, uint64_t t0)
+{
+	if (r->kind == IPC_RECORD_SHMEM)
+	{
+		printf("%10llu %14.6f  shmem %15s/%-15s size=%u len=%u",
+			static_cast<unsigned long long>(r->seq), (r->ts - t0) / 1e6,
+			RecordName(r->title, sizeof(r->title)).c_str(), RecordName(r->name, sizeof(r->name)).c_str(), r->type, r->len);
+	}
+	else
+	{
+		printf("%10llu %14.6f  msg   %8s -> %-8s type=%u len=%u priority=%u",
+			static_cast<unsigned long long>(r->seq), (r->ts - t0) / 1e6,
+			RecordName(r->title, 8).c_str(), RecordName(r->name, 8).c_str(), r->type, r->len, r->priority);
+		if (r->flags)
+		{
+			printf(" %s=%u", r->flags & MQ_FLAG_REQUEST ? "request" : "reply", r->corr);
+		}
+	}
+	if (r->trace)
+	{
+		printf(" trace=0x%llx", static_cast<unsigned long long>(r->trace));
+	}
+	printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+	bool fast = false;
+	bool dump = false;
+	double speed = 1;
+	long loops = 1;
+	string prefix;
+	int opt;
+	while ((opt = getopt(argc, argv, "fs:l:p:d")) != -1)
+	{
+		if (opt == 'f')
+		{
+			fast = true;
+		}
+		else if (opt == 's')
+		{
+			speed = atof(optarg);
+		}
+		else if (opt == 'l')
+		{
+			loops = atol(optarg);
+		}
+		else if (opt == 'p')
+		{
+			prefix = optarg;
+		}
+		else if (opt == 'd')
+		{
+			dump = true;
+		}
+		else
+		{
+			optind = argc;
+			break;
+		}
+	}
+	if (optind != argc - 1 || speed <= 0 || loops <= 0)
+	{
+		fprintf(stderr, "Usage: %s [-f] [-s speed] [-l loops] [-p prefix] [-d] file\n", argv[0]);
+		return 1;
+	}
+
+	// the replay itself is never recorded
+	unsetenv(IPC_RECORD_ENV);
+
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat st;
+	void* base = MAP_FAILED;
+	if (fd >= 0 && fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(ipc_record_log))
+	{
+		base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+	if (base == MAP_FAILED)
+	{
+		fprintf(stderr, "cannot open the record log %s\n", argv[optind]);
+		return 1;
+	}
+
+	const ipc_record_log* log = static_cast<const ipc_record_log*>(base);
+	if (log->magic != IPC_RECORD_MAGIC || log->version != IPC_RECORD_VERSION || log->size != static_cast<uint64_t>(st.st_size))
+	{
+		fprintf(stderr, "%s is not a record log of this version\n", argv[optind]);
+		return 1;
+	}
+
+	// collect the records, a record being written when the log was taken is skipped
+	vector<const ipc_record*> records;
+	uint64_t end = log->tail < log->size ? log->tail : log->size;
+	uint64_t skipped = 0;
+	for (uint64_t offset = sizeof(ipc_record_log); offset + sizeof(ipc_record) <= end; )
+	{
+		// the unused end of a chunk is zero filled
+		const ipc_record* r = reinterpret_cast<const ipc_record*>(static_cast<const char*>(base) + offset);
+		if (r->size == 0)
+		{
+			offset = sizeof(ipc_record_log) + (offset - sizeof(ipc_record_log) + IPC_RECORD_CHUNK) / IPC_RECORD_CHUNK * IPC_RECORD_CHUNK;
+			continue;
+		}
+		if (r->size < sizeof(ipc_record) || offset + r->size > end)
+		{
+			break;
+		}
+		offset += r->size;
+		if (r->kind == IPC_RECORD_SHMEM || r->kind == IPC_RECORD_MSG)
+		{
+			records.push_back(r);
+		}
+		else
+		{
+			skipped++;
+		}
+	}
+
+	// the processes append in parallel, the replay follows the time of the records
+	stable_sort(records.begin(), records.end(), [](const ipc_record* a, const ipc_record* b) {return a->ts < b->ts;});
+	fprintf(stderr, "%zu records, %llu being written, %llu dropped for the log was full\n", records.size(),
+		static_cast<unsigned long long>(skipped), static_cast<unsigned long long>(log->dropped));
+	if (records.empty())
+	{
+		return 0;
+	}
+
+	uint64_t t0 = records[0]->ts;
+	if (dump)
+	{
+		for (size_t i = 0; i < records.size(); i++)
+		{
+			DumpRecord(records[i], t0);
+		}
+		return 0;
+	}
+
+	// resolve the targets before the replay, so the replay loop does no lookup
+	vector<replay_target> targets;
+	vector<replay_event> events;
+	map<string, int> indexes;
+	map<string, ShMem*> segments;
+	map<string, MsgQ*> senders;
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		const ipc_record* r = records[i];
+		bool shmem = r->kind == IPC_RECORD_SHMEM;
+		string title = RecordName(r->title, shmem ? sizeof(r->title) : 8);
+		string name = RecordName(r->name, shmem ? sizeof(r->name) : 8);
+		string key = to_string(r->kind) + "/" + title + "/" + name;
+		map<string, int>::iterator it = indexes.find(key);
+		if (it != indexes.end())
+		{
+			events.push_back({r, it->second});
+			continue;
+		}
+
+		replay_target t;
+		if (shmem)
+		{
+			ShMem*& shm = segments[title];
+			shm = shm ? shm : new ShMem(prefix + title);
+			t.shm = shm;
+			t.id = shm->CreatePublisher(name, r->type);
+			if (t.id <= 0)
+			{
+				fprintf(stderr, "cannot create the element %s/%s: %s\n", title.c_str(), name.c_str(), shm->GetErrorMessage().c_str());
+			}
+		}
+		else
+		{
+			MsgQ*& sender = senders[title];
+			sender = sender ? sender : new MsgQ(title);
+			t.sender = sender;
+			t.dest = name;
+			if (Resolve(t) <= 0)
+			{
+				fprintf(stderr, "the destnation %s is not found yet\n", name.c_str());
+			}
+		}
+
+		indexes[key] = targets.size();
+		events.push_back({r, static_cast<int>(targets.size())});
+		targets.push_back(t);
+	}
+
+	uint64_t written = 0;
+	uint64_t sent = 0;
+	uint64_t failed = 0;
+	char reply[MQ_MAX_MSGSIZE];
+	string replier;
+	int type;
+	int len;
+	uint64_t start = GetMonotonicTime();
+	uint64_t offset = 0;
+	for (long loop = 0; loop < loops; loop++)
+	{
+		for (size_t i = 0; i < events.size(); i++)
+		{
+			const ipc_record* r = events[i].record;
+			replay_target& t = targets[events[i].target];
+			if (!fast)
+			{
+				WaitUntil(start + offset + static_cast<uint64_t>((r->ts - t0) / speed));
+			}
+
+			SetTraceID(r->trace);
+			if (t.shm)
+			{
+				int ret = t.id <= 0 ? -1 : r->type ? t.shm->Write(t.id, const_cast<ipc_record*>(r + 1))
+					: t.shm->Write(t.id, string(reinterpret_cast<const char*>(r + 1)));
+				ret >= 0 ? written++ : failed++;
+			}
+			else
+			{
+				SendRecord(t, r) ? sent++ : failed++;
+			}
+
+			// the replies to the recorded senders are dropped
+			if ((i & (REPLAY_POLL_EVENTS - 1)) == 0)
+			{
+				for (map<string, MsgQ*>::iterator it = senders.begin(); it != senders.end(); ++it)
+				{
+					while (it->second->PollMsg(&replier, &type, &len, reply, sizeof(reply)) > 0)
+					{
+					}
+				}
+			}
+		}
+		offset = GetMonotonicTime() - start;
+	}
+	SetTraceID(0);
+
+	double secs = (GetMonotonicTime() - start) / 1e9;
+	fprintf(stderr, "%llu elements written, %llu messages sent, %llu failed in %.3f seconds, %.0f events per second\n",
+		static_cast<unsigned long long>(written), static_cast<unsigned long long>(sent), static_cast<unsigned long long>(failed),
+		secs, (written + sent + failed) / secs);
+
+	for (map<string, MsgQ*>::iterator it = senders.begin(); it != senders.end(); ++it)
+	{
+		delete it->second;
+	}
+	for (map<string, ShMem*>::iterator it = segments.begin(); it != segments.end(); ++it)
+	{
+		delete it->second;
+	}
+	return 0;
+}
@@ -0,0 +1,860 @@
+/**
+ * Stress test of ipc-utils library.
+ *
+ * It forks N writer and M reader processes against one shared memory segment and one set of message queues, and runs
+ * them for a fixed time. Every payload carries its source, a sequence number and a checksum over the rest of it.
+ *   Every writer publishes its own element as fast as it can, and sends a stream of messages to every reader from
+ *   several threads sharing one MsgQ. With every publishing, it also counts up two shared elements updated by all writers,
+ *   one by CompareAndSwap() and one by CompareAndWrite(). No update shall be lost.
+ *   Every reader reads all the elements and drains its queue. It detects the torn elements by their checksums, the
+ *   elements going back in sequence, the corrupted, duplicated and reordered messages, and the messages lost when the
+ *   streams are stopped.
+ *
+ * Each result is a line of JSON on stdout, for example
+ *   {"stress":"shmem","writers":2,"readers":2,"secs":5.0,"writes":..,"reads":..,"writes_per_sec":..,"reads_per_sec":..,"busy":0,"torn":0,"reordered":0,
+ *    "shared_updates":..,"conflicts":..,"lost_updates":0}
+ * The exit code is 1 when any violation is found or any process failed, 0 otherwise.
+ *
+ * With -a, it checks instead that the steady-state Write(), Read(), SendMsg() and ReceiveMsg() do not allocate any memory.
+ * Every operation is counted by the replaced operator new after some rounds of warming up, for example
+ *   {"alloc":"msgq_send_receive","count":10000,"allocations":0}
+ *
+ * With -l, it checks instead that the log lines with the strings in char arrays and in char pointers are written whole.
+ *
+ * Usage: ipc-stress [-w writers] [-r readers] [-t threads] [-d seconds] [-s size] [-a] [-l]
+ *		-w	the writer processes, 2 by default
+ *		-r	the reader processes, 2 by default
+ *		-t	the sending threads of every writer, 2 by default
+ *		-d	the seconds to run, 5 by default
+ *		-s	the size of every element in bytes, 256 by default. The messages carry up to 1000 bytes of it.
+ *		-a	check the allocations of the hot paths instead
+ *		-l	check the log lines with string arguments instead
+ *
+ * Version 1.0
+ */
+
+#include "ipc-utils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <new>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define STRESS_SHMEM "ipc-stress" // the shared memory of the elements
+#define STRESS_CAS "stress-cas" // the shared element of 8 bytes counted up by all writers with compare and swap
+#define STRESS_VERSIONED "stress-ver" // the shared element counted up by all writers with the versioned writes
+#define STRESS_MAXPROCS 99 // the max number of writers or readers, the channel names are up to 8 characters
+#define STRESS_MAXTHREADS 16 // the max number of sending threads of a writer
+#define STRESS_MAXMSG 1000 // the max size of a message payload
+#define STRESS_GRACE 5000000000ULL // the nanoseconds the readers wait for the end of the streams after the run
+#define STRESS_ALLOCROUNDS 10000 // the operations counted by the allocation check, after the same rounds of warming up
+#define STRESS_LOGLINES 1000 // the lines logged by the logger check
+
+// the head of every payload, the rest of it is filled from the source and the sequence
+struct stress_payload
+{
+	uint32_t source; // the writer for an element, the writer * STRESS_MAXTHREADS + thread for a message
+	uint32_t checksum; // FNV-1a of the payload after this field
+	uint64_t seq; // the sequence of the source, from 1. It is the last one sent in a MSG_STOP
+};
+
+// the value of the shared elements, the number of updates and the sum of the writers that did them, both wrapping around
+struct stress_counter
+{
+	uint32_t count;
+	uint32_t sum;
+};
+
+// the value of the versioned shared element, a torn copy has different counters
+struct stress_versioned
+{
+	stress_counter copies[4];
+};
+
+// the counters of all processes, in a shared anonymous mapping
+struct stress_results
+{
+	uint32_t ready; // the readers with their queues created
+	uint64_t writes; // the elements written
+	uint64_t reads; // the elements read consistently
+	uint64_t busy; // the reads refused by the library for the elements updated too fast
+	uint64_t torn; // the elements read with a bad checksum
+	uint64_t element_reordered; // the elements read older than a previous read
+	uint64_t updates; // the updates of each shared element
+	uint64_t update_sum; // the sum of the writers of the updates
+	uint64_t conflicts; // the updates of the shared elements retried after another writer
+	uint64_t lost_updates; // the updates missing from the shared elements
+	uint64_t sent; // the messages sent
+	uint64_t send_retries; // the sendings timed out by a full queue and retried
+	uint64_t received; // the messages received
+	uint64_t corrupted; // the messages of a bad length or a bad checksum
+	uint64_t duplicated; // the messages received with the same sequence as the previous one
+	uint64_t reordered; // the messages received with a sequence older than the previous one
+	uint64_t lost; // the messages never received till the end of their streams
+	uint64_t unfinished; // the streams without their ends received in time
+};
+
+static stress_results* s_results = NULL;
+static bool s_counting = false; // true while the allocations are counted
+static uint64_t s_allocations = 0; // the allocations counted
+
+// every allocation of the process, including the ones of the library, is counted while the counting is on.
+// They are kept out of line, so that the compiler does not match the malloc() and free() inside against the callers.
+__attribute__((noinline)) void* operator new(size_t size)
+{
+	if (s_counting)
+	{
+		s_allocations++;
+	}
+	void* p = malloc(size ? size : 1);
+	if (!p)
+	{
+		throw bad_alloc();
+	}
+	return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+// add to a counter of all processes
+// @param counter	the counter in the results
+// @param n			the number to add
+static void Add(uint64_t* counter, uint64_t n)
+{
+	if (n)
+	{
+		__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+	}
+}
+
+// the checksum of a payload
+// @param p		the payload
+// @param size	the size of the payload
+// @return		the FNV-1a hash of the payload after the checksum
+static uint32_t Checksum(const stress_payload* p, int size)
+{
+	const uint8_t* begin = reinterpret_cast<const uint8_t*>(p) + offsetof(stress_payload, seq);
+	const uint8_t* end = reinterpret_cast<const uint8_t*>(p) + size;
+	uint32_t h = 2166136261U ^ p->source;
+	for (const uint8_t* b = begin; b < end; b++)
+	{
+		h = (h ^ *b) * 16777619U;
+	}
+	return h;
+}
+
+// fill a payload
+// @param p			the payload
+// @param size		the size of the payload
+// @param source		the source of the payload
+// @param seq		the sequence of the payload
+static void Fill(stress_payload* p, int size, uint32_t source, uint64_t seq)
+{
+	p->source = source;
+	p->seq = seq;
+	uint8_t* data = reinterpret_cast<uint8_t*>(p + 1);
+	for (int i = 0; i < size - static_cast<int>(sizeof(stress_payload)); i++)
+	{
+		data[i] = static_cast<uint8_t>(seq * 131 + i * 7 + source);
+	}
+	p->checksum = Checksum(p, size);
+}
+
+// the channel name of a writer or a reader
+static string WriterName(int w) {return "str-w" + to_string(w);}
+static string ReaderName(int r) {return "str-r" + to_string(r);}
+
+// send a message to a reader, a sending timed out by the full queue is retried
+// @return		true for sent, false when the reader is gone
+static bool SendTo(MsgQ& tx, int chn, int type, int len, void* data, uint64_t* retries)
+{
+	uint64_t start = GetMonotonicTime();
+	while (tx.SendMsg(chn, type, len, data, MSG_PRIORITY_LOW) <= 0)
+	{
+		(*retries)++;
+		if (GetMonotonicTime() - start > STRESS_GRACE)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// a sending thread of a writer. It streams to every reader, and ends every stream with its last sequence.
+// @param tx		the MsgQ shared by the threads of the writer
+// @param source	the source of the messages
+// @param size		the size of the messages
+// @param chns		the channels of the readers
+// @param deadline	the CLOCK_MONOTONIC time to stop
+// @param failed (out)	set when a reader is gone
+static void RunSender(MsgQ* tx, uint32_t source, int size, vector<int> chns, uint64_t deadline, atomic<bool>* failed)
+{
+	vector<char> buf(size);
+	stress_payload* p = reinterpret_cast<stress_payload*>(buf.data());
+	vector<uint64_t> seqs(chns.size(), 0);
+	uint64_t sent = 0;
+	uint64_t retries = 0;
+	while (GetMonotonicTime() < deadline && !*failed)
+	{
+		for (size_t r = 0; r < chns.size(); r++)
+		{
+			Fill(p, size, source, ++seqs[r]);
+			if (!SendTo(*tx, chns[r], MSG_DATA, size, p, &retries))
+			{
+				*failed = true;
+				break;
+			}
+			sent++;
+		}
+	}
+
+	// the end of a stream has the priority of the stream, so it is received after all of it
+	for (size_t r = 0; r < chns.size(); r++)
+	{
+		stress_payload end;
+		end.source = source;
+		end.seq = seqs[r];
+		end.checksum = Checksum(&end, sizeof(end));
+		if (!SendTo(*tx, chns[r], MSG_STOP, sizeof(end), &end, &retries))
+		{
+			*failed = true;
+		}
+	}
+	Add(&s_results->sent, sent);
+	Add(&s_results->send_retries, retries);
+}
+
+// count up the shared elements
+// @param shm		the shared memory
+// @param cas		the ID of the element updated by compare and swap
+// @param ver		the ID of the element updated by the versioned writes
+// @param w			the writer
+// @param conflicts (out)	the updates retried
+// @return			true for updated
+static bool CountUp(ShMem& shm, int cas, int ver, int w, uint64_t* conflicts)
+{
+	stress_counter current;
+	if (shm.Read(cas, &current) < 0)
+	{
+		return false;
+	}
+	while (true)
+	{
+		stress_counter next = {current.count + 1, current.sum + w + 1};
+		int n = shm.CompareAndSwap(cas, &current, &next);
+		if (n > 0)
+		{
+			break;
+		}
+		if (n != -4)
+		{
+			return false;
+		}
+		(*conflicts)++;
+	}
+
+	stress_versioned v;
+	uint32_t version;
+	while (true)
+	{
+		if (shm.Read(ver, &v, &version) < 0)
+		{
+			continue; // updated too fast to be read
+		}
+		stress_counter next = {v.copies[0].count + 1, v.copies[0].sum + w + 1};
+		for (int i = 0; i < 4; i++)
+		{
+			v.copies[i] = next;
+		}
+		int n = shm.CompareAndWrite(ver, &version, &v);
+		if (n > 0)
+		{
+			return true;
+		}
+		if (n != -4)
+		{
+			return false;
+		}
+		(*conflicts)++;
+	}
+}
+
+// a writer process
+// @return		the exit code of the process
+static int RunWriter(int w, int readers, int threads, int size, uint64_t deadline)
+{
+	ShMem shm(STRESS_SHMEM);
+	int id = shm.CreatePublisher("stress-" + to_string(w), size);
+	if (id <= 0)
+	{
+		fprintf(stderr, "writer %d cannot publish its element: %s\n", w, shm.GetErrorMessage().c_str());
+		return 2;
+	}
+	int cas = shm.CreateShared(STRESS_CAS, sizeof(stress_counter));
+	int ver = shm.CreateShared(STRESS_VERSIONED, sizeof(stress_versioned));
+	if (cas <= 0 || ver <= 0)
+	{
+		fprintf(stderr, "writer %d cannot update the shared elements: %s\n", w, shm.GetErrorMessage().c_str());
+		return 2;
+	}
+
+	// the readers are onboard once their queues are created
+	MsgQ tx(WriterName(w), 1000);
+	while (__atomic_load_n(&s_results->ready, __ATOMIC_ACQUIRE) < static_cast<uint32_t>(readers))
+	{
+		usleep(1000);
+	}
+	vector<int> chns;
+	for (int r = 0; r < readers; r++)
+	{
+		int chn = tx.GetDestChannel(ReaderName(r));
+		if (chn <= 0)
+		{
+			fprintf(stderr, "writer %d cannot find reader %d: %s\n", w, r, tx.GetErrorMessage().c_str());
+			return 2;
+		}
+		chns.push_back(chn);
+	}
+
+	atomic<bool> failed(false);
+	vector<thread> senders;
+	int msgsize = size > STRESS_MAXMSG ? STRESS_MAXMSG : size;
+	for (int t = 0; t < threads; t++)
+	{
+		senders.push_back(thread(RunSender, &tx, static_cast<uint32_t>(w * STRESS_MAXTHREADS + t), msgsize, chns, deadline, &failed));
+	}
+
+	// the element is published by this thread only, the sequence 1 was written by the parent
+	vector<char> buf(size);
+	stress_payload* p = reinterpret_cast<stress_payload*>(buf.data());
+	uint64_t seq = 1;
+	uint64_t updates = 0;
+	uint64_t conflicts = 0;
+	while (GetMonotonicTime() < deadline)
+	{
+		Fill(p, size, w, ++seq);
+		if (shm.Write(id, p) < 0)
+		{
+			fprintf(stderr, "writer %d cannot publish: %s\n", w, shm.GetErrorMessage().c_str());
+			failed = true;
+			break;
+		}
+		if (!CountUp(shm, cas, ver, w, &conflicts))
+		{
+			fprintf(stderr, "writer %d cannot update the shared elements: %s\n", w, shm.GetErrorMessage().c_str());
+			failed = true;
+			break;
+		}
+		updates++;
+	}
+	Add(&s_results->writes, seq - 1);
+	Add(&s_results->updates, updates);
+	Add(&s_results->update_sum, updates * (w + 1));
+	Add(&s_results->conflicts, conflicts);
+
+	for (size_t t = 0; t < senders.size(); t++)
+	{
+		senders[t].join();
+	}
+	return failed ? 2 : 0;
+}
+
+// a reader process
+// @return		the exit code of the process
+static int RunReader(int r, int writers, int threads, int size, uint64_t deadline)
+{
+	MsgQ rx(ReaderName(r), 1000);
+	__atomic_fetch_add(&s_results->ready, 1, __ATOMIC_RELEASE);
+
+	ShMem shm(STRESS_SHMEM, true, 1000000); // the readers never write the segment
+	vector<int> ids(writers);
+	vector<uint64_t> last(writers, 0);
+	for (int w = 0; w < writers; w++)
+	{
+		ids[w] = shm.Subscribe("stress-" + to_string(w));
+		if (ids[w] <= 0)
+		{
+			fprintf(stderr, "reader %d cannot find element %d: %s\n", r, w, shm.GetErrorMessage().c_str());
+			return 2;
+		}
+	}
+	int ver = shm.Subscribe(STRESS_VERSIONED);
+
+	// the streams are kept by their sources
+	int streams = writers * threads;
+	vector<uint64_t> expected(writers * STRESS_MAXTHREADS, 0); // the last sequence received of each stream
+	vector<uint64_t> accepted(writers * STRESS_MAXTHREADS, 0); // the messages received in order of each stream
+	vector<bool> ended(writers * STRESS_MAXTHREADS, false);
+	vector<char> buf(size > STRESS_MAXMSG ? size : STRESS_MAXMSG);
+	stress_payload* p = reinterpret_cast<stress_payload*>(buf.data());
+	stress_results counts;
+	memset(&counts, 0, sizeof(counts));
+	int finished = 0;
+	string sender;
+	int type = 0;
+	int len = 0;
+
+	while (finished < streams && GetMonotonicTime() < deadline + STRESS_GRACE)
+	{
+		// every element once, its sequence never goes back
+		bool running = GetMonotonicTime() < deadline;
+		for (int w = 0; w < writers && running; w++)
+		{
+			if (shm.Read(ids[w], p) < 0)
+			{
+				counts.busy++;
+				continue;
+			}
+			if (p->checksum != Checksum(p, size) || p->source != static_cast<uint32_t>(w))
+			{
+				counts.torn++;
+				continue;
+			}
+			counts.reads++;
+			counts.element_reordered += p->seq < last[w];
+			last[w] = p->seq;
+		}
+
+		// the versioned shared element is never torn by its writers
+		stress_versioned v;
+		if (running && shm.Read(ver, &v) > 0)
+		{
+			for (int i = 1; i < 4; i++)
+			{
+				if (v.copies[i].count != v.copies[0].count || v.copies[i].sum != v.copies[0].sum)
+				{
+					counts.torn++;
+					break;
+				}
+			}
+		}
+
+		// then the messages in the queue, waiting for them after the run
+		for (int i = 0; i < 64; i++)
+		{
+			int chn = running ? rx.PollMsg(&sender, &type, &len, p, buf.size()) : rx.ReceiveMsg(&sender, &type, &len, p, buf.size());
+			if (chn <= 0)
+			{
+				break;
+			}
+
+			int expected_len = type == MSG_STOP ? sizeof(stress_payload) : (size > STRESS_MAXMSG ? STRESS_MAXMSG : size);
+			uint32_t source = p->source;
+			if ((type != MSG_DATA && type != MSG_STOP) || len != expected_len || p->checksum != Checksum(p, len)
+				|| source / STRESS_MAXTHREADS >= static_cast<uint32_t>(writers) || source % STRESS_MAXTHREADS >= static_cast<uint32_t>(threads))
+			{
+				counts.corrupted++;
+				continue;
+			}
+
+			if (type == MSG_STOP)
+			{
+				if (!ended[source])
+				{
+					ended[source] = true;
+					finished++;
+					counts.lost += p->seq > accepted[source] ? p->seq - accepted[source] : 0;
+				}
+				continue;
+			}
+
+			counts.received++;
+			if (p->seq == expected[source])
+			{
+				counts.duplicated++;
+			}
+			else if (p->seq < expected[source])
+			{
+				counts.reordered++;
+			}
+			else
+			{
+				accepted[source]++;
+				expected[source] = p->seq;
+			}
+		}
+	}
+
+	Add(&s_results->reads, counts.reads);
+	Add(&s_results->busy, counts.busy);
+	Add(&s_results->torn, counts.torn);
+	Add(&s_results->element_reordered, counts.element_reordered);
+	Add(&s_results->received, counts.received);
+	Add(&s_results->corrupted, counts.corrupted);
+	Add(&s_results->duplicated, counts.duplicated);
+	Add(&s_results->reordered, counts.reordered);
+	Add(&s_results->lost, counts.lost);
+	Add(&s_results->unfinished, streams - finished);
+	return 0;
+}
+
+// run an operation in rounds, the allocations of the second half are counted and reported
+// @param name		the name of the operation
+// @param op		the operation
+// @return			the allocations counted
+template <typename F>
+static uint64_t CountAllocations(const char* name, F op)
+{
+	for (int i = 0; i < STRESS_ALLOCROUNDS; i++)
+	{
+		op();
+	}
+
+	s_allocations = 0;
+	s_counting = true;
+	for (int i = 0; i < STRESS_ALLOCROUNDS; i++)
+	{
+		op();
+	}
+	s_counting = false;
+
+	printf("{\"alloc\":\"%s\",\"count\":%d,\"allocations\":%llu}\n", name, STRESS_ALLOCROUNDS, static_cast<unsigned long long>(s_allocations));
+	fflush(stdout);
+	return s_allocations;
+}
+
+// check the steady-state publishing, reading, sending and receiving do not allocate any memory
+// @param size		the size of the element and the messages
+// @return			the exit code, 1 when any allocation is found
+static int CheckAllocations(int size)
+{
+	int msgsize = size > STRESS_MAXMSG ? STRESS_MAXMSG : size;
+	shm_unlink("/" STRESS_SHMEM);
+	const char* names[] = {"str-ta", "str-ra", "str-ka", "str-ea"};
+	for (const char* name : names)
+	{
+		mq_unlink(("/" + string(name)).c_str());
+	}
+
+	ShMem shm(STRESS_SHMEM);
+	int id = shm.CreatePublisher("alloc", size);
+	int sid = shm.CreatePublisher("alloc-s", 0);
+	MsgQ tx("str-ta", 1000);
+	MsgQ rx("str-ra", 1000);
+	int chn = tx.GetDestChannel("str-ra");
+	if (id <= 0 || sid <= 0 || chn <= 0)
+	{
+		fprintf(stderr, "cannot create the elements or the queues: %s %s\n", shm.GetErrorMessage().c_str(), tx.GetErrorMessage().c_str());
+		return 1;
+	}
+
+	vector<char> buf(size > STRESS_MAXMSG ? size : STRESS_MAXMSG);
+	stress_payload* p = reinterpret_cast<stress_payload*>(buf.data());
+	Fill(p, size, 0, 1);
+	string text = "a string longer than the short string buffer";
+	string sender;
+	string read;
+	int type = 0;
+	int len = 0;
+	uint64_t total = 0;
+
+	total += CountAllocations("shmem_write", [&]() {shm.Write(id, p);});
+	total += CountAllocations("shmem_read", [&]() {shm.Read(id, p);});
+	total += CountAllocations("shmem_read_by_name", [&]() {shm.Read("alloc", &len, p);});
+	total += CountAllocations("shmem_write_string", [&]() {shm.Write(sid, text);});
+	total += CountAllocations("shmem_read_string", [&]() {shm.Read(sid, &read);});
+	total += CountAllocations("msgq_send_receive", [&]()
+	{
+		tx.SendMsg(chn, MSG_DATA, msgsize, p);
+		rx.ReceiveMsg(&sender, &type, &len, p, buf.size());
+	});
+	total += CountAllocations("msgq_send_receive_by_name", [&]()
+	{
+		tx.SendMsg("str-ra", MSG_DATA, msgsize, p);
+		rx.ReceiveMsg(&sender, &type, &len, p, buf.size());
+	});
+
+	// through the kernel queues, the echoing process counts its own allocations
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		MsgQ echo("str-ea", 1000000L);
+		echo.SendMsg("str-ka", MSG_ONBOARD, 0, NULL);
+		uint64_t n = CountAllocations("msgq_kernel_echo", [&]()
+		{
+			if (echo.ReceiveMsg(&sender, &type, &len, p, buf.size()) > 0)
+			{
+				echo.SendMsg(0, MSG_DATA, len, p);
+			}
+		});
+		_exit(n ? 1 : 0);
+	}
+
+	MsgQ kernel("str-ka", 1000000L);
+	if (kernel.ReceiveMsg(&sender, &type, &len, p, buf.size()) <= 0 || type != MSG_ONBOARD)
+	{
+		fprintf(stderr, "the echoing process is not onboard: %s\n", kernel.GetErrorMessage().c_str());
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return 1;
+	}
+	int echo = kernel.GetDestChannel("str-ea");
+	total += CountAllocations("msgq_kernel_send_receive", [&]()
+	{
+		kernel.SendMsg(echo, MSG_DATA, msgsize, p);
+		kernel.ReceiveMsg(&sender, &type, &len, p, buf.size());
+	});
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	shm_unlink("/" STRESS_SHMEM);
+	for (const char* name : names)
+	{
+		mq_unlink(("/" + string(name)).c_str());
+	}
+
+	if (total || !WIFEXITED(status) || WEXITSTATUS(status))
+	{
+		fprintf(stderr, "FAILED: the hot paths allocated memory\n");
+		return 1;
+	}
+	fprintf(stderr, "PASSED\n");
+	return 0;
+}
+
+// check the log lines with the string arguments in char arrays and in char pointers are kept whole
+// @return			the exit code, 1 when any line is lost or corrupted
+static int CheckLogger()
+{
+	char file[] = "/tmp/ipc-stress-log-XXXXXX";
+	int fd = mkstemp(file);
+	if (fd < 0 || StartLogger(file) < 0)
+	{
+		fprintf(stderr, "cannot start the logger on %s\n", file);
+		return 1;
+	}
+	close(fd);
+
+	char buf[64] = "a string in a char array";
+	char* text = strdup("a string in a char pointer, longer than the eight bytes reserved for a pointer");
+	for (int i = 0; i < STRESS_LOGLINES; i++)
+	{
+		Log("line %d [%s] [%s] %d", i, buf, text, i);
+	}
+	StopLogger();
+
+	int good = 0;
+	FILE* f = fopen(file, "r");
+	char line[LOG_MAXLINE + 1];
+	while (f && fgets(line, sizeof(line), f))
+	{
+		char expected[LOG_MAXLINE];
+		snprintf(expected, sizeof(expected), "line %d [%s] [%s] %d\n", good, buf, text, good);
+		const char* body = strstr(line, "line ");
+		if (!body || strcmp(body, expected))
+		{
+			fprintf(stderr, "the log line %d is corrupted: %s", good, line);
+			break;
+		}
+		good++;
+	}
+	if (f)
+	{
+		fclose(f);
+	}
+	unlink(file);
+	free(text);
+
+	printf("{\"logger\":\"char_strings\",\"count\":%d,\"good\":%d}\n", STRESS_LOGLINES, good);
+	if (good != STRESS_LOGLINES)
+	{
+		fprintf(stderr, "FAILED: the log lines with string arguments are lost or corrupted\n");
+		return 1;
+	}
+	fprintf(stderr, "PASSED\n");
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int writers = 2;
+	int readers = 2;
+	int threads = 2;
+	double secs = 5;
+	int size = 256;
+	bool alloc = false;
+	bool logger = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "w:r:t:d:s:al")) != -1)
+	{
+		if (opt == 'w')
+		{
+			writers = atoi(optarg);
+		}
+		else if (opt == 'r')
+		{
+			readers = atoi(optarg);
+		}
+		else if (opt == 't')
+		{
+			threads = atoi(optarg);
+		}
+		else if (opt == 'd')
+		{
+			secs = atof(optarg);
+		}
+		else if (opt == 's')
+		{
+			size = atoi(optarg);
+		}
+		else if (opt == 'a')
+		{
+			alloc = true;
+		}
+		else if (opt == 'l')
+		{
+			logger = true;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-w writers] [-r readers] [-t threads] [-d seconds] [-s size] [-a] [-l]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (writers < 1 || writers > STRESS_MAXPROCS || readers < 1 || readers > STRESS_MAXPROCS || threads < 1 || threads > STRESS_MAXTHREADS
+		|| secs <= 0 || size < static_cast<int>(sizeof(stress_payload)) || size * writers >= 32768)
+	{
+		fprintf(stderr, "invalid arguments, 1-%d writers and readers, 1-%d threads, and the elements of all writers less than 32KB\n",
+			STRESS_MAXPROCS, STRESS_MAXTHREADS);
+		return 1;
+	}
+
+	if (alloc)
+	{
+		return CheckAllocations(size);
+	}
+	if (logger)
+	{
+		return CheckLogger();
+	}
+
+	void* results = mmap(0, sizeof(stress_results), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	s_results = static_cast<stress_results*>(results);
+	memset(s_results, 0, sizeof(stress_results));
+
+	// a fresh segment and fresh queues, the elements hold a valid payload before any reader starts
+	shm_unlink("/" STRESS_SHMEM);
+	for (int i = 0; i < STRESS_MAXPROCS; i++)
+	{
+		mq_unlink(("/" + WriterName(i)).c_str());
+		mq_unlink(("/" + ReaderName(i)).c_str());
+	}
+	{
+		ShMem shm(STRESS_SHMEM);
+		vector<char> buf(size);
+		for (int w = 0; w < writers; w++)
+		{
+			int id = shm.CreatePublisher("stress-" + to_string(w), size);
+			if (id <= 0)
+			{
+				fprintf(stderr, "cannot create element %d: %s\n", w, shm.GetErrorMessage().c_str());
+				return 1;
+			}
+			Fill(reinterpret_cast<stress_payload*>(buf.data()), size, w, 1);
+			shm.Write(id, buf.data());
+		}
+		if (shm.CreateShared(STRESS_CAS, sizeof(stress_counter)) <= 0 || shm.CreateShared(STRESS_VERSIONED, sizeof(stress_versioned)) <= 0)
+		{
+			fprintf(stderr, "cannot create the shared elements: %s\n", shm.GetErrorMessage().c_str());
+			return 1;
+		}
+	}
+
+	fflush(stdout);
+	uint64_t start = GetMonotonicTime();
+	uint64_t deadline = start + static_cast<uint64_t>(secs * 1e9);
+	for (int r = 0; r < readers; r++)
+	{
+		if (fork() == 0)
+		{
+			_exit(RunReader(r, writers, threads, size, deadline));
+		}
+	}
+	for (int w = 0; w < writers; w++)
+	{
+		if (fork() == 0)
+		{
+			_exit(RunWriter(w, readers, threads, size, deadline));
+		}
+	}
+
+	int failures = 0;
+	int status;
+	while (wait(&status) > 0)
+	{
+		failures += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	}
+	double elapsed = (GetMonotonicTime() - start) / 1e9;
+
+	// every update of the writers is in both shared elements
+	{
+		ShMem shm(STRESS_SHMEM, true);
+		stress_counter cas;
+		stress_versioned ver;
+		memset(&cas, 0, sizeof(cas));
+		memset(&ver, 0, sizeof(ver));
+		shm.Read(shm.Subscribe(STRESS_CAS), &cas);
+		shm.Read(shm.Subscribe(STRESS_VERSIONED), &ver);
+		uint32_t updates = static_cast<uint32_t>(s_results->updates);
+		uint32_t sum = static_cast<uint32_t>(s_results->update_sum);
+		s_results->lost_updates = static_cast<uint32_t>(updates - cas.count) + static_cast<uint32_t>(updates - ver.copies[0].count)
+			+ (cas.sum != sum) + (ver.copies[0].sum != sum);
+	}
+
+	const stress_results& s = *s_results;
+	printf("{\"stress\":\"shmem\",\"writers\":%d,\"readers\":%d,\"secs\":%.1f,\"writes\":%llu,\"reads\":%llu,"
+		"\"writes_per_sec\":%.0f,\"reads_per_sec\":%.0f,\"busy\":%llu,\"torn\":%llu,\"reordered\":%llu,"
+		"\"shared_updates\":%llu,\"conflicts\":%llu,\"lost_updates\":%llu}\n",
+		writers, readers, secs,
+		static_cast<unsigned long long>(s.writes), static_cast<unsigned long long>(s.reads),
+		s.writes / secs, s.reads / secs,
+		static_cast<unsigned long long>(s.busy), static_cast<unsigned long long>(s.torn),
+		static_cast<unsigned long long>(s.element_reordered), static_cast<unsigned long long>(s.updates),
+		static_cast<unsigned long long>(s.conflicts), static_cast<unsigned long long>(s.lost_updates));
+	printf("{\"stress\":\"msgq\",\"writers\":%d,\"threads\":%d,\"readers\":%d,\"secs\":%.1f,\"sent\":%llu,\"received\":%llu,"
+		"\"msgs_per_sec\":%.0f,\"send_retries\":%llu,\"corrupted\":%llu,\"duplicated\":%llu,\"reordered\":%llu,\"lost\":%llu,\"unfinished\":%llu}\n",
+		writers, threads, readers, elapsed,
+		static_cast<unsigned long long>(s.sent), static_cast<unsigned long long>(s.received),
+		s.received / elapsed, static_cast<unsigned long long>(s.send_retries),
+		static_cast<unsigned long long>(s.corrupted), static_cast<unsigned long long>(s.duplicated),
+		static_cast<unsigned long long>(s.reordered), static_cast<unsigned long long>(s.lost),
+		static_cast<unsigned long long>(s.unfinished));
+
+	uint64_t violations = s.torn + s.element_reordered + s.lost_updates + s.corrupted + s.duplicated + s.reordered + s.lost + s.unfinished;
+	shm_unlink("/" STRESS_SHMEM);
+	for (int i = 0; i < writers || i < readers; i++)
+	{
+		mq_unlink(("/" + WriterName(i)).c_str());
+		mq_unlink(("/" + ReaderName(i)).c_str());
+	}
+
+	if (violations || failures)
+	{
+		fprintf(stderr, "FAILED: %llu violations, %d processes failed\n", static_cast<unsigned long long>(violations), failures);
+		return 1;
+	}
+	fprintf(stderr, "PASSED\n");
+	return 0;
+}
@@ -0,0 +1,232 @@
+/**
+ * ipc-top shows the live statistics of ipc-utils library.
+ *
+ * It maps the statistics and the channel directory read-only, so it never changes them and takes no lock.
+ * The processes being watched are not affected.
+ *
+ * For every shared element:	the writes, reads and read retries per second, and their totals.
+ * For every channel:			the receiver pid, the queue depth, its high-water mark and max,
+ *								the messages sent and received per second, the receive timeouts per second,
+ *								and the send failures by errno.
+ *
+ * Usage: ipc-top [-i interval_ms] [-n count]
+ *		-i	the refreshing interval in milliseconds, 1000 by default
+ *		-n	exit after the number of refreshings, run till interrupted by default
+ *
+ * Version 1.0
+ */
+
+#include "ipc-utils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+
+// map a shared memory read-only
+// @param name		the name of the shared memory
+// @param size		the size expected
+// @return			the pointer to the shared memory, NULL for not existing yet
+static const void* MapReadOnly(const char* name, size_t size)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	struct stat st;
+	void* base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= size)
+	{
+		base = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	return base == MAP_FAILED ? NULL : base;
+}
+
+// find the live counters of a channel without claiming any entry
+// @param stats		the statistics
+// @param name		the channel name in uint64_t style
+// @return			the counters, NULL for not found
+static const ipc_channel_stats* FindChannelStats(const ipc_stats* stats, uint64_t name)
+{
+	uint32_t slot = static_cast<uint32_t>((name * 0x9E3779B97F4A7C15ULL) >> (64 - 10));
+	for (int i = 0; i < IPC_STATS_CHANNELS; i++)
+	{
+		const ipc_channel_stats* entry = stats->channels + ((slot + i) & (IPC_STATS_CHANNELS - 1));
+		uint64_t n = __atomic_load_n(&entry->name, __ATOMIC_ACQUIRE);
+		if (n == name)
+		{
+			return entry;
+		}
+		if (n == 0)
+		{
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+// the rate of a counter
+// @param now		the counter now
+// @param last		the counter at the last refreshing
+// @param secs		the seconds since the last refreshing
+// @return			the rate per second
+static double Rate(uint64_t now, uint64_t last, double secs)
+{
+	return now >= last && secs > 0 ? (now - last) / secs : 0;
+}
+
+int main(int argc, char* argv[])
+{
+	long interval = 1000;
+	long count = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:n:")) != -1)
+	{
+		if (opt == 'i')
+		{
+			interval = atol(optarg);
+		}
+		else if (opt == 'n')
+		{
+			count = atol(optarg);
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-i interval_ms] [-n count]\n", argv[0]);
+			return 1;
+		}
+	}
+	interval = interval < 10 ? 10 : interval;
+
+	const ipc_stats* stats = NULL;
+	const mq_directory* directory = NULL;
+	vector<ipc_element_stats> lastElements(IPC_STATS_ELEMENTS);
+	vector<mq_directory_entry> lastEntries(MQ_DIRECTORYSIZE);
+	vector<uint64_t> lastTimeouts(MQ_DIRECTORYSIZE, 0);
+	uint64_t last = GetMonotonicTime();
+	bool tty = isatty(STDOUT_FILENO);
+
+	for (long n = 0; count < 0 || n <= count; n++)
+	{
+		// the first round only takes the counters, the rates are shown from the second round
+		if (n)
+		{
+			usleep(interval * 1000);
+		}
+
+		if (!stats)
+		{
+			stats = static_cast<const ipc_stats*>(MapReadOnly(IPC_STATSNAME, sizeof(ipc_stats)));
+		}
+		if (!directory)
+		{
+			directory = static_cast<const mq_directory*>(MapReadOnly(MQ_DIRECTORYNAME, sizeof(mq_directory)));
+		}
+
+		uint64_t now = GetMonotonicTime();
+		double secs = (now - last) / 1e9;
+		last = now;
+		if (!n)
+		{
+			secs = 0;
+		}
+
+		string out = tty ? "\033[H\033[2J" : "";
+		char line[256];
+		timespec tp;
+		clock_gettime(CLOCK_REALTIME, &tp);
+		snprintf(line, sizeof(line), "ipc-top %s, refreshed every %ld ms\n\n", GetDateTime(tp.tv_sec, tp.tv_nsec / 1000).c_str(), interval);
+		out += line;
+
+		if (!stats || stats->version != IPC_STATS_VERSION)
+		{
+			out += stats ? "the statistics has a different layout\n" : "no statistics yet\n";
+			stats = stats && stats->version == IPC_STATS_VERSION ? stats : NULL;
+		}
+		else
+		{
+			snprintf(line, sizeof(line), "%-32s %10s %10s %10s %12s %12s %10s\n", "ELEMENT", "WRITES/S", "READS/S", "RETRIES/S", "WRITES", "READS", "RETRIES");
+			out += line;
+			for (int i = 0; i < IPC_STATS_ELEMENTS; i++)
+			{
+				const ipc_element_stats* e = stats->elements + i;
+				if (!__atomic_load_n(&e->key, __ATOMIC_ACQUIRE))
+				{
+					continue;
+				}
+
+				ipc_element_stats cur;
+				memcpy(&cur, e, sizeof(cur));
+				string name = string(cur.title, strnlen(cur.title, sizeof(cur.title))) + "/" + string(cur.name, strnlen(cur.name, sizeof(cur.name)));
+				snprintf(line, sizeof(line), "%-32s %10.0f %10.0f %10.0f %12llu %12llu %10llu\n", name.c_str(),
+					Rate(cur.writes, lastElements[i].writes, secs),
+					Rate(cur.reads, lastElements[i].reads, secs),
+					Rate(cur.read_retries, lastElements[i].read_retries, secs),
+					static_cast<unsigned long long>(cur.writes),
+					static_cast<unsigned long long>(cur.reads),
+					static_cast<unsigned long long>(cur.read_retries));
+				out += line;
+				lastElements[i] = cur;
+			}
+		}
+
+		if (!directory)
+		{
+			out += "\nno channel directory yet\n";
+		}
+		else
+		{
+			snprintf(line, sizeof(line), "\n%-8s %7s %5s %5s %5s %10s %10s %10s  %s\n", "CHANNEL", "PID", "DEPTH", "HWM", "MAX", "SENT/S", "RECV/S", "TIMEOUT/S", "SEND FAILURES again/timedout/intr/msgsize/badf/other");
+			out += line;
+			for (int i = 0; i < MQ_DIRECTORYSIZE; i++)
+			{
+				const mq_directory_entry* d = directory->entries + i;
+				uint64_t name = __atomic_load_n(&d->name, __ATOMIC_ACQUIRE);
+				if (!name)
+				{
+					continue;
+				}
+
+				mq_directory_entry cur;
+				memcpy(&cur, d, sizeof(cur));
+				const ipc_channel_stats* c = stats ? FindChannelStats(stats, name) : NULL;
+				ipc_channel_stats counters;
+				memset(&counters, 0, sizeof(counters));
+				if (c)
+				{
+					memcpy(&counters, c, sizeof(counters));
+				}
+
+				int64_t depth = static_cast<int64_t>(cur.sent - cur.received);
+				snprintf(line, sizeof(line), "%-8.8s %7d %5lld %5u %5u %10.0f %10.0f %10.0f  %llu/%llu/%llu/%llu/%llu/%llu\n", (char*)&name,
+					cur.pid, static_cast<long long>(depth < 0 ? 0 : depth), counters.depth_hwm, cur.maxmsg,
+					Rate(cur.sent, lastEntries[i].sent, secs),
+					Rate(cur.received, lastEntries[i].received, secs),
+					Rate(counters.receive_timeouts, lastTimeouts[i], secs),
+					static_cast<unsigned long long>(counters.send_failures[IPC_SENDERR_AGAIN]),
+					static_cast<unsigned long long>(counters.send_failures[IPC_SENDERR_TIMEDOUT]),
+					static_cast<unsigned long long>(counters.send_failures[IPC_SENDERR_INTR]),
+					static_cast<unsigned long long>(counters.send_failures[IPC_SENDERR_MSGSIZE]),
+					static_cast<unsigned long long>(counters.send_failures[IPC_SENDERR_BADF]),
+					static_cast<unsigned long long>(counters.send_failures[IPC_SENDERR_OTHER]));
+				out += line;
+				lastEntries[i] = cur;
+				lastTimeouts[i] = counters.receive_timeouts;
+			}
+		}
+
+		// the first round is shown only when it is the only one
+		if (n || count == 0)
+		{
+			fputs(out.c_str(), stdout);
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
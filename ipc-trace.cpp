@@ -0,0 +1,201 @@
+/**
+ * ipc-trace exports the trace rings of ipc-utils library to the Chrome/Perfetto JSON trace format.
+ *
+ * The library built with "make TRACE=1" records the ShMem publishing and reading, and the MsgQ sending and receiving,
+ * in a trace ring of every thread, /dev/shm/ipc-trace.<pid>.<tid>. The rings are kept after the processes exit.
+ * Every event is a slice of its thread. The events of the same trace ID are linked by flow arrows, so that one sample
+ * can be followed from ShMem::Write() through the MsgQ hops.
+ *
+ * Usage: ipc-trace [-r] > trace.json
+ *		-r	remove the trace rings after exporting them
+ * Open trace.json by https://ui.perfetto.dev or chrome://tracing
+ *
+ * Version 1.0
+ */
+
+#include "ipc-utils.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace std;
+
+// an event exported
+struct trace_event
+{
+	ipc_trace_record record;
+	int pid;
+	int tid;
+};
+
+// print a name in uint64_t style
+// @param name		the name in uint64_t style
+// @return			the name in string, up to 8 characters
+static string NameString(uint64_t name)
+{
+	return string((char*)&name, strnlen((char*)&name, sizeof(name)));
+}
+
+// read a trace ring
+// @param file		the name of the shared memory
+// @param events (out)	the events read are appended
+// @param threads (out)	the thread names by pid and tid
+// @return			the number of events read, negtive for error
+static int ReadRing(string file, vector<trace_event>* events, map<pair<int, int>, string>* threads)
+{
+	int fd = shm_open(("/" + file).c_str(), O_RDONLY, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	struct stat st;
+	void* base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(ipc_trace_ring))
+	{
+		base = mmap(0, sizeof(ipc_trace_ring), PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		return -2;
+	}
+
+	const ipc_trace_ring* ring = static_cast<const ipc_trace_ring*>(base);
+	if (ring->version != IPC_TRACE_VERSION || ring->size != IPC_TRACE_RECORDS)
+	{
+		munmap(base, sizeof(ipc_trace_ring));
+		return -3;
+	}
+
+	// only the latest records are kept by the ring
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > IPC_TRACE_RECORDS ? head - IPC_TRACE_RECORDS : 0;
+	for (uint64_t i = first; i < head; i++)
+	{
+		trace_event e;
+		e.record = ring->records[i & (IPC_TRACE_RECORDS - 1)];
+		e.pid = ring->pid;
+		e.tid = ring->tid;
+		events->push_back(e);
+	}
+	(*threads)[make_pair(ring->pid, ring->tid)] = string(ring->thread, strnlen(ring->thread, sizeof(ring->thread)));
+
+	munmap(base, sizeof(ipc_trace_ring));
+	return static_cast<int>(head - first);
+}
+
+int main(int argc, char* argv[])
+{
+	bool remove = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "r")) != -1)
+	{
+		if (opt == 'r')
+		{
+			remove = true;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-r] > trace.json\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// the trace rings are the shared memory named ipc-trace.<pid>.<tid>
+	vector<string> files;
+	DIR* dir = opendir("/dev/shm");
+	if (dir)
+	{
+		string prefix = string(IPC_TRACEPREFIX).substr(1);
+		for (dirent* d = readdir(dir); d; d = readdir(dir))
+		{
+			if (strncmp(d->d_name, prefix.c_str(), prefix.length()) == 0)
+			{
+				files.push_back(d->d_name);
+			}
+		}
+		closedir(dir);
+	}
+
+	vector<trace_event> events;
+	map<pair<int, int>, string> threads;
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		int n = ReadRing(files[i], &events, &threads);
+		if (n < 0)
+		{
+			fprintf(stderr, "cannot read the trace ring %s, error %d\n", files[i].c_str(), n);
+		}
+		else if (remove)
+		{
+			shm_unlink(("/" + files[i]).c_str());
+		}
+	}
+
+	// the flow of a trace follows the time of its events
+	sort(events.begin(), events.end(), [](const trace_event& a, const trace_event& b) {return a.record.ts < b.record.ts;});
+	map<uint64_t, int> remaining;
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		if (events[i].record.trace)
+		{
+			remaining[events[i].record.trace]++;
+		}
+	}
+
+	const char* names[] = {"", "publish", "read", "send", "receive"};
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	bool first = true;
+	for (map<pair<int, int>, string>::iterator it = threads.begin(); it != threads.end(); ++it)
+	{
+		printf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n",
+			it->first.first, it->first.second, it->second.c_str());
+		first = false;
+	}
+
+	map<uint64_t, bool> started;
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		const ipc_trace_record& r = events[i].record;
+		const char* event = r.event > 0 && r.event <= IPC_TRACE_RECEIVE ? names[r.event] : "unknown";
+		string name = NameString(r.name);
+		double ts = r.ts / 1000.0; // in microseconds
+		char trace[24];
+		snprintf(trace, sizeof(trace), "0x%llx", static_cast<unsigned long long>(r.trace));
+
+		printf("%s{\"name\":\"%s %s\",\"cat\":\"ipc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":0.5,\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":\"%s\",\"%s\":%u}}",
+			first ? "" : ",\n", event, name.c_str(), ts, events[i].pid, events[i].tid, trace,
+			r.event == IPC_TRACE_PUBLISH || r.event == IPC_TRACE_READ ? "publisher" : "type", r.arg);
+		first = false;
+
+		// the flow starts at the first event of a trace, steps through the others, and finishes at the last one
+		if (r.trace)
+		{
+			const char* ph = "t";
+			if (!started[r.trace])
+			{
+				started[r.trace] = true;
+				ph = "s";
+			}
+			else if (remaining[r.trace] == 1)
+			{
+				ph = "f";
+			}
+			remaining[r.trace]--;
+			if (ph[0] != 's' || remaining[r.trace] > 0)
+			{
+				printf(",\n{\"name\":\"trace\",\"cat\":\"ipc\",\"ph\":\"%s\",\"bp\":\"e\",\"id\":\"%s\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+					ph, trace, ts, events[i].pid, events[i].tid);
+			}
+		}
+	}
+	printf("\n]}\n");
+
+	fprintf(stderr, "%zu events of %zu threads exported\n", events.size(), threads.size());
+	return 0;
+}
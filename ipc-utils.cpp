@@ -2,9 +2,350 @@
 #include <cstdio>
 #include <time.h>
 #include <chrono>
+#include <linux/futex.h> // for futex
+#include <sys/syscall.h> // for syscall
+#include <sched.h> // for sched_yield
+#include <signal.h> // for kill
+#include <poll.h> // for ppoll
+#include <sys/prctl.h> // for timer slack
+#include <pthread.h> // for pthread_atfork
+#include <cstdlib> // for getenv
+#include <new> // for the aligned log rings
+
+static thread_local uint64_t t_traceId = 0; // the trace ID carried by the current thread
+static atomic<uint32_t> s_traceSeq(0); // the sequence of the trace IDs created by this process
+static uint32_t s_tracePid = 0; // the pid in the trace IDs, cleared in the child after fork
+
+#ifdef IPC_TRACE
+static thread_local ipc_trace_ring* t_traceRing = NULL; // the trace ring of the current thread
+static thread_local bool t_traceFailed = false; // the trace ring cannot be created, do not try again
+
+// the forked child is a new process with its own trace ring
+static void ResetTraceRing()
+{
+	t_traceRing = NULL;
+	t_traceFailed = false;
+}
+
+// create the trace ring of the current thread
+// @return			the trace ring, NULL for error
+static ipc_trace_ring* OpenTraceRing()
+{
+	static bool s_atfork = pthread_atfork(NULL, NULL, ResetTraceRing) == 0;
+	(void)s_atfork;
+	if (t_traceFailed)
+	{
+		return NULL;
+	}
+
+	int pid = getpid();
+	int tid = static_cast<int>(syscall(SYS_gettid));
+	string name = IPC_TRACEPREFIX + to_string(pid) + "." + to_string(tid);
+	int fd = shm_open(name.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+	void* base = MAP_FAILED;
+	if (fd >= 0)
+	{
+		if (ftruncate(fd, sizeof(ipc_trace_ring)) == 0)
+		{
+			base = mmap(0, sizeof(ipc_trace_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+		}
+		close(fd);
+	}
+	if (base == MAP_FAILED)
+	{
+		t_traceFailed = true;
+		return NULL;
+	}
+
+	ipc_trace_ring* ring = static_cast<ipc_trace_ring*>(base);
+	ring->pid = pid;
+	ring->tid = tid;
+	ring->size = IPC_TRACE_RECORDS;
+	pthread_getname_np(pthread_self(), ring->thread, sizeof(ring->thread));
+	__atomic_store_n(&ring->version, IPC_TRACE_VERSION, __ATOMIC_RELEASE);
+	t_traceRing = ring;
+	return ring;
+}
+
+// record an event in the trace ring of the current thread
+// @param event		the event, for example IPC_TRACE_SEND
+// @param trace		the trace ID, 0 for none
+// @param name		the element name or the peer channel name in uint64_t style
+// @param arg		the publisher ID or the message type
+// @param ts		the CLOCK_MONOTONIC time in nanoseconds already taken, 0 to take it now
+static inline void TraceEvent(uint32_t event, uint64_t trace, uint64_t name, uint32_t arg, uint64_t ts)
+{
+	ipc_trace_ring* ring = t_traceRing ? t_traceRing : OpenTraceRing();
+	if (!ring)
+	{
+		return;
+	}
+
+	uint64_t head = ring->head;
+	ipc_trace_record* r = ring->records + (head & (IPC_TRACE_RECORDS - 1));
+	r->ts = ts ? ts : GetMonotonicTime();
+	r->trace = trace;
+	r->name = name;
+	r->event = event;
+	r->arg = arg;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+#define IPC_TRACEPOINT(event, trace, name, arg, ts) TraceEvent(event, trace, name, arg, ts)
+#else
+#define IPC_TRACEPOINT(event, trace, name, arg, ts)
+#endif
+
+// map the record log named by IPC_RECORD, create it if not existing
+// @return			the record log, NULL when nothing is recorded
+static ipc_record_log* MapRecordLog()
+{
+	const char* file = getenv(IPC_RECORD_ENV);
+	if (!file || !*file)
+	{
+		return NULL;
+	}
+
+	// the creator sizes the log, the others wait for it
+	bool created = false;
+	off_t size = 0;
+	int fd = open(file, O_CREAT | O_EXCL | O_RDWR, 0666);
+	if (fd >= 0)
+	{
+		const char* mb = getenv(IPC_RECORD_SIZEENV);
+		size = static_cast<off_t>(mb && atol(mb) > 0 ? atol(mb) : IPC_RECORD_DEFAULTMB) << 20;
+		created = ftruncate(fd, size) == 0;
+		if (!created)
+		{
+			close(fd);
+			unlink(file);
+			return NULL;
+		}
+	}
+	else if (errno == EEXIST && (fd = open(file, O_RDWR)) >= 0)
+	{
+		struct stat st;
+		for (int i = 0; i < 1000 && fstat(fd, &st) == 0; i++)
+		{
+			size = st.st_size;
+			if (static_cast<size_t>(size) >= sizeof(ipc_record_log))
+			{
+				break;
+			}
+			usleep(1000);
+		}
+	}
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	void* base = MAP_FAILED;
+	if (static_cast<size_t>(size) >= sizeof(ipc_record_log))
+	{
+		// the whole log is populated here, so the recording takes no page fault
+		base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	}
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	ipc_record_log* log = static_cast<ipc_record_log*>(base);
+	if (created)
+	{
+		timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		log->version = IPC_RECORD_VERSION;
+		log->size = size;
+		log->tail = sizeof(ipc_record_log);
+		log->created = static_cast<uint64_t>(t.tv_sec) * 1000000000ULL + t.tv_nsec;
+		__atomic_store_n(&log->magic, IPC_RECORD_MAGIC, __ATOMIC_RELEASE);
+		return log;
+	}
+
+	// the magic is stored last by the creator
+	for (int i = 0; i < 1000 && __atomic_load_n(&log->magic, __ATOMIC_ACQUIRE) != IPC_RECORD_MAGIC; i++)
+	{
+		usleep(1000);
+	}
+	if (log->magic != IPC_RECORD_MAGIC || log->version != IPC_RECORD_VERSION || log->size != static_cast<uint64_t>(size))
+	{
+		munmap(base, size);
+		return NULL;
+	}
+	return log;
+}
+
+static thread_local char* t_recordPos = NULL; // the next record in the chunk of the current thread
+static thread_local char* t_recordEnd = NULL; // the end of the chunk of the current thread
+
+// the forked child reserves its own chunks
+static void ResetRecordChunk()
+{
+	t_recordPos = NULL;
+	t_recordEnd = NULL;
+}
+
+// get the record log, it is mapped once in a process
+// @return			the record log, NULL when nothing is recorded
+static inline ipc_record_log* GetRecordLog()
+{
+	static ipc_record_log* log = MapRecordLog();
+	return log;
+}
+
+// append a record to the record log. The chunks of a thread are reserved by the tail, the records are appended without any lock
+// @param log		the record log
+// @param r			the record, its size, seq and kind are filled here
+// @param kind		IPC_RECORD_SHMEM or IPC_RECORD_MSG
+// @param data		the data of the record
+static void AppendRecord(ipc_record_log* log, ipc_record& r, uint16_t kind, const void* data)
+{
+	r.size = (sizeof(ipc_record) + r.len + 7) & ~7U;
+	r.seq = __atomic_fetch_add(&log->seq, 1, __ATOMIC_RELAXED);
+	r.kind = 0;
+
+	// a new chunk is reserved when the record does not fit in the rest of the current one, a large record has a chunk of its own
+	if (static_cast<size_t>(t_recordEnd - t_recordPos) < r.size)
+	{
+		static bool s_atfork = pthread_atfork(NULL, NULL, ResetRecordChunk) == 0;
+		(void)s_atfork;
+		uint64_t chunk = (r.size + IPC_RECORD_CHUNK - 1) / IPC_RECORD_CHUNK * IPC_RECORD_CHUNK;
+		uint64_t offset = __atomic_fetch_add(&log->tail, chunk, __ATOMIC_RELAXED);
+		if (offset + chunk > log->size)
+		{
+			ResetRecordChunk();
+			__atomic_fetch_add(&log->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		t_recordPos = reinterpret_cast<char*>(log) + offset;
+		t_recordEnd = t_recordPos + chunk;
+	}
+
+	ipc_record* rec = reinterpret_cast<ipc_record*>(t_recordPos);
+	t_recordPos += r.size;
+	memcpy(rec, &r, sizeof(r));
+	if (r.len)
+	{
+		memcpy(rec + 1, data, r.len);
+	}
+	__atomic_store_n(&rec->kind, kind, __ATOMIC_RELEASE);
+}
+
+// record a message sent
+// @param log		the record log
+// @param sender	the sender channel name in uint64_t style
+// @param dest		the destnation channel name in uint64_t style
+// @param type		the type of the message
+// @param len		the length of the message data
+// @param data		the message data
+// @param priority	the priority of the message
+// @param corr		the correlation ID, 0 for none
+// @param flags		the flags of the message, only MQ_FLAG_REQUEST and MQ_FLAG_REPLY are kept
+// @param ts		the CLOCK_MONOTONIC time in nanoseconds when the message was sent
+static void RecordMessage(ipc_record_log* log, uint64_t sender, uint64_t dest, int type, int len, const void* data, int priority, uint32_t corr, uint16_t flags, uint64_t ts)
+{
+	ipc_record r;
+	memset(&r, 0, sizeof(r));
+	r.type = type;
+	r.ts = ts;
+	r.trace = t_traceId;
+	memcpy(r.title, &sender, sizeof(sender));
+	memcpy(r.name, &dest, sizeof(dest));
+	r.len = len;
+	r.priority = priority;
+	r.flags = flags & (MQ_FLAG_REQUEST | MQ_FLAG_REPLY);
+	r.corr = corr;
+	AppendRecord(log, r, IPC_RECORD_MSG, data);
+}
+
+// build the message
+// @return			the text, or the message of the status
+string ipc_message::str() const
+{
+	switch (m_status)
+	{
+	case IPC_STATUS_FOUND:
+		return "found the element";
+	case IPC_STATUS_NOTFOUND:
+		return "cannot find the element";
+	case IPC_STATUS_UPDATED:
+		return "element is updated";
+	case IPC_STATUS_READ:
+		return "";
+	case IPC_STATUS_OUTOFRANGE:
+		return "element ID is out of range";
+	case IPC_STATUS_TOOFAST:
+		return "the element was updated too fast to be read";
+	case IPC_STATUS_SENT:
+		return "message sent";
+	case IPC_STATUS_QUEUED:
+		return "message queued";
+	case IPC_STATUS_FULL:
+		return "the queue was full";
+	case IPC_STATUS_TIMEDOUT:
+		return "The call timed out before a message could be transferred.";
+	case IPC_STATUS_INTERRUPTED:
+		return "The call was interrupted by a signal handler";
+	case IPC_STATUS_NOMESSAGE:
+		return "no message";
+	case IPC_STATUS_RECEIVED:
+		return string((char*)&m_name, strnlen((char*)&m_name, sizeof(m_name)));
+	case IPC_STATUS_CHANGED:
+		return "the element was updated by another writer";
+	default:
+		return m_text;
+	}
+}
+
+// wait for a sequence turned odd by another writer to move on. The claim of a writer that died is broken by turning the
+// sequence even, the claim without any owner recorded is taken as the one of a writer died right after claiming.
+// @param seq		the sequence
+// @param owner		the pid of the writer holding the claim, 0 for none
+// @param odd		the odd sequence of the claim
+// @param usec		the microseconds to wait for a writer alive
+// @return			0 when the sequence moved on or the claim was broken, the pid of the writer still holding it otherwise
+static uint32_t WaitSeqClaim(uint32_t* seq, uint32_t* owner, uint32_t odd, long usec)
+{
+	uint64_t deadline = GetMonotonicTime() + usec * 1000ULL;
+	while (__atomic_load_n(seq, __ATOMIC_ACQUIRE) == odd)
+	{
+		uint32_t pid = __atomic_load_n(owner, __ATOMIC_RELAXED);
+		bool dead = pid && kill(static_cast<pid_t>(pid), 0) < 0 && errno == ESRCH;
+		if (dead || GetMonotonicTime() > deadline)
+		{
+			if (pid && !dead)
+			{
+				return pid;
+			}
+
+			// the owner is cleared first, so that a later claim is never taken for the dead one
+			if (!pid || __atomic_compare_exchange_n(owner, &pid, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				uint32_t expected = odd;
+				__atomic_compare_exchange_n(seq, &expected, odd + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+			}
+			return 0;
+		}
+		sched_yield();
+	}
+	return 0;
+}
+
+// the empty header area of a read only instance not attached yet, no element is found in it
+static shm_header s_detachedHeaders[1];
 
 // Constructor of the shared memory, the name is specified
-ShMem::ShMem(string title)
+ShMem::ShMem(string title) : ShMem(title, false)
+{
+}
+
+// Constructor of the shared memory for the subscribers only
+// @param title			the title of the shared memory
+// @param readonly		true to map an existing segment for reading only, it is never created or cleared
+// @param wait_usec		the time in microseconds to wait for the segment to be created, 0 for not waiting
+ShMem::ShMem(string title, bool readonly, long wait_usec)
 {
 	if (title.empty())
 	{
@@ -20,40 +361,188 @@ ShMem::ShMem(string title)
 	}
 	title = "/" + m_title; // add the / in front of the title
 
-	// create the shared memory object
-	m_fd = shm_open(title.c_str(), O_CREAT | O_RDWR, 0666);
-
 	// configure the total size of the shared memory object
+	int size_segment = sizeof(shm_segment);
 	int size_headers = MAX_PUBLISHERS * sizeof(shm_header);
 	int size_names = MAX_PUBLISHERS * 16;
 	int size_data = 65536;
-	m_size = size_headers + size_names + size_data; // total size of the headers, names, and data
+	m_size = size_segment + size_headers + size_names + size_data; // total size of the segment header, headers, names, and data
+
+	// clear the flags of all publishers, no publisher by this instance
+	memset(m_publishers, 0, sizeof(m_publishers));
+	memset(m_stats, 0, sizeof(m_stats));
+	memset(m_noStats, 0, sizeof(m_noStats));
+
+	// a subscriber only instance maps an existing segment, it sees no element till the segment is attached
+	m_readonly = readonly;
+	if (m_readonly)
+	{
+		m_headers = s_detachedHeaders;
+		if (Attach(wait_usec) == 0)
+		{
+			m_message.assign(m_names[0]);
+		}
+		return;
+	}
+
+	// create the shared memory object
+	m_fd = shm_open(title.c_str(), O_CREAT | O_RDWR, 0666);
 	ftruncate(m_fd, m_size);
 
 	// memory map the shared memory object
 	void* base = mmap(0, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
-	m_headers = (shm_header*)base;
-	m_names = (char(*)[16]) base + size_headers;
-	m_data = base + size_headers + size_names;
+	SetAreas(base);
 	m_err = strlen(m_names[0]);
 
-	// check if the shared memory has been setup before
-	if (strlen(m_names[0]) != m_title.length() || strcmp(m_names[0], m_title.c_str()))
+	// check if the shared memory has been setup before, a segment of an older layout is setup again
+	if (__atomic_load_n(&m_segment->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || m_segment->version != SHM_VERSION
+		|| strlen(m_names[0]) != m_title.length() || strcmp(m_names[0], m_title.c_str()))
 	{
 		memset(base, 0, m_size); // clear the whole shared memory
 		strcpy(m_names[0], m_title.c_str()); // assign the title to be the first ID
+		m_segment->version = SHM_VERSION;
+		m_segment->size = m_size;
+		__atomic_store_n(&m_segment->magic, SHM_MAGIC, __ATOMIC_RELEASE);
 		m_err = strlen(m_names[0]);
 	}
 
-	// clear the flags of all publishers, no publisher by this instance
-	memset(m_publishers, 0, sizeof(m_publishers));
+	GetRecordLog(); // map the record log before any publishing
 
 	m_message.assign(m_names[0]);
 }
 
 ShMem::~ShMem()
 {
-	munmap((void*)m_headers, m_size);
+	if (m_segment)
+	{
+		munmap((void*)m_segment, m_size);
+	}
+}
+
+// set the areas of a mapped segment
+// @param base			the address of the segment
+void ShMem::SetAreas(void* base)
+{
+	m_segment = (shm_segment*)base;
+	m_headers = (shm_header*)((char*)base + sizeof(shm_segment)); // the headers start right after the segment header
+	m_names = (char(*)[16]) ((char*)m_headers + MAX_PUBLISHERS * sizeof(shm_header)); // the names start right after the headers
+	m_data = (char*)m_names + MAX_PUBLISHERS * 16;
+}
+
+// attach the segment of a read only instance
+// @param wait_usec		the time in microseconds to wait for the segment to be created, 0 for not waiting
+// @return				0 for success, negtive for error code
+int ShMem::Attach(long wait_usec)
+{
+	if (m_segment)
+	{
+		m_err = 0;
+		return m_err;
+	}
+
+	string title = "/" + m_title;
+	uint64_t deadline = GetMonotonicTime() + static_cast<uint64_t>(wait_usec > 0 ? wait_usec : 0) * 1000;
+	while (true)
+	{
+		// the segment is ready when it is sized and its magic is stored, the creator stores the magic last
+		void* base = MAP_FAILED;
+		int fd = shm_open(title.c_str(), O_RDONLY, 0);
+		if (fd >= 0)
+		{
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size >= m_size)
+			{
+				base = mmap(0, m_size, PROT_READ, MAP_SHARED, fd, 0);
+			}
+			close(fd);
+		}
+
+		m_err = -1;
+		m_message = "shared memory not created yet";
+		if (base != MAP_FAILED)
+		{
+			const shm_segment* segment = (const shm_segment*)base;
+			const char* name = (const char*)base + sizeof(shm_segment) + MAX_PUBLISHERS * sizeof(shm_header);
+			if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC)
+			{
+				if (segment->version != SHM_VERSION || segment->size != static_cast<uint32_t>(m_size))
+				{
+					m_err = -2;
+					m_message = "shared memory of layout version " + to_string(segment->version) + ", expected " + to_string(SHM_VERSION);
+				}
+				else if (strncmp(name, m_title.c_str(), 16))
+				{
+					m_err = -3;
+					m_message = "shared memory of another title";
+				}
+				else
+				{
+					SetAreas(base);
+					m_err = 0;
+					m_message = "shared memory attached for reading only";
+					return m_err;
+				}
+			}
+			munmap(base, m_size);
+		}
+
+		// only a segment not created yet is waited for
+		if (m_err != -1 || GetMonotonicTime() >= deadline)
+		{
+			return m_err;
+		}
+		usleep(SHM_ATTACH_POLL);
+	}
+}
+
+// get the live counters of an element
+// @param PublisherID	the ID of the shared element or publisher, 1-256
+// @return				the counters, NULL when the statistics is not available
+ipc_element_stats* ShMem::GetElementStats(int PublisherID)
+{
+	if (m_stats[PublisherID] || m_noStats[PublisherID])
+	{
+		return m_stats[PublisherID];
+	}
+
+	ipc_stats* stats = GetStats();
+	if (!stats)
+	{
+		return NULL;
+	}
+
+	// the key is the FNV-1a hash of the title and the name, 0 is reserved for empty entry
+	uint64_t key = 0xCBF29CE484222325ULL;
+	string s = m_title + "/" + m_names[PublisherID];
+	for (size_t i = 0; i < s.length(); i++)
+	{
+		key = (key ^ static_cast<uint8_t>(s[i])) * 0x100000001B3ULL;
+	}
+	key = key ? key : 1;
+
+	// linear probing from the hashed entry. Entries are claimed by compare and swap and never released
+	uint32_t slot = static_cast<uint32_t>(key >> 54);
+	for (int i = 0; i < IPC_STATS_ELEMENTS; i++)
+	{
+		ipc_element_stats* entry = stats->elements + ((slot + i) & (IPC_STATS_ELEMENTS - 1));
+		uint64_t expected = __atomic_load_n(&entry->key, __ATOMIC_ACQUIRE);
+		if (expected == 0 && __atomic_compare_exchange_n(&entry->key, &expected, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			strncpy(entry->title, m_title.c_str(), sizeof(entry->title) - 1);
+			strncpy(entry->name, m_names[PublisherID], sizeof(entry->name) - 1);
+			expected = key;
+		}
+
+		if (expected == key)
+		{
+			m_stats[PublisherID] = entry;
+			return entry;
+		}
+	}
+
+	// the table is full, the entries are never released
+	m_noStats[PublisherID] = true;
+	return NULL;
 }
 
 // Read the shared element
@@ -63,12 +552,22 @@ ShMem::~ShMem()
 // @return				the publisher ID, positive for success, negtive for error code
 //						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 int ShMem::Read(string PublisherName, int* len, void* ptr)
+{
+	return Read(PublisherName.c_str(), len, ptr);
+}
+
+// Read the shared element
+// @param PublisherName	the name of the shared element or publisher, 1-15 characters
+// @param len (out)		the size of the shared element, 0-1024. 0 for string up to 63 characters
+// @param ptr (out)		the pointer to the data read
+// @return				the publisher ID, positive for success, negtive for error code
+int ShMem::Read(const char* PublisherName, int* len, void* ptr)
 {
 	int id = Subscribe(PublisherName);
 	if (id <= 0)
 	{
 		m_err = -1;
-		m_message = "no shuch a publisher: " + PublisherName;
+		m_message = "no shuch a publisher: " + string(PublisherName);
 		return m_err;
 	}
 	
@@ -82,6 +581,15 @@ int ShMem::Read(string PublisherName, int* len, void* ptr)
 // @return				the publisher ID, positive for success, negtive for error code
 //						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 int ShMem::Read(string PublisherName, int* n)
+{
+	return Read(PublisherName.c_str(), n);
+}
+
+// Read the shared element in integer
+// @param PublisherName	the name of the shared element or publisher, 1-15 characters
+// @param n (out)		the pointer to the integer read
+// @return				the publisher ID, positive for success, negtive for error code
+int ShMem::Read(const char* PublisherName, int* n)
 {
 	int id = Subscribe(PublisherName);
 	if (id > 0 && Read(id, n) < 0)
@@ -98,6 +606,15 @@ int ShMem::Read(string PublisherName, int* n)
 // @return				the publisher ID, positive for success, negtive for error code
 //						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 int ShMem::Read(string PublisherName, double* t)
+{
+	return Read(PublisherName.c_str(), t);
+}
+
+// Read the shared element in double
+// @param PublisherName	the name of the shared element or publisher, 1-15 characters
+// @param t (out)		the pointer to the double read
+// @return				the publisher ID, positive for success, negtive for error code
+int ShMem::Read(const char* PublisherName, double* t)
 {
 	int id = Subscribe(PublisherName);
 	if (id > 0 && Read(id, t) < 0)
@@ -114,6 +631,15 @@ int ShMem::Read(string PublisherName, double* t)
 // @return				the publisher ID, positive for success, negtive for error code
 //						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 int ShMem::Read(string PublisherName, string* s)
+{
+	return Read(PublisherName.c_str(), s);
+}
+
+// Read the shared element in string
+// @param PublisherName	the name of the shared element or publisher, 1-15 characters
+// @param s (out)		the pointer to the string read
+// @return				the publisher ID, positive for success, negtive for error code
+int ShMem::Read(const char* PublisherName, string* s)
 {
 	int id = Subscribe(PublisherName);
 	if (id > 0 && Read(id, s) < 0)
@@ -131,6 +657,33 @@ int ShMem::Read(string PublisherName, string* s)
 //						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 int ShMem::CreatePublisher(string PublisherName, int size)
 {
+	return AddElement(PublisherName, size, SHM_ELEMENT_PUBLISHER);
+}
+
+// create a shared element that any process can update, or get the ID of it
+// @param PublisherName	the name of the shared element
+// @param size			the size of the shared element, 1-8 for the one updated by CompareAndSwap() without lock,
+//						0 (string) or larger for the one updated by CompareAndWrite()
+// @return				the publisher ID, positive for success, negtive for error code
+int ShMem::CreateShared(string PublisherName, int size)
+{
+	return AddElement(PublisherName, size, size > 0 && size <= 8 ? SHM_ELEMENT_ATOMIC : SHM_ELEMENT_VERSIONED);
+}
+
+// add an element
+// @param PublisherName	the name of the shared element
+// @param size			the size of the shared element
+// @param kind			SHM_ELEMENT_PUBLISHER, SHM_ELEMENT_ATOMIC or SHM_ELEMENT_VERSIONED
+// @return				the publisher ID, positive for success, negtive for error code
+int ShMem::AddElement(const string& PublisherName, int size, uint8_t kind)
+{
+	if (m_readonly)
+	{
+		m_err = -3;
+		m_message = "shared memory attached for reading only";
+		return m_err;
+	}
+
 	// check the name length
 	if (PublisherName.length() == 0 || PublisherName.length() > 15)
 	{
@@ -147,69 +700,82 @@ int ShMem::CreatePublisher(string PublisherName, int size)
 		return m_err;
 	}
 
-	// check and wait till the headers is unlocked
+	// lock the headers by turning the high byte of the element counter on, a lock left by a crashed process is broken
 	unsigned int usecs = 0; // sleep time in us
-	while (m_headers[0].offset >= MAX_PUBLISHERS)
+	uint16_t counter = __atomic_load_n(&m_headers[0].offset, __ATOMIC_RELAXED) & 0xFF;
+	while (!__atomic_compare_exchange_n(&m_headers[0].offset, &counter, counter | 0xFF00, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
 	{
-		usecs += 100;
-		if (usecs > 500)
+		if (counter >= MAX_PUBLISHERS)
 		{
-			m_headers[0].offset &= 0xFF; // unlock the header
-			m_err = -1;
-			m_message = "others locked the headers";
+			usecs += 100;
+			if (usecs > 500)
+			{
+				__atomic_compare_exchange_n(&m_headers[0].offset, &counter, counter & 0xFF, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+				usecs = 0;
+			}
+			usleep(usecs);  // sleep for a little while to wait for unlock
 		}
-		usleep(usecs);  // sleep for a little while to wait for unlock
+		counter &= 0xFF;
 	}
 
-	// lock the header
-	m_headers[0].offset |= 0xFF00;
-
 	// now starts to add the element into the sharing
-	uint16_t total_elements = m_headers[0].offset & 0xFF;
+	uint16_t total_elements = counter;
 	uint16_t offset = m_headers[0].size; // the offset is the second 16bits
 	uint16_t u_size = static_cast<uint16_t>(size);
 
 	// check if the elements has been create before
-	for (uint16_t i = 1; i < total_elements; i++)
+	for (uint16_t i = 1; i <= total_elements; i++)
 	{
 		if (strcmp(m_names[i], PublisherName.c_str()) == 0)
 		{
+			if (m_segment->kind[i] != kind)
+			{
+				m_err = -3;
+				m_message = "the element is of another kind";
+				__atomic_store_n(&m_headers[0].offset, total_elements, __ATOMIC_RELEASE); // unlock the header
+				return m_err;
+			}
 			if (u_size <= m_headers[i].size)
 			{
 				m_err = 0;
 				m_message = "found valid previously shared element";
-				m_headers[0].offset &= 0x00FF; // unlock the header
+				__atomic_store_n(&m_headers[0].offset, total_elements, __ATOMIC_RELEASE); // unlock the header
 				m_publishers[i] = true;
 				return i; // reuse the previouse 
 			}
 			m_err = -1;
 			m_message = "invalid sharing size, larger than previous";
-			m_headers[0].offset &= 0x00FF; // unlock the header
+			__atomic_store_n(&m_headers[0].offset, total_elements, __ATOMIC_RELEASE); // unlock the header
 			return m_err;
 		}
 	}
 
-	// add a new publisher
+	// add a new publisher, the element updated in place takes a whole aligned word for the atomic operations
 	total_elements++;
-	uint16_t temp_size = m_headers[0].size + (u_size ? u_size : 64);  // modify the default offset
+	if (kind == SHM_ELEMENT_ATOMIC)
+	{
+		offset = (offset + 7) & ~7;
+	}
+	uint16_t temp_size = offset + (kind == SHM_ELEMENT_ATOMIC ? 8 : u_size ? u_size : 64);  // modify the default offset
 	if (temp_size < m_headers[0].size)
 	{
 		m_err = -1;
 		m_message = "total size overflowed: " + to_string(u_size) + " " + to_string(m_headers[0].size);
-		m_headers[0].offset &= 0x00FF; // unlock the header
+		__atomic_store_n(&m_headers[0].offset, counter, __ATOMIC_RELEASE); // unlock the header
 		return m_err;
 	}
 
 	strcpy(m_names[total_elements], PublisherName.c_str()); // add the name to the name list
 	m_headers[total_elements].offset = offset; // update the offset of the element
 	m_headers[total_elements].size = u_size; // update the size of the element
+	m_segment->kind[total_elements] = kind;
 	m_headers[0].size = temp_size;  // modify the default offset
 	m_publishers[total_elements] = true;
 	
 	m_err = 0;
 	m_message = "new sharing added";
 	
-	m_headers[0].offset = total_elements; // increment the element counter and unlock the header
+	__atomic_store_n(&m_headers[0].offset, total_elements, __ATOMIC_RELEASE); // increment the element counter and unlock the header
 	return total_elements;
 }
 
@@ -219,24 +785,58 @@ int ShMem::CreatePublisher(string PublisherName, int size)
 //						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 int ShMem::Subscribe(string PublisherName)
 {
+	return Subscribe(PublisherName.c_str());
+}
+
+// subscribe a publisher or get the publisher id by name
+// @param PublisherName	the name of the shared element
+// @return				the publisher ID, positive for success, negtive for error code
+//						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
+int ShMem::Subscribe(const char* PublisherName)
+{
+	// a read only instance attaches the segment created after it
+	if (!m_segment && Attach() < 0)
+	{
+		return m_err;
+	}
+
 	uint16_t total_elements = m_headers[0].offset & 0xFF;
 
 	// check if the elements has been create before
-	for (uint16_t i = 1; i < total_elements; i++)
+	for (uint16_t i = 1; i <= total_elements; i++)
 	{
-		if (strcmp(m_names[i], PublisherName.c_str()) == 0)
+		if (strcmp(m_names[i], PublisherName) == 0)
 		{
 			m_err = 0;
-			m_message = "found the element";
+			m_message.Set(IPC_STATUS_FOUND);
 			return i; // reuse the previouse 
 		}
 	}
 
 	m_err = -1;
-	m_message = "cannot find the element";
+	m_message.Set(IPC_STATUS_NOTFOUND);
 	return m_err;
 }
 
+// get the size of a shared element
+// @param PublisherID	the ID of the shared element or publisher, 1-256
+// @return				the size of the element, 0 for a string, negtive for error code
+int ShMem::GetElementSize(int PublisherID)
+{
+	uint16_t total_elements = __atomic_load_n(&m_headers[0].offset, __ATOMIC_ACQUIRE) & 0xFF;
+
+	if (PublisherID <= 0 || PublisherID > total_elements)
+	{
+		m_err = -1;
+		m_message.Set(IPC_STATUS_OUTOFRANGE);
+		return m_err;
+	}
+
+	m_err = 0;
+	m_message.Set(IPC_STATUS_FOUND);
+	return m_headers[PublisherID].size;
+}
+
 // publish new data with the publisher
 // @param PublisherID	the ID of the shared element or publisher, 1-256
 // @param ptr			the pointer to the data to be published
@@ -248,7 +848,7 @@ int ShMem::Write(int PublisherID, void* ptr)
 	if (PublisherID == 0 || PublisherID > total_elements)
 	{
 		m_err = -1;
-		m_message = "element ID is out of range";
+		m_message.Set(IPC_STATUS_OUTOFRANGE);
 		return m_err;
 	}
 	
@@ -259,36 +859,231 @@ int ShMem::Write(int PublisherID, void* ptr)
 		return m_err;
 	}
 
-	size_t size = static_cast<size_t>(m_headers[PublisherID].size);
-	uint16_t offset = m_headers[PublisherID].offset ^ 0x8000; // write the data to the opposite offset
-	//fprintf(stderr, "the offset for reading is %d, for writing is %d\n", m_headers[PublisherID].offset, offset);
-
-	//check if it is a string type
-	if (size)
+	uint32_t* seq = m_segment->seq + PublisherID;
+	uint8_t kind = m_segment->kind[PublisherID];
+	if (kind == SHM_ELEMENT_ATOMIC)
 	{
-		memcpy(m_data + offset, ptr, size);  // copy the data to the destination
+		// the element updated in place is overwritten whatever its value is
+		size_t size = static_cast<size_t>(m_headers[PublisherID].size);
+		uint16_t offset = m_headers[PublisherID].offset;
+		uint64_t desired = 0;
+		memcpy(&desired, ptr, size);
+		__atomic_store_n((uint64_t*)((char*)m_data + offset), desired, __ATOMIC_RELEASE);
+		__atomic_fetch_add(seq, 2, __ATOMIC_RELEASE);
+		CountWrite(PublisherID, offset);
 	}
-	else
+	else if (kind == SHM_ELEMENT_VERSIONED)
 	{
-		if (static_cast<string*>(ptr)->length() > 63)
+		// the writers of a versioned element take turns by turning its sequence odd
+		uint32_t before = __atomic_load_n(seq, __ATOMIC_RELAXED);
+		while ((before & 1) || !__atomic_compare_exchange_n(seq, &before, before + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
 		{
-			m_message = "string too long";
-			static_cast<string*>(ptr)->assign(static_cast<string*>(ptr)->substr(0, 63));
+			if ((before & 1) && WaitClaim(PublisherID, before) < 0)
+			{
+				return m_err;
+			}
+			before = __atomic_load_n(seq, __ATOMIC_RELAXED);
 		}
-		strcpy((char*)(m_data + offset), static_cast<string*>(ptr)->c_str());
-
-		//fprintf(stderr, "now the new string is %s", (char*)(m_data + offset));
+		__atomic_store_n(m_segment->owner + PublisherID, static_cast<uint32_t>(getpid()), __ATOMIC_RELAXED);
+		WriteClaimed(PublisherID, ptr, before);
+	}
+	else
+	{
+		// the sequence turns odd before the copying, so that a reader still copying the opposite offset can tell
+		uint32_t before = __atomic_load_n(seq, __ATOMIC_RELAXED);
+		__atomic_store_n(seq, before + 1, __ATOMIC_RELAXED);
+		WriteClaimed(PublisherID, ptr, before);
 	}
-	m_headers[PublisherID].offset = offset; // revert the ping-pong flag
 
 	m_err = 0;
-	m_message = "element is updated";
+	m_message.Set(IPC_STATUS_UPDATED);
 	return m_headers[PublisherID].size;
 }
 
-// publish new data in integer with the publisher
+// copy the data into an element of which the sequence is turned odd by this writer
 // @param PublisherID	the ID of the shared element or publisher, 1-256
-// @param n				the data in integer to be published
+// @param ptr			the pointer to the data, the pointer to a string for a string element
+// @param seq			the even sequence before the writing
+// @return				the actual bytes of data written
+int ShMem::WriteClaimed(int PublisherID, const void* ptr, uint32_t seq)
+{
+	size_t size = static_cast<size_t>(m_headers[PublisherID].size);
+	uint16_t offset = m_headers[PublisherID].offset ^ 0x8000; // write the data to the opposite offset
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	//check if it is a string type
+	if (size)
+	{
+		memcpy((char*)m_data + offset, ptr, size);  // copy the data to the destination
+	}
+	else
+	{
+		// a string longer than 63 characters is truncated in the element, the string itself is kept
+		const string* text = static_cast<const string*>(ptr);
+		size_t n = text->length() > 63 ? 63 : text->length();
+		memcpy((char*)m_data + offset, text->c_str(), n);
+		((char*)m_data)[offset + n] = 0;
+	}
+	__atomic_store_n(&m_headers[PublisherID].offset, offset, __ATOMIC_RELEASE); // revert the ping-pong flag
+	if (m_segment->kind[PublisherID] == SHM_ELEMENT_VERSIONED)
+	{
+		__atomic_store_n(m_segment->owner + PublisherID, 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&m_segment->seq[PublisherID], seq + 2, __ATOMIC_RELEASE);
+
+	CountWrite(PublisherID, offset);
+	return static_cast<int>(size);
+}
+
+// wait for another writer to release a versioned element, the claim of a writer that died is broken
+// @param PublisherID	the ID of the shared element, 1-256
+// @param seq			the odd sequence of the claim
+// @return				0 when the element is released, -5 when its writer is alive and holds it for SHM_CLAIM_TIMEOUT
+int ShMem::WaitClaim(int PublisherID, uint32_t seq)
+{
+	// a broken claim leaves its half written copy at the opposite offset, the readers keep the last one
+	uint32_t pid = WaitSeqClaim(m_segment->seq + PublisherID, m_segment->owner + PublisherID, seq, SHM_CLAIM_TIMEOUT);
+	if (pid)
+	{
+		m_err = -5;
+		m_message = "the shared element " + to_string(PublisherID) + " is held by process " + to_string(pid);
+		return m_err;
+	}
+	return 0;
+}
+
+// count a write of an element in the live counters, and record it
+// @param PublisherID	the ID of the shared element or publisher, 1-256
+// @param offset		the offset of the data written
+void ShMem::CountWrite(int PublisherID, uint16_t offset)
+{
+	ipc_element_stats* stats = GetElementStats(PublisherID);
+	if (stats)
+	{
+		__atomic_fetch_add(&stats->writes, 1, __ATOMIC_RELAXED);
+	}
+
+	ipc_record_log* log = GetRecordLog();
+	if (log)
+	{
+		ipc_record r;
+		memset(&r, 0, sizeof(r));
+		r.type = m_headers[PublisherID].size;
+		r.ts = GetMonotonicTime();
+		r.trace = t_traceId;
+		strncpy(r.title, m_title.c_str(), sizeof(r.title) - 1);
+		memcpy(r.name, m_names[PublisherID], sizeof(r.name));
+		r.len = r.type ? r.type : strlen((char*)m_data + offset) + 1;
+		AppendRecord(log, r, IPC_RECORD_SHMEM, (char*)m_data + offset);
+	}
+
+#ifdef IPC_TRACE
+	// a write out of any trace starts a new one, the readers carry it on
+	uint64_t trace = t_traceId ? t_traceId : NewTraceID();
+	if (stats)
+	{
+		__atomic_store_n(&stats->trace, trace, __ATOMIC_RELAXED);
+	}
+	uint64_t name;
+	memcpy(&name, m_names[PublisherID], sizeof(name)); // the names are zero filled after their ends
+	IPC_TRACEPOINT(IPC_TRACE_PUBLISH, trace, name, PublisherID, 0);
+#endif
+}
+
+// compare and swap a shared element of 1-8 bytes, lock free
+// @param PublisherID	the ID of the shared element, 1-256
+// @param expected (in/out)	the value expected, it is set to the current value when the element has another one
+// @param desired		the new value
+// @return				the bytes of data written, positive for success, negtive for error code.
+int ShMem::CompareAndSwap(int PublisherID, void* expected, const void* desired)
+{
+	uint16_t total_elements = m_headers[0].offset & 0xFF;
+
+	if (PublisherID <= 0 || PublisherID > total_elements)
+	{
+		m_err = -1;
+		m_message.Set(IPC_STATUS_OUTOFRANGE);
+		return m_err;
+	}
+
+	if (!m_publishers[PublisherID] || m_segment->kind[PublisherID] != SHM_ELEMENT_ATOMIC)
+	{
+		m_err = -2;
+		m_message = "not a shared element of 1-8 bytes at " + to_string(PublisherID) + " in this process";
+		return m_err;
+	}
+
+	// the value is zero filled to the word, so the padding always compares equal
+	size_t size = static_cast<size_t>(m_headers[PublisherID].size);
+	uint16_t offset = m_headers[PublisherID].offset;
+	uint64_t current = 0;
+	uint64_t value = 0;
+	memcpy(&current, expected, size);
+	memcpy(&value, desired, size);
+	if (!__atomic_compare_exchange_n((uint64_t*)((char*)m_data + offset), &current, value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		memcpy(expected, &current, size);
+		m_err = -4;
+		m_message.Set(IPC_STATUS_CHANGED);
+		return m_err;
+	}
+
+	__atomic_fetch_add(m_segment->seq + PublisherID, 2, __ATOMIC_RELEASE);
+	CountWrite(PublisherID, offset);
+	m_err = 0;
+	m_message.Set(IPC_STATUS_UPDATED);
+	return static_cast<int>(size);
+}
+
+// write a shared element when it has not been updated since it was read
+// @param PublisherID	the ID of the shared element, 1-256
+// @param version (in/out)	the version read by Read(), it is set to the new version when written
+// @param ptr			the pointer to the data to be written
+// @return				the actual bytes of data written, positive for success, negtive for error code.
+int ShMem::CompareAndWrite(int PublisherID, uint32_t* version, void* ptr)
+{
+	uint16_t total_elements = m_headers[0].offset & 0xFF;
+
+	if (PublisherID <= 0 || PublisherID > total_elements)
+	{
+		m_err = -1;
+		m_message.Set(IPC_STATUS_OUTOFRANGE);
+		return m_err;
+	}
+
+	if (!m_publishers[PublisherID] || m_segment->kind[PublisherID] != SHM_ELEMENT_VERSIONED)
+	{
+		m_err = -2;
+		m_message = "not a versioned shared element at " + to_string(PublisherID) + " in this process";
+		return m_err;
+	}
+
+	// the version is the even sequence, it turns odd only for the writer that has still seen it
+	uint32_t before = *version;
+	if ((before & 1) || !__atomic_compare_exchange_n(m_segment->seq + PublisherID, &before, *version + 1, false,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		// the version read is of the claim being written, it is released before the caller reads again
+		if ((before & 1) && WaitClaim(PublisherID, before) < 0)
+		{
+			return m_err;
+		}
+		m_err = -4;
+		m_message.Set(IPC_STATUS_CHANGED);
+		return m_err;
+	}
+
+	__atomic_store_n(m_segment->owner + PublisherID, static_cast<uint32_t>(getpid()), __ATOMIC_RELAXED);
+	int size = WriteClaimed(PublisherID, ptr, before);
+	*version = before + 2;
+	m_err = 0;
+	m_message.Set(IPC_STATUS_UPDATED);
+	return size;
+}
+
+// publish new data in integer with the publisher
+// @param PublisherID	the ID of the shared element or publisher, 1-256
+// @param n				the data in integer to be published
 // @return				the actual bytes of data written, positive for success, negtive for error code.
 int ShMem::Write(int PublisherID, int n)
 {
@@ -324,12 +1119,12 @@ int ShMem::Write(int PublisherID, double t)
 // @param PublisherID	the ID of the shared element or publisher, 1-256
 // @param s				the data in string to be published, 0-63 characters
 // @return				the actual bytes of data written, positive for success, negtive for error code.
-int ShMem::Write(int PublisherID, string s)
+int ShMem::Write(int PublisherID, const string& s)
 {
 	size_t size = static_cast<size_t>(m_headers[PublisherID].size);
 	if (size == 0)
 	{
-		return Write(PublisherID, &s);
+		return Write(PublisherID, const_cast<string*>(&s));
 	}
 	
 	m_err = -1;
@@ -348,23 +1143,43 @@ int ShMem::Read(int PublisherID, void* ptr)
 	if (PublisherID == 0 || PublisherID > total_elements)
 	{
 		m_err = -1;
-		m_message = "element ID is out of range";
+		m_message.Set(IPC_STATUS_OUTOFRANGE);
 		return m_err;
 	}
 
-	size_t size = static_cast<size_t>(m_headers[PublisherID].size);
-	uint16_t offset = m_headers[PublisherID].offset; // the offset of the data according to the ping-pong flag
-	if (size)
+	if (CopyElement(PublisherID, ptr, m_headers[PublisherID].size) < 0)
 	{
-		memcpy(ptr, m_data + offset, size);  // read the data other than string
+		return m_err;
 	}
-	else
+
+	m_err = 0;
+	m_message.Set(IPC_STATUS_READ);
+	return m_headers[PublisherID].size;
+}
+
+// read a shared element with its version
+// @param PublisherID	the ID of the shared element or publisher, 1-256
+// @param ptr (out)		the pointer to the data read
+// @param version (out)	the version of the data read, for CompareAndWrite()
+// @return				the actual bytes of data read, positive for success, negtive for error code.
+int ShMem::Read(int PublisherID, void* ptr, uint32_t* version)
+{
+	uint16_t total_elements = m_headers[0].offset & 0xFF;
+
+	if (PublisherID <= 0 || PublisherID > total_elements)
+	{
+		m_err = -1;
+		m_message.Set(IPC_STATUS_OUTOFRANGE);
+		return m_err;
+	}
+
+	if (CopyElement(PublisherID, ptr, m_headers[PublisherID].size, version) < 0)
 	{
-		static_cast<string*>(ptr)->assign((char*)m_data + offset);  // read string
+		return m_err;
 	}
 
 	m_err = 0;
-	m_message = "";
+	m_message.Set(IPC_STATUS_READ);
 	return m_headers[PublisherID].size;
 }
 
@@ -379,7 +1194,7 @@ int ShMem::Read(int PublisherID, int* n)
 	if (PublisherID == 0 || PublisherID > total_elements)
 	{
 		m_err = -1;
-		m_message = "element ID is out of range";
+		m_message.Set(IPC_STATUS_OUTOFRANGE);
 		return m_err;
 	}
 
@@ -391,11 +1206,13 @@ int ShMem::Read(int PublisherID, int* n)
 		return m_err;
 	}
 	
-	uint16_t offset = m_headers[PublisherID].offset; // the offset of the data according to the ping-pong flag
-	memcpy(n, m_data + offset, size);
+	if (CopyElement(PublisherID, n, size) < 0)
+	{
+		return m_err;
+	}
 
 	m_err = 0;
-	m_message = "";
+	m_message.Set(IPC_STATUS_READ);
 	return m_err;
 }
 
@@ -410,7 +1227,7 @@ int ShMem::Read(int PublisherID, double* t)
 	if (PublisherID == 0 || PublisherID > total_elements)
 	{
 		m_err = -1;
-		m_message = "element ID is out of range";
+		m_message.Set(IPC_STATUS_OUTOFRANGE);
 		return m_err;
 	}
 
@@ -422,11 +1239,13 @@ int ShMem::Read(int PublisherID, double* t)
 		return m_err;
 	}
 	
-	uint16_t offset = m_headers[PublisherID].offset; // the offset of the data according to the ping-pong flag
-	memcpy(t, m_data + offset, size);
+	if (CopyElement(PublisherID, t, size) < 0)
+	{
+		return m_err;
+	}
 
 	m_err = 0;
-	m_message = "";
+	m_message.Set(IPC_STATUS_READ);
 	return m_err;
 }
 
@@ -441,7 +1260,7 @@ int ShMem::Read(int PublisherID, string* s)
 	if (PublisherID == 0 || PublisherID > total_elements)
 	{
 		m_err = -1;
-		m_message = "element ID is out of range";
+		m_message.Set(IPC_STATUS_OUTOFRANGE);
 		return m_err;
 	}
 
@@ -452,416 +1271,4581 @@ int ShMem::Read(int PublisherID, string* s)
 		return m_err;
 	}
 	
-	uint16_t offset = m_headers[PublisherID].offset; // the offset of the data according to the ping-pong flag
-	s->assign((char*)m_data + offset);  // read string
+	if (CopyElement(PublisherID, s, 0) < 0)
+	{
+		return m_err;
+	}
 
 	m_err = 0;
-	m_message = "";
+	m_message.Set(IPC_STATUS_READ);
 	return m_err;
 }
 
-// open new a channel for messages receiving
-// @param	my_chn_name	the name of my channel, 1-8 characters
-// @param	timeout_usec	timeout in microseconds, 10-1,000,000
-MsgQ::MsgQ(string my_chn_name, long timeout_usec)
+// copy an element consistently, the copying is repeated while a write overlapped it
+// @param PublisherID	the ID of the shared element or publisher, 1-256
+// @param ptr (out)		the pointer to the data read, the pointer to a string for a string element
+// @param size			the size of the element, 0 for string
+// @param version (out)	the version of the copy, NULL for not needed
+// @return				0 for success, negtive for error code
+int ShMem::CopyElement(int PublisherID, void* ptr, size_t size, uint32_t* version)
 {
-	memset(&send_buf, 0, sizeof(send_buf));
-	memset(&receive_buf, 0, sizeof(receive_buf));
-	memset(m_Channels, 0, sizeof(m_Channels));
-	memset(m_ChnNames, 0, sizeof(m_ChnNames));
+	// the element updated in place is loaded at once
+	if (m_segment->kind[PublisherID] == SHM_ELEMENT_ATOMIC)
+	{
+		const char* addr = (char*)m_data + m_headers[PublisherID].offset;
+		uint64_t value = __atomic_load_n((const uint64_t*)addr, __ATOMIC_ACQUIRE);
+		memcpy(ptr, &value, size);
+		if (version)
+		{
+			*version = __atomic_load_n(m_segment->seq + PublisherID, __ATOMIC_RELAXED) & ~1u;
+		}
+		CountRead(PublisherID, 0);
+		return 0;
+	}
 
-	my_chn_name = my_chn_name.length() > 8 ? my_chn_name.substr(0, 8) : my_chn_name;
-	m_timeout = timeout_usec < 10 ? 10 : timeout_usec;
-	m_timeout = timeout_usec > 1000000L ? 1000000L : timeout_usec;
+	// The copy is consistent when no write started after the sequence was loaded, or only the write in progress did.
+	// The write in progress fills the opposite offset, the one after it is the first to overwrite the offset copied.
+	uint32_t* seq = m_segment->seq + PublisherID;
+	int retries = 0;
+	while (true)
+	{
+		uint32_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+		uint16_t offset = __atomic_load_n(&m_headers[PublisherID].offset, __ATOMIC_ACQUIRE);
+		if (size)
+		{
+			memcpy(ptr, (char*)m_data + offset, size);  // read the data other than string
+		}
+		else
+		{
+			const char* text = (char*)m_data + offset;
+			static_cast<string*>(ptr)->assign(text, strnlen(text, 64));  // read string, a string element has 64 bytes
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(seq, __ATOMIC_RELAXED) - before <= 1)
+		{
+			if (version)
+			{
+				*version = before & ~1u; // the write in progress has not replaced the copy yet
+			}
+			break;
+		}
 
-	// assign the attributes for the message queue
-	mq_attr attr;
-	attr.mq_flags = 0;
-	attr.mq_maxmsg = 10;
-	attr.mq_msgsize = 2048;
-	attr.mq_curmsgs = 0;
+		if (++retries > SHM_READ_RETRIES)
+		{
+			CountRead(PublisherID, retries);
+			m_err = -3;
+			m_message.Set(IPC_STATUS_TOOFAST);
+			return m_err;
+		}
+	}
+	CountRead(PublisherID, retries);
+	return 0;
+}
 
-	// m_myChn is the channel for reading only, try to open it if not existing
-	string name = "/" + my_chn_name;
-	char buffer[10];
-	memset(buffer, 0, sizeof(buffer));
-	buffer[0] = '/';
-	strcpy(buffer + 1, my_chn_name.c_str());
-	m_myChn = mq_open(buffer, O_RDONLY | O_CREAT, 0660, NULL);
-	if (m_myChn < 0)
+// count a read of an element in the live counters
+// @param PublisherID	the ID of the shared element or publisher, 1-256
+// @param retries		the times the read was repeated
+void ShMem::CountRead(int PublisherID, int retries)
+{
+	ipc_element_stats* stats = GetElementStats(PublisherID);
+	if (stats)
 	{
-		perror ("Server: mq_open (main)");
+		__atomic_fetch_add(&stats->reads, 1, __ATOMIC_RELAXED);
+		if (retries)
+		{
+			__atomic_fetch_add(&stats->read_retries, retries, __ATOMIC_RELAXED);
+		}
 	}
 
-	// channels in the list are all opened for writting in nonblocking mode only
-	// channel 1 is reserved for main, so open it here in advance
-	m_totalChannels = 1;
-	m_Channels[1] = mq_open("/main", O_WRONLY | O_NONBLOCK);
-	strcpy((char*)m_ChnNames, my_chn_name.c_str()); // assign m_ChnNames[0], the /0 of a 8 characters is taken care of
-	my_chn_name.assign((char*)m_ChnNames);
-	strcpy((char*)(m_ChnNames + 1), "main");
-	m_myChnName = m_ChnNames[0];
+#ifdef IPC_TRACE
+	uint64_t trace = stats ? __atomic_load_n(&stats->trace, __ATOMIC_RELAXED) : 0;
+	t_traceId = trace ? trace : t_traceId;
+	uint64_t name;
+	memcpy(&name, m_names[PublisherID], sizeof(name)); // the names are zero filled after their ends
+	IPC_TRACEPOINT(IPC_TRACE_READ, trace, name, PublisherID, 0);
+#endif
+}
 
-	m_err = 0;
-	mq_getattr(m_myChn, &attr);
-	m_message = "My message queue '" + my_chn_name 
-		+ "' is created with id=" + to_string(m_myChn) 
-		+ " for receiving.\nMessage queue 'main' is opened with id=" + to_string(m_Channels[1]) 
-		+ " for sending.\nMy queue currently has " + to_string(attr.mq_curmsgs) 
-		+ "s messages to be received in queue. \nThe max message size of my queue is " + to_string(attr.mq_msgsize) 
-		+ ". The max number of messages on my queue is " + to_string(attr.mq_maxmsg);
+// hash of a channel name in uint64_t style, Fibonacci hashing
+// @param name		the channel name in uint64_t style
+// @param bits		the bits of the hash
+// @return			the hash value in range of 0 to 2^bits-1
+static inline uint32_t HashName(uint64_t name, int bits)
+{
+	return static_cast<uint32_t>((name * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
 }
 
-MsgQ::~MsgQ()
+// wait on a futex in shared memory till it is woken up or its value is changed
+// @param addr		the address of the futex
+// @param val		the value expected
+// @param usec		the timeout in microseconds
+// @return			0 when woken up, negtive for timeout or value changed
+static int FutexWait(uint32_t* addr, uint32_t val, long usec)
 {
-	// close all the message queue opened in this class before. The message queue is still in the kernel without been deleted.
-	for (int i = 1; i <= m_totalChannels; i++)
-	{
-		mq_close(m_Channels[i]);
-	}
-	mq_close(m_myChn);
+	timespec timeout;
+	timeout.tv_sec = usec / 1000000L;
+	timeout.tv_nsec = (usec % 1000000L) * 1000L;
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, &timeout, NULL, 0);
 }
 
-// get the channel for message sending by its name. 
-// @param	chn_name	the name of the channel, 1-8 characters
-// @return	the channel ID	number greater than 1, 1 is reserved for main, negtive for error code
-int MsgQ::GetDestChannel(string chn_name)
+// wake up the waiters of a futex in shared memory
+// @param addr		the address of the futex
+// @param count		the max number of waiters to wake up, all of them by default
+// @return			the number of waiters woken up
+static int FutexWake(uint32_t* addr, int count = INT32_MAX)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+// wait on a futex in shared memory as one of its counted waiters, the wakers skip the syscall when there is none.
+// The count is dropped on every return. A count left by a waiter that has crashed only costs its wakers a syscall.
+// @param addr		the address of the futex
+// @param val		the value expected
+// @param waiters	the number of waiters of the futex
+// @param usec		the timeout in microseconds
+// @return			0 when woken up, negtive for timeout or value changed
+static int FutexWaitCounted(uint32_t* addr, uint32_t val, uint32_t* waiters, long usec)
 {
-	if (chn_name.empty() || chn_name.length() > 8)
+	__atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+	int ret = FutexWait(addr, val, usec);
+	__atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+	return ret;
+}
+
+// get the max message size of a message queue
+// @param chn		the descriptor of the message queue
+// @return			the max message size, 0 for error
+static int GetQueueMsgSize(mqd_t chn)
+{
+	mq_attr attr;
+	if (mq_getattr(chn, &attr) < 0)
 	{
-		m_err = -1;
-		m_message = "invalid channel name. 1-8 characters";
-		return m_err;
+		return 0;
 	}
+	return static_cast<int>(attr.mq_msgsize);
+}
 
-	// n is the temporal variable to hold chn_name in uint64_t style
-	uint64_t n = 0;
-	if (chn_name.length() == 8)
+// read a limit of the message queue from /proc/sys/fs/mqueue
+// @param name		the name of the limit, msg_max or msgsize_max
+// @param def		the default value when the limit cannot be read
+// @return			the limit
+static long GetQueueLimit(const char* name, long def)
+{
+	string path = string("/proc/sys/fs/mqueue/") + name;
+	FILE* f = fopen(path.c_str(), "r");
+	if (!f)
 	{
-		memcpy(&n, chn_name.c_str(), 8);
+		return def;
 	}
-	else
+
+	long limit = def;
+	if (fscanf(f, "%ld", &limit) != 1)
 	{
-		strcpy((char*)&n, chn_name.c_str());
+		limit = def;
 	}
+	fclose(f);
+	return limit;
+}
 
-	// check if the channel name has been defined
-	for (int i = 1; i < m_totalChannels + 1; i++)
+// the in-process queues of the receivers in this process by their channel names
+static mutex s_localLock;
+static map<uint64_t, weak_ptr<mq_local_queue>> s_localQueues;
+static uint32_t s_forkGeneration = 0; // increased in the child of a fork, the queues of the parent are not shared with it
+
+// count the forks, so that a child never delivers to the in-process queues copied from its parent
+static void CountFork()
+{
+	s_forkGeneration++;
+}
+
+// create an in-process queue and register it by the channel name
+// @param name		the channel name in uint64_t style
+// @return			the in-process queue
+static shared_ptr<mq_local_queue> CreateLocalQueue(uint64_t name)
+{
+	static bool s_atfork = pthread_atfork(NULL, NULL, CountFork) == 0;
+	(void)s_atfork;
+
+	shared_ptr<mq_local_queue> q = make_shared<mq_local_queue>();
+	for (int p = 0; p <= MSG_PRIORITY_URGENT; p++)
 	{
-		if (m_ChnNames[i] == n)
+		q->rings[p].head.store(0, memory_order_relaxed);
+		q->rings[p].tail.store(0, memory_order_relaxed);
+		for (size_t i = 0; i < MQ_LOCAL_SLOTS; i++)
 		{
-			return i;
+			q->rings[p].slots[i].seq.store(i, memory_order_relaxed);
 		}
 	}
+	q->generation = s_forkGeneration;
 
-	// this is a new name, try to open it for messages sending
-	chn_name = "/" + chn_name; // adding the / in front of the channel name
-	m_message = "message queue " + chn_name;
-	mqd_t ret = mq_open(chn_name.c_str(), O_WRONLY | O_NONBLOCK);
-	if (ret < 0)
-	{
-		m_err = ret;		
-		m_message += " does not exist";
-		return m_err;
-	}
-
-	m_message += " is opened for messages sending";
-	m_totalChannels++;
-	m_ChnNames[m_totalChannels] = n;
-	m_Channels[m_totalChannels] = ret;
-	return m_totalChannels;
+	lock_guard<mutex> lock(s_localLock);
+	s_localQueues[name] = q;
+	return q;
 }
 
-// get the name of the channel
-// @param channel	the channel number
-// @return			the name of the channel, empty for no such a channel
-string MsgQ::GetChannelName(int channel)
+// get the credits in a directory entry, the depth of the queue less the messages sent but not yet received. The messages
+// below MSG_PRIORITY_HIGH do not get the credits reserved by MSG_PRIORITY_RESERVE.
+// @param entry		the directory entry
+// @param priority	the priority of the message
+// @return			the credits, negtive for unknown
+static int GetEntryCredits(mq_directory_entry* entry, unsigned int priority = MSG_PRIORITY_URGENT)
 {
-	if (channel < 0 || channel > m_totalChannels)
+	if (!entry || !entry->maxmsg)
 	{
-		m_err = -1;
-		m_message = "invalid channel";
-		return "";
+		return -1;
 	}
 
-	//m_message = "(" + to_string(channel) + ") " + to_string(m_ChnNames[channel]) + ":";
-	m_message.assign((char*)(m_ChnNames + channel));
-	return m_message;
+	int64_t outstanding = __atomic_load_n(&entry->sent, __ATOMIC_RELAXED) - __atomic_load_n(&entry->received, __ATOMIC_RELAXED);
+	int64_t credits = static_cast<int64_t>(entry->maxmsg) - outstanding;
+	if (priority < MSG_PRIORITY_HIGH)
+	{
+		credits -= entry->maxmsg / MSG_PRIORITY_RESERVE;
+	}
+	return credits < 0 ? 0 : static_cast<int>(credits);
 }
 
-// receive a message sent to me
-// @param SenderName (out)	the sender name in string, 1-15 characters
-// @param type (out)		the type of the message, can be MSG_NULL (0), MSG_DATA (1), MSG_COMMAND (6), ...
-// @param len (out)			the length of the message data, 0-1024
-// @param data (out)		the pointer to the received data without message header
-// @return					the sender channel, positive for success, negtive for error code
-int MsgQ::ReceiveMsg(string* SenderName, int* type, int* len, void* data)
+// retry the messages in a send queue in order, called with the lock of the queue held
+// @param q			the send queue
+// @return			the number of messages remained in the send queue
+static int RetrySendQueue(mq_send_queue* q)
 {
-	*len = 0;
-	timespec timeout;
-	clock_gettime(CLOCK_REALTIME_COARSE, &timeout);
-	timeout.tv_nsec += m_timeout * 1000L; // add the timeout in microsecond
-	while (timeout.tv_nsec >= 1000000000L)  // adjust the sec and nano seconds, make it compatible timeout > 1s
-	{
-		timeout.tv_sec++;
-		timeout.tv_nsec -= 1000000000L;
-	}
+	uint8_t blocked[MAX_MESSAGECHANNELS]; // the bits of the blocked priorities of each destnation
+	memset(blocked, 0, sizeof(blocked));
 
-	// read the message queue
-	m_err = mq_timedreceive(m_myChn, (char *)&receive_buf, 8192, 0, &timeout);
-	if (m_err < 0)
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now); // the sending returns immediately for a full queue
+	uint64_t monotonic = GetMonotonicTime();
+	for (deque<mq_pending_send>::iterator it = q->queue.begin(); it != q->queue.end();)
 	{
-		if (errno == EAGAIN)
+		// an expired message is dropped without sending
+		uint64_t deadline = reinterpret_cast<const mq_buffer*>(it->data.data())->deadline;
+		if (deadline && deadline < monotonic)
 		{
-			m_message = "no message";
-			m_err = 0;
+			q->dropped++;
+			q->pending[it->channel]--;
+			it = q->queue.erase(it);
+			continue;
 		}
-		else if (errno == EBADF)
+
+		// the messages after a blocked one of the same priority to the same destnation keep waiting, so that the order is kept.
+		// The higher priorities may pass the lower ones held back below the reserved credits, the receiver takes them first anyway.
+		uint8_t bit = 1 << it->priority;
+		if ((blocked[it->channel] & bit) || GetEntryCredits(it->entry, it->priority) == 0)
 		{
-			m_message = "The descriptor specified in mqdes was invalid.";
-		} 
-		else if (errno == EINVAL)
+			blocked[it->channel] |= bit;
+			++it;
+			continue;
+		}
+
+		if (mq_timedsend(it->chn, it->data.data(), it->data.size(), it->priority, &now) < 0)
 		{
-			m_message = "The call would have blocked, and abs_timeout was invalid, either because tv_sec was less than zero, or because tv_nsec was less than zero or greater than 1000 million.";
+			if (errno == EAGAIN || errno == ETIMEDOUT || errno == EINTR)
+			{
+				blocked[it->channel] |= bit;
+				++it;
+				continue;
+			}
+			q->dropped++;
 		}
-		else if (errno == EMSGSIZE)
+		else if (it->entry)
 		{
-			m_message = to_string(sizeof(receive_buf)) + " was less than the mq_msgsize attribute of the message queue.";
-		} 
-		else if (errno == ETIMEDOUT)
+			__atomic_fetch_add(&it->entry->sent, 1, __ATOMIC_RELAXED);
+		}
+
+		q->pending[it->channel]--;
+		it = q->queue.erase(it);
+	}
+
+	return q->queue.size();
+}
+
+// drop the fragments of a message that are still in a send queue, called with the lock of the queue held
+// @param q			the send queue
+// @param channel	the destnation channel
+// @param seq		the sequence number of the message
+static void DropQueuedMessage(mq_send_queue* q, int channel, uint32_t seq)
+{
+	for (deque<mq_pending_send>::iterator it = q->queue.begin(); it != q->queue.end();)
+	{
+		if (it->channel == channel && reinterpret_cast<const mq_buffer*>(it->data.data())->seq == seq)
 		{
-			m_message = "The call timed out before a message could be transferred.";
-			m_err = 0;
+			q->pending[channel]--;
+			it = q->queue.erase(it);
 		}
 		else
 		{
-			m_message = "error when receiving message";
+			++it;
 		}
-		
-		return m_err;
 	}
+}
 
-	// got a message, parses it
-	m_ChnNames[0] = receive_buf.name;
-	m_message.assign((char *)&receive_buf);
-	SenderName->assign((char *)&receive_buf); // the time stamp has a /0 in the front 
-	m_ts = receive_buf.ts;
-	*len = receive_buf.len;
-	*type = receive_buf.type;
-	
-	// check not copy to itself
-	if (data != receive_buf.buf)
+// stop the thread of the send queue, and retry the messages left before the descriptors are closed
+mq_send_queue::~mq_send_queue()
+{
+	unique_lock<mutex> guard(lock);
+	if (worker.joinable())
 	{
-		memcpy(data, receive_buf.buf, receive_buf.len);
+		running = false;
+		cond.notify_all();
+		guard.unlock();
+		worker.join();
+		guard.lock();
 	}
 
-	for (int i = 1; i < m_totalChannels + 1; i++)
+	uint64_t deadline = GetMonotonicTime() + MQ_CLOSE_TIMEOUT * 1000ULL;
+	while (RetrySendQueue(this) > 0 && GetMonotonicTime() < deadline)
 	{
-		if (m_ChnNames[i] == m_ChnNames[0])
-		{
-			m_Channels[0] = m_Channels[i];
-			return i;
-		}
+		usleep(MQ_RETRY_INTERVAL);
 	}
-
-	// for a new sender channel, add it to the list
-	char buffer[10];
-	memset(buffer, 0, sizeof(buffer));
-	buffer[0] = '/';
-	memcpy(buffer + 1, m_ChnNames, sizeof(uint64_t));
-
-	m_Channels[0] = mq_open(buffer, O_WRONLY | O_NONBLOCK);
-	m_totalChannels++;
-	m_ChnNames[m_totalChannels] = m_ChnNames[0];
-	m_Channels[m_totalChannels] = m_Channels[0];
-	m_message = "new sender " + m_message;
-	return m_totalChannels;
+	dropped += queue.size();
 }
 
-// send a message to the destnation
-// @param DestName	the destnation name, empty for reply to the last sender
-// @param type		the type of the message, for example MSG_COMMAND (6)
-// @param len		the length of the message net data, can be 0 or positive
-// @param data		the pointer to the data to be sent, can be NULL in case len is 0
-// @return			the destnation channel, positive for success, negtive for error code
-int MsgQ::SendMsg(string DestName, int type, int len, void* data)
+// the thread retrying a send queue till it is stopped
+// @param q			the send queue
+static void RunSendQueue(mq_send_queue* q)
 {
-	int chn = GetDestChannel(DestName);
-	if (chn > 0 && SendMsg(chn, type, len, data) < 0)
+	unique_lock<mutex> lock(q->lock);
+	while (q->running)
 	{
-		return -1;
+		if (q->queue.empty() || RetrySendQueue(q) == 0)
+		{
+			q->cond.wait(lock);
+		}
+		else
+		{
+			q->cond.wait_for(lock, chrono::microseconds(MQ_RETRY_INTERVAL));
+		}
 	}
-	
-	return chn;
 }
 
-// send a command to the destnation
-// @param DestName	the destnation name, empty for reply to the last sender
-// @param n			the integer data to be sent
-// @return			the destnation channel, positive for success, negtive for error code
-int MsgQ::SendCmd(string DestName, string s)
+// get the absolute time of a timeout from now
+// @param clock		the clock used for the absolute time
+// @param usec		the timeout in microseconds
+// @return			the absolute time when the timeout expires
+static timespec GetDeadline(clockid_t clock, long usec)
 {
-	return SendMsg(DestName, MSG_COMMAND, s.length() + 1, (void *)s.c_str());
+	timespec deadline;
+	clock_gettime(clock, &deadline);
+	deadline.tv_sec += usec / 1000000L;
+	deadline.tv_nsec += (usec % 1000000L) * 1000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	return deadline;
 }
 
-// send a message to the destnation
-// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
-// @param type		the type of the message, for example MSG_COMMAND (6)
-// @param len		the length of the message net data, can be 0 or positive
-// @param data		the pointer to the data to be sent, can be NULL in case len is 0
-// @return			bytes of data actually sent, positive for success, negtive for error code.
-int MsgQ::SendMsg(int DestChn, int type, int len, void* data)
+// open new a channel for messages receiving
+// @param	my_chn_name	the name of my channel, 1-8 characters
+// @param	timeout_usec	timeout in microseconds, 10-1,000,000
+// @param	max_msgs	the max number of messages in my queue when it is created
+// @param	msg_size	the max size of a message in my queue when it is created, 128-65536
+MsgQ::MsgQ(string my_chn_name, long timeout_usec, long max_msgs, long msg_size)
 {
-	if (type <= 0 || type > 255)
+	memset(m_ChnNames, 0, sizeof(m_ChnNames));
+	memset(m_ChnMsgSize, 0, sizeof(m_ChnMsgSize));
+	memset(m_ChnEntry, 0, sizeof(m_ChnEntry));
+	memset(m_ChnAlive, 0, sizeof(m_ChnAlive));
+	memset(m_ChnStats, 0, sizeof(m_ChnStats));
+	memset(m_ChnExpired, 0, sizeof(m_ChnExpired));
+	memset(m_ChnConflation, 0, sizeof(m_ChnConflation));
+	memset(m_ChnLocalState, 0, sizeof(m_ChnLocalState));
+	memset(m_ChnHash, 0, sizeof(m_ChnHash));
+	memset(m_Topics, 0, sizeof(m_Topics));
+	memset(m_Groups, 0, sizeof(m_Groups));
+	for (int i = 0; i < MAX_MESSAGECHANNELS; i++)
 	{
-		m_err = -1;
-		m_message = "invalid sending message type";
-		return m_err;
+		m_Channels[i] = -1;
+	}
+
+	my_chn_name = my_chn_name.length() > 8 ? my_chn_name.substr(0, 8) : my_chn_name;
+	m_timeout = timeout_usec < 10 ? 10 : (timeout_usec > 1000000L ? 1000000L : timeout_usec);
+
+	// assign the attributes for the message queue
+	mq_attr attr;
+	attr.mq_flags = 0;
+	attr.mq_maxmsg = max_msgs < 1 ? 1 : max_msgs;
+	attr.mq_msgsize = msg_size < MQ_MIN_MSGSIZE ? MQ_MIN_MSGSIZE : (msg_size > MQ_MAX_MSGSIZE ? MQ_MAX_MSGSIZE : msg_size);
+	attr.mq_curmsgs = 0;
+	long maxmsg = attr.mq_maxmsg;
+	long msgsize = attr.mq_msgsize;
+
+	// m_myChn is the channel for reading only, try to open it if not existing
+	char buffer[10];
+	memset(buffer, 0, sizeof(buffer));
+	buffer[0] = '/';
+	strcpy(buffer + 1, my_chn_name.c_str());
+	m_myChn = mq_open(buffer, O_RDONLY | O_CREAT, 0660, &attr);
+	if (m_myChn < 0 && errno == EINVAL)
+	{
+		// the geometry exceeds the system limits, clamp it to the limits, then fall back to the system defaults
+		long limit = GetQueueLimit("msg_max", 10);
+		attr.mq_maxmsg = attr.mq_maxmsg > limit ? limit : attr.mq_maxmsg;
+		limit = GetQueueLimit("msgsize_max", 8192);
+		attr.mq_msgsize = attr.mq_msgsize > limit ? limit : attr.mq_msgsize;
+		m_myChn = mq_open(buffer, O_RDONLY | O_CREAT, 0660, &attr);
+		if (m_myChn < 0 && errno == EINVAL)
+		{
+			m_myChn = mq_open(buffer, O_RDONLY | O_CREAT, 0660, NULL);
+		}
+	}
+	if (m_myChn < 0)
+	{
+		perror ("Server: mq_open (main)");
 	}
 
-	if (len < 0 || len > MAX_MESSAGELENGTH)
+	// the buffers follow the geometry actually applied, which is different from the requested one for an existing queue
+	m_err = 0;
+	if (mq_getattr(m_myChn, &attr) < 0)
+	{
+		attr.mq_maxmsg = maxmsg;
+		attr.mq_msgsize = msgsize;
+		attr.mq_curmsgs = 0;
+		m_err = -1;
+	}
+	else if (attr.mq_maxmsg != maxmsg || attr.mq_msgsize != msgsize)
 	{
 		m_err = -2;
-		m_message = "invalid sending message length";
-		return m_err;
 	}
+	m_maxMsgs = static_cast<int>(attr.mq_maxmsg);
+	m_msgSize = static_cast<int>(attr.mq_msgsize);
+	m_sendBuffer.assign(m_msgSize > (int)sizeof(mq_buffer) ? m_msgSize : sizeof(mq_buffer), 0);
+	m_receiveBuffer.assign(m_msgSize > (int)sizeof(mq_buffer) ? m_msgSize : sizeof(mq_buffer), 0);
 
-	if (DestChn < 0 || DestChn > m_totalChannels)
+	// map the shared channel directory, create it if not existing
+	int fd = shm_open(MQ_DIRECTORYNAME, O_CREAT | O_RDWR, 0666);
+	if (fd >= 0)
 	{
-		m_err = -3;
-		m_message = "invalid dest ID";
-		return m_err;
+		if (ftruncate(fd, sizeof(mq_directory)) == 0)
+		{
+			void* base = mmap(0, sizeof(mq_directory), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			m_directory = base == MAP_FAILED ? NULL : static_cast<mq_directory*>(base);
+		}
+		close(fd);
 	}
-	
-	// calculate the time stamp and the timeout
-	timespec timeout;
-	clock_gettime(CLOCK_REALTIME_COARSE, &timeout);
 
-	send_buf.ts = timeout.tv_nsec / 1000; // the time stamp is the microseconds
-	timeout.tv_nsec += 1000000L; // +1ms for sending timeout
-	if (timeout.tv_nsec >= 1000000000L)
+	// channel 1 is reserved for main. Its descriptor is opened lazily as all other channels
+	strcpy((char*)m_ChnNames, my_chn_name.c_str()); // assign m_ChnNames[0], the /0 of a 8 characters is taken care of
+	my_chn_name.assign((char*)m_ChnNames);
+	m_myChnName = m_ChnNames[0];
+	uint64_t n = 0;
+	strcpy((char*)&n, "main");
+	AddChannel(n);
+
+	// register my channel in the directory, so that senders can find me without syscall
+	// the credits are granted by the depth of my queue, the messages remained in my queue are not received yet
+	m_myEntry = LookupDirectory(m_myChnName, m_myChn >= 0);
+	if (m_myEntry)
 	{
-		timeout.tv_sec++;
-		timeout.tv_nsec -= 1000000L;
+		__atomic_store_n(&m_myEntry->maxmsg, static_cast<uint32_t>(attr.mq_maxmsg), __ATOMIC_RELAXED);
+		__atomic_store_n(&m_myEntry->received, __atomic_load_n(&m_myEntry->sent, __ATOMIC_RELAXED) - attr.mq_curmsgs, __ATOMIC_RELAXED);
+		__atomic_store_n(&m_myEntry->pid, getpid(), __ATOMIC_RELEASE);
 	}
 
-	send_buf.name = m_myChnName;
-	send_buf.type = type;
-	send_buf.len = len;
-	// printf("%d: (name=%ld, ts=%d, type=%d, len=%d) \n", len, send_buf.name, send_buf.ts, send_buf.type, send_buf.len);
-	
-	// make the memory copy only when they are not the same
-	if (send_buf.buf != data)
+	// the senders in this process deliver to me through my in-process queue
+	if (m_myChn >= 0)
 	{
-		memcpy(send_buf.buf, data, len);
+		m_held.assign(m_receiveBuffer.size(), 0);
+		m_local = CreateLocalQueue(m_myChnName);
+		m_myStats = GetChannelStats(m_myChnName);
 	}
-	len += sizeof(send_buf) - MAX_MESSAGELENGTH;
+	GetRecordLog(); // map the record log before any sending
 
-	m_err = mq_timedsend(m_Channels[DestChn], (const char*)&send_buf, len, 0, &timeout);
+	m_message = "My message queue '" + my_chn_name 
+		+ "' is created with id=" + to_string(m_myChn) 
+		+ " for receiving" + (m_directory ? " and registered in the directory" : ", the directory is not available")
+		+ ".\nMy queue currently has " + to_string(attr.mq_curmsgs) 
+		+ "s messages to be received in queue. \nThe max message size of my queue is " + to_string(attr.mq_msgsize) 
+		+ ". The max number of messages on my queue is " + to_string(attr.mq_maxmsg);
 	if (m_err < 0)
 	{
-		if (errno == EAGAIN)
+		m_message += ".\nThe requested geometry of " + to_string(maxmsg) + " messages in " + to_string(msgsize) 
+			+ " bytes is not applied";
+	}
+}
+
+MsgQ::~MsgQ()
+{
+	// the send queue is flushed and its thread stopped before the descriptors are closed
+	m_sendQueue.reset();
+
+	// the senders holding my in-process queue fall back to the kernel queue
+	if (m_local)
+	{
+		lock_guard<mutex> lock(s_localLock);
+		__atomic_store_n(&m_local->alive, false, __ATOMIC_RELEASE);
+		map<uint64_t, weak_ptr<mq_local_queue>>::iterator it = s_localQueues.find(m_myChnName);
+		if (it != s_localQueues.end() && it->second.lock() == m_local)
 		{
-			m_message = "the queue was full";
+			s_localQueues.erase(it);
 		}
-		else if (errno == EBADF)
+	}
+	if (m_local)
+	{
+		ForwardLocal();
+	}
+
+	// close all the message queue opened in this class before. The message queue is still in the kernel without been deleted.
+	for (int i = 1; i <= m_totalChannels; i++)
+	{
+		if (m_Channels[i] >= 0)
 		{
-			m_message = "The descriptor specified was invalid.";
+			mq_close(m_Channels[i]);
 		}
-		else if (errno == EINTR)
+	}
+	mq_close(m_myChn);
+
+	for (int i = 1; i <= m_totalTopics; i++)
+	{
+		munmap(m_Topics[i].ring, sizeof(mq_topic));
+	}
+
+	for (int i = 1; i <= m_totalGroups; i++)
+	{
+		if (m_Groups[i].joined)
 		{
-			m_message = "The call was interrupted by a signal handler";
+			__atomic_fetch_sub(&m_Groups[i].ring->workers, 1, __ATOMIC_RELAXED);
 		}
-		else if (errno == EINVAL)
+		munmap(m_Groups[i].ring, sizeof(mq_group));
+	}
+
+	for (int i = 1; i <= m_totalChannels; i++)
+	{
+		if (m_ChnConflation[i])
 		{
-			m_message = "The call would have blocked, and abs_timeout was invalid";
+			munmap(m_ChnConflation[i], offsetof(mq_conflation, slots) + m_ChnConflation[i]->size * sizeof(mq_conflation_slot));
 		}
-		else if (errno == EMSGSIZE)
+	}
+
+	if (m_conflation)
+	{
+		munmap(m_conflation->table, m_conflation->mapsize);
+	}
+
+	if (m_directory)
+	{
+		munmap(m_directory, sizeof(mq_directory));
+	}
+}
+
+// look up or register a channel name in the shared directory
+// @param name		the channel name in uint64_t style
+// @param create	true to claim an entry for the name when not found
+// @return			the directory entry, NULL for not found
+mq_directory_entry* MsgQ::LookupDirectory(uint64_t name, bool create)
+{
+	if (!m_directory || !name)
+	{
+		return NULL;
+	}
+
+	// linear probing from the hashed entry. Entries are claimed by compare and swap and never released
+	uint32_t slot = HashName(name, 10);
+	for (int i = 0; i < MQ_DIRECTORYSIZE; i++)
+	{
+		mq_directory_entry* entry = m_directory->entries + ((slot + i) & (MQ_DIRECTORYSIZE - 1));
+		uint64_t n = __atomic_load_n(&entry->name, __ATOMIC_ACQUIRE);
+		if (n == name)
 		{
-			m_message = "msg_len was greater than the mq_msgsize attribute of the message queue.";
+			return entry;
 		}
-		else if (errno == ETIMEDOUT)
+
+		if (n == 0)
 		{
-			m_message = "The call timed out before a message could be transferred.";
+			if (!create)
+			{
+				return NULL;
+			}
+
+			uint64_t expected = 0;
+			if (__atomic_compare_exchange_n(&entry->name, &expected, name, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == name)
+			{
+				return entry;
+			}
 		}
-		else
+	}
+
+	return NULL;
+}
+
+// check the receiver registered in a directory entry is alive. A receiver without its pid is taken as alive.
+// @param entry		the directory entry
+// @return			false when the process of the receiver has gone
+static bool IsEntryAlive(mq_directory_entry* entry)
+{
+	pid_t pid = __atomic_load_n(&entry->pid, __ATOMIC_ACQUIRE);
+	return pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// check the receiver of a known channel is alive, at most once every MQ_ALIVE_INTERVAL
+// @param channel	the channel number
+// @return			the channel, -2 when its receiver has gone
+int MsgQ::CheckChannelAlive(int channel)
+{
+	uint64_t now = GetMonotonicTime();
+	if (now - m_ChnAlive[channel] < MQ_ALIVE_INTERVAL * 1000ULL)
+	{
+		return channel;
+	}
+
+	mq_directory_entry* entry = GetChannelEntry(channel);
+	if (entry && !IsEntryAlive(entry))
+	{
+		m_err = -2;
+		m_message = "message queue /" + string((char *)(m_ChnNames + channel), strnlen((char *)(m_ChnNames + channel), sizeof(uint64_t))) + " has no live receiver";
+		return m_err;
+	}
+
+	m_ChnAlive[channel] = now;
+	return channel;
+}
+
+// find a channel by its name in the local hash table
+// @param name		the channel name in uint64_t style
+// @return			the channel, 0 for not found
+int MsgQ::FindChannel(uint64_t name)
+{
+	uint32_t slot = HashName(name, 9);
+	for (int i = 0; i < MQ_HASHSIZE; i++)
+	{
+		int chn = m_ChnHash[(slot + i) & (MQ_HASHSIZE - 1)];
+		if (chn == 0 || m_ChnNames[chn] == name)
 		{
-			m_message = "error while sending";
+			return chn;
 		}
-		
+	}
+
+	return 0;
+}
+
+// add a channel to the local list without opening it
+// @param name		the channel name in uint64_t style
+// @return			the channel, negtive for error code
+int MsgQ::AddChannel(uint64_t name)
+{
+	if (m_totalChannels >= MAX_MESSAGECHANNELS - 1)
+	{
+		m_err = -1;
+		m_message = "too many channels";
 		return m_err;
 	}
 
-	m_err = len;
-	m_message = "message sent";
-	// m_message = "message (type=" + to_string(send_buf.type) + ", len=" + to_string(send_buf.len) + ") was sent to ";
-	// m_message.append((char*)(m_ChnNames + DestChn));
-	// m_message.append(" at channel " + to_string(m_Channels[DestChn]) + " with size=" + to_string(len));
-	return m_err;
+	// the channel is filled in before it is counted, for the threads reading the table without the lock
+	int chn = m_totalChannels + 1;
+	m_ChnNames[chn] = name;
+	m_Channels[chn] = -1;
+
+	uint32_t slot = HashName(name, 9);
+	while (m_ChnHash[slot])
+	{
+		slot = (slot + 1) & (MQ_HASHSIZE - 1);
+	}
+	m_ChnHash[slot] = chn;
+	__atomic_store_n(&m_totalChannels, chn, __ATOMIC_RELEASE);
+	return chn;
 }
 
-// send a command to the destnation
-// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
-// @param s			the string data to be sent
-// @return			bytes of data actually sent, positive for success, negtive for error code.
-int MsgQ::SendCmd(int DestChn, string s)
+// open the descriptor of a channel for sending
+// @param channel	the channel number
+// @return			0 on success, negtive for error code
+int MsgQ::OpenChannel(int channel)
 {
-	return SendMsg(DestChn, MSG_COMMAND, s.length() + 1, (void *)s.c_str());
+	char buffer[10];
+	memset(buffer, 0, sizeof(buffer));
+	buffer[0] = '/';
+	memcpy(buffer + 1, m_ChnNames + channel, sizeof(uint64_t));
+
+	mqd_t ret = mq_open(buffer, O_WRONLY);
+	if (ret < 0)
+	{
+		m_err = -1;
+		m_message = "message queue " + string(buffer) + " cannot be opened for sending";
+		return m_err;
+	}
+
+	m_Channels[channel] = ret;
+	m_ChnMsgSize[channel] = GetQueueMsgSize(ret);
+	return 0;
 }
 
-// clear a message queue
-// @param DestName	the destnation name, empty for my channel name
-// @return 		0 on success, negtive for error code
-int MsgQ::ClearQueue(string DestName)
+// open the descriptors of all known channels that have not been opened yet
+// @return			the number of channels opened, negtive for error code
+int MsgQ::OpenChannels()
 {
-	m_message.clear();
-	if (DestName.empty())
+	int count = 0;
+	for (int i = 1; i <= m_totalChannels; i++)
 	{
-		DestName = m_myChnName;
+		if (m_Channels[i] < 0 && OpenChannel(i) == 0)
+		{
+			count++;
+		}
+		m_ChnLocalState[i] = m_ChnLocalState[i] == 2 ? 0 : m_ChnLocalState[i]; // look up the receivers created in this process since
 	}
-	DestName = "/" + DestName;
-	
-	mqd_t Chn = mq_open(DestName.c_str(), O_RDONLY | O_NONBLOCK);
-	if (Chn < 0)
+
+	m_err = count;
+	m_message = to_string(count) + " channels opened";
+	return m_err;
+}
+
+// the lock of the threads sending through the same MsgQ and of its channel table, held in its scope. The lock is a plain
+// word in the MsgQ. The holder may wait in mq_timedsend() for queue space, up to
+// MQ_FRAGMENT_TIMEOUT for a fragment, so the waiters sleep on a futex. The word is 0 when free, 1 when taken, 2 when
+// taken with waiters.
+struct mq_send_guard
+{
+	mq_send_guard(uint32_t* lock, bool take = true) : m_lock(take ? lock : NULL)
 	{
-		m_err = -1;
+		uint32_t c = 0;
+		if (!m_lock || __atomic_compare_exchange_n(m_lock, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			return;
+		}
 
-		if (errno == EACCES)
+		if (c != 2)
 		{
-			m_message = "Access denied";
+			c = __atomic_exchange_n(m_lock, 2, __ATOMIC_ACQUIRE);
 		}
-		else if (errno == EMFILE || errno == ENFILE)
+		while (c != 0)
 		{
-			m_message = "Too many message queue opened";
+			syscall(SYS_futex, m_lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+			c = __atomic_exchange_n(m_lock, 2, __ATOMIC_ACQUIRE);
 		}
-		else if (errno == ENAMETOOLONG)
+	}
+
+	~mq_send_guard()
+	{
+		if (m_lock && __atomic_exchange_n(m_lock, 0, __ATOMIC_RELEASE) == 2)
 		{
-			m_message = "name was too long";
+			syscall(SYS_futex, m_lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
 		}
-		else if (errno == ENOENT)
+	}
+
+	uint32_t* m_lock; // NULL when the lock is not taken
+};
+
+// get the channel for message sending by its name. 
+// @param	chn_name	the name of the channel, 1-8 characters
+// @return	the channel ID	number greater than 1, 1 is reserved for main, negtive for error code
+int MsgQ::GetDestChannel(string chn_name)
+{
+	return GetDestChannel(chn_name.c_str());
+}
+
+// get the channel for message sending by its name. 
+// @param	chn_name	the name of the channel, 1-8 characters
+// @return	the channel ID	number greater than 1, 1 is reserved for main, negtive for error code, -2 when the receiver has gone
+int MsgQ::GetDestChannel(const char* chn_name)
+{
+	size_t length = strnlen(chn_name, 9);
+	if (length == 0 || length > 8)
+	{
+		m_err = -1;
+		m_message = "invalid channel name. 1-8 characters";
+		return m_err;
+	}
+
+	// n is the temporal variable to hold chn_name in uint64_t style
+	uint64_t n = 0;
+	memcpy(&n, chn_name, length);
+
+	// check if the channel name has been defined
+	mq_send_guard guard(&m_sendLock);
+	int chn = FindChannel(n);
+	if (chn > 0)
+	{
+		return CheckChannelAlive(chn);
+	}
+
+	// this is a new name. Receivers register in the directory, so the name is resolved without any syscall.
+	// A name left in the directory by a receiver that has gone is not resolved.
+	m_message = "message queue /" + string(chn_name);
+	mq_directory_entry* entry = LookupDirectory(n, false);
+	if (entry && !IsEntryAlive(entry))
+	{
+		m_err = -2;
+		m_message += " has no live receiver";
+		return m_err;
+	}
+	if (entry)
+	{
+		m_message += " is found in the directory";
+		chn = AddChannel(n);
+		if (chn > 0)
 		{
-			m_message = "no queue with this name exists";
-			m_err = 0;
+			m_ChnAlive[chn] = GetMonotonicTime();
 		}
+		return chn;
+	}
 
+	// the receiver may be created without the directory, try to open it for messages sending
+	mqd_t ret = mq_open(("/" + string(chn_name)).c_str(), O_WRONLY);
+	if (ret < 0)
+	{
+		m_err = ret;		
+		m_message += " does not exist";
 		return m_err;
 	}
-	
-	do
+
+	chn = AddChannel(n);
+	if (chn < 0)
 	{
-		m_err = mq_receive(Chn, (char *)&receive_buf, 8192, 0);
-	} while (m_err > 0);
-	
-	return mq_close(Chn);
-}
+		mq_close(ret);
+		return chn;
+	}
+
+	LookupDirectory(n, true);
+	m_message += " is opened for messages sending";
+	m_Channels[chn] = ret;
+	m_ChnMsgSize[chn] = GetQueueMsgSize(ret);
+	return chn;
+}
+
+// get the name of the channel
+// @param channel	the channel number
+// @return			the name of the channel, empty for no such a channel
+string MsgQ::GetChannelName(int channel)
+{
+	if (channel < 0 || channel > m_totalChannels)
+	{
+		m_err = -1;
+		m_message = "invalid channel";
+		return "";
+	}
+
+	//m_message = "(" + to_string(channel) + ") " + to_string(m_ChnNames[channel]) + ":";
+	m_message.assign((char*)(m_ChnNames + channel), strnlen((char*)(m_ChnNames + channel), sizeof(m_ChnNames[channel])));
+	return m_message.str();
+}
+
+// receive a message sent to me. Fragmented messages are returned after all fragments are reassembled.
+// @param SenderName (out)	the sender name in string, 1-15 characters
+// @param type (out)		the type of the message, can be MSG_NULL (0), MSG_DATA (1), MSG_COMMAND (6), ...
+// @param len (out)			the length of the message data, 0-1MB
+// @param data (out)		the pointer to the received data without message header
+// @param size				the size of the data buffer. A longer message is dropped with its length reported in len
+// @return					the sender channel, positive for success, negtive for error code
+int MsgQ::ReceiveMsg(string* SenderName, int* type, int* len, void* data, int size)
+{
+	return Receive(SenderName, type, len, data, size, m_timeout);
+}
+
+// receive a message sent to me without blocking. It is the same as ReceiveMsg() with a zero timeout.
+// @param SenderName (out)	the sender name in string, 1-15 characters
+// @param type (out)		the type of the message
+// @param len (out)			the length of the message data, 0-1MB
+// @param data (out)		the pointer to the received data without message header
+// @param size				the size of the data buffer. A longer message is dropped with its length reported in len
+// @return					the sender channel, 0 for no message, negtive for error code
+int MsgQ::PollMsg(string* SenderName, int* type, int* len, void* data, int size)
+{
+	return Receive(SenderName, type, len, data, size, 0);
+}
+
+// receive a message sent to me
+// @param SenderName (out)	the sender name in string
+// @param type (out)		the type of the message
+// @param len (out)			the length of the message data
+// @param data (out)		the pointer to the received data without message header
+// @param size				the size of the data buffer
+// @param timeout_usec		the timeout in microseconds, 0 for no blocking
+// @return					the sender channel, 0 for no message, negtive for error code
+int MsgQ::Receive(string* SenderName, int* type, int* len, void* data, int size, long timeout_usec)
+{
+	*len = 0;
+	timespec timeout = GetDeadline(CLOCK_REALTIME_COARSE, timeout_usec);
+	uint64_t deadline = m_precise ? GetMonotonicTime() + timeout_usec * 1000ULL : 0;
+	mq_buffer* msg = reinterpret_cast<mq_buffer*>(m_receiveBuffer.data());
+
+	while (true)
+	{
+		// My in-process queue and my kernel queue are merged by priority. While my in-process queue has a message below
+		// urgent, the head of the kernel queue is taken without blocking and held till no in-process message is higher.
+		char* payload = msg->buf;
+		bool local = false;
+		bool held = false;
+		int top = m_local ? PeekLocal() : -1;
+		if (top >= 0 && top < MSG_PRIORITY_URGENT && !m_heldLen && m_myEntry
+			&& __atomic_load_n(&m_myEntry->sent, __ATOMIC_RELAXED) != __atomic_load_n(&m_myEntry->received, __ATOMIC_RELAXED))
+		{
+			HoldKernelMessage();
+		}
+
+		if (m_heldLen && static_cast<int>(m_heldPrio) > top)
+		{
+			m_receiveBuffer.swap(m_held);
+			msg = reinterpret_cast<mq_buffer*>(m_receiveBuffer.data());
+			payload = msg->buf;
+			m_err = m_heldLen;
+			m_prio = m_heldPrio;
+			m_heldLen = 0;
+			held = true;
+		}
+		else if (m_local)
+		{
+			// when my in-process queue is empty, I am parked before reading the kernel queue,
+			// so that the next in-process sender rings a doorbell through the kernel queue.
+			local = ReceiveLocal(msg, &payload);
+			if (!local && !m_heldLen)
+			{
+				__atomic_store_n(&m_local->parked, 1, __ATOMIC_SEQ_CST);
+				local = ReceiveLocal(msg, &payload);
+			}
+		}
+
+		// read the message queue, the held message was read from it already
+		if (local)
+		{
+			m_err = MQ_HEADERSIZE + msg->total;
+		}
+		else if (m_precise && !held)
+		{
+			m_err = ReceivePrecise((char *)msg, m_receiveBuffer.size(), deadline);
+		}
+		else if (!held)
+		{
+			m_err = mq_timedreceive(m_myChn, (char *)msg, m_receiveBuffer.size(), &m_prio, &timeout);
+		}
+		if (m_err >= 0 && !local && !held)
+		{
+			GrantCredit();
+		}
+		if (m_err < 0)
+		{
+			if (m_myStats && (errno == EAGAIN || errno == ETIMEDOUT))
+			{
+				__atomic_fetch_add(&m_myStats->receive_timeouts, 1, __ATOMIC_RELAXED);
+			}
+
+			if (errno == EAGAIN)
+			{
+				m_message.Set(IPC_STATUS_NOMESSAGE);
+				m_err = 0;
+			}
+			else if (errno == EBADF)
+			{
+				m_message = "The descriptor specified in mqdes was invalid.";
+			} 
+			else if (errno == EINVAL)
+			{
+				m_message = "The call would have blocked, and abs_timeout was invalid, either because tv_sec was less than zero, or because tv_nsec was less than zero or greater than 1000 million.";
+			}
+			else if (errno == EMSGSIZE)
+			{
+				m_message = to_string(m_receiveBuffer.size()) + " was less than the mq_msgsize attribute of the message queue.";
+			} 
+			else if (errno == ETIMEDOUT)
+			{
+				m_message.Set(IPC_STATUS_TIMEDOUT);
+				m_err = 0;
+			}
+			else
+			{
+				m_message = "error when receiving message";
+			}
+			
+			return m_err;
+		}
+
+		// a message of a sender built with another header layout cannot be parsed
+		if (!local && msg->version != MQ_WIRE_VERSION)
+		{
+			m_err = -6;
+			m_message = "message of wire version " + to_string(msg->version) + " is dropped, " + to_string(MQ_WIRE_VERSION) + " is expected";
+			return m_err;
+		}
+
+		// a doorbell of my in-process queue only wakes me up
+		if (!local && (msg->flags & MQ_FLAG_LOCAL))
+		{
+			continue;
+		}
+
+		// a doorbell carries the latest value of its key in my conflation table
+		if (msg->flags & MQ_FLAG_CONFLATED)
+		{
+			if (!ReadConflated(msg))
+			{
+				continue; // the value was received at an earlier doorbell
+			}
+			payload = m_conflation->buffer.data();
+		}
+
+		// find the sender channel, a new sender is added to the list. Its descriptor is opened at the first reply or by OpenChannels()
+		m_message.Set(IPC_STATUS_RECEIVED, msg->name);
+		// the channel table is shared with the sending threads
+		int chn;
+		{
+			mq_send_guard guard(&m_sendLock);
+			chn = FindChannel(msg->name);
+			if (chn == 0)
+			{
+				chn = AddChannel(msg->name);
+				if (chn < 0)
+				{
+					return m_err;
+				}
+				m_message = "new sender " + string((char *)&msg->name, strnlen((char *)&msg->name, sizeof(msg->name)));
+			}
+		}
+
+		// an expired message is dropped before its data is copied anywhere, so are the rest fragments of it
+		if (msg->deadline && msg->deadline < GetMonotonicTime())
+		{
+			// a message is counted once, whichever of its fragments is found expired first
+			mq_reassembly* r = m_Reassembly + chn;
+			if (r->expired != msg->seq)
+			{
+				r->expired = msg->seq;
+				m_ChnExpired[chn]++;
+			}
+			r->received = 0;
+			continue;
+		}
+
+		// a single message is parsed in place, a fragment is copied to the reassembly buffer of the sender
+		if (!local && msg->total > msg->len)
+		{
+			mq_reassembly* r = m_Reassembly + chn;
+			if (msg->total > MAX_FRAGMENTEDLENGTH || msg->offset + msg->len > msg->total)
+			{
+				continue; // invalid fragment
+			}
+
+			if (msg->offset == 0)
+			{
+				r->seq = msg->seq;
+				r->received = 0;
+				if (r->data.size() < msg->total)
+				{
+					r->data.resize(msg->total);
+				}
+			}
+			else if (r->seq != msg->seq || r->received != msg->offset)
+			{
+				r->received = 0; // a fragment is lost, drop the whole message
+				continue;
+			}
+
+			memcpy(r->data.data() + msg->offset, msg->buf, msg->len);
+			r->received += msg->len;
+			if (r->received < msg->total)
+			{
+				continue; // wait for more fragments
+			}
+			r->received = 0;
+			payload = r->data.data();
+		}
+
+		// got a message, parses it
+		m_receiveTime = GetMonotonicTime();
+		if (m_latencyStats)
+		{
+			RecordLatency(chn, msg->type, m_receiveTime - msg->ts);
+		}
+		t_traceId = msg->trace ? msg->trace : t_traceId;
+		IPC_TRACEPOINT(IPC_TRACE_RECEIVE, msg->trace, msg->name, msg->type, m_receiveTime);
+
+		{
+			mq_send_guard guard(&m_sendLock);
+			m_ChnNames[0] = msg->name;
+			__atomic_store_n(&m_lastChn, chn, __ATOMIC_RELEASE);
+		}
+		SenderName->assign((char *)&msg->name, strnlen((char *)&msg->name, sizeof(msg->name)));
+		m_ts = msg->ts;
+		m_corr = msg->corr;
+		m_flags = msg->flags;
+		*len = msg->total;
+		*type = msg->type;
+
+		if (*len > size)
+		{
+			m_err = -5;
+			m_message = "message of " + to_string(*len) + " bytes is larger than the receiving buffer";
+			return m_err;
+		}
+
+		// check not copy to itself
+		if (data != payload)
+		{
+			memcpy(data, payload, *len);
+		}
+
+		return chn;
+	}
+}
+
+// find a topic by its name, map its ring if it is new
+// @param TopicName	the name of the topic, 1-8 characters
+// @return			the topic ID, positive for success, negtive for error code
+int MsgQ::OpenTopic(string TopicName)
+{
+	if (TopicName.empty() || TopicName.length() > 8)
+	{
+		m_err = -1;
+		m_message = "invalid topic name. 1-8 characters";
+		return m_err;
+	}
+
+	uint64_t n = 0;
+	memcpy(&n, TopicName.c_str(), TopicName.length());
+	for (int i = 1; i <= m_totalTopics; i++)
+	{
+		if (m_Topics[i].name == n)
+		{
+			return i;
+		}
+	}
+
+	if (m_totalTopics >= MAX_TOPICS)
+	{
+		m_err = -2;
+		m_message = "too many topics";
+		return m_err;
+	}
+
+	// only the creator initializes the ring, others wait till it is ready
+	string name = "/topic." + TopicName;
+	bool creator = true;
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+	if (fd < 0 && errno == EEXIST)
+	{
+		creator = false;
+		fd = shm_open(name.c_str(), O_RDWR, 0666);
+	}
+	if (fd < 0 || (creator && ftruncate(fd, sizeof(mq_topic)) < 0))
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		m_err = -3;
+		m_message = "cannot open the topic " + name;
+		return m_err;
+	}
+
+	struct stat st;
+	unsigned int usecs = 0;
+	while (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) < sizeof(mq_topic) && usecs < 1000000)
+	{
+		usleep(100);
+		usecs += 100;
+	}
+
+	void* base = mmap(0, sizeof(mq_topic), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		m_err = -4;
+		m_message = "cannot map the topic " + name;
+		return m_err;
+	}
+
+	mq_topic* ring = static_cast<mq_topic*>(base);
+	if (creator)
+	{
+		ring->version = MQ_TOPIC_VERSION;
+		__atomic_store_n(&ring->ready, 1, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		usecs = 0;
+		while (!__atomic_load_n(&ring->ready, __ATOMIC_ACQUIRE) && usecs < 1000000)
+		{
+			usleep(100);
+			usecs += 100;
+		}
+
+		if (!ring->ready || ring->version != MQ_TOPIC_VERSION)
+		{
+			munmap(base, sizeof(mq_topic));
+			m_err = -5;
+			m_message = "the topic " + name + " is not ready or has a different layout";
+			return m_err;
+		}
+	}
+
+	m_totalTopics++;
+	m_Topics[m_totalTopics].name = n;
+	m_Topics[m_totalTopics].ring = ring;
+	m_Topics[m_totalTopics].subscribed = false;
+	return m_totalTopics;
+}
+
+// subscribe a topic, the messages published after the subscribing will be received by ReceiveTopic()
+// @param TopicName	the name of the topic, 1-8 characters
+// @return			the topic ID, positive for success, negtive for error code
+int MsgQ::Subscribe(string TopicName)
+{
+	int id = OpenTopic(TopicName);
+	if (id < 0)
+	{
+		return id;
+	}
+
+	mq_topic_state* topic = m_Topics + id;
+	if (!topic->subscribed)
+	{
+		topic->cursor = __atomic_load_n(&topic->ring->head, __ATOMIC_ACQUIRE);
+		topic->lost = 0;
+		topic->subscribed = true;
+	}
+
+	m_err = 0;
+	m_message = "topic " + TopicName + " is subscribed";
+	return id;
+}
+
+// publish a message to all subscribers of a topic. The message is written once in shared memory.
+// @param TopicName	the name of the topic, 1-8 characters
+// @param type		the type of the message, for example MSG_UPDATE (16)
+// @param len		the length of the message net data, 0-2016
+// @param data		the pointer to the data to be published, can be NULL in case len is 0
+// @return			the topic ID, positive for success, negtive for error code
+int MsgQ::Publish(string TopicName, int type, int len, void* data)
+{
+	if (type <= 0 || type > 255)
+	{
+		m_err = -1;
+		m_message = "invalid publishing message type";
+		return m_err;
+	}
+
+	if (len < 0 || len > static_cast<int>(sizeof(mq_topic_slot::buf)))
+	{
+		m_err = -2;
+		m_message = "invalid publishing message length";
+		return m_err;
+	}
+
+	int id = OpenTopic(TopicName);
+	if (id < 0)
+	{
+		return id;
+	}
+
+	// claim a sequence, then write the message in its slot between the odd and the even marks. The mark of a slot only
+	// goes forward. A publisher lapped by MQ_TOPIC_SLOTS newer ones gives up its slot, the message is lost to the subscribers
+	// anyway. A slot still being written by an older publisher is waited for up to MQ_TOPIC_CLAIM_TIMEOUT, and taken over
+	// only when that publisher has gone, or has not recorded itself as the owner by then.
+	mq_topic* ring = m_Topics[id].ring;
+	uint64_t seq = __atomic_fetch_add(&ring->head, 1, __ATOMIC_ACQ_REL);
+	mq_topic_slot* slot = ring->slots + (seq & (MQ_TOPIC_SLOTS - 1));
+	uint64_t deadline = 0;
+	uint64_t mark = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	while (true)
+	{
+		if (mark > 2 * seq)
+		{
+			m_err = 0;
+			m_message = "message published but overwritten by newer ones";
+			return id;
+		}
+
+		if (mark & 1)
+		{
+			uint32_t pid = __atomic_load_n(&slot->owner, __ATOMIC_RELAXED);
+			bool dead = pid && kill(static_cast<pid_t>(pid), 0) < 0 && errno == ESRCH;
+			uint64_t now = GetMonotonicTime();
+			deadline = deadline ? deadline : now + MQ_TOPIC_CLAIM_TIMEOUT * 1000ULL;
+			if (!dead && now < deadline)
+			{
+				sched_yield();
+				mark = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+				continue;
+			}
+
+			if (pid && !dead)
+			{
+				m_err = -6;
+				m_message = "the slot of the message is still being written by the publisher " + to_string(pid);
+				return m_err;
+			}
+
+			// the owner is cleared first, so that a later claim is never taken for the dead one
+			if (pid && !__atomic_compare_exchange_n(&slot->owner, &pid, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				mark = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+				continue;
+			}
+		}
+
+		if (__atomic_compare_exchange_n(&slot->seq, &mark, 2 * seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		{
+			break;
+		}
+	}
+	__atomic_store_n(&slot->owner, static_cast<uint32_t>(getpid()), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->name = m_myChnName;
+	slot->ts = GetMonotonicTime();
+	slot->type = type;
+	slot->len = len;
+	if (len)
+	{
+		memcpy(slot->buf, data, len);
+	}
+	__atomic_store_n(&slot->owner, 0, __ATOMIC_RELAXED);
+	mark = 2 * seq + 1;
+	__atomic_compare_exchange_n(&slot->seq, &mark, 2 * seq + 2, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+	// wake up the subscribers only when some of them are waiting
+	__atomic_fetch_add(&ring->futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST))
+	{
+		FutexWake(&ring->futex);
+	}
+
+	m_err = 0;
+	m_message = "message published";
+	return id;
+}
+
+// receive a message of a subscribed topic. It blocks until a message is published or the timeout expires.
+// @param TopicID			the topic ID returned by Subscribe()
+// @param SenderName (out)	the publisher name in string, 1-8 characters
+// @param type (out)		the type of the message
+// @param len (out)			the length of the message data
+// @param data (out)		the pointer to the received data without message header
+// @param size				the size of the data buffer. A longer message is dropped with its length reported in len
+// @return					the topic ID for a message, 0 for no message, negtive for error code
+int MsgQ::ReceiveTopic(int TopicID, string* SenderName, int* type, int* len, void* data, int size)
+{
+	*len = 0;
+	if (TopicID <= 0 || TopicID > m_totalTopics || !m_Topics[TopicID].subscribed)
+	{
+		m_err = -1;
+		m_message = "the topic is not subscribed";
+		return m_err;
+	}
+
+	mq_topic_state* topic = m_Topics + TopicID;
+	mq_topic* ring = topic->ring;
+	uint64_t deadline = GetMonotonicTime() + m_timeout * 1000ULL;
+	while (true)
+	{
+		uint32_t futex = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST);
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head - topic->cursor > MQ_TOPIC_SLOTS)
+		{
+			// fell behind the publishers, skip the messages overwritten
+			topic->lost += head - topic->cursor - MQ_TOPIC_SLOTS;
+			topic->cursor = head - MQ_TOPIC_SLOTS;
+		}
+
+		if (topic->cursor < head)
+		{
+			mq_topic_slot* slot = ring->slots + (topic->cursor & (MQ_TOPIC_SLOTS - 1));
+			uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if (seq == 2 * topic->cursor + 2)
+			{
+				// copy the message out, then check it was not overwritten during the copying
+				uint64_t name = slot->name;
+				int t = slot->type;
+				int n = slot->len;
+				if (n <= size && n <= static_cast<int>(sizeof(slot->buf)))
+				{
+					memcpy(data, slot->buf, n);
+				}
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+				{
+					continue;
+				}
+
+				topic->cursor++;
+				SenderName->assign((char *)&name, strnlen((char *)&name, sizeof(name)));
+				*type = t;
+				*len = n;
+				if (n > size)
+				{
+					m_err = -2;
+					m_message = "message of " + to_string(n) + " bytes is larger than the receiving buffer";
+					return m_err;
+				}
+
+				m_err = TopicID;
+				m_message = "message received";
+				return m_err;
+			}
+
+			if (seq > 2 * topic->cursor + 2)
+			{
+				continue; // overwritten, it is counted as lost in the next round
+			}
+
+			// the publisher is writing the message, or has not claimed its slot yet. The message is skipped only when
+			// its publisher has gone, otherwise it is waited for like the next publishing.
+			uint32_t pid = __atomic_load_n(&slot->owner, __ATOMIC_RELAXED);
+			if (seq == 2 * topic->cursor + 1 && pid && kill(static_cast<pid_t>(pid), 0) < 0 && errno == ESRCH)
+			{
+				topic->cursor++;
+				topic->lost++;
+				continue;
+			}
+		}
+
+		// wait for the next publishing
+		uint64_t now = GetMonotonicTime();
+		if (now >= deadline)
+		{
+			m_err = 0;
+			m_message = "no message";
+			return m_err;
+		}
+
+		FutexWaitCounted(&ring->futex, futex, &ring->waiters, static_cast<long>((deadline - now) / 1000) + 1);
+	}
+}
+
+// take back the claim of a group slot when it was abandoned, that is its owner has gone, or it has had no owner for
+// MQ_GROUP_CLAIM_TIMEOUT since it was first seen at the position
+// @param slot			the slot claimed
+// @param pos			the position of the slot
+// @param seen (in/out)	the position and the time in nanoseconds the claim was first seen
+// @return				true when the claim was taken back, the slot shall then be released by CAS of its seq
+static bool TakeAbandonedClaim(mq_group_slot* slot, uint64_t pos, uint64_t seen[2])
+{
+	uint32_t owner = __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+	if (owner)
+	{
+		if (kill(owner, 0) == 0 || errno != ESRCH)
+		{
+			return false;
+		}
+		return __atomic_compare_exchange_n(&slot->owner, &owner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	}
+
+	uint64_t now = GetMonotonicTime();
+	if (seen[0] != pos || !seen[1])
+	{
+		seen[0] = pos;
+		seen[1] = now;
+	}
+	return now - seen[1] >= MQ_GROUP_CLAIM_TIMEOUT * 1000ULL;
+}
+
+// count a slot of a group released for the sending, and wake up one sender waiting for space
+// @param ring		the ring of the group
+static void ReleaseGroupSpace(mq_group* ring)
+{
+	__atomic_fetch_add(&ring->space, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->senders, __ATOMIC_SEQ_CST))
+	{
+		FutexWake(&ring->space, 1);
+	}
+}
+
+// copy out the message of a group slot claimed for receiving, then release the slot for the sending of the next round
+// @param slot			the slot claimed
+// @param pos			the position of the slot
+// @param name (out)	the name of the sender
+// @param type (out)	the type of the message
+// @param len (out)		the length of the message data
+// @param data (out)	the buffer of the data, it is not copied when it is longer than size
+// @param size			the size of the buffer
+// @return				true when the slot was released, false when it had been taken back and the copy is not valid
+static bool CopyGroupSlot(mq_group_slot* slot, uint64_t pos, uint64_t* name, int* type, int* len, void* data, int size)
+{
+	__atomic_store_n(&slot->owner, static_cast<uint32_t>(getpid()), __ATOMIC_RELAXED);
+	*name = slot->name;
+	*type = slot->type;
+	*len = slot->len;
+	if (*len <= size)
+	{
+		memcpy(data, slot->buf, *len);
+	}
+	__atomic_store_n(&slot->owner, 0, __ATOMIC_RELAXED);
+
+	uint64_t seq = pos + 1;
+	return __atomic_compare_exchange_n(&slot->seq, &seq, pos + MQ_GROUP_SLOTS, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+// find a consumer group by its name, map its ring if it is new
+// @param GroupName	the name of the group, 1-8 characters
+// @return			the group ID, positive for success, negtive for error code
+int MsgQ::OpenGroup(string GroupName)
+{
+	if (GroupName.empty() || GroupName.length() > 8)
+	{
+		m_err = -1;
+		m_message = "invalid group name. 1-8 characters";
+		return m_err;
+	}
+
+	uint64_t n = 0;
+	memcpy(&n, GroupName.c_str(), GroupName.length());
+	for (int i = 1; i <= m_totalGroups; i++)
+	{
+		if (m_Groups[i].name == n)
+		{
+			return i;
+		}
+	}
+
+	if (m_totalGroups >= MAX_GROUPS)
+	{
+		m_err = -2;
+		m_message = "too many groups";
+		return m_err;
+	}
+
+	// only the creator initializes the ring, others wait till it is ready
+	string name = "/grp." + GroupName;
+	bool creator = true;
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+	if (fd < 0 && errno == EEXIST)
+	{
+		creator = false;
+		fd = shm_open(name.c_str(), O_RDWR, 0666);
+	}
+	if (fd < 0 || (creator && ftruncate(fd, sizeof(mq_group)) < 0))
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		m_err = -3;
+		m_message = "cannot open the group " + name;
+		return m_err;
+	}
+
+	struct stat st;
+	unsigned int usecs = 0;
+	while (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) < sizeof(mq_group) && usecs < 1000000)
+	{
+		usleep(100);
+		usecs += 100;
+	}
+
+	void* base = mmap(0, sizeof(mq_group), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		m_err = -4;
+		m_message = "cannot map the group " + name;
+		return m_err;
+	}
+
+	mq_group* ring = static_cast<mq_group*>(base);
+	if (creator)
+	{
+		for (uint64_t i = 0; i < MQ_GROUP_SLOTS; i++)
+		{
+			ring->slots[i].seq = i;
+		}
+		ring->version = MQ_GROUP_VERSION;
+		__atomic_store_n(&ring->ready, 1, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		usecs = 0;
+		while (!__atomic_load_n(&ring->ready, __ATOMIC_ACQUIRE) && usecs < 1000000)
+		{
+			usleep(100);
+			usecs += 100;
+		}
+
+		if (!ring->ready || ring->version != MQ_GROUP_VERSION)
+		{
+			munmap(base, sizeof(mq_group));
+			m_err = -5;
+			m_message = "the group " + name + " is not ready or has a different layout";
+			return m_err;
+		}
+	}
+
+	m_totalGroups++;
+	m_Groups[m_totalGroups].name = n;
+	m_Groups[m_totalGroups].ring = ring;
+	m_Groups[m_totalGroups].joined = false;
+	return m_totalGroups;
+}
+
+// join a consumer group as one of its workers. Every message sent to the group is received by exactly one worker.
+// @param GroupName	the name of the group, 1-8 characters
+// @return			the group ID, positive for success, negtive for error code
+int MsgQ::JoinGroup(string GroupName)
+{
+	int id = OpenGroup(GroupName);
+	if (id < 0)
+	{
+		return id;
+	}
+
+	if (!m_Groups[id].joined)
+	{
+		__atomic_fetch_add(&m_Groups[id].ring->workers, 1, __ATOMIC_RELAXED);
+		m_Groups[id].joined = true;
+	}
+
+	m_err = 0;
+	m_message = "group " + GroupName + " is joined";
+	return id;
+}
+
+// leave a consumer group. The messages left in the group are received by the other workers.
+// @param GroupID	the group ID returned by JoinGroup()
+// @return			0 on success, negtive for error code
+int MsgQ::LeaveGroup(int GroupID)
+{
+	if (GroupID <= 0 || GroupID > m_totalGroups || !m_Groups[GroupID].joined)
+	{
+		m_err = -1;
+		m_message = "the group is not joined";
+		return m_err;
+	}
+
+	__atomic_fetch_sub(&m_Groups[GroupID].ring->workers, 1, __ATOMIC_RELAXED);
+	m_Groups[GroupID].joined = false;
+	m_err = 0;
+	m_message = "group is left";
+	return m_err;
+}
+
+// send a message to a consumer group, it is received by the first idle worker. It blocks while the group is full or the timeout expires.
+// @param GroupName	the name of the group, 1-8 characters
+// @param type		the type of the message, for example MSG_UPDATE (16)
+// @param len		the length of the message net data, 0-2016
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @return			the group ID, positive for success, negtive for error code
+int MsgQ::SendGroup(string GroupName, int type, int len, void* data)
+{
+	if (type <= 0 || type > 255)
+	{
+		m_err = -1;
+		m_message = "invalid group message type";
+		return m_err;
+	}
+
+	if (len < 0 || len > static_cast<int>(sizeof(mq_group_slot::buf)))
+	{
+		m_err = -2;
+		m_message = "invalid group message length";
+		return m_err;
+	}
+
+	int id = OpenGroup(GroupName);
+	if (id < 0)
+	{
+		return id;
+	}
+
+	// claim the slot at the head, the senders race for it by CAS
+	mq_group* ring = m_Groups[id].ring;
+	mq_group_slot* slot = NULL;
+	uint64_t deadline = 0;
+	uint64_t seen[2] = {0, 0};
+	uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	while (true)
+	{
+		uint32_t space = __atomic_load_n(&ring->space, __ATOMIC_SEQ_CST);
+		slot = ring->slots + (pos & (MQ_GROUP_SLOTS - 1));
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = static_cast<int64_t>(seq - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+			continue; // pos is reloaded by the failed CAS
+		}
+
+		if (diff > 0)
+		{
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		// the message of the last round is still being received when a worker has claimed it, take it back if the worker has gone
+		bool claimed = seq == pos + 1 - MQ_GROUP_SLOTS && __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > seq - 1;
+		if (claimed && TakeAbandonedClaim(slot, seq - 1, seen)
+			&& __atomic_compare_exchange_n(&slot->seq, &seq, pos, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			ReleaseGroupSpace(ring);
+			continue;
+		}
+
+		// the group is full, wait for a worker to receive a message
+		uint64_t now = GetMonotonicTime();
+		if (!deadline)
+		{
+			deadline = now + m_timeout * 1000ULL;
+		}
+		if (now >= deadline)
+		{
+			m_err = -6;
+			m_message = "the group " + GroupName + " is full";
+			return m_err;
+		}
+
+		if (claimed)
+		{
+			sched_yield();
+		}
+		else
+		{
+			FutexWaitCounted(&ring->space, space, &ring->senders, static_cast<long>((deadline - now) / 1000) + 1);
+		}
+		pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+
+	// the slot is owned by this sender till it is released for the receiving, unless the workers have taken it back
+	__atomic_store_n(&slot->owner, static_cast<uint32_t>(getpid()), __ATOMIC_RELAXED);
+	slot->name = m_myChnName;
+	slot->ts = GetMonotonicTime();
+	slot->type = type;
+	slot->len = len;
+	if (len)
+	{
+		memcpy(slot->buf, data, len);
+	}
+	__atomic_store_n(&slot->owner, 0, __ATOMIC_RELAXED);
+
+	uint64_t seq = pos;
+	if (!__atomic_compare_exchange_n(&slot->seq, &seq, pos + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	{
+		m_err = -7;
+		m_message = "the message was dropped by the group after the claim timed out";
+		return m_err;
+	}
+
+	// wake up only one idle worker, the others keep sleeping
+	__atomic_fetch_add(&ring->futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST))
+	{
+		FutexWake(&ring->futex, 1);
+	}
+
+	m_err = 0;
+	m_message = "message sent to group";
+	return id;
+}
+
+// receive a message of a joined group. It blocks until a message is sent to the group or the timeout expires.
+// @param GroupID			the group ID returned by JoinGroup()
+// @param SenderName (out)	the sender name in string, 1-8 characters
+// @param type (out)		the type of the message
+// @param len (out)			the length of the message data
+// @param data (out)		the pointer to the received data without message header
+// @param size				the size of the data buffer. A longer message is dropped with its length reported in len
+// @return					the group ID for a message, 0 for no message, negtive for error code
+int MsgQ::ReceiveGroup(int GroupID, string* SenderName, int* type, int* len, void* data, int size)
+{
+	*len = 0;
+	if (GroupID <= 0 || GroupID > m_totalGroups || !m_Groups[GroupID].joined)
+	{
+		m_err = -1;
+		m_message = "the group is not joined";
+		return m_err;
+	}
+
+	// claim the slot at the tail, the workers race for it by CAS
+	mq_group* ring = m_Groups[GroupID].ring;
+	mq_group_slot* slot = NULL;
+	uint64_t deadline = 0;
+	uint64_t seen[2] = {0, 0};
+	uint64_t name = 0;
+	int t = 0;
+	int n = 0;
+	uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	while (true)
+	{
+		uint32_t futex = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST);
+		slot = ring->slots + (pos & (MQ_GROUP_SLOTS - 1));
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = static_cast<int64_t>(seq - (pos + 1));
+		if (diff == 0)
+		{
+			if (!__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				continue; // pos is reloaded by the failed CAS
+			}
+
+			// the slot is owned by this worker till it is released for the sending of the next round
+			if (CopyGroupSlot(slot, pos, &name, &t, &n, data, size))
+			{
+				break;
+			}
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (diff > 0)
+		{
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		// a sender has claimed the slot at the tail but not written it yet. Skip it if the sender has gone.
+		bool claimed = seq == pos && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != pos;
+		if (claimed && TakeAbandonedClaim(slot, pos, seen)
+			&& __atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		{
+			if (__atomic_compare_exchange_n(&slot->seq, &seq, pos + MQ_GROUP_SLOTS, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			{
+				ReleaseGroupSpace(ring);
+			}
+			else if (CopyGroupSlot(slot, pos, &name, &t, &n, data, size))
+			{
+				break; // the sender finished it in the meantime
+			}
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		// the group is empty, or a sender is still writing the slot at the tail
+		uint64_t now = GetMonotonicTime();
+		if (!deadline)
+		{
+			deadline = now + m_timeout * 1000ULL;
+		}
+		if (now >= deadline)
+		{
+			m_err = 0;
+			m_message = "no message";
+			return m_err;
+		}
+
+		if (claimed)
+		{
+			sched_yield();
+		}
+		else
+		{
+			FutexWaitCounted(&ring->futex, futex, &ring->waiters, static_cast<long>((deadline - now) / 1000) + 1);
+		}
+		pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	}
+
+	ReleaseGroupSpace(ring);
+
+	SenderName->assign((char *)&name, strnlen((char *)&name, sizeof(name)));
+	*type = t;
+	*len = n;
+	if (n > size)
+	{
+		m_err = -2;
+		m_message = "message of " + to_string(n) + " bytes is larger than the receiving buffer";
+		return m_err;
+	}
+
+	m_err = GroupID;
+	m_message = "message received";
+	return m_err;
+}
+
+// get the number of messages waiting in a consumer group
+// @param GroupID	the group ID returned by JoinGroup() or SendGroup()
+// @return			the number of messages not received yet
+int MsgQ::GetGroupPending(int GroupID)
+{
+	if (GroupID <= 0 || GroupID > m_totalGroups)
+	{
+		return 0;
+	}
+
+	mq_group* ring = m_Groups[GroupID].ring;
+	int64_t pending = static_cast<int64_t>(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+	return pending < 0 ? 0 : static_cast<int>(pending);
+}
+
+// record the latency of a received message
+// @param channel	the sender channel
+// @param type		the type of the message
+// @param ns		the latency in nanoseconds
+void MsgQ::RecordLatency(int channel, int type, uint64_t ns)
+{
+	// only the receiving thread creates the histograms, the others may read them at the same time
+	if (!m_ChnLatency[channel])
+	{
+		atomic_store(m_ChnLatency + channel, make_shared<LatencyHistogram>());
+	}
+	m_ChnLatency[channel]->Record(ns);
+
+	type &= 0xFF;
+	if (!m_TypeLatency[type])
+	{
+		atomic_store(m_TypeLatency + type, make_shared<LatencyHistogram>());
+	}
+	m_TypeLatency[type]->Record(ns);
+}
+
+// get the latency histogram of a sender channel
+// @param channel	the sender channel
+// @return			the histogram, empty when no message from the channel has been recorded
+shared_ptr<LatencyHistogram> MsgQ::GetChannelLatency(int channel)
+{
+	if (channel <= 0 || channel >= MAX_MESSAGECHANNELS)
+	{
+		return shared_ptr<LatencyHistogram>();
+	}
+	return atomic_load(m_ChnLatency + channel);
+}
+
+// get the latency histogram of a message type
+// @param type		the type of the message, 1-255
+// @return			the histogram, empty when no message of the type has been recorded
+shared_ptr<LatencyHistogram> MsgQ::GetTypeLatency(int type)
+{
+	if (type <= 0 || type > 255)
+	{
+		return shared_ptr<LatencyHistogram>();
+	}
+	return atomic_load(m_TypeLatency + type);
+}
+
+// dump all latency histograms, one line for each sender channel and each message type
+// @return			the lines in format of LatencyHistogram::Dump()
+string MsgQ::DumpLatencyStats()
+{
+	string s;
+	for (int i = 1; i < MAX_MESSAGECHANNELS; i++)
+	{
+		shared_ptr<LatencyHistogram> h = GetChannelLatency(i);
+		if (h)
+		{
+			s += h->Dump("channel:" + string((char*)(m_ChnNames + i), strnlen((char*)(m_ChnNames + i), 8))) + "\n";
+		}
+	}
+	for (int i = 1; i < 256; i++)
+	{
+		shared_ptr<LatencyHistogram> h = GetTypeLatency(i);
+		if (h)
+		{
+			s += h->Dump("type:" + to_string(i)) + "\n";
+		}
+	}
+	return s;
+}
+
+// send a message to the destnation
+// @param DestName	the destnation name, empty for reply to the last sender
+// @param type		the type of the message, for example MSG_COMMAND (6)
+// @param len		the length of the message net data, can be 0 or positive
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+// @return			the destnation channel, positive for success, negtive for error code
+int MsgQ::SendMsg(string DestName, int type, int len, void* data, int priority)
+{
+	return SendMsg(DestName.c_str(), type, len, data, priority);
+}
+
+// send a message to the destnation
+// @param DestName	the destnation name
+// @param type		the type of the message, for example MSG_COMMAND (6)
+// @param len		the length of the message net data, can be 0 or positive
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+// @return			the destnation channel, positive for success, negtive for error code
+int MsgQ::SendMsg(const char* DestName, int type, int len, void* data, int priority)
+{
+	int chn = GetDestChannel(DestName);
+	if (chn > 0 && SendMsg(chn, type, len, data, priority) < 0)
+	{
+		return -1;
+	}
+	
+	return chn;
+}
+
+// send a message with a time to live. The receiver drops it unread once it is older than the TTL.
+// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+// @param type		the type of the message, for example MSG_COMMAND (6)
+// @param len		the length of the message net data, 0-1MB
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @param ttl_usec	the time to live in microseconds, 0 for no expiry
+// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+// @return			bytes of data actually sent, positive for success, negtive for error code.
+int MsgQ::SendMsgTTL(int DestChn, int type, int len, void* data, long ttl_usec, int priority)
+{
+	uint64_t deadline = ttl_usec > 0 ? GetMonotonicTime() + ttl_usec * 1000ULL : 0;
+	return Send(DestChn, type, len, data, priority, 0, 0, deadline);
+}
+
+// send a message with a time to live. The receiver drops it unread once it is older than the TTL.
+// @param DestName	the destnation name, empty for reply to the last sender
+// @param type		the type of the message, for example MSG_COMMAND (6)
+// @param len		the length of the message net data, 0-1MB
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @param ttl_usec	the time to live in microseconds, 0 for no expiry
+// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+// @return			the destnation channel, positive for success, negtive for error code
+int MsgQ::SendMsgTTL(string DestName, int type, int len, void* data, long ttl_usec, int priority)
+{
+	int chn = GetDestChannel(DestName);
+	if (chn > 0 && SendMsgTTL(chn, type, len, data, ttl_usec, priority) < 0)
+	{
+		return -1;
+	}
+	return chn;
+}
+
+// get the number of messages dropped unread for their expired TTL
+// @param chn		the sender channel, 0 for all channels
+// @return			the number of expired messages
+uint64_t MsgQ::GetExpired(int chn)
+{
+	if (chn > 0)
+	{
+		return chn <= m_totalChannels ? m_ChnExpired[chn] : 0;
+	}
+
+	uint64_t total = 0;
+	for (int i = 1; i <= m_totalChannels; i++)
+	{
+		total += m_ChnExpired[i];
+	}
+	return total;
+}
+
+// send a command to the destnation
+// @param DestName	the destnation name, empty for reply to the last sender
+// @param n			the integer data to be sent
+// @return			the destnation channel, positive for success, negtive for error code
+int MsgQ::SendCmd(string DestName, string s)
+{
+	return SendMsg(DestName, MSG_COMMAND, s.length() + 1, (void *)s.c_str());
+}
+
+// send a message to the destnation
+// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+// @param type		the type of the message, for example MSG_COMMAND (6)
+// @param len		the length of the message net data, can be 0 or positive
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+// @return			bytes of data actually sent, positive for success, negtive for error code.
+int MsgQ::SendMsg(int DestChn, int type, int len, void* data, int priority)
+{
+	return Send(DestChn, type, len, data, priority, 0, 0);
+}
+
+// send a message to the destnation without waiting for its credits or queue space
+// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+// @param type		the type of the message, for example MSG_COMMAND (6)
+// @param len		the length of the message net data, can be 0 or positive
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+// @return			bytes of data actually sent, positive for success, negtive for error code.
+int MsgQ::TrySendMsg(int DestChn, int type, int len, void* data, int priority)
+{
+	return Send(DestChn, type, len, data, priority, 0, MQ_FLAG_NOWAIT);
+}
+
+// send a request to the destnation, the reply shall carry the same correlation ID
+// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+// @param corr		the correlation ID of the request, not 0
+// @param type		the type of the message, for example MSG_QUERY (15)
+// @param len		the length of the message net data, 0-1MB
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+// @return			bytes of data actually sent, positive for success, negtive for error code.
+int MsgQ::SendRequest(int DestChn, uint32_t corr, int type, int len, void* data, int priority)
+{
+	return Send(DestChn, type, len, data, priority, corr, MQ_FLAG_REQUEST);
+}
+
+// send a reply of a request to the destnation
+// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+// @param corr		the correlation ID of the request, GetMsgCorrelation() when the request is received
+// @param type		the type of the message, for example MSG_DATA (17)
+// @param len		the length of the message net data, 0-1MB
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+// @return			bytes of data actually sent, positive for success, negtive for error code.
+int MsgQ::SendReply(int DestChn, uint32_t corr, int type, int len, void* data, int priority)
+{
+	return Send(DestChn, type, len, data, priority, corr, MQ_FLAG_REPLY);
+}
+
+// send a message to the destnation with the correlation ID and flags in its header
+// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+// @param type		the type of the message
+// @param len		the length of the message net data, 0-1MB
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+// @param corr		the correlation ID, 0 for none
+// @param flags		the flags of the message, MQ_FLAG_REQUEST or MQ_FLAG_REPLY
+// @return			bytes of data actually sent, positive for success, negtive for error code.
+int MsgQ::Send(int DestChn, int type, int len, void* data, int priority, uint32_t corr, uint16_t flags, uint64_t deadline)
+{
+	// the doorbell of an in-process message is sent by SendLocal() under the lock already taken
+	mq_send_guard guard(&m_sendLock, !(flags & MQ_FLAG_LOCAL));
+
+	if (type <= 0 || type > 255)
+	{
+		m_err = -1;
+		m_message = "invalid sending message type";
+		return m_err;
+	}
+
+	if (len < 0 || len > MAX_FRAGMENTEDLENGTH)
+	{
+		m_err = -2;
+		m_message = "invalid sending message length";
+		return m_err;
+	}
+
+	if (priority == MSG_PRIORITY_DEFAULT)
+	{
+		priority = GetDefaultPriority(type);
+	}
+	else if (priority < MSG_PRIORITY_LOW || priority > MSG_PRIORITY_URGENT)
+	{
+		m_err = -4;
+		m_message = "invalid sending message priority";
+		return m_err;
+	}
+
+	if (DestChn == 0)
+	{
+		DestChn = __atomic_load_n(&m_lastChn, __ATOMIC_ACQUIRE);
+	}
+
+	if (DestChn <= 0 || DestChn > m_totalChannels)
+	{
+		m_err = -3;
+		m_message = "invalid dest ID";
+		return m_err;
+	}
+
+	// a destnation in the same process is delivered through its in-process queue without the kernel
+	if (!(flags & MQ_FLAG_LOCAL) && m_ChnLocalState[DestChn] != 2 && GetLocalQueue(DestChn))
+	{
+		return SendLocal(DestChn, type, len, data, priority, corr, flags, deadline);
+	}
+
+	bool wait = !(flags & MQ_FLAG_NOWAIT);
+	flags &= ~MQ_FLAG_NOWAIT;
+
+	// the descriptor is opened lazily at the first sending
+	if (m_Channels[DestChn] < 0 && OpenChannel(DestChn) < 0)
+	{
+		return m_err;
+	}
+	
+	// calculate the time stamp and the timeout
+	mq_buffer* msg = reinterpret_cast<mq_buffer*>(m_sendBuffer.data());
+	msg->ts = GetMonotonicTime();
+	timespec timeout = GetDeadline(CLOCK_REALTIME_COARSE, wait ? 1000 : 0); // +1ms for sending timeout
+
+	msg->name = m_myChnName;
+	msg->type = type;
+	msg->seq = ++m_seq;
+	msg->total = len;
+	msg->corr = corr;
+	msg->flags = flags;
+	msg->version = MQ_WIRE_VERSION;
+	msg->deadline = deadline;
+	msg->trace = t_traceId;
+
+	// the data longer than the message size of either queue is sent in fragments
+	int fragment = m_sendBuffer.size();
+	if (m_ChnMsgSize[DestChn] > 0 && m_ChnMsgSize[DestChn] < fragment)
+	{
+		fragment = m_ChnMsgSize[DestChn];
+	}
+	fragment -= MQ_HEADERSIZE;
+
+	// the fragments of a message are either all accepted by the send queue or not at all
+	bool queueing = m_sendQueue && m_sendQueue->depth > 0;
+	if (queueing && len > fragment)
+	{
+		int fragments = (len + fragment - 1) / fragment;
+		lock_guard<mutex> lock(m_sendQueue->lock);
+		if (static_cast<int>(m_sendQueue->queue.size()) + fragments > m_sendQueue->depth)
+		{
+			CountSendFailure(DestChn, EAGAIN);
+			m_err = -6;
+			m_message = "the send queue has no room for the " + to_string(fragments) + " fragments";
+			return m_err;
+		}
+	}
+
+	// the messages below MSG_PRIORITY_HIGH leave the reserved credits of the destnation to the urgent ones. They wait for
+	// the credits up to the same 1ms as for the space in the queue.
+	mq_directory_entry* entry = queueing ? NULL : GetChannelEntry(DestChn);
+	uint64_t until = GetMonotonicTime() + (wait ? 1000000 : 0);
+	while (GetEntryCredits(entry, priority) == 0 && GetMonotonicTime() < until)
+	{
+		usleep(50);
+	}
+	if (GetEntryCredits(entry, priority) == 0)
+	{
+		errno = EAGAIN;
+		CountSendFailure(DestChn, EAGAIN);
+		m_err = -1;
+		m_message.Set(IPC_STATUS_FULL);
+		return m_err;
+	}
+
+	int sent = 0;
+	int queued = 0;
+	int offset = 0;
+	do
+	{
+		int n = len - offset > fragment ? fragment : len - offset;
+		msg->offset = offset;
+		msg->len = n;
+		// printf("%d: (name=%ld, ts=%d, type=%d, len=%d) \n", len, msg->name, msg->ts, msg->type, msg->len);
+
+		// make the memory copy only when they are not the same
+		if (n && msg->buf != data)
+		{
+			memcpy(msg->buf, (char*)data + offset, n);
+		}
+
+		// the fragments after the first one wait longer for the receiver to drain the queue
+		if (offset)
+		{
+			timeout = GetDeadline(CLOCK_REALTIME_COARSE, MQ_FRAGMENT_TIMEOUT);
+		}
+
+		if (queueing)
+		{
+			m_err = QueueSend(DestChn, (const char*)msg, n + MQ_HEADERSIZE, priority);
+			if (m_err == -6)
+			{
+				CountSendFailure(DestChn, EAGAIN);
+				return m_err;
+			}
+			queued += m_err > 0;
+			m_err = m_err > 0 ? 0 : m_err;
+		}
+		else
+		{
+			m_err = mq_timedsend(m_Channels[DestChn], (const char*)msg, n + MQ_HEADERSIZE, priority, &timeout);
+			if (m_err == 0 && GetChannelEntry(DestChn))
+			{
+				__atomic_fetch_add(&m_ChnEntry[DestChn]->sent, 1, __ATOMIC_RELAXED);
+			}
+		}
+
+		if (m_err < 0)
+		{
+			CountSendFailure(DestChn, errno);
+			if (errno == EAGAIN)
+			{
+				m_message.Set(IPC_STATUS_FULL);
+			}
+			else if (errno == EBADF)
+			{
+				m_message = "The descriptor specified was invalid.";
+			}
+			else if (errno == EINTR)
+			{
+				m_message.Set(IPC_STATUS_INTERRUPTED);
+			}
+			else if (errno == EINVAL)
+			{
+				m_message = "The call would have blocked, and abs_timeout was invalid";
+			}
+			else if (errno == EMSGSIZE)
+			{
+				m_message = "msg_len was greater than the mq_msgsize attribute of the message queue.";
+			}
+			else if (errno == ETIMEDOUT)
+			{
+				m_message.Set(IPC_STATUS_TIMEDOUT);
+			}
+			else
+			{
+				m_message = "error while sending";
+			}
+
+			if (offset)
+			{
+				m_message += " The fragment at " + to_string(offset) + " of " + to_string(len) + " bytes was not sent.";
+			}
+			if (queued)
+			{
+				lock_guard<mutex> lock(m_sendQueue->lock);
+				DropQueuedMessage(m_sendQueue.get(), DestChn, msg->seq);
+			}
+			return m_err;
+		}
+
+		offset += n;
+		sent += n + MQ_HEADERSIZE;
+	} while (offset < len);
+
+	if (!(flags & MQ_FLAG_LOCAL))
+	{
+		IPC_TRACEPOINT(IPC_TRACE_SEND, msg->trace, m_ChnNames[DestChn], type, msg->ts);
+	}
+
+	// the doorbells are not recorded, the messages they ring are
+	ipc_record_log* log = GetRecordLog();
+	if (log && !(flags & (MQ_FLAG_LOCAL | MQ_FLAG_CONFLATED)))
+	{
+		RecordMessage(log, m_myChnName, m_ChnNames[DestChn], type, len, data, priority, corr, flags, msg->ts);
+	}
+
+	m_err = sent;
+	m_message.Set(queued ? IPC_STATUS_QUEUED : IPC_STATUS_SENT);
+	// m_message = "message (type=" + to_string(msg->type) + ", len=" + to_string(msg->len) + ") was sent to ";
+	// m_message.append((char*)(m_ChnNames + DestChn));
+	// m_message.append(" at channel " + to_string(m_Channels[DestChn]) + " with size=" + to_string(len));
+	return m_err;
+}
+
+// send a command to the destnation
+// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+// @param s			the string data to be sent
+// @return			bytes of data actually sent, positive for success, negtive for error code.
+int MsgQ::SendCmd(int DestChn, string s)
+{
+	return SendMsg(DestChn, MSG_COMMAND, s.length() + 1, (void *)s.c_str());
+}
+
+// get the in-process queue of a channel owned by the same process
+// @param channel	the channel number
+// @return			the in-process queue, NULL for a channel of another process
+mq_local_queue* MsgQ::GetLocalQueue(int channel)
+{
+	mq_local_queue* q = m_ChnLocal[channel].get();
+	if (q && __atomic_load_n(&q->alive, __ATOMIC_ACQUIRE) && q->generation == s_forkGeneration)
+	{
+		return q;
+	}
+
+	// look it up at the first sending, or again when the receiver is gone
+	{
+		lock_guard<mutex> lock(s_localLock);
+		map<uint64_t, weak_ptr<mq_local_queue>>::iterator it = s_localQueues.find(m_ChnNames[channel]);
+		m_ChnLocal[channel] = it != s_localQueues.end() ? it->second.lock() : shared_ptr<mq_local_queue>();
+	}
+
+	q = m_ChnLocal[channel].get();
+	if (!q || q->generation != s_forkGeneration)
+	{
+		m_ChnLocal[channel].reset();
+		m_ChnLocalState[channel] = 2;
+		return NULL;
+	}
+
+	m_ChnLocalState[channel] = 1;
+	return q;
+}
+
+// send a message through the in-process queue of the destnation
+// @param DestChn	the destnation channel
+// @param type		the type of the message
+// @param len		the length of the message net data, 0-1MB
+// @param data		the pointer to the data to be sent
+// @param priority	the priority of the message, 0-3
+// @param corr		the correlation ID, 0 for none
+// @param flags		the flags of the message
+// @param deadline	the CLOCK_MONOTONIC time in nanoseconds after which the message expires, 0 for none
+// @return			bytes of data actually sent, positive for success, negtive for error code.
+int MsgQ::SendLocal(int DestChn, int type, int len, void* data, int priority, uint32_t corr, uint16_t flags, uint64_t deadline)
+{
+	mq_local_queue* q = m_ChnLocal[DestChn].get();
+	mq_local_ring* ring = q->rings + priority;
+	bool wait = !(flags & MQ_FLAG_NOWAIT);
+	flags &= ~MQ_FLAG_NOWAIT;
+
+	// claim a slot, waiting for the receiver as long as the sending timeout of the kernel queue when the ring is full
+	mq_local_slot* slot = NULL;
+	size_t pos = ring->head.load(memory_order_relaxed);
+	uint64_t timeout = 0;
+	while (true)
+	{
+		slot = ring->slots + (pos & (MQ_LOCAL_SLOTS - 1));
+		intptr_t dif = static_cast<intptr_t>(slot->seq.load(memory_order_acquire)) - static_cast<intptr_t>(pos);
+		if (dif == 0)
+		{
+			if (ring->head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (dif < 0)
+		{
+			uint64_t now = GetMonotonicTime();
+			timeout = timeout ? timeout : now + (wait ? 1000000ULL : 0);
+			if (now >= timeout)
+			{
+				errno = EAGAIN;
+				m_err = -1;
+				m_message.Set(IPC_STATUS_FULL);
+				return m_err;
+			}
+			sched_yield();
+			pos = ring->head.load(memory_order_relaxed);
+		}
+		else
+		{
+			pos = ring->head.load(memory_order_relaxed);
+		}
+	}
+
+	mq_buffer* msg = reinterpret_cast<mq_buffer*>(slot->data);
+	msg->name = m_myChnName;
+	msg->ts = GetMonotonicTime();
+	msg->type = type;
+	msg->seq = ++m_seq;
+	msg->total = len;
+	msg->offset = 0;
+	msg->len = len > 65535 ? 65535 : len;
+	msg->corr = corr;
+	msg->flags = flags;
+	msg->version = MQ_WIRE_VERSION;
+	msg->deadline = deadline;
+	msg->trace = t_traceId;
+	IPC_TRACEPOINT(IPC_TRACE_SEND, msg->trace, m_ChnNames[DestChn], type, msg->ts);
+	if (len <= MQ_LOCAL_INLINE)
+	{
+		if (len)
+		{
+			memcpy(msg->buf, data, len);
+		}
+	}
+	else
+	{
+		slot->big.assign(static_cast<char*>(data), static_cast<char*>(data) + len);
+	}
+	slot->seq.store(pos + 1, memory_order_release);
+
+	ipc_record_log* log = GetRecordLog();
+	if (log)
+	{
+		RecordMessage(log, m_myChnName, m_ChnNames[DestChn], type, len, data, priority, corr, flags, msg->ts);
+	}
+
+	// the first sender after the receiver is parked wakes it up through its kernel queue
+	atomic_thread_fence(memory_order_seq_cst);
+	if (__atomic_load_n(&q->parked, __ATOMIC_RELAXED) && __atomic_exchange_n(&q->parked, 0, __ATOMIC_SEQ_CST))
+	{
+		int err = m_err;
+		Send(DestChn, type, 0, NULL, priority, 0, MQ_FLAG_LOCAL);
+		m_err = err;
+	}
+
+	m_err = len + MQ_HEADERSIZE;
+	m_message.Set(IPC_STATUS_SENT);
+	return m_err;
+}
+
+// receive a message from my in-process queue without blocking
+// @param msg		the buffer for the message header and its inline data
+// @param payload (out)	the pointer to the message data
+// @return			true for a message received
+bool MsgQ::ReceiveLocal(mq_buffer* msg, char** payload)
+{
+	for (int p = MSG_PRIORITY_URGENT; p >= MSG_PRIORITY_LOW; p--)
+	{
+		mq_local_ring* ring = m_local->rings + p;
+		size_t pos = ring->tail.load(memory_order_relaxed);
+		mq_local_slot* slot = NULL;
+		while (true)
+		{
+			slot = ring->slots + (pos & (MQ_LOCAL_SLOTS - 1));
+			intptr_t dif = static_cast<intptr_t>(slot->seq.load(memory_order_acquire)) - static_cast<intptr_t>(pos + 1);
+			if (dif == 0)
+			{
+				if (ring->tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (dif < 0)
+			{
+				slot = NULL; // empty
+				break;
+			}
+			else
+			{
+				pos = ring->tail.load(memory_order_relaxed);
+			}
+		}
+
+		if (!slot)
+		{
+			continue;
+		}
+
+		// the inline data is copied out before the slot is released, the long data is taken by swapping the buffers
+		memcpy(msg, slot->data, MQ_HEADERSIZE);
+		if (msg->total <= MQ_LOCAL_INLINE)
+		{
+			memcpy(msg->buf, slot->data + MQ_HEADERSIZE, msg->total);
+			*payload = msg->buf;
+		}
+		else
+		{
+			m_local->big.swap(slot->big);
+			*payload = m_local->big.data();
+		}
+		m_prio = p;
+		slot->seq.store(pos + MQ_LOCAL_SLOTS, memory_order_release);
+		return true;
+	}
+
+	return false;
+}
+
+// count a failed sending in the live counters of a channel by its errno
+// @param stats		the live counters of the destnation channel
+// @param err		the errno of the sending
+static void CountSendError(ipc_channel_stats* stats, int err)
+{
+	int index = IPC_SENDERR_OTHER;
+	if (err == EAGAIN)
+	{
+		index = IPC_SENDERR_AGAIN;
+	}
+	else if (err == ETIMEDOUT)
+	{
+		index = IPC_SENDERR_TIMEDOUT;
+	}
+	else if (err == EINTR)
+	{
+		index = IPC_SENDERR_INTR;
+	}
+	else if (err == EMSGSIZE)
+	{
+		index = IPC_SENDERR_MSGSIZE;
+	}
+	else if (err == EBADF)
+	{
+		index = IPC_SENDERR_BADF;
+	}
+	__atomic_fetch_add(&stats->send_failures[index], 1, __ATOMIC_RELAXED);
+}
+
+// get the highest priority of the messages in my in-process queue
+// @return			the priority, -1 for empty
+int MsgQ::PeekLocal()
+{
+	for (int p = MSG_PRIORITY_URGENT; p >= MSG_PRIORITY_LOW; p--)
+	{
+		mq_local_ring* ring = m_local->rings + p;
+		size_t pos = ring->tail.load(memory_order_relaxed);
+		if (ring->slots[pos & (MQ_LOCAL_SLOTS - 1)].seq.load(memory_order_acquire) == pos + 1)
+		{
+			return p;
+		}
+	}
+	return -1;
+}
+
+// take the head of my kernel queue without blocking and hold it, so that it is received after the higher in-process messages
+void MsgQ::HoldKernelMessage()
+{
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int n = mq_timedreceive(m_myChn, m_held.data(), m_held.size(), &m_heldPrio, &now);
+	if (n >= 0)
+	{
+		m_heldLen = n;
+		GrantCredit();
+	}
+}
+
+// grant a credit back to the senders for a message received from my kernel queue
+void MsgQ::GrantCredit()
+{
+	if (!m_myEntry)
+	{
+		return;
+	}
+
+	// the messages not received yet are the depth of my queue
+	uint64_t received = __atomic_fetch_add(&m_myEntry->received, 1, __ATOMIC_RELAXED);
+	int64_t depth = static_cast<int64_t>(__atomic_load_n(&m_myEntry->sent, __ATOMIC_RELAXED) - received);
+	depth = depth > m_maxMsgs ? m_maxMsgs : depth; // the senders may refill my queue after my receiving
+	if (m_myStats && depth > static_cast<int64_t>(m_myStats->depth_hwm))
+	{
+		__atomic_store_n(&m_myStats->depth_hwm, static_cast<uint32_t>(depth), __ATOMIC_RELAXED);
+	}
+}
+
+// hand the messages left in my in-process queue and the one held back to my kernel queue, so that the next receiver
+// of my channel gets them. The ones that do not fit are counted as send failures of my channel
+void MsgQ::ForwardLocal()
+{
+	if (!m_heldLen && PeekLocal() < 0)
+	{
+		return;
+	}
+
+	// my descriptor is for receiving only
+	string path = "/" + string((char*)&m_myChnName, strnlen((char*)&m_myChnName, sizeof(m_myChnName)));
+	mqd_t chn = mq_open(path.c_str(), O_WRONLY);
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	mq_buffer* msg = reinterpret_cast<mq_buffer*>(m_receiveBuffer.data());
+	char* payload = msg->buf;
+	while (m_heldLen || ReceiveLocal(msg, &payload))
+	{
+		int err = 0;
+		if (m_heldLen)
+		{
+			err = mq_timedsend(chn, m_held.data(), m_heldLen, m_heldPrio, &now) < 0 ? errno : 0;
+			m_heldLen = 0;
+		}
+		else if (msg->flags & MQ_FLAG_LOCAL)
+		{
+			continue;
+		}
+		else if (static_cast<int>(MQ_HEADERSIZE + msg->total) > m_msgSize)
+		{
+			err = EMSGSIZE; // a long message is not fragmented again
+		}
+		else
+		{
+			if (payload != msg->buf)
+			{
+				memcpy(msg->buf, payload, msg->total);
+			}
+			msg->len = msg->total;
+			err = mq_timedsend(chn, (const char*)msg, MQ_HEADERSIZE + msg->total, m_prio, &now) < 0 ? errno : 0;
+		}
+
+		if (err == 0 && m_myEntry)
+		{
+			__atomic_fetch_add(&m_myEntry->sent, 1, __ATOMIC_RELAXED);
+		}
+		else if (err && m_myStats)
+		{
+			CountSendError(m_myStats, err);
+		}
+	}
+
+	if (chn >= 0)
+	{
+		mq_close(chn);
+	}
+}
+
+// set the receiving mode. The precise mode waits with ppoll on the monotonic clock, optionally busy polling before blocking.
+// The precise mode sets the timer slack of the calling thread to 1ns, call it from the receiving thread.
+// @param precise	true for the precise mode on the monotonic clock
+// @param spin_usec	the max microseconds to busy poll before blocking in the precise mode, 0 for blocking at once
+void MsgQ::SetReceiveMode(bool precise, long spin_usec)
+{
+	m_precise = precise;
+	m_spin = spin_usec < 0 ? 0 : spin_usec;
+
+	// the default timer slack of 50us would delay every timeout of ppoll
+	if (precise)
+	{
+		prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+	}
+}
+
+// receive a message of my queue in the precise mode, busy polling for the spin budget then blocking in ppoll
+// @param buffer	the receiving buffer
+// @param size		the size of the receiving buffer
+// @param deadline	the deadline in CLOCK_MONOTONIC nanoseconds
+// @return			the size of the message received, -1 for error with errno ETIMEDOUT at the deadline
+int MsgQ::ReceivePrecise(char* buffer, size_t size, uint64_t deadline)
+{
+	static const timespec past = {0, 0}; // mq_timedreceive returns at once for an empty queue
+	uint64_t now = GetMonotonicTime();
+	uint64_t spin = now + m_spin * 1000ULL;
+	while (true)
+	{
+		int n = mq_timedreceive(m_myChn, buffer, size, &m_prio, &past);
+		if (n >= 0 || errno != ETIMEDOUT)
+		{
+			return n;
+		}
+
+		now = GetMonotonicTime();
+		if (now >= deadline)
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		// the senders increase my sent counter right after a message is queued, polling it takes no system call
+		if (now < spin && m_myEntry)
+		{
+			uint64_t sent = __atomic_load_n(&m_myEntry->sent, __ATOMIC_ACQUIRE);
+			while (__atomic_load_n(&m_myEntry->sent, __ATOMIC_ACQUIRE) == sent && now < spin && now < deadline)
+			{
+#if defined(__x86_64__) || defined(__i386__)
+				__builtin_ia32_pause();
+#endif
+				now = GetMonotonicTime();
+			}
+			continue;
+		}
+
+		// ppoll sleeps on the monotonic clock with the resolution of high resolution timers
+		timespec left;
+		left.tv_sec = (deadline - now) / 1000000000ULL;
+		left.tv_nsec = (deadline - now) % 1000000000ULL;
+		pollfd fd;
+		fd.fd = m_myChn;
+		fd.events = POLLIN;
+		fd.revents = 0;
+		if (ppoll(&fd, 1, &left, NULL) < 0 && errno != EINTR)
+		{
+			return -1;
+		}
+	}
+}
+
+// get the descriptor of a destnation queue, it is opened when not yet. It can be polled by epoll for queue space
+// @param DestChn	the destnation channel, 0 for the last sender, 1 for main
+// @return			the descriptor, negtive for error code
+int MsgQ::GetChannelFd(int DestChn)
+{
+	DestChn = DestChn == 0 ? __atomic_load_n(&m_lastChn, __ATOMIC_ACQUIRE) : DestChn;
+	if (DestChn <= 0 || DestChn > m_totalChannels)
+	{
+		m_err = -3;
+		m_message = "invalid dest ID";
+		return m_err;
+	}
+
+	if (m_Channels[DestChn] < 0 && OpenChannel(DestChn) < 0)
+	{
+		return m_err;
+	}
+	return m_Channels[DestChn];
+}
+
+// get the directory entry of a channel
+// @param channel	the channel number
+// @return			the directory entry, NULL for not found
+mq_directory_entry* MsgQ::GetChannelEntry(int channel)
+{
+	if (!m_ChnEntry[channel])
+	{
+		m_ChnEntry[channel] = LookupDirectory(m_ChnNames[channel], false);
+	}
+	return m_ChnEntry[channel];
+}
+
+// count a failed sending to a channel by its errno
+// @param channel	the destnation channel
+// @param err		the errno of the sending
+void MsgQ::CountSendFailure(int channel, int err)
+{
+	if (!m_ChnStats[channel])
+	{
+		m_ChnStats[channel] = GetChannelStats(m_ChnNames[channel]);
+	}
+	if (m_ChnStats[channel])
+	{
+		CountSendError(m_ChnStats[channel], err);
+	}
+	errno = err; // the errno is kept for the error message
+}
+
+// send a message through the send queue, it is queued when the destnation has no credits
+// @param DestChn	the destnation channel
+// @param buffer	the message with its header
+// @param size		the size of the message
+// @param priority	the priority of the message
+// @return			0 for sent, 1 for queued, negtive for error code
+int MsgQ::QueueSend(int DestChn, const char* buffer, int size, unsigned int priority)
+{
+	mq_send_queue* q = m_sendQueue.get();
+	mq_directory_entry* entry = GetChannelEntry(DestChn);
+	lock_guard<mutex> lock(q->lock);
+
+	// without the thread, the queue is retried by the sending
+	if (!q->running && !q->queue.empty())
+	{
+		RetrySendQueue(q);
+	}
+
+	// send it directly when nothing of the same or higher priority is waiting for the destnation and it has credits
+	bool waiting = false;
+	for (size_t i = 0; q->pending[DestChn] && i < q->queue.size() && !waiting; i++)
+	{
+		waiting = q->queue[i].channel == DestChn && q->queue[i].priority >= priority;
+	}
+	if (!waiting && GetEntryCredits(entry, priority) != 0)
+	{
+		timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (mq_timedsend(m_Channels[DestChn], buffer, size, priority, &now) == 0)
+		{
+			if (entry)
+			{
+				__atomic_fetch_add(&entry->sent, 1, __ATOMIC_RELAXED);
+			}
+			return 0;
+		}
+
+		if (errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR)
+		{
+			return -1;
+		}
+	}
+
+	if (static_cast<int>(q->queue.size()) >= q->depth)
+	{
+		errno = ENOBUFS;
+		m_err = -6;
+		m_message = "the send queue is full";
+		return m_err;
+	}
+
+	mq_pending_send pending;
+	pending.channel = DestChn;
+	pending.chn = m_Channels[DestChn];
+	pending.priority = priority;
+	pending.entry = entry;
+	pending.data.assign(buffer, buffer + size);
+	q->queue.push_back(std::move(pending));
+	q->pending[DestChn]++;
+	q->cond.notify_one();
+	return 1;
+}
+
+// enable the bounded send queue. The sending never blocks, messages without credits are queued and retried in order.
+// @param depth		the max number of messages in the send queue, 0 to send without the queue
+// @param async		true to retry the queue by a thread of this MsgQ, false to retry it by FlushSendQueue() and the sending
+// @return			0 on success, negtive for error code
+int MsgQ::EnableSendQueue(int depth, bool async)
+{
+	if (depth < 0)
+	{
+		m_err = -1;
+		m_message = "invalid depth of the send queue";
+		return m_err;
+	}
+
+	if (!m_sendQueue)
+	{
+		m_sendQueue = make_shared<mq_send_queue>();
+		memset(m_sendQueue->pending, 0, sizeof(m_sendQueue->pending));
+	}
+
+	{
+		lock_guard<mutex> lock(m_sendQueue->lock);
+		m_sendQueue->depth = depth;
+		if (async && !m_sendQueue->running)
+		{
+			m_sendQueue->running = true;
+			m_sendQueue->worker = thread(RunSendQueue, m_sendQueue.get());
+		}
+	}
+
+	m_err = 0;
+	m_message = "send queue of " + to_string(depth) + " messages is enabled";
+	return m_err;
+}
+
+// retry the messages in the send queue
+// @return			the number of messages remained in the send queue
+int MsgQ::FlushSendQueue()
+{
+	if (!m_sendQueue)
+	{
+		return 0;
+	}
+
+	lock_guard<mutex> lock(m_sendQueue->lock);
+	return RetrySendQueue(m_sendQueue.get());
+}
+
+// get the number of messages waiting in the send queue
+// @return			the number of messages in the send queue
+int MsgQ::GetPendingSends()
+{
+	if (!m_sendQueue)
+	{
+		return 0;
+	}
+
+	lock_guard<mutex> lock(m_sendQueue->lock);
+	return m_sendQueue->queue.size();
+}
+
+// get the credits of a destnation, the number of messages it can take without blocking
+// @param DestChn	the destnation channel, 0 for the last sender, 1 for main
+// @param priority	the priority of the messages, those below MSG_PRIORITY_HIGH do not get the reserved credits
+// @return			the credits, negtive for unknown
+int MsgQ::GetCredits(int DestChn, int priority)
+{
+	DestChn = DestChn == 0 ? __atomic_load_n(&m_lastChn, __ATOMIC_ACQUIRE) : DestChn;
+	if (DestChn <= 0 || DestChn > m_totalChannels)
+	{
+		return -1;
+	}
+
+	return GetEntryCredits(GetChannelEntry(DestChn), priority < MSG_PRIORITY_LOW ? MSG_PRIORITY_URGENT : priority);
+}
+
+// check the backpressure of a destnation
+// @param DestChn	the destnation channel, 0 for the last sender, 1 for main
+// @return			true when the destnation has no credit or messages to it are waiting in the send queue
+bool MsgQ::IsBackpressured(int DestChn)
+{
+	DestChn = DestChn == 0 ? __atomic_load_n(&m_lastChn, __ATOMIC_ACQUIRE) : DestChn;
+	if (GetCredits(DestChn) == 0)
+	{
+		return true;
+	}
+
+	if (!m_sendQueue || DestChn <= 0 || DestChn > m_totalChannels)
+	{
+		return false;
+	}
+
+	lock_guard<mutex> lock(m_sendQueue->lock);
+	return m_sendQueue->pending[DestChn] > 0;
+}
+
+// map the conflation table of a channel
+// @param name		the channel name in uint64_t style
+// @param keys		the number of slots to create the table, 0 to map an existing one
+// @return			the table, NULL for not conflating
+mq_conflation* MsgQ::MapConflation(uint64_t name, uint32_t keys)
+{
+	string path = "/cfl." + string((char*)&name, strnlen((char*)&name, sizeof(name)));
+	int fd = shm_open(path.c_str(), keys ? O_CREAT | O_RDWR : O_RDWR, 0666);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	// the receiver never shrinks a table, senders may have mapped it
+	struct stat st;
+	size_t size = offsetof(mq_conflation, slots) + keys * sizeof(mq_conflation_slot);
+	if (fstat(fd, &st) < 0 || (static_cast<size_t>(st.st_size) < size && ftruncate(fd, size) < 0))
+	{
+		close(fd);
+		return NULL;
+	}
+	size = static_cast<size_t>(st.st_size) > size ? st.st_size : size;
+
+	void* base = size > offsetof(mq_conflation, slots) ? mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	// the table is initialized only by the receiver creating it, the senders may be writing an existing one.
+	// A table of another layout, or one left half initialized, is initialized again.
+	mq_conflation* table = static_cast<mq_conflation*>(base);
+	if (keys && (__atomic_load_n(&table->ready, __ATOMIC_ACQUIRE) != 1 || table->version != MQ_CONFLATION_VERSION))
+	{
+		__atomic_store_n(&table->ready, 2, __ATOMIC_RELEASE);
+		memset(table->slots, 0, size - offsetof(mq_conflation, slots));
+		table->version = MQ_CONFLATION_VERSION;
+		table->size = (size - offsetof(mq_conflation, slots)) / sizeof(mq_conflation_slot);
+		__atomic_store_n(&table->ready, 1, __ATOMIC_RELEASE);
+	}
+	else if (__atomic_load_n(&table->ready, __ATOMIC_ACQUIRE) != 1 || table->version != MQ_CONFLATION_VERSION
+		|| offsetof(mq_conflation, slots) + table->size * sizeof(mq_conflation_slot) > size)
+	{
+		munmap(base, size);
+		return NULL;
+	}
+
+	return table;
+}
+
+// enable the conflation of my channel. A conflated message replaces the not yet received one with the same key in place,
+// so that the queue holds at most one doorbell for each key and a slow receiver gets only the latest values.
+// @param keys		the max number of keys of a new table, rounded up to power of 2
+// @return			0 on success, negtive for error code
+int MsgQ::EnableConflation(int keys)
+{
+	if (keys <= 0 || keys > 65536)
+	{
+		m_err = -1;
+		m_message = "invalid number of conflation keys, 1-65536";
+		return m_err;
+	}
+
+	if (m_conflation)
+	{
+		m_err = -2;
+		m_message = "conflation is enabled already";
+		return m_err;
+	}
+
+	uint32_t size = 1;
+	while (size < static_cast<uint32_t>(keys))
+	{
+		size <<= 1;
+	}
+
+	mq_conflation* table = MapConflation(m_myChnName, size);
+	if (!table)
+	{
+		m_err = -3;
+		m_message = "cannot map the conflation table";
+		return m_err;
+	}
+
+	m_conflation = make_shared<mq_conflation_state>();
+	m_conflation->table = table;
+	m_conflation->mapsize = offsetof(mq_conflation, slots) + table->size * sizeof(mq_conflation_slot);
+	m_conflation->delivered.assign(table->size, 0);
+	m_conflation->buffer.resize(sizeof(table->slots[0].buf));
+
+	m_err = 0;
+	m_message = "conflation of " + to_string(table->size) + " keys is enabled";
+	return m_err;
+}
+
+// send a latest-state message to a conflating destnation. An unreceived message with the same key is replaced.
+// @param DestChn	the destnation channel, 0 for the last sender, 1 for main
+// @param key		the key of the state, for example the ID of the updated element
+// @param type		the type of the message, for example MSG_UPDATE (16)
+// @param len		the length of the message net data, 0-984
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @return			bytes of data sent or conflated, positive for success, negtive for error code.
+//					-6 when another sender has been writing the slot for MQ_CONFLATION_TIMEOUT
+int MsgQ::SendConflated(int DestChn, uint64_t key, int type, int len, void* data)
+{
+	DestChn = DestChn == 0 ? __atomic_load_n(&m_lastChn, __ATOMIC_ACQUIRE) : DestChn;
+	if (DestChn <= 0 || DestChn > m_totalChannels)
+	{
+		m_err = -3;
+		m_message = "invalid dest ID";
+		return m_err;
+	}
+
+	if (type <= 0 || type > 255 || len < 0 || len > static_cast<int>(sizeof(mq_conflation_slot::buf)))
+	{
+		m_err = -2;
+		m_message = "invalid conflated message type or length";
+		return m_err;
+	}
+
+	// a destnation not conflating gets a plain message
+	if (!m_ChnConflation[DestChn])
+	{
+		m_ChnConflation[DestChn] = MapConflation(m_ChnNames[DestChn], 0);
+		if (!m_ChnConflation[DestChn])
+		{
+			return SendMsg(DestChn, type, len, data);
+		}
+	}
+
+	// linear probing from the hashed slot. Slots are claimed by compare and swap and never released
+	mq_conflation* table = m_ChnConflation[DestChn];
+	mq_conflation_slot* slot = NULL;
+	uint32_t hash = HashName(key + 1, __builtin_ctz(table->size));
+	uint32_t index = 0;
+	for (uint32_t i = 0; i < table->size && !slot; i++)
+	{
+		index = (hash + i) & (table->size - 1);
+		uint64_t k = __atomic_load_n(&table->slots[index].key, __ATOMIC_ACQUIRE);
+		if (k == 0)
+		{
+			uint64_t expected = 0;
+			if (__atomic_compare_exchange_n(&table->slots[index].key, &expected, key + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				k = key + 1;
+			}
+			else
+			{
+				k = expected;
+			}
+		}
+		slot = k == key + 1 ? table->slots + index : NULL;
+	}
+
+	if (!slot)
+	{
+		m_err = -5;
+		m_message = "too many keys for the conflation table";
+		return m_err;
+	}
+
+	// the writers of a slot are serialized by turning the seq odd, the claim of a sender that died is broken
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	while ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		if (seq & 1)
+		{
+			uint32_t pid = WaitSeqClaim(&slot->seq, &slot->owner, seq, MQ_CONFLATION_TIMEOUT);
+			if (pid)
+			{
+				m_err = -6;
+				m_message = "the conflation slot is held by process " + to_string(pid);
+				return m_err;
+			}
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_store_n(&slot->owner, static_cast<uint32_t>(getpid()), __ATOMIC_RELAXED);
+
+	slot->name = m_myChnName;
+	slot->ts = GetMonotonicTime();
+	slot->type = type;
+	slot->len = len;
+	if (len)
+	{
+		memcpy(slot->buf, data, len);
+	}
+	__atomic_store_n(&slot->owner, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+	ipc_record_log* log = GetRecordLog();
+	if (log)
+	{
+		RecordMessage(log, m_myChnName, m_ChnNames[DestChn], type, len, data, GetDefaultPriority(type), 0, 0, slot->ts);
+	}
+
+	// only the sender turning the slot pending rings the doorbell
+	if (__atomic_exchange_n(&slot->pending, 1, __ATOMIC_SEQ_CST) == 0
+		&& Send(DestChn, type, 0, NULL, MSG_PRIORITY_DEFAULT, index, MQ_FLAG_CONFLATED) < 0)
+	{
+		__atomic_store_n(&slot->pending, 0, __ATOMIC_SEQ_CST);
+		return m_err;
+	}
+
+	m_err = len + MQ_HEADERSIZE;
+	m_message = "message conflated";
+	return m_err;
+}
+
+// send a latest-state message to a conflating destnation. An unreceived message with the same key is replaced.
+// @param DestName	the destnation name in string, 1-8 characters
+// @param key		the key of the state, for example the ID of the updated element
+// @param type		the type of the message, for example MSG_UPDATE (16)
+// @param len		the length of the message net data, 0-984
+// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+// @return			the destnation channel, positive for success, negtive for error code
+int MsgQ::SendConflated(string DestName, uint64_t key, int type, int len, void* data)
+{
+	int chn = GetDestChannel(DestName);
+	if (chn > 0 && SendConflated(chn, key, type, len, data) < 0)
+	{
+		return -1;
+	}
+	return chn;
+}
+
+// read the latest value of the slot rung by a doorbell into the conflation buffer
+// @param msg		the doorbell, its header is updated to the conflated message
+// @return			true for a new value, false for one received already
+bool MsgQ::ReadConflated(mq_buffer* msg)
+{
+	mq_conflation_state* c = m_conflation.get();
+	if (!c || msg->corr >= c->table->size)
+	{
+		return false;
+	}
+
+	// clear the pending before reading, a later writer rings again. A value read twice is dropped by its seq
+	mq_conflation_slot* slot = c->table->slots + msg->corr;
+	__atomic_store_n(&slot->pending, 0, __ATOMIC_SEQ_CST);
+
+	uint32_t seq;
+	do
+	{
+		// a sender alive holding the slot for so long rings again when it is done
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+		{
+			if (WaitSeqClaim(&slot->seq, &slot->owner, seq, MQ_CONFLATION_TIMEOUT))
+			{
+				return false;
+			}
+			continue;
+		}
+
+		msg->name = slot->name;
+		msg->ts = slot->ts;
+		msg->type = slot->type;
+		msg->len = slot->len > c->buffer.size() ? c->buffer.size() : slot->len;
+		memcpy(c->buffer.data(), slot->buf, msg->len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq);
+
+	msg->total = msg->len;
+	msg->offset = 0;
+	if (seq == c->delivered[msg->corr])
+	{
+		return false;
+	}
+
+	c->delivered[msg->corr] = seq;
+	return true;
+}
+
+// send a blob handle to the destnation. One reference of the blob is transferred to the receiver.
+// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+// @param handle	the handle of the blob allocated in BlobPool
+// @param type		the type of the message, MSG_BLOB by default
+// @return			bytes of data actually sent, positive for success, negtive for error code. The caller keeps the reference on error.
+int MsgQ::SendBlob(int DestChn, uint64_t handle, int type)
+{
+	return SendMsg(DestChn, type, sizeof(handle), &handle);
+}
+
+// send a blob handle to the destnation. One reference of the blob is transferred to the receiver.
+// @param DestName	the destnation name, empty for reply to the last sender
+// @param handle	the handle of the blob allocated in BlobPool
+// @param type		the type of the message, MSG_BLOB by default
+// @return			the destnation channel, positive for success, negtive for error code. The caller keeps the reference on error.
+int MsgQ::SendBlob(string DestName, uint64_t handle, int type)
+{
+	return SendMsg(DestName, type, sizeof(handle), &handle);
+}
+
+// clear a message queue
+// @param DestName	the destnation name, empty for my channel name
+// @return 		0 on success, negtive for error code
+int MsgQ::ClearQueue(string DestName)
+{
+	m_message.clear();
+	if (DestName.empty())
+	{
+		DestName.assign((char*)&m_myChnName, strnlen((char*)&m_myChnName, sizeof(m_myChnName)));
+	}
+	DestName = "/" + DestName;
+	
+	mqd_t Chn = mq_open(DestName.c_str(), O_RDONLY | O_NONBLOCK);
+	if (Chn < 0)
+	{
+		m_err = -1;
+
+		if (errno == EACCES)
+		{
+			m_message = "Access denied";
+		}
+		else if (errno == EMFILE || errno == ENFILE)
+		{
+			m_message = "Too many message queue opened";
+		}
+		else if (errno == ENAMETOOLONG)
+		{
+			m_message = "name was too long";
+		}
+		else if (errno == ENOENT)
+		{
+			m_message = "no queue with this name exists";
+			m_err = 0;
+		}
+
+		return m_err;
+	}
+	
+	// the queue to be cleared may have a larger message size than mine. The credits are granted back to its senders
+	uint64_t n = 0;
+	memcpy(&n, DestName.c_str() + 1, DestName.length() - 1 > 8 ? 8 : DestName.length() - 1);
+	mq_directory_entry* entry = LookupDirectory(n, false);
+	vector<char> buffer(GetQueueMsgSize(Chn));
+	do
+	{
+		m_err = mq_receive(Chn, buffer.data(), buffer.size(), 0);
+		if (m_err >= 0 && entry)
+		{
+			__atomic_fetch_add(&entry->received, 1, __ATOMIC_RELAXED);
+		}
+	} while (m_err >= 0);
+	
+	return mq_close(Chn);
+}
+
+// create a request/reply client over a message queue
+// @param queue		the message queue to send requests and receive replies, owned by the caller
+RpcClient::RpcClient(MsgQ* queue)
+{
+	m_queue = queue;
+	m_buffer.resize(MAX_FRAGMENTEDLENGTH);
+}
+
+RpcClient::~RpcClient()
+{
+	// the pending requests are cancelled
+	map<uint32_t, rpc_pending> pending;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		pending.swap(m_pending);
+	}
+
+	for (map<uint32_t, rpc_pending>::iterator it = pending.begin(); it != pending.end(); ++it)
+	{
+		RpcReply reply = {RPC_ERR_CANCELLED, 0, vector<char>()};
+		Complete(it->second, reply);
+	}
+}
+
+// send a request and add it to the pending list
+// @return			the ID of the request, 0 when the request could not be sent
+uint32_t RpcClient::Send(int DestChn, int type, int len, void* data, long timeout_usec, int priority, rpc_pending& pending)
+{
+	uint32_t id = ++m_lastId;
+	if (id == 0)
+	{
+		id = ++m_lastId; // 0 is reserved for the plain messages
+	}
+
+	pending.deadline = GetMonotonicTime() + timeout_usec * 1000ULL;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_pending[id] = pending;
+	}
+
+	if (m_queue->SendRequest(DestChn, id, type, len, data, priority) < 0)
+	{
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_pending.erase(id);
+		}
+
+		return Fail(pending, RPC_ERR_SEND, "request cannot be sent: " + m_queue->GetErrorMessage());
+	}
+
+	m_err = 0;
+	m_message = "request " + to_string(id) + " sent";
+	return id;
+}
+
+// fail a request that was not sent, it is completed with the failure
+// @return			0 for no request ID
+uint32_t RpcClient::Fail(rpc_pending& pending, int status, string message)
+{
+	m_err = status;
+	m_message = message;
+	RpcReply reply = {status, 0, vector<char>()};
+	Complete(pending, reply);
+	return 0;
+}
+
+// send a request, its completion is notified by the future
+// @return			the future of the reply. Its status is RPC_ERR_SEND when the request could not be sent
+future<RpcReply> RpcClient::Call(int DestChn, int type, int len, void* data, long timeout_usec, int priority)
+{
+	rpc_pending pending;
+	pending.result = make_shared<promise<RpcReply>>();
+	future<RpcReply> result = pending.result->get_future();
+	Send(DestChn, type, len, data, timeout_usec, priority, pending);
+	return result;
+}
+
+// send a request, its completion is notified by the future
+// @return			the future of the reply. Its status is RPC_ERR_DEST for an unknown destnation, RPC_ERR_SEND when the request could not be sent
+future<RpcReply> RpcClient::Call(string DestName, int type, int len, void* data, long timeout_usec, int priority)
+{
+	int chn = m_queue->GetDestChannel(DestName);
+	if (chn < 0)
+	{
+		rpc_pending pending;
+		pending.result = make_shared<promise<RpcReply>>();
+		future<RpcReply> result = pending.result->get_future();
+		Fail(pending, RPC_ERR_DEST, "unknown destnation " + DestName);
+		return result;
+	}
+	return Call(chn, type, len, data, timeout_usec, priority);
+}
+
+// send a request, its completion is notified by the callback in Poll()
+// @return			the ID of the request, 0 when the request could not be sent and the callback has been called
+uint32_t RpcClient::Call(int DestChn, int type, int len, void* data, long timeout_usec, RpcCallback callback, int priority)
+{
+	rpc_pending pending;
+	pending.callback = callback;
+	return Send(DestChn, type, len, data, timeout_usec, priority, pending);
+}
+
+// send a request, its completion is notified by the callback in Poll()
+// @return			the ID of the request, 0 when the destnation is unknown or the request could not be sent, and the callback has been called
+uint32_t RpcClient::Call(string DestName, int type, int len, void* data, long timeout_usec, RpcCallback callback, int priority)
+{
+	int chn = m_queue->GetDestChannel(DestName);
+	if (chn < 0)
+	{
+		rpc_pending pending;
+		pending.callback = callback;
+		return Fail(pending, RPC_ERR_DEST, "unknown destnation " + DestName);
+	}
+	return Call(chn, type, len, data, timeout_usec, callback, priority);
+}
+
+// complete a request, called outside the lock
+// @param pending	the pending request
+// @param reply		the reply or the failure
+void RpcClient::Complete(rpc_pending& pending, RpcReply& reply)
+{
+	if (pending.callback)
+	{
+		pending.callback(reply);
+	}
+	else if (pending.result)
+	{
+		pending.result->set_value(std::move(reply));
+	}
+}
+
+// cancel a request, it is completed with RPC_ERR_CANCELLED
+// @param id		the ID of the request
+// @return			0 on success, negtive for no such a pending request
+int RpcClient::Cancel(uint32_t id)
+{
+	rpc_pending pending;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		map<uint32_t, rpc_pending>::iterator it = m_pending.find(id);
+		if (it == m_pending.end())
+		{
+			return -1;
+		}
+		pending = it->second;
+		m_pending.erase(it);
+	}
+
+	RpcReply reply = {RPC_ERR_CANCELLED, 0, vector<char>()};
+	Complete(pending, reply);
+	return 0;
+}
+
+// complete the requests timed out
+void RpcClient::Expire()
+{
+	uint64_t now = GetMonotonicTime();
+	vector<rpc_pending> expired;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		for (map<uint32_t, rpc_pending>::iterator it = m_pending.begin(); it != m_pending.end();)
+		{
+			if (it->second.deadline <= now)
+			{
+				expired.push_back(it->second);
+				m_pending.erase(it++);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < expired.size(); i++)
+	{
+		RpcReply reply = {RPC_ERR_TIMEOUT, 0, vector<char>()};
+		Complete(expired[i], reply);
+	}
+}
+
+// receive a message, dispatch the replies and expire the requests timed out
+// @return					the sender channel of other messages, 0 for no message or a reply dispatched, negtive for error code
+int RpcClient::Poll(string* SenderName, int* type, int* len, void* data, int size)
+{
+	*len = 0;
+	int chn = m_queue->ReceiveMsg(SenderName, type, len, m_buffer.data(), m_buffer.size());
+	if (chn > 0 && (m_queue->GetMsgFlags() & MQ_FLAG_REPLY))
+	{
+		// dispatch the reply to its request. A late reply of a request timed out or cancelled is dropped
+		rpc_pending pending;
+		bool found = false;
+		{
+			lock_guard<mutex> lock(m_mutex);
+			map<uint32_t, rpc_pending>::iterator it = m_pending.find(m_queue->GetMsgCorrelation());
+			if (it != m_pending.end())
+			{
+				pending = it->second;
+				m_pending.erase(it);
+				found = true;
+			}
+		}
+
+		if (found)
+		{
+			RpcReply reply = {chn, *type, vector<char>(m_buffer.begin(), m_buffer.begin() + *len)};
+			Complete(pending, reply);
+		}
+		*len = 0;
+		chn = 0;
+	}
+	Expire();
+
+	if (chn <= 0)
+	{
+		m_err = chn;
+		m_message = m_queue->GetErrorMessage();
+		return chn;
+	}
+
+	// other messages are returned to the caller
+	if (*len > size)
+	{
+		m_err = -5;
+		m_message = "message of " + to_string(*len) + " bytes is larger than the receiving buffer";
+		return m_err;
+	}
+	memcpy(data, m_buffer.data(), *len);
+	m_err = chn;
+	return chn;
+}
+
+// get the number of requests waiting for their replies
+// @return			the number of pending requests
+int RpcClient::GetPending()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_pending.size();
+}
+
+MsgDispatcher::MsgDispatcher() : m_buf(MAX_MESSAGELENGTH)
+{
+}
+
+// register the handler of a type
+// @param type		the type of the message, 1-255
+// @param size		the size of the message
+// @param h			the handler
+void MsgDispatcher::Register(int type, int size, RawHandler h)
+{
+	m_table[type].size = size;
+	m_table[type].handler = h;
+	if (m_buf.size() < static_cast<size_t>(size))
+	{
+		m_buf.resize(size);
+	}
+}
+
+// receive a message and dispatch it
+// @param q			the queue to receive
+// @param wait		true to wait for a message by the timeout of the queue, false to return at once
+// @return			the sender channel when the message is dispatched, 0 for no message, negtive for error code
+int MsgDispatcher::Dispatch(MsgQ& q, bool wait)
+{
+	int type = 0;
+	int len = 0;
+	int size = static_cast<int>(m_buf.size());
+	int chn = wait ? q.ReceiveMsg(&m_sender, &type, &len, m_buf.data(), size) : q.PollMsg(&m_sender, &type, &len, m_buf.data(), size);
+	if (chn <= 0)
+	{
+		return chn;
+	}
+
+	int result = Dispatch(type, len, m_buf.data(), q);
+	return result < 0 ? result : chn;
+}
+
+// dispatch a message received
+// @param type		the type of the message
+// @param len		the length of the message data
+// @param data		the message data, aligned as the heap
+// @param q			the queue the message was received by
+// @return			0 when the message is dispatched, DISPATCH_NOHANDLER or DISPATCH_BADLENGTH when it is refused
+int MsgDispatcher::Dispatch(int type, int len, const void* data, MsgQ& q)
+{
+	const dispatch_entry* entry = type > 0 && type < 256 ? m_table + type : NULL;
+	if (!entry || entry->size < 0)
+	{
+		if (!m_unknown)
+		{
+			m_refused++;
+			return DISPATCH_NOHANDLER;
+		}
+		m_unknown(type, len, data, q);
+		return 0;
+	}
+
+	if (len != entry->size)
+	{
+		m_refused++;
+		return DISPATCH_BADLENGTH;
+	}
+
+	entry->handler(type, len, data, q);
+	return 0;
+}
+
+// the size and the number of blobs in each size class
+static const uint32_t s_blobSizes[BLOB_CLASSES] = {4096, 65536, 1048576, 8388608};
+static const uint32_t s_blobCounts[BLOB_CLASSES] = {512, 128, 16, 4};
+
+// attach the blob pool, create it if not existing
+// @param title		the name of the pool, the shared memory is named as /title-blobs
+BlobPool::BlobPool(string title)
+{
+	if (!title.empty())
+	{
+		m_title.assign(title.substr(0, 15));
+	}
+	title = "/" + m_title + "-blobs";
+
+	// the layout of the pool, the pool header, the blob headers of each class, then the blob data of each class aligned to pages
+	blob_pool layout;
+	memset(&layout, 0, sizeof(layout));
+	uint64_t offset = sizeof(blob_pool);
+	for (int c = 0; c < BLOB_CLASSES; c++)
+	{
+		layout.classes[c].size = s_blobSizes[c];
+		layout.classes[c].count = s_blobCounts[c];
+		layout.classes[c].headers = offset;
+		offset += s_blobCounts[c] * sizeof(blob_header);
+	}
+	offset = (offset + 4095) & ~4095ULL;
+	for (int c = 0; c < BLOB_CLASSES; c++)
+	{
+		layout.classes[c].data = offset;
+		offset += static_cast<uint64_t>(s_blobSizes[c]) * s_blobCounts[c];
+	}
+	layout.size = offset;
+
+	// only the creator initializes the pool, others wait till it is ready
+	bool creator = true;
+	int fd = shm_open(title.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+	if (fd < 0 && errno == EEXIST)
+	{
+		creator = false;
+		fd = shm_open(title.c_str(), O_RDWR, 0666);
+	}
+	if (fd < 0)
+	{
+		m_err = -1;
+		m_message = "cannot open the blob pool " + title;
+		return;
+	}
+
+	if (creator && ftruncate(fd, layout.size) < 0)
+	{
+		close(fd);
+		m_err = -2;
+		m_message = "cannot allocate the blob pool of " + to_string(layout.size) + " bytes";
+		return;
+	}
+
+	// wait for the creator to size the pool
+	struct stat st;
+	unsigned int usecs = 0;
+	while (fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) < layout.size && usecs < 1000000)
+	{
+		usleep(100);
+		usecs += 100;
+	}
+
+	void* base = mmap(0, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		m_err = -3;
+		m_message = "cannot map the blob pool";
+		return;
+	}
+	m_pool = static_cast<blob_pool*>(base);
+
+	if (creator)
+	{
+		// chain all blobs of each class into its free list
+		memcpy(m_pool->classes, layout.classes, sizeof(layout.classes));
+		m_pool->size = layout.size;
+		for (int c = 0; c < BLOB_CLASSES; c++)
+		{
+			blob_header* headers = reinterpret_cast<blob_header*>((char*)base + layout.classes[c].headers);
+			for (uint32_t i = 0; i < s_blobCounts[c]; i++)
+			{
+				headers[i].next = i + 1 < s_blobCounts[c] ? i + 2 : 0;
+			}
+			m_pool->classes[c].head = 1;
+		}
+		m_pool->version = BLOB_VERSION;
+		__atomic_store_n(&m_pool->ready, 1, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		usecs = 0;
+		while (!__atomic_load_n(&m_pool->ready, __ATOMIC_ACQUIRE) && usecs < 1000000)
+		{
+			usleep(100);
+			usecs += 100;
+		}
+
+		if (!m_pool->ready || m_pool->version != BLOB_VERSION || m_pool->size != layout.size)
+		{
+			munmap(base, layout.size);
+			m_pool = NULL;
+			m_err = -4;
+			m_message = "the blob pool " + title + " is not ready or has a different layout";
+			return;
+		}
+	}
+
+	m_err = 0;
+	m_message = "blob pool " + title + " is attached with " + to_string(layout.size) + " bytes";
+}
+
+BlobPool::~BlobPool()
+{
+	if (m_pool)
+	{
+		munmap(m_pool, m_pool->size);
+	}
+}
+
+// get the header of a blob by its handle
+// @param handle	the handle of the blob
+// @param gen		true to check the generation of the handle
+// @return			the header of the blob, NULL for an invalid handle
+blob_header* BlobPool::GetHeader(uint64_t handle, bool gen)
+{
+	uint32_t c = static_cast<uint32_t>(handle >> 56) - 1;
+	uint32_t index = static_cast<uint32_t>(handle >> 32) & 0xFFFFFF;
+	if (!m_pool || c >= BLOB_CLASSES || index >= m_pool->classes[c].count)
+	{
+		m_err = -1;
+		m_message = "invalid blob handle";
+		return NULL;
+	}
+
+	blob_header* header = reinterpret_cast<blob_header*>((char*)m_pool + m_pool->classes[c].headers) + index;
+	if (gen && (__atomic_load_n(&header->state, __ATOMIC_ACQUIRE) >> 32) != static_cast<uint32_t>(handle))
+	{
+		m_err = -2;
+		m_message = "stale blob handle";
+		return NULL;
+	}
+
+	return header;
+}
+
+// allocate a blob with one reference
+// @param size		the size of the blob, 1 to 8MB
+// @return			the handle of the blob, 0 for error
+uint64_t BlobPool::Alloc(int size)
+{
+	if (!m_pool || size <= 0 || static_cast<uint32_t>(size) > s_blobSizes[BLOB_CLASSES - 1])
+	{
+		m_err = -1;
+		m_message = "invalid blob size";
+		return 0;
+	}
+
+	for (uint32_t c = 0; c < BLOB_CLASSES; c++)
+	{
+		blob_class* bc = m_pool->classes + c;
+		if (bc->size < static_cast<uint32_t>(size))
+		{
+			continue;
+		}
+
+		// pop the first free blob, the tag in the high 32 bits prevents the ABA problem
+		blob_header* headers = reinterpret_cast<blob_header*>((char*)m_pool + bc->headers);
+		uint64_t head = __atomic_load_n(&bc->head, __ATOMIC_ACQUIRE);
+		while (static_cast<uint32_t>(head))
+		{
+			uint32_t index = static_cast<uint32_t>(head) - 1;
+			uint64_t next = __atomic_load_n(&headers[index].next, __ATOMIC_RELAXED);
+			uint64_t newhead = (((head >> 32) + 1) << 32) | next;
+			if (__atomic_compare_exchange_n(&bc->head, &head, newhead, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				blob_header* header = headers + index;
+				uint32_t gen = static_cast<uint32_t>(__atomic_load_n(&header->state, __ATOMIC_RELAXED) >> 32) + 1;
+				header->size = size;
+				__atomic_store_n(&header->state, (static_cast<uint64_t>(gen) << 32) | 1, __ATOMIC_RELEASE);
+
+				m_err = 0;
+				m_message = "blob allocated";
+				return (static_cast<uint64_t>(c + 1) << 56) | (static_cast<uint64_t>(index) << 32) | gen;
+			}
+		}
+	}
+
+	m_err = -2;
+	m_message = "the blob pool is exhausted for size " + to_string(size);
+	return 0;
+}
+
+// add a reference to a blob
+// @param handle	the handle of the blob
+// @return			the reference count after adding, negtive for error code
+int BlobPool::AddRef(uint64_t handle)
+{
+	blob_header* header = GetHeader(handle);
+	if (!header)
+	{
+		return m_err;
+	}
+
+	// the generation and the references are compared and swapped together, the blob may be reallocated meanwhile
+	uint64_t state = __atomic_load_n(&header->state, __ATOMIC_RELAXED);
+	do
+	{
+		if ((state >> 32) != static_cast<uint32_t>(handle) || static_cast<uint32_t>(state) == 0)
+		{
+			m_err = -3;
+			m_message = "the blob has been released";
+			return m_err;
+		}
+	} while (!__atomic_compare_exchange_n(&header->state, &state, state + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	m_err = 0;
+	return static_cast<uint32_t>(state) + 1;
+}
+
+// release a reference of a blob. The blob is returned to the pool when its last reference is released.
+// @param handle	the handle of the blob
+// @return			the reference count remained, 0 when the blob is returned to the pool, negtive for error code
+int BlobPool::Release(uint64_t handle)
+{
+	blob_header* header = GetHeader(handle);
+	if (!header)
+	{
+		return m_err;
+	}
+
+	// the generation and the references are compared and swapped together, the blob may be reallocated meanwhile
+	uint64_t state = __atomic_load_n(&header->state, __ATOMIC_RELAXED);
+	do
+	{
+		if ((state >> 32) != static_cast<uint32_t>(handle) || static_cast<uint32_t>(state) == 0)
+		{
+			m_err = -3;
+			m_message = "the blob has been released";
+			return m_err;
+		}
+	} while (!__atomic_compare_exchange_n(&header->state, &state, state - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	m_err = 0;
+	uint32_t refs = static_cast<uint32_t>(state);
+	if (refs > 1)
+	{
+		return refs - 1;
+	}
+
+	// the last reference is released, push the blob back to the free list
+	blob_class* bc = m_pool->classes + (handle >> 56) - 1;
+	uint32_t index = static_cast<uint32_t>(handle >> 32) & 0xFFFFFF;
+	uint64_t head = __atomic_load_n(&bc->head, __ATOMIC_RELAXED);
+	uint64_t newhead;
+	do
+	{
+		__atomic_store_n(&header->next, static_cast<uint32_t>(head), __ATOMIC_RELAXED);
+		newhead = (((head >> 32) + 1) << 32) | (index + 1);
+	} while (!__atomic_compare_exchange_n(&bc->head, &head, newhead, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	m_message = "blob returned to the pool";
+	return 0;
+}
+
+// get the pointer to the data of a blob
+// @param handle	the handle of the blob
+// @return			the pointer to the data, NULL for an invalid or stale handle
+void* BlobPool::GetPtr(uint64_t handle)
+{
+	blob_header* header = GetHeader(handle);
+	if (!header)
+	{
+		return NULL;
+	}
+
+	blob_class* bc = m_pool->classes + (handle >> 56) - 1;
+	uint32_t index = static_cast<uint32_t>(handle >> 32) & 0xFFFFFF;
+	return (char*)m_pool + bc->data + static_cast<uint64_t>(index) * bc->size;
+}
+
+// get the size of a blob
+// @param handle	the handle of the blob
+// @return			the size requested at the allocation, negtive for error code
+int BlobPool::GetSize(uint64_t handle)
+{
+	blob_header* header = GetHeader(handle);
+	if (!header)
+	{
+		return m_err;
+	}
+
+	return header->size;
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+	Reset();
+}
+
+// clear all the records
+void LatencyHistogram::Reset()
+{
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		m_buckets[i].store(0, std::memory_order_relaxed);
+	}
+	m_count.store(0, std::memory_order_relaxed);
+	m_sum.store(0, std::memory_order_relaxed);
+	m_max.store(0, std::memory_order_relaxed);
+}
+
+// the bucket of a value. Values below 2^(SUBBITS+1) take one bucket each, 
+// each larger power of 2 is split into 2^SUBBITS linear sub-buckets
+// @param ns		the value
+// @return			the index of the bucket
+static inline int GetBucket(uint64_t ns)
+{
+	if (ns < (2ULL << HISTOGRAM_SUBBITS))
+	{
+		return static_cast<int>(ns);
+	}
+
+	int e = 63 - __builtin_clzll(ns); // the highest bit, at least SUBBITS+1
+	if (e >= HISTOGRAM_MAXBITS)
+	{
+		return HISTOGRAM_BUCKETS - 1;
+	}
+	int sub = static_cast<int>(ns >> (e - HISTOGRAM_SUBBITS)) & ((1 << HISTOGRAM_SUBBITS) - 1);
+	return ((e - HISTOGRAM_SUBBITS + 1) << HISTOGRAM_SUBBITS) + sub;
+}
+
+// the highest value of a bucket
+// @param bucket	the index of the bucket
+// @return			the highest value in the bucket
+static inline uint64_t GetBucketValue(int bucket)
+{
+	if (bucket < (2 << HISTOGRAM_SUBBITS))
+	{
+		return bucket;
+	}
+
+	int e = (bucket >> HISTOGRAM_SUBBITS) + HISTOGRAM_SUBBITS - 1;
+	uint64_t sub = bucket & ((1 << HISTOGRAM_SUBBITS) - 1);
+	return ((((1ULL << HISTOGRAM_SUBBITS) + sub + 1) << (e - HISTOGRAM_SUBBITS))) - 1;
+}
+
+// record a value
+// @param ns		the value in nanoseconds
+void LatencyHistogram::Record(uint64_t ns)
+{
+	m_buckets[GetBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(ns, std::memory_order_relaxed);
+
+	uint64_t max = m_max.load(std::memory_order_relaxed);
+	while (ns > max && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+	{
+	}
+}
+
+// get the mean of the values recorded
+// @return			the mean value in nanoseconds, 0 for no record
+uint64_t LatencyHistogram::GetMean()
+{
+	uint64_t count = GetCount();
+	return count ? m_sum.load(std::memory_order_relaxed) / count : 0;
+}
+
+// get the value at a percentile
+// @param percentile	the percentile, 0-100, for example 99.9 for p999
+// @return				the value in nanoseconds, the highest equivalent value of the bucket, 0 for no record
+uint64_t LatencyHistogram::GetPercentile(double percentile)
+{
+	uint64_t count = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		count += m_buckets[i].load(std::memory_order_relaxed);
+	}
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	// the rank of the percentile, at least the first record
+	uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * count + 0.5);
+	rank = rank < 1 ? 1 : (rank > count ? count : rank);
+
+	uint64_t total = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		total += m_buckets[i].load(std::memory_order_relaxed);
+		if (total >= rank)
+		{
+			uint64_t value = GetBucketValue(i);
+			uint64_t max = GetMax();
+			return value > max ? max : value;
+		}
+	}
+	return GetMax();
+}
+
+// dump the summary of the histogram
+// @param name		the name of the histogram
+// @return			a line of "name count=... mean=... p50=... p90=... p99=... p999=... max=..." in nanoseconds
+string LatencyHistogram::Dump(string name)
+{
+	return name + " count=" + to_string(GetCount()) 
+		+ " mean=" + to_string(GetMean()) 
+		+ " p50=" + to_string(GetPercentile(50)) 
+		+ " p90=" + to_string(GetPercentile(90)) 
+		+ " p99=" + to_string(GetPercentile(99)) 
+		+ " p999=" + to_string(GetPercentile(99.9)) 
+		+ " max=" + to_string(GetMax());
+}
+
+// map the live statistics, create it if not existing
+// @return			the statistics, NULL when it is not available or has a different layout
+static ipc_stats* MapStats()
+{
+	int fd = shm_open(IPC_STATSNAME, O_CREAT | O_RDWR, 0666);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	struct stat st;
+	void* base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (static_cast<size_t>(st.st_size) == sizeof(ipc_stats) || (st.st_size == 0 && ftruncate(fd, sizeof(ipc_stats)) == 0)))
+	{
+		base = mmap(0, sizeof(ipc_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	// the first user sets the version, the statistics is zero filled till then
+	ipc_stats* stats = static_cast<ipc_stats*>(base);
+	uint32_t version = 0;
+	if (!__atomic_compare_exchange_n(&stats->version, &version, IPC_STATS_VERSION, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && version != IPC_STATS_VERSION)
+	{
+		munmap(base, sizeof(ipc_stats));
+		return NULL;
+	}
+	return stats;
+}
+
+// create a new trace ID, for example for a new sensor sample. It is unique among all processes
+// @return			the trace ID, never 0
+uint64_t NewTraceID()
+{
+	if (!s_tracePid)
+	{
+		static bool s_atfork = pthread_atfork(NULL, NULL, [] { s_tracePid = 0; }) == 0;
+		(void)s_atfork;
+		s_tracePid = static_cast<uint32_t>(getpid());
+	}
+	return (static_cast<uint64_t>(s_tracePid) << 32) | (s_traceSeq.fetch_add(1, std::memory_order_relaxed) + 1);
+}
+
+// set the trace ID of the current thread. It is carried by the messages sent by the thread.
+// @param trace		the trace ID, 0 to stop carrying it
+void SetTraceID(uint64_t trace)
+{
+	t_traceId = trace;
+}
+
+// get the trace ID of the current thread
+// @return			the trace ID, 0 for none
+uint64_t GetTraceID()
+{
+	return t_traceId;
+}
+
+// get the live statistics shared by all processes, it is mapped once in a process
+// @return			the statistics, NULL when it is not available
+ipc_stats* GetStats()
+{
+	static ipc_stats* stats = MapStats();
+	return stats;
+}
+
+// look up or claim the live counters of a channel
+// @param name		the channel name in uint64_t style
+// @return			the counters, NULL when the statistics is not available or full
+ipc_channel_stats* GetChannelStats(uint64_t name)
+{
+	ipc_stats* stats = GetStats();
+	if (!stats || !name)
+	{
+		return NULL;
+	}
+
+	// linear probing from the hashed entry. Entries are claimed by compare and swap and never released
+	uint32_t slot = HashName(name, 10);
+	for (int i = 0; i < IPC_STATS_CHANNELS; i++)
+	{
+		ipc_channel_stats* entry = stats->channels + ((slot + i) & (IPC_STATS_CHANNELS - 1));
+		uint64_t expected = 0;
+		if (__atomic_compare_exchange_n(&entry->name, &expected, name, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == name)
+		{
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+// get the CLOCK_MONOTONIC time
+// @return			the monotonic time in nanoseconds, same in all processes
+uint64_t GetMonotonicTime()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return static_cast<uint64_t>(t.tv_sec) * 1000000000ULL + t.tv_nsec;
+}
+
+// format a date and time, the date and time of a second is formatted once by each thread
+// @param buf (out)	the buffer for the date and time
+// @param size		the size of the buffer
+// @param sec		the seconds since the epoch
+// @param usec		the microseconds in the second
+// @return			the length of the date and time
+static int FormatDateTime(char* buf, size_t size, time_t sec, long usec)
+{
+	// localtime_r() takes no global lock, only a new second is formatted
+	static thread_local time_t t_sec = -1;
+	static thread_local char t_prefix[32];
+	if (sec != t_sec)
+	{
+		struct tm nowtm;
+		localtime_r(&sec, &nowtm);
+		strftime(t_prefix, sizeof(t_prefix), "%Y-%m-%d %H:%M:%S", &nowtm);
+		t_sec = sec;
+	}
+	if (usec < 0 || usec > 999999 || size < 27)
+	{
+		int n = snprintf(buf, size, "%s.%06ld", t_prefix, usec);
+		return n < static_cast<int>(size) ? n : size - 1;
+	}
+
+	// 19 characters of the date and time, followed by 6 digits of the microseconds
+	memcpy(buf, t_prefix, 19);
+	buf[19] = '.';
+	for (int i = 25; i > 19; i--)
+	{
+		buf[i] = '0' + usec % 10;
+		usec /= 10;
+	}
+	buf[26] = 0;
+	return 26;
+}
 
 string GetDateTime(time_t sec, time_t usec)
 {
-	struct tm *nowtm;
-	char tmbuf[64];
 	char buf[64];
-	nowtm = localtime(&sec);
-	strftime(tmbuf, sizeof tmbuf, "%Y-%m-%d %H:%M:%S", nowtm);
-	snprintf(buf, sizeof buf, "%s.%06ld", tmbuf, usec);
+	FormatDateTime(buf, sizeof(buf), sec, usec);
 	return buf;
+}
+
+// the log rings are kept by their threads and by the writer, a ring is released after its thread exits and it is drained
+struct log_ring_holder
+{
+	shared_ptr<log_ring> ring;
+
+	~log_ring_holder()
+	{
+		if (ring)
+		{
+			ring->closed.store(true, memory_order_release);
+		}
+	}
+};
+
+static thread_local log_ring_holder t_logRing; // the log ring of the current thread
+static mutex s_logLock; // guards the list of the log rings
+static vector<shared_ptr<log_ring>> s_logRings; // the log rings of all the threads
+static atomic<bool> s_logStarted(false); // the lines are logged only when the logger is started
+static atomic<bool> s_logStop(false); // the writer is asked to stop after draining the rings
+static uint32_t s_logGeneration = 0; // increased in the child of a fork, the rings and the writer of the parent are not shared with it
+static thread* s_logWriter = NULL; // the background writer
+static int s_logFd = -1; // the file the lines are appended to, -1 for none
+static MsgQ* s_logQueue = NULL; // the queue of the writer sending the lines, NULL for none
+static string s_logDest; // the destnation of the lines sent
+static uint64_t s_logDropped = 0; // the dropped lines of the rings released
+
+// the forked child has no writer, it may start its own logger
+static void LockLogRings()
+{
+	s_logLock.lock();
+}
+
+static void UnlockLogRings()
+{
+	s_logLock.unlock();
+}
+
+static void ResetLogger()
+{
+	s_logRings.clear();
+	s_logGeneration++;
+	s_logStarted = false;
+	s_logStop = false;
+	s_logWriter = NULL; // the thread is not in the child
+	s_logQueue = NULL;
+	if (s_logFd > STDERR_FILENO)
+	{
+		close(s_logFd);
+	}
+	s_logFd = -1;
+	s_logLock.unlock();
+}
+
+// create the log ring of the current thread
+// @return			the log ring, NULL for out of memory
+static log_ring* OpenLogRing()
+{
+	// the head and the tail are in their own cache lines
+	void* mem = NULL;
+	if (posix_memalign(&mem, 64, sizeof(log_ring)))
+	{
+		return NULL;
+	}
+	shared_ptr<log_ring> ring(new (mem) log_ring(), [](log_ring* r) {r->~log_ring(); free(r);});
+	ring->generation = s_logGeneration;
+	{
+		lock_guard<mutex> lock(s_logLock);
+		s_logRings.push_back(ring);
+	}
+	t_logRing.ring = ring;
+	return ring.get();
+}
+
+// reserve a record in the log ring of the current thread
+// @param size		the size of the record with its arguments, multiple of 8
+// @return			the record, NULL when the logger is not started or the ring is full
+log_record* LogBegin(uint32_t size)
+{
+	if (!s_logStarted.load(memory_order_relaxed))
+	{
+		return NULL;
+	}
+
+	log_ring* ring = t_logRing.ring.get();
+	if ((!ring || ring->generation != s_logGeneration) && !(ring = OpenLogRing()))
+	{
+		return NULL;
+	}
+
+	// a record never wraps, the end of the ring is padded when it is too short for the record
+	uint64_t head = ring->head.load(memory_order_relaxed);
+	uint32_t pos = head & (LOG_RINGSIZE - 1);
+	uint32_t pad = pos + size > LOG_RINGSIZE ? LOG_RINGSIZE - pos : 0;
+	if (head + pad + size - ring->tail.load(memory_order_acquire) > LOG_RINGSIZE)
+	{
+		ring->dropped.store(ring->dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	if (pad >= sizeof(log_record))
+	{
+		log_record* padding = reinterpret_cast<log_record*>(ring->buf + pos);
+		padding->size = pad;
+		padding->format = NULL;
+	}
+	log_record* r = reinterpret_cast<log_record*>(ring->buf + ((head + pad) & (LOG_RINGSIZE - 1)));
+	r->size = size;
+	ring->next = head + pad + size;
+	return r;
+}
+
+// publish the record reserved to the background writer
+void LogCommit()
+{
+	log_ring* ring = t_logRing.ring.get();
+	ring->head.store(ring->next, memory_order_release);
+}
+
+// format a log record into a line. The flags, the width and the precision of a conversion are kept,
+// its length modifiers are replaced by the ones of the argument type
+// @param r			the record
+// @param buf (out)	the buffer for the line, LOG_MAXLINE bytes
+// @return			the length of the line
+static int FormatLogRecord(const log_record* r, char* buf)
+{
+	int n = FormatDateTime(buf, LOG_MAXLINE, r->ts / 1000000000ULL, r->ts % 1000000000ULL / 1000);
+	buf[n++] = ' ';
+
+	const char* arg = reinterpret_cast<const char*>(r + 1);
+	uint32_t next = 0;
+	for (const char* f = r->format; *f && n < LOG_MAXLINE - 1; f++)
+	{
+		if (*f != '%' || f[1] == '%')
+		{
+			buf[n++] = *f;
+			f += *f == '%';
+			continue;
+		}
+
+		char spec[40] = "%";
+		int k = 1;
+		const char* s = f + 1;
+		while (*s && strchr("-+ #0123456789.", *s) && k < 24)
+		{
+			spec[k++] = *s++;
+		}
+		while (*s && strchr("hlLqjzt", *s))
+		{
+			s++;
+		}
+		char conv = *s;
+		if (!conv)
+		{
+			break;
+		}
+
+		// a conversion without its argument is kept as it is
+		if (next >= r->nargs)
+		{
+			int len = s + 1 - f < LOG_MAXLINE - 1 - n ? s + 1 - f : LOG_MAXLINE - 1 - n;
+			memcpy(buf + n, f, len);
+			n += len;
+			f = s;
+			continue;
+		}
+		f = s;
+
+		char tag = r->tags[next++];
+		uint64_t v;
+		memcpy(&v, arg, 8);
+		arg += 8;
+		int room = LOG_MAXLINE - 1 - n;
+		int m = 0;
+		bool floating = strchr("fFeEgGaA", conv) != NULL;
+		if (tag == 'i' || tag == 'u')
+		{
+			if (conv == 'c')
+			{
+				strcpy(spec + k, "c");
+				m = snprintf(buf + n, room, spec, static_cast<int>(v));
+			}
+			else if (floating)
+			{
+				spec[k] = conv;
+				m = snprintf(buf + n, room, spec, tag == 'i' ? static_cast<double>(static_cast<int64_t>(v)) : static_cast<double>(v));
+			}
+			else
+			{
+				conv = strchr("oxXu", conv) ? conv : tag == 'i' ? 'd' : 'u';
+				spec[k] = 'l';
+				spec[k + 1] = 'l';
+				spec[k + 2] = conv;
+				m = snprintf(buf + n, room, spec, v);
+			}
+		}
+		else if (tag == 'd')
+		{
+			double d;
+			memcpy(&d, &v, 8);
+			spec[k] = floating ? conv : 'g';
+			m = snprintf(buf + n, room, spec, d);
+		}
+		else if (tag == 's')
+		{
+			string str(arg, v);
+			arg += (v + 7) & ~7ULL;
+			spec[k] = 's';
+			m = snprintf(buf + n, room, spec, str.c_str());
+		}
+		else
+		{
+			m = snprintf(buf + n, room, "%p", reinterpret_cast<void*>(v));
+		}
+		n += m < 0 ? 0 : m < room ? m : room - 1;
+	}
+
+	buf[n] = 0;
+	return n;
+}
+
+// write a line to the file and the destnation of the logger
+// @param line		the line
+// @param len		the length of the line
+// @param out (out)	the lines to be appended to the file
+static void WriteLogLine(char* line, int len, string* out)
+{
+	if (s_logFd >= 0)
+	{
+		out->append(line, len);
+		out->push_back('\n');
+	}
+	if (s_logQueue)
+	{
+		s_logQueue->SendMsg(s_logDest, MSG_LOG, len + 1, line, MSG_PRIORITY_LOW);
+	}
+}
+
+// drain the log ring of a thread
+// @param ring		the log ring
+// @param out (out)	the lines to be appended to the file
+static void DrainLogRing(log_ring* ring, string* out)
+{
+	char line[LOG_MAXLINE];
+	uint64_t head = ring->head.load(memory_order_acquire);
+	uint64_t tail = ring->tail.load(memory_order_relaxed);
+	while (tail < head)
+	{
+		uint32_t pos = tail & (LOG_RINGSIZE - 1);
+		const log_record* r = reinterpret_cast<const log_record*>(ring->buf + pos);
+		if (LOG_RINGSIZE - pos < sizeof(log_record))
+		{
+			tail += LOG_RINGSIZE - pos;
+			continue;
+		}
+		if (r->format)
+		{
+			WriteLogLine(line, FormatLogRecord(r, line), out);
+		}
+		tail += r->size;
+	}
+	ring->tail.store(tail, memory_order_release);
+
+	uint64_t dropped = ring->dropped.load(memory_order_relaxed);
+	if (dropped != ring->reported)
+	{
+		timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		int n = FormatDateTime(line, sizeof(line), t.tv_sec, t.tv_nsec / 1000);
+		n += snprintf(line + n, sizeof(line) - n, " %llu log lines were dropped for the log ring was full",
+			static_cast<unsigned long long>(dropped - ring->reported));
+		WriteLogLine(line, n, out);
+		ring->reported = dropped;
+	}
+}
+
+// the background writer drains the log rings in every LOG_INTERVAL, the logging threads never wait for it
+static void RunLogWriter()
+{
+	string out;
+	vector<shared_ptr<log_ring>> rings;
+	while (true)
+	{
+		bool stop = s_logStop.load(memory_order_acquire);
+		{
+			lock_guard<mutex> lock(s_logLock);
+			rings = s_logRings;
+		}
+
+		for (size_t i = 0; i < rings.size(); i++)
+		{
+			DrainLogRing(rings[i].get(), &out);
+		}
+		for (size_t done = 0; done < out.length(); )
+		{
+			ssize_t n = write(s_logFd, out.data() + done, out.length() - done);
+			if (n <= 0)
+			{
+				break;
+			}
+			done += n;
+		}
+		out.clear();
+
+		// the rings of the exited threads are released after they are drained
+		{
+			lock_guard<mutex> lock(s_logLock);
+			for (size_t i = 0; i < s_logRings.size(); )
+			{
+				log_ring* ring = s_logRings[i].get();
+				if (ring->closed.load(memory_order_acquire) && ring->head.load(memory_order_acquire) == ring->tail.load(memory_order_relaxed))
+				{
+					s_logDropped += ring->dropped.load(memory_order_relaxed);
+					s_logRings.erase(s_logRings.begin() + i);
+				}
+				else
+				{
+					i++;
+				}
+			}
+		}
+		rings.clear();
+
+		if (stop)
+		{
+			break;
+		}
+		usleep(LOG_INTERVAL);
+	}
+}
+
+// start the asynchronous logger of this process
+// @param file		the file the lines are appended to, "" for stderr unless the lines are sent
+// @param dest		the destnation channel the lines are sent to as MSG_LOG, "" for none
+// @param my_chn_name	the channel name of the writer, required when the lines are sent
+// @return			0 for success, negtive for error code
+int StartLogger(string file, string dest, string my_chn_name)
+{
+	static bool s_atfork = pthread_atfork(LockLogRings, UnlockLogRings, ResetLogger) == 0 && atexit(StopLogger) == 0;
+	(void)s_atfork;
+	if (s_logWriter)
+	{
+		return -1;
+	}
+	if (!dest.empty() && my_chn_name.empty())
+	{
+		return -3;
+	}
+
+	s_logFd = -1;
+	if (!file.empty())
+	{
+		s_logFd = open(file.c_str(), O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0666);
+		if (s_logFd < 0)
+		{
+			return -2;
+		}
+	}
+	else if (dest.empty())
+	{
+		s_logFd = STDERR_FILENO;
+	}
+
+	if (!dest.empty())
+	{
+		s_logQueue = new MsgQ(my_chn_name);
+		s_logDest = dest;
+	}
+
+	s_logStop = false;
+	s_logStarted = true;
+	s_logWriter = new thread(RunLogWriter);
+	return 0;
+}
+
+// stop the logger after the lines logged are written
+void StopLogger()
+{
+	if (!s_logWriter)
+	{
+		return;
+	}
+
+	s_logStarted = false;
+	s_logStop.store(true, memory_order_release);
+	s_logWriter->join();
+	delete s_logWriter;
+	s_logWriter = NULL;
+
+	if (s_logFd > STDERR_FILENO)
+	{
+		close(s_logFd);
+	}
+	s_logFd = -1;
+	delete s_logQueue;
+	s_logQueue = NULL;
+}
+
+// get the number of lines dropped for the log ring of the thread was full
+// @return			the lines dropped by all the threads
+uint64_t GetLogDropped()
+{
+	lock_guard<mutex> lock(s_logLock);
+	uint64_t dropped = s_logDropped;
+	for (size_t i = 0; i < s_logRings.size(); i++)
+	{
+		dropped += s_logRings[i]->dropped.load(memory_order_relaxed);
+	}
+	return dropped;
+}
+
+// get the default priority of a message type
+// @param type		the type of the message, for example MSG_COMMAND (6)
+// @return			the priority of the type, MSG_PRIORITY_LOW to MSG_PRIORITY_URGENT
+int GetDefaultPriority(int type)
+{
+	switch (type)
+	{
+	case MSG_STOP:
+	case MSG_DOWN:
+		return MSG_PRIORITY_URGENT;
+	case MSG_COMMAND:
+	case MSG_QUERY:
+		return MSG_PRIORITY_HIGH;
+	case MSG_DATA:
+	case MSG_LOG:
+		return MSG_PRIORITY_LOW;
+	default:
+		return MSG_PRIORITY_NORMAL;
+	}
 }
\ No newline at end of file
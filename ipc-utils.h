@@ -3,6 +3,18 @@
 #include <cstdint>
 #include <cstring> // for str copy
 #include <string>  // for c++ string
+#include <vector>  // for message buffers
+#include <cstddef> // for offsetof
+#include <atomic>  // for lock free counters
+#include <memory>  // for shared_ptr
+#include <map> // for pending requests
+#include <mutex> // for pending requests
+#include <future> // for request completion
+#include <functional> // for request completion
+#include <deque> // for the send queue
+#include <thread> // for the send queue
+#include <condition_variable> // for the send queue
+#include <type_traits> // for the log arguments
 #include <mqueue.h>  // for message queue
 #include <fcntl.h> // for O_* constants
 #include <sys/mman.h> // for shared memory related
@@ -10,19 +22,102 @@
 #include <time.h> // for mode constants
 
 #define MAX_PUBLISHERS 256
+#define SHM_READ_RETRIES 16 // the max times to repeat a read of an element updated during the copying
+#define SHM_MAGIC 0x4D454D4853435049ULL // "IPCSHMEM", the magic number of a shared memory segment
+#define SHM_VERSION 5 // the layout version of a shared memory segment
+#define SHM_ELEMENT_PUBLISHER 0 // the element is written by its single publisher
+#define SHM_ELEMENT_ATOMIC 1 // the element of 1-8 bytes is updated in place by any process with a lock free compare and swap
+#define SHM_ELEMENT_VERSIONED 2 // the element is updated by any process with an optimistic write checked by its version
+#define SHM_ATTACH_POLL 1000 // the interval in microseconds to look for the segment while a read only attach is waiting
+#define SHM_CLAIM_TIMEOUT 100000 // the microseconds a writer waits for another one holding a versioned element before giving up
 #define MAX_MESSAGECHANNELS 256
-#define MAX_MESSAGELENGTH 1024
+#define MAX_MESSAGELENGTH 1024 // the default size of the receiving data buffer
+#define MAX_FRAGMENTEDLENGTH 1048576 // the max length of a message data, messages longer than a queue message are fragmented
+#define MQ_DEFAULT_MAXMSG 10 // the default max number of messages in a queue
+#define MQ_DEFAULT_MSGSIZE 2048 // the default max size of a message in a queue, including the message header
+#define MQ_MIN_MSGSIZE 128 // the min size of a message in a queue
+#define MQ_MAX_MSGSIZE 65536 // the max size of a message in a queue
+#define MQ_FRAGMENT_TIMEOUT 100000 // the timeout in microseconds to wait for queue space for the fragments after the first one
+#define MQ_RETRY_INTERVAL 500 // the interval in microseconds to retry the messages in the send queue
+#define MQ_CLOSE_TIMEOUT 100000 // the microseconds the messages left in the send queue are retried when it is closed
+#define MQ_ALIVE_INTERVAL 1000000 // the microseconds between the checks of the receiver of a known channel being alive
+#define MQ_WIRE_VERSION 1 // the version of the message header in the queues, the messages of other versions are rejected
+#define MQ_FLAG_REQUEST 1 // the message is a request, the receiver shall reply with the same correlation ID
+#define MQ_FLAG_REPLY 2 // the message is a reply to the request with the same correlation ID
+#define MQ_FLAG_CONFLATED 4 // the message is a doorbell, the data is the latest value of its key in the conflation table of the receiver
+#define MQ_CONFLATION_KEYS 256 // the default number of keys in a conflation table
+#define MQ_CONFLATION_MSGSIZE 1024 // the max size of a conflated message, including the slot header
+#define MQ_CONFLATION_VERSION 2 // the layout version of the conflation table
+#define MQ_CONFLATION_TIMEOUT 100000 // the microseconds to wait for another sender writing a conflation slot
+#define MQ_FLAG_LOCAL 8 // the message is a doorbell of the in-process queue of the receiver, it has no data
+#define MQ_FLAG_NOWAIT 16 // the sending fails at once instead of waiting for credits or queue space, it is not sent in the message
+#define MQ_LOCAL_SLOTS 64 // the number of messages in the in-process queue for each priority, power of 2
+#define MQ_LOCAL_INLINE 256 // the max length of a message data kept inline in an in-process slot, longer data is passed by its buffer
+#define MAX_TOPICS 32 // the max number of topics published or subscribed by a MsgQ
+#define MQ_TOPIC_SLOTS 64 // the number of messages kept in the ring of a topic, power of 2
+#define MQ_TOPIC_MSGSIZE MQ_DEFAULT_MSGSIZE // the max size of a topic message, including the message header
+#define MQ_TOPIC_VERSION 3 // the layout version of the topic ring
+#define MQ_TOPIC_CLAIM_TIMEOUT 100000 // the max time in us to wait for a slot of a topic still being written by an older publisher
+#define MAX_GROUPS 16 // the max number of consumer groups joined or sent to by a MsgQ
+#define MQ_GROUP_SLOTS 256 // the number of messages in the ring of a consumer group, power of 2
+#define MQ_GROUP_MSGSIZE MQ_DEFAULT_MSGSIZE // the max size of a group message, including the message header
+#define MQ_GROUP_VERSION 2 // the layout version of the group ring
+#define MQ_GROUP_CLAIM_TIMEOUT 100000 // the max time in us for a slot of a group claimed without an owner, before it is taken back
+#define MQ_HASHSIZE 512 // the size of the local name-to-channel hash table, twice of MAX_MESSAGECHANNELS
+#define MQ_DIRECTORYSIZE 1024 // the number of entries in the shared channel directory, power of 2
+#define MQ_DIRECTORYNAME "/mq-directory" // the name of the shared memory holding the channel directory
+#define IPC_STATSNAME "/ipc-stats" // the name of the shared memory holding the live statistics
+#define IPC_STATS_VERSION 2 // the layout version of the statistics
+#define IPC_STATS_ELEMENTS 1024 // the number of shared element entries in the statistics, power of 2
+#define IPC_STATS_CHANNELS MQ_DIRECTORYSIZE // the number of channel entries in the statistics, power of 2
+#define IPC_SENDERR_AGAIN 0 // the index of the send failures for a full queue
+#define IPC_SENDERR_TIMEDOUT 1 // the index of the send failures for the sending timed out
+#define IPC_SENDERR_INTR 2 // the index of the send failures for an interrupt by a signal
+#define IPC_SENDERR_MSGSIZE 3 // the index of the send failures for a message larger than the queue message
+#define IPC_SENDERR_BADF 4 // the index of the send failures for an invalid descriptor
+#define IPC_SENDERR_OTHER 5 // the index of the send failures for any other errno
+#define IPC_SENDERRORS 6 // the number of send failure counters
+#define IPC_TRACEPREFIX "/ipc-trace." // the prefix of the shared memory holding the trace ring of a thread, followed by pid.tid
+#define IPC_TRACE_VERSION 1 // the layout version of the trace ring
+#define IPC_TRACE_RECORDS 65536 // the number of records in the trace ring of a thread, power of 2
+#define IPC_TRACE_PUBLISH 1 // the event of ShMem::Write(), the arg is the publisher ID
+#define IPC_TRACE_READ 2 // the event of ShMem::Read(), the arg is the publisher ID
+#define IPC_TRACE_SEND 3 // the event of MsgQ sending, the arg is the message type
+#define IPC_TRACE_RECEIVE 4 // the event of MsgQ receiving, the arg is the message type
+#define IPC_RECORD_ENV "IPC_RECORD" // the environment variable naming the record log file, nothing is recorded without it
+#define IPC_RECORD_SIZEENV "IPC_RECORD_MB" // the environment variable of the capacity of a new record log in MB
+#define IPC_RECORD_DEFAULTMB 256 // the default capacity of a new record log in MB, populated by each recording process
+#define IPC_RECORD_MAGIC 0x474F4C4352435049ULL // "IPCRCLOG", the magic of a record log
+#define IPC_RECORD_VERSION 1 // the layout version of the record log
+#define IPC_RECORD_CHUNK 65536 // the space reserved by a thread at a time in the record log, a record never crosses the chunks
+#define IPC_RECORD_SHMEM 1 // the record of ShMem::Write()
+#define IPC_RECORD_MSG 2 // the record of a message sent by MsgQ
+#define LOG_RINGSIZE 1048576 // the size in bytes of the log ring of a thread, power of 2
+#define LOG_MAXARGS 16 // the max number of arguments of a log line
+#define LOG_MAXSTRING 255 // the max length of a string argument kept in a log record, a longer one is cut
+#define LOG_INTERVAL 1000 // the interval in microseconds of the background writer to drain the log rings
+#define LOG_MAXLINE 1024 // the max length of a formatted log line, a longer one is cut
 
 #define MSG_NULL 0
 #define MSG_COMMAND 6
 #define MSG_ONBOARD 11
 #define MSG_LOG 12
-#define MSG_WATCHDOG 12
+#define MSG_WATCHDOG 18
 #define MSG_DOWN 13
 #define MSG_STOP 14
 #define MSG_QUERY 15
 #define MSG_UPDATE 16
 #define MSG_DATA 17
+#define MSG_BLOB 20 // the data is a uint64_t handle of a blob in the BlobPool
+#define MSG_USER 32 // the first type of the typed messages of the modules, up to 255
+
+// message priorities. Messages of higher priority are always received before those of lower priority
+#define MSG_PRIORITY_DEFAULT -1 // use the default priority of the message type
+#define MSG_PRIORITY_LOW 0 // bulk traffic, MSG_DATA, MSG_LOG
+#define MSG_PRIORITY_NORMAL 1 // MSG_ONBOARD, MSG_UPDATE, and unknown types
+#define MSG_PRIORITY_HIGH 2 // MSG_COMMAND, MSG_QUERY
+#define MSG_PRIORITY_URGENT 3 // MSG_STOP, MSG_DOWN
+#define MSG_PRIORITY_RESERVE 4 // 1/4 of the depth of a queue is reserved for MSG_PRIORITY_HIGH and MSG_PRIORITY_URGENT
 
 using namespace std;
 
@@ -31,7 +126,7 @@ using namespace std;
 // Principle: High cohesion and low coupling.
 //	1.	All modules in Roswell or assigned projects shall use these utilities to publish or subscribe public data.
 //	2.	Shared memory here is designed to follow publisher - subscriber model. Any elements in the shared memory can 
-//		have only single publisher but multiple subscribers.
+//		have only single publisher but multiple subscribers, except the shared elements in 14.
 //	3.	Publisher can publish its elements at any moments regardless the behaviors of any other publishers or subscribers. 
 //		The publisher does not care or know who are the subscribers. Multiple publishers are allowed to publish their own elements in different process/thread simutaneously. 
 //	4.	Subscribers can read its subscriptions (the shared elements) at any moments regardless who is writing or reading them. 
@@ -39,11 +134,23 @@ using namespace std;
 //	5.	Every module is allowed to have multiple publishers together with multiple subscribers. 
 //	6.	Each shared element always occupies the same location in the shared memory no matter how many times it is declared or loaded in the module.
 //	7.	The writing and reading to the shared memory are all operations that are non blocking, non locking, and multithreaded safe.
+//		Every element has a sequence number in the segment header, odd while its publisher is writing. A read is repeated while
+//		a write overlapped its copying, and fails with -3 rather than returning a torn copy after SHM_READ_RETRIES times.
 //	8.	255 publishers can be created in this implementation, where each of them can have any data structure with a size less than 32K.
 //	9.	The total data of all elements can has a size also no more than 32K.
 //	10.	Each element is identified by its name in string for at most 15 characters. Refering the name in every process/thread will always has
 //		the same result.
 //	11.	The element published by a publisher will remain in the kernel even when the process is terminated.
+//	12.	The publishing and the reading do not allocate any memory. The names are also taken as const char*, so that a name in 
+//		a literal is looked up without building a string. The status of an operation is kept by GetStatus(), its message 
+//		is built only when GetErrorMessage() is called.
+//	13.	Monitors and tools attach by ShMem(title, true) for reading only. The segment is mapped read only, it is never created
+//		or cleared, and one of another layout version or title is refused. The attach can wait for the creator, and a segment
+//		not there yet is attached again by the next Subscribe().
+//	14.	The shared elements created by CreateShared() can be updated by any process. An element of 1-8 bytes is updated in place
+//		by CompareAndSwap() without any lock. A larger one is read with its version and written by CompareAndWrite() when the
+//		version is still the same, the writer that lost reads it again and retries. Write() to a shared element always succeeds,
+//		unless another writer has held a versioned one for SHM_CLAIM_TIMEOUT. The claim of a writer that died is broken.
 //
 
 // MsgQ class
@@ -54,18 +161,77 @@ using namespace std;
 //		but multiple senders.
 //	3.	Senders can send messages to the destnate receiver at any moments without knowing the state of the receiver and other senders. 
 //		Multiple senders are allowed to send their messages to a receiver in different process/thread simutaneously. 
-//	4.	Receiver can read its messages at its convenient time. The messages are in FIFO series.
+//	4.	Receiver can read its messages at its convenient time. The messages are in FIFO series within the same priority. 
+//		Messages of higher priority, for example MSG_STOP and MSG_COMMAND, are received ahead of the MSG_DATA and MSG_LOG traffic.
+//		The last 1/MSG_PRIORITY_RESERVE of the depth of a queue in the directory is reserved for them, the messages of lower 
+//		priority are refused or queued as full above it. The in-process queue has separate rings for every priority.
 //	5.	Multiple receivers and senders can be defined and worked in single module. 
 //	6.	The receiving of a message is a blocking opertion with timeout. It will block until either the message queue has a message 
 //		or the timeout expires. The timeout can be specified between 10us to 1s.
 //  7. 	The sending of a message is also a blocking operation with timeout. It will block until either the message queue has available 
 //		space for the new message or a small 1ms timeout expires.
-//	8.	The receiving and the sending of message are all non locking and multithreaded safe.
+//		With EnableSendQueue(), the sending never blocks. A message that finds no credit or a full queue is kept in a bounded 
+//		local send queue and retried asynchronously in order. The credits of a receiver are its queue depth less the messages 
+//		sent but not yet received, counted in the channel directory. GetCredits() and IsBackpressured() let producers throttle ahead of time.
+//		When the MsgQ is destroyed, the messages left in its send queue are retried for up to
+//		MQ_CLOSE_TIMEOUT and the ones still left are dropped. A fragmented message is refused unless all its fragments fit in the queue.
+//	8.	The receiving and the sending of message are all non locking and multithreaded safe. The threads sending through the same
+//		MsgQ are serialized on its send buffer by a futex lock, which the receiving takes only briefly to update the channel table and the last sender.
 //	9.	The message queue will remain in the kernel even when the process that created it is terminated. All messages in the queue remains there.
 //	10. Each message queue is identified by its name in string with at most 8 characters. 
+//		The depth and the message size of the queue are specified when it is created. Messages longer than a queue message, 
+//		up to 1MB, are fragmented by the sender and reassembled by the receiver transparently. The receiver shall drain 
+//		the queue while a message with more fragments than the queue depth is being sent.
 //	11.	We introduce the concept of message channel here for the conience to distinguish the message sending and reading. They ocuppy different channels.
+//	12.	Every receiver registers its name once in a channel directory in shared memory. Senders resolve names through a local hash table 
+//		and the directory without any syscall. The descriptor of a channel is opened lazily on its first sending, or by OpenChannels().
+//	13.	A topic is a ring of messages in shared memory, named as /topic.name. Publish() writes a message once no matter how many
+//		subscribers there are. Every subscriber reads the topic with its own cursor, starting from the messages published after
+//		its Subscribe(). A subscriber that falls behind more than 64 messages loses the oldest ones, which are counted.
+//		A message is waited for till its publisher finishes it, and skipped as lost only when its publisher has gone.
+//	14.	A typed message is a plain struct with its type, see ipc_message_type. Send(dest, msg) takes the type and the length
+//		from the struct at compile time, and MsgDispatcher hands every message received to the handler of its struct.
+//	15.	The senders in the same process deliver through the in-process queue of the receiver, merged with its kernel queue by
+//		priority. The messages left in it when the receiver is destroyed are handed to its kernel queue.
 // 
 
+// BlobPool class
+// Objective: hand large data such as camera frames to other modules without copying it.
+//	1.	The blobs are allocated in a shared memory in 4 size classes, 4KB, 64KB, 1MB and 8MB. The allocation and the release 
+//		are lock free. A request is served by the next larger class when its own class is exhausted.
+//	2.	A blob is identified by a uint64_t handle which is valid in every process. A handle of a released blob is detected as stale.
+//	3.	Every blob has a reference count shared among all processes. Alloc() gives the first reference. The blob is returned to 
+//		the pool when its last holder releases it.
+//	4.	MsgQ::SendBlob() ships only the handle and transfers one reference to the receiver, who shall release it after use.
+//		Call AddRef() before SendBlob() to keep using the blob after the sending.
+//
+
+// RpcClient class
+// Objective: pipeline many requests to server modules over MsgQ without waiting a round trip for each.
+//	1.	Every request carries a correlation ID in its message header. The server replies with MsgQ::SendReply() using 
+//		the correlation ID from MsgQ::GetMsgCorrelation(), so requests can be answered in any order.
+//	2.	The completion of a request is notified by a std::future or a callback, with the reply, a timeout, or a cancellation.
+//	3.	The replies are dispatched by Poll(), which shall be called by the thread owning the MsgQ in place of MsgQ::ReceiveMsg().
+//		Other messages are returned by Poll() as by MsgQ::ReceiveMsg(). The callbacks are called in Poll().
+//
+
+// MsgDispatcher class
+// Objective: replace the if-else chains over the message types in the receiving loops.
+//	1.	A handler is registered by the struct of its message, On<gps_fix>(handler). The type and the size of the message are
+//		taken from the struct at compile time.
+//	2.	A message received is dispatched by a table indexed by its type, one lookup and one call whatever the number of types.
+//	3.	A message of another length than its struct is refused and counted, it never reaches the handler.
+//
+
+// Log() asynchronous logger
+// Objective: log from the hot loops without a syscall, a lock or any formatting.
+//	1.	StartLogger() starts a background writer of the process. Log("speed %f at %d", v, i) keeps the format and the arguments
+//		in binary in a ring of the calling thread, the writer formats the lines later and appends them to a file or sends them
+//		as MSG_LOG messages to a collector. The format shall be kept by the caller, a string literal is the common case.
+//	2.	A line logged into a full ring is dropped and counted, the logging thread never waits for the writer.
+//	3.	The date and time of a line are formatted once in every second, GetDateTime() takes the same cache.
+//
+
 // The preparation. We need to have several common directories setup and an environment variable LD_LIBRARY_PATH been created/setup.
 //	mkdir ~/projects
 //	mkdir ~/projects/common
@@ -79,13 +245,457 @@ struct shm_header
 	uint16_t size;
 };
 
+// the segment header in front of the element headers. A segment of another magic, version or title is initialized again,
+// a read only attach refuses it instead.
+struct shm_segment
+{
+	uint64_t magic; // SHM_MAGIC, stored last when the segment is initialized
+	uint32_t version; // the layout version, SHM_VERSION
+	uint32_t size; // the total size of the segment
+	uint32_t seq[MAX_PUBLISHERS]; // the sequence of every element, odd while it is being written, bumped by 2 on every write
+	uint8_t kind[MAX_PUBLISHERS]; // the kind of every element, SHM_ELEMENT_PUBLISHER, SHM_ELEMENT_ATOMIC or SHM_ELEMENT_VERSIONED
+	uint32_t owner[MAX_PUBLISHERS]; // the pid of the process writing a versioned element, 0 when none
+};
+static_assert(sizeof(shm_segment) % 8 == 0, "the elements updated in place need the data area aligned to 8 bytes");
+
+// the entry of a receiver in the shared channel directory. The name is claimed once and never released.
+struct mq_directory_entry
+{
+	uint64_t name; // the channel name in uint64_t style, 0 for empty entry
+	int32_t pid; // the process id of the latest receiver of this channel
+	uint32_t maxmsg; // the depth of the queue, the credits granted to all senders
+	uint64_t sent; // the number of messages sent to the queue, increased by the senders
+	uint64_t received; // the number of messages received from the queue, increased by the receiver
+};
+
+struct mq_directory
+{
+	mq_directory_entry entries[MQ_DIRECTORYSIZE]; // open addressing hash table indexed by the channel name
+};
+
+// the live counters of a shared element, claimed by its key once and never released
+struct ipc_element_stats
+{
+	uint64_t key; // the hash of the shared memory title and the element name, 0 for empty entry
+	char title[16]; // the title of the shared memory
+	char name[16]; // the name of the element
+	uint64_t writes;
+	uint64_t reads;
+	uint64_t read_retries; // the reads repeated because the element was updated during the copying
+	uint64_t trace; // the trace ID of the last write, taken by the readers when tracing is built in
+};
+
+// the live counters of a channel, the sent and received messages are counted in the channel directory
+struct ipc_channel_stats
+{
+	uint64_t name; // the channel name in uint64_t style, 0 for empty entry
+	uint64_t send_failures[IPC_SENDERRORS]; // the failed sendings to this channel by errno
+	uint64_t receive_timeouts; // the receivings of this channel returned without a message
+	uint32_t depth_hwm; // the high-water mark of the queue depth seen by the receiver
+	uint32_t reserved;
+};
+
+// a record of an IPC event in a trace ring
+struct ipc_trace_record
+{
+	uint64_t ts; // the CLOCK_MONOTONIC time in nanoseconds
+	uint64_t trace; // the trace ID, 0 for none
+	uint64_t name; // the first 8 characters of the element name, or the peer channel name in uint64_t style
+	uint32_t event; // IPC_TRACE_PUBLISH, IPC_TRACE_READ, IPC_TRACE_SEND or IPC_TRACE_RECEIVE
+	uint32_t arg; // the publisher ID or the message type
+};
+
+// the trace ring of a thread in shared memory. Only its thread writes it, it is kept after the process exits for ipc-trace
+struct ipc_trace_ring
+{
+	uint32_t version; // the layout version
+	int32_t pid;
+	int32_t tid;
+	uint32_t size; // the number of records
+	uint64_t head; // the number of records written, the latest size of them are kept
+	char thread[16]; // the name of the thread
+	uint64_t reserved[3];
+	ipc_trace_record records[IPC_TRACE_RECORDS];
+};
+
+// a record in the record log, followed by its data and padded to 8 bytes
+struct ipc_record
+{
+	uint32_t size; // the size of the record with its data, multiple of 8
+	uint16_t kind; // IPC_RECORD_SHMEM or IPC_RECORD_MSG, stored last, 0 while the record is being written
+	uint16_t type; // the message type, or the size of the element, 0 for a string element
+	uint64_t seq; // the sequence number among all the recording processes
+	uint64_t ts; // the CLOCK_MONOTONIC time in nanoseconds
+	uint64_t trace; // the trace ID, 0 for none
+	char title[16]; // the title of the shared memory, or the sender channel name
+	char name[16]; // the name of the element, or the destnation channel name
+	uint32_t len; // the length of the data
+	uint16_t priority; // the priority of the message
+	uint16_t flags; // MQ_FLAG_REQUEST or MQ_FLAG_REPLY of the message
+	uint32_t corr; // the correlation ID of the message
+	uint32_t reserved;
+};
+
+// the append-only record log mapped by all the recording processes. Each thread appends to its own chunks reserved by the tail.
+// The unused end of a chunk is zero filled, a record of size 0 skips to the next chunk
+struct ipc_record_log
+{
+	uint64_t magic; // IPC_RECORD_MAGIC, stored last by the creator
+	uint32_t version; // the layout version
+	uint32_t reserved;
+	uint64_t size; // the size of the log file
+	uint64_t tail; // the offset of the next chunk, it may go beyond the size when the log is full
+	uint64_t seq; // the number of records, including the dropped ones
+	uint64_t dropped; // the records dropped for the log was full
+	uint64_t created; // the CLOCK_REALTIME time in nanoseconds when the log was created
+	uint64_t reserved2;
+};
+
+// the live statistics in shared memory. It is zero filled when created and read by ipc-top without any lock
+struct ipc_stats
+{
+	uint32_t version; // the layout version, set by the first user
+	uint32_t reserved[15];
+	ipc_element_stats elements[IPC_STATS_ELEMENTS]; // open addressing hash table indexed by the key
+	ipc_channel_stats channels[IPC_STATS_CHANNELS]; // open addressing hash table indexed by the channel name
+};
+
 struct mq_buffer
 {
 	uint64_t name;
-	uint32_t ts;
+	uint64_t ts; // the CLOCK_MONOTONIC time in nanoseconds when the message was sent
+	uint16_t type;
+	uint16_t len; // the length of data in this message or fragment
+	uint32_t seq; // the sequence number of the message from the sender
+	uint32_t total; // the total length of the message data, larger than len for a fragmented message
+	uint32_t offset; // the offset of this fragment in the message data
+	uint32_t corr; // the correlation ID of a request and its reply, 0 for none
+	uint16_t flags; // MQ_FLAG_REQUEST or MQ_FLAG_REPLY
+	uint8_t version; // MQ_WIRE_VERSION of the sender
+	uint8_t reserved;
+	uint64_t deadline; // the CLOCK_MONOTONIC time in nanoseconds after which the message is dropped unread, 0 for none
+	uint64_t trace; // the trace ID carried through the hops, 0 for none
+	char buf[MAX_MESSAGELENGTH]; // the data, actually extends to the message size of the queue
+};
+
+#define MQ_HEADERSIZE offsetof(mq_buffer, buf)
+
+// a message in the ring of a topic
+struct mq_topic_slot
+{
+	uint64_t seq; // 2*sequence+1 while the message is being written, 2*sequence+2 after it is written
+	uint64_t name; // the name of the publisher
+	uint64_t ts; // the CLOCK_MONOTONIC time in nanoseconds when the message was published
 	uint16_t type;
 	uint16_t len;
-	char buf[MAX_MESSAGELENGTH];
+	uint32_t owner; // the pid of the publisher writing the slot, 0 when it is not being written
+	char buf[MQ_TOPIC_MSGSIZE - 32];
+};
+
+// the ring of a topic in shared memory
+struct mq_topic
+{
+	uint32_t version; // the layout version, valid when the topic is ready
+	uint32_t ready; // set after the ring is initialized by its creator
+	uint64_t head; // the sequence of the next message to be published
+	uint32_t futex; // increased after every publishing, the subscribers wait on it
+	uint32_t waiters; // the number of subscribers waiting on the futex
+	uint64_t reserved[5];
+	mq_topic_slot slots[MQ_TOPIC_SLOTS];
+};
+
+// a message in the ring of a consumer group
+struct mq_group_slot
+{
+	uint64_t seq; // the position of the slot for sending when it equals the head, for receiving when it equals the tail+1
+	uint64_t name; // the name of the sender
+	uint64_t ts; // the CLOCK_MONOTONIC time in nanoseconds when the message was sent
+	uint16_t type;
+	uint16_t len;
+	uint32_t owner; // the pid of the sender or the worker having claimed the slot, 0 when it is not claimed
+	char buf[MQ_GROUP_MSGSIZE - 32];
+};
+
+// the bounded multi-producer multi-consumer ring of a consumer group in shared memory
+struct mq_group
+{
+	uint32_t version; // the layout version, valid when the group is ready
+	uint32_t ready; // set after the ring is initialized by its creator
+	uint32_t futex; // increased after every sending, the idle workers wait on it
+	uint32_t waiters; // the number of workers waiting on the futex
+	uint32_t space; // increased after every receiving, the senders of a full ring wait on it
+	uint32_t senders; // the number of senders waiting for space
+	uint32_t workers; // the number of workers joined
+	uint32_t reserved0[9];
+	uint64_t head; // the position of the next message to be sent, in its own cache line
+	uint64_t reserved1[7];
+	uint64_t tail; // the position of the next message to be received, in its own cache line
+	uint64_t reserved2[7];
+	mq_group_slot slots[MQ_GROUP_SLOTS];
+};
+
+// the state of a consumer group in a MsgQ
+struct mq_group_state
+{
+	uint64_t name; // the name of the group in uint64_t style
+	mq_group* ring; // the ring of the group
+	bool joined;
+};
+
+// the state of a topic in a MsgQ
+struct mq_topic_state
+{
+	uint64_t name; // the name of the topic in uint64_t style
+	mq_topic* ring; // the ring of the topic
+	uint64_t cursor; // the sequence of the next message to be received, valid for a subscribed topic
+	uint64_t lost; // the number of messages lost by falling behind the publishers
+	bool subscribed;
+};
+
+// a slot of a conflation table, keeping the latest message of a key. It is written under a seqlock.
+struct mq_conflation_slot
+{
+	uint32_t seq; // odd while a sender is writing, even when the message is stable
+	uint32_t pending; // 1 when a doorbell of the slot is in the queue of the receiver
+	uint64_t key; // the key plus 1, 0 for an empty slot. Slots are claimed by compare and swap and never released
+	uint64_t name; // the sender name in uint64_t style
+	uint64_t ts; // the send time of the message in CLOCK_MONOTONIC nanoseconds
+	uint16_t type;
+	uint16_t len;
+	uint32_t owner; // the pid of the sender writing the slot, 0 when none
+	char buf[MQ_CONFLATION_MSGSIZE - 40];
+};
+
+// the conflation table of a receiver in shared memory, shared by all its senders
+struct mq_conflation
+{
+	uint32_t version; // the layout version, MQ_CONFLATION_VERSION
+	uint32_t ready; // 1 when the table is initialized, 2 while the receiver creating it is initializing it
+	uint32_t size; // the number of slots, power of 2
+	uint32_t reserved;
+	mq_conflation_slot slots[1]; // the slots, size of them are mapped
+};
+
+// the state of the conflation table of a receiver
+struct mq_conflation_state
+{
+	mq_conflation* table;
+	size_t mapsize;
+	vector<uint32_t> delivered; // the seq of the value last received from each slot
+	vector<char> buffer; // the copy of the latest received value
+};
+
+// a slot of an in-process queue. The seq follows the bounded MPMC queue of Dmitry Vyukov
+struct mq_local_slot
+{
+	atomic<size_t> seq;
+	char data[MQ_HEADERSIZE + MQ_LOCAL_INLINE]; // the message header and its inline data
+	vector<char> big; // the data longer than MQ_LOCAL_INLINE, swapped to the receiver without copying
+};
+
+// the ring of one priority in an in-process queue
+struct mq_local_ring
+{
+	alignas(64) atomic<size_t> head; // the position of next enqueue
+	alignas(64) atomic<size_t> tail; // the position of next dequeue
+	mq_local_slot slots[MQ_LOCAL_SLOTS];
+};
+
+// the in-process queue of a receiver. Senders in the same process deliver to it without crossing the kernel.
+struct mq_local_queue
+{
+	mq_local_ring rings[MSG_PRIORITY_URGENT + 1]; // the rings of the priorities, higher priority is received first
+	uint32_t parked = 0; // 1 when the receiver may be waiting on its kernel queue, the first sender to clear it rings a doorbell
+	bool alive = true; // false when the receiver is destroyed
+	uint32_t generation; // the fork generation of the process owning the queue
+	vector<char> big; // the data of the last long message received
+};
+
+// a log line in the log ring of a thread, followed by its arguments in 8-byte slots.
+// A string argument is its length in a slot followed by its characters padded to 8 bytes
+struct log_record
+{
+	uint32_t size; // the size of the record with its arguments, multiple of 8
+	uint32_t nargs; // the number of arguments
+	uint64_t ts; // the CLOCK_REALTIME time in nanoseconds
+	const char* format; // the format of the line, it is kept by the caller. NULL for the padding to the end of the ring
+	char tags[LOG_MAXARGS]; // the type of each argument, 'i' signed, 'u' unsigned, 'd' double, 'p' pointer, 's' string
+};
+
+// the log ring of a thread, written by the thread and drained by the background writer
+struct log_ring
+{
+	alignas(64) atomic<uint64_t> head; // the bytes written by the thread
+	alignas(64) atomic<uint64_t> tail; // the bytes drained by the writer
+	atomic<uint64_t> dropped; // the lines dropped for the ring was full
+	atomic<bool> closed; // the thread has exited, the ring is released after it is drained
+	uint32_t generation; // the fork generation of the process owning the ring
+	uint64_t next; // the head after the record being written
+	uint64_t reported; // the dropped lines reported by the writer
+	char buf[LOG_RINGSIZE];
+};
+
+// a message waiting in the send queue
+struct mq_pending_send
+{
+	int channel; // the destnation channel
+	mqd_t chn; // the descriptor of the destnation
+	unsigned int priority;
+	mq_directory_entry* entry; // the directory entry of the destnation, NULL for unknown
+	vector<char> data; // the message with its header
+};
+
+// the bounded send queue of a MsgQ, retried by its own thread. It is flushed and its thread is stopped when it is released
+struct mq_send_queue
+{
+	~mq_send_queue();
+
+	mutex lock;
+	condition_variable cond;
+	deque<mq_pending_send> queue;
+	int pending[MAX_MESSAGECHANNELS]; // the number of messages queued for each destnation
+	int depth = 0; // the max number of messages in the queue
+	uint64_t dropped = 0; // the messages dropped by errors other than a full queue
+	bool running = false;
+	thread worker;
+};
+
+// the reassembly state of fragmented messages from a sender
+struct mq_reassembly
+{
+	uint32_t seq = 0; // the sequence number of the message in reassembly
+	uint32_t received = 0; // the bytes of data received so far
+	uint32_t expired = 0; // the sequence number of the last message counted as expired, 0 for none
+	vector<char> data;
+};
+
+#define BLOB_CLASSES 4 // the number of size classes in the blob pool
+#define BLOB_VERSION 2 // the layout version of the blob pool
+
+// the header of a blob in the pool
+struct blob_header
+{
+	uint64_t state; // the generation in the high 32 bits, increased at every allocation, and the reference count in the low 32 bits, 0 for free
+	uint32_t size; // the size requested at the allocation
+	uint32_t next; // the next free blob in the free list, index+1, 0 for the end
+};
+
+// the state of a size class in the blob pool
+struct blob_class
+{
+	uint64_t head; // the free list, low 32 bits are the first free index+1, high 32 bits are the tag against ABA
+	uint32_t size; // the size of each blob in the class
+	uint32_t count; // the number of blobs in the class
+	uint64_t headers; // the offset of the blob headers from the base of the pool
+	uint64_t data; // the offset of the blob data from the base of the pool
+};
+
+struct blob_pool
+{
+	uint32_t version; // the layout version, valid when the pool is ready
+	uint32_t ready; // set after the pool is initialized by its creator
+	uint64_t size; // the total size of the pool
+	blob_class classes[BLOB_CLASSES];
+};
+
+#define HISTOGRAM_SUBBITS 4 // 16 sub-buckets in each power of 2, the values are recorded with less than 6.25% error
+#define HISTOGRAM_MAXBITS 36 // the values up to 2^36 nanoseconds, about 68 seconds, are recorded in range
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAXBITS - HISTOGRAM_SUBBITS + 2) << HISTOGRAM_SUBBITS)
+
+// LatencyHistogram class
+// Objective: record latencies in nanoseconds in an HDR style log-linear histogram.
+//	1.	The recording is lock free and wait free. It can be queried or dumped by other threads at any moments.
+//	2.	Values below 16ns are recorded exactly, larger values with a relative error less than 6.25%. Values beyond 68s are counted as 68s.
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	// record a value
+	// @param ns		the value in nanoseconds
+	void Record(uint64_t ns);
+
+	// clear all the records
+	void Reset();
+
+	// get the number of records
+	// @return			the number of records
+	uint64_t GetCount() {return m_count.load(std::memory_order_relaxed);};
+
+	// get the max value recorded
+	// @return			the max value in nanoseconds
+	uint64_t GetMax() {return m_max.load(std::memory_order_relaxed);};
+
+	// get the mean of the values recorded
+	// @return			the mean value in nanoseconds, 0 for no record
+	uint64_t GetMean();
+
+	// get the value at a percentile
+	// @param percentile	the percentile, 0-100, for example 99.9 for p999
+	// @return				the value in nanoseconds, the highest equivalent value of the bucket, 0 for no record
+	uint64_t GetPercentile(double percentile);
+
+	// dump the summary of the histogram
+	// @param name		the name of the histogram
+	// @return			a line of "name count=... mean=... p50=... p90=... p99=... p999=... max=..." in nanoseconds
+	string Dump(string name);
+
+protected:
+	std::atomic<uint64_t> m_buckets[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum;
+	std::atomic<uint64_t> m_max;
+};
+
+// the status of the last operation of ShMem and MsgQ. The publishing, reading, sending and receiving keep only their status,
+// the message of the status is built when GetErrorMessage() asks for it. The other operations keep their message as a text.
+enum ipc_status
+{
+	IPC_STATUS_TEXT = 0, // the message is a text kept by the operation
+	IPC_STATUS_FOUND, // the element is found
+	IPC_STATUS_NOTFOUND, // the element is not found
+	IPC_STATUS_UPDATED, // the element is updated
+	IPC_STATUS_READ, // the element is read, the message is empty
+	IPC_STATUS_OUTOFRANGE, // the element ID is out of range
+	IPC_STATUS_TOOFAST, // the element was updated too fast to be read
+	IPC_STATUS_SENT, // the message is sent
+	IPC_STATUS_QUEUED, // the message is kept in the send queue
+	IPC_STATUS_FULL, // the destnation queue was full
+	IPC_STATUS_TIMEDOUT, // the sending or the receiving timed out
+	IPC_STATUS_INTERRUPTED, // the sending was interrupted by a signal
+	IPC_STATUS_NOMESSAGE, // no message to receive
+	IPC_STATUS_RECEIVED, // a message is received, the message is the sender name
+	IPC_STATUS_CHANGED // the shared element was updated by another process since it was read
+};
+
+// the message of the last operation, either a status or a text. Assigning a text turns the status to IPC_STATUS_TEXT.
+class ipc_message
+{
+public:
+	ipc_message& operator=(const string& s) {m_status = IPC_STATUS_TEXT; m_text = s; return *this;};
+	ipc_message& operator=(const char* s) {m_status = IPC_STATUS_TEXT; m_text = s; return *this;};
+	ipc_message& assign(const char* s, size_t n) {m_status = IPC_STATUS_TEXT; m_text.assign(s, n); return *this;};
+	ipc_message& assign(const string& s) {m_status = IPC_STATUS_TEXT; m_text.assign(s); return *this;};
+	ipc_message& operator+=(const string& s) {m_text = str(); m_status = IPC_STATUS_TEXT; m_text += s; return *this;};
+	void clear() {m_status = IPC_STATUS_TEXT; m_text.clear();};
+
+	// keep a status without any text
+	// @param status	the status of the operation
+	// @param name		the sender name in uint64_t style for IPC_STATUS_RECEIVED
+	void Set(ipc_status status, uint64_t name = 0) {m_status = status; m_name = name;};
+
+	// get the status
+	// @return			the status, IPC_STATUS_TEXT for a text
+	ipc_status GetStatus() const {return m_status;};
+
+	// build the message
+	// @return			the text, or the message of the status
+	string str() const;
+
+protected:
+	ipc_status m_status = IPC_STATUS_TEXT;
+	uint64_t m_name = 0;
+	string m_text = "";
 };
 
 class ShMem
@@ -94,7 +704,25 @@ public:
 	// ShMem();
 	// Constructor of the shared memory, the name is specified
 	ShMem(string title);
+
+	// Constructor of the shared memory for the subscribers only
+	// @param title			the title of the shared memory
+	// @param readonly		true to map an existing segment for reading only, it is never created or cleared.
+	//						false is the same as ShMem(title)
+	// @param wait_usec		the time in microseconds to wait for the segment to be created, 0 for not waiting
+	//						Check IsAttached(). A segment not attached is attached again by Attach() or the next Subscribe().
+	ShMem(string title, bool readonly, long wait_usec = 0);
 	~ShMem();
+
+	// attach the segment of a read only instance
+	// @param wait_usec		the time in microseconds to wait for the segment to be created, 0 for not waiting
+	// @return				0 for success, negtive for error code
+	//						-1 for the segment not created yet, -2 for another layout version, -3 for another title
+	int Attach(long wait_usec = 0);
+
+	// check if the segment is attached
+	// @return				true when the segment is mapped
+	bool IsAttached() {return m_segment != NULL;};
 	
 	// create a publisher 
 	// @param PublisherName	the name of the shared element
@@ -103,6 +731,37 @@ public:
 	//						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 	int CreatePublisher(string PublisherName, int size);
 
+	// create a shared element that any process can update, or get the ID of it
+	// @param PublisherName	the name of the shared element
+	// @param size			the size of the shared element, 1-8 for the one updated by CompareAndSwap() without lock,
+	//						0 (string) or larger for the one updated by CompareAndWrite()
+	// @return				the publisher ID, positive for success, negtive for error code
+	int CreateShared(string PublisherName, int size);
+
+	// compare and swap a shared element of 1-8 bytes, lock free
+	// @param PublisherID	the ID of the shared element, 1-256
+	// @param expected (in/out)	the value expected, it is set to the current value when the element has another one
+	// @param desired		the new value
+	// @return				the bytes of data written, positive for success, negtive for error code.
+	//						-4 for another value, the caller compares against the current value in expected again
+	int CompareAndSwap(int PublisherID, void* expected, const void* desired);
+
+	// read a shared element with its version
+	// @param PublisherID	the ID of the shared element or publisher, 1-256
+	// @param ptr (out)		the pointer to the data read
+	// @param version (out)	the version of the data read, for CompareAndWrite()
+	// @return				the actual bytes of data read, positive for success, negtive for error code.
+	int Read(int PublisherID, void* ptr, uint32_t* version);
+
+	// write a shared element when it has not been updated since it was read
+	// @param PublisherID	the ID of the shared element, 1-256
+	// @param version (in/out)	the version read by Read(), it is set to the new version when written
+	// @param ptr			the pointer to the data to be written
+	// @return				the actual bytes of data written, positive for success, negtive for error code.
+	//						-4 when another process updated it, the caller reads it again and retries
+	//						-5 when another process has been writing it for SHM_CLAIM_TIMEOUT
+	int CompareAndWrite(int PublisherID, uint32_t* version, void* ptr);
+
 	// publish new data with the publisher
 	// @param PublisherID	the ID of the shared element or publisher, 1-256
 	// @param ptr			the pointer to the data to be published
@@ -116,6 +775,7 @@ public:
 	// @return				the publisher ID, positive for success, negtive for error code
 	//						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 	int Read(string PublisherName, int* len, void* ptr);
+	int Read(const char* PublisherName, int* len, void* ptr);
 
 	// Convenient functions to take the advantages of shared memory
 	
@@ -133,9 +793,9 @@ public:
 
 	// publish new data in string with the publisher
 	// @param PublisherID	the ID of the shared element or publisher, 1-256
-	// @param s				the data in string to be published, 0-63 characters
+	// @param s				the data in string to be published, 0-63 characters. A longer string is truncated in the element
 	// @return				the actual bytes of data written, positive for success, negtive for error code.
-	int Write(int PublisherID, string s);
+	int Write(int PublisherID, const string& s);
 
 	// Read the shared element in integer
 	// @param PublisherName	the name of the shared element or publisher, 1-15 characters
@@ -143,6 +803,7 @@ public:
 	// @return				the publisher ID, positive for success, negtive for error code
 	//						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 	int Read(string PublisherName, int* n);
+	int Read(const char* PublisherName, int* n);
 	
 	// Read the shared element in double
 	// @param PublisherName	the name of the shared element or publisher, 1-15 characters
@@ -150,6 +811,7 @@ public:
 	// @return				the publisher ID, positive for success, negtive for error code
 	//						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 	int Read(string PublisherName, double* t);
+	int Read(const char* PublisherName, double* t);
 
 	// Read the shared element in string
 	// @param PublisherName	the name of the shared element or publisher, 1-15 characters
@@ -157,12 +819,19 @@ public:
 	// @return				the publisher ID, positive for success, negtive for error code
 	//						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 	int Read(string PublisherName, string* s);
+	int Read(const char* PublisherName, string* s);
 	
 	// subscribe a publisher or get the name by ID
 	// @param PublisherName	the name of the shared element
 	// @return				the publisher ID, positive for success, negtive for error code
 	//						The publisher ID keeps unchanged for the same publisher name among all processes/threads.
 	int Subscribe(string PublisherName);
+	int Subscribe(const char* PublisherName);
+
+	// get the size of a shared element
+	// @param PublisherID	the ID of the shared element or publisher, 1-256
+	// @return				the size of the element, 0 for a string, negtive for error code
+	int GetElementSize(int PublisherID);
 
 	// Read the shared element
 	// @param PublisherID	the ID of the shared element or publisher, 1-256
@@ -190,20 +859,100 @@ public:
 
 	// get the error message of last operation
 	// @return		the error message
-	string GetErrorMessage() {return m_message;};
+	string GetErrorMessage() {return m_message.str();};
+
+	// get the status of last operation
+	// @return		the status, IPC_STATUS_TEXT when the error message is a text
+	ipc_status GetStatus() {return m_message.GetStatus();};
 
 protected:
+	// get the live counters of an element
+	// @param PublisherID	the ID of the shared element or publisher, 1-256
+	// @return				the counters, NULL when the statistics is not available
+	ipc_element_stats* GetElementStats(int PublisherID);
+
+	// count a read of an element in the live counters
+	// @param PublisherID	the ID of the shared element or publisher, 1-256
+	// @param retries		the times the read was repeated
+	void CountRead(int PublisherID, int retries);
+
+	// count a write of an element in the live counters, and record it
+	// @param PublisherID	the ID of the shared element or publisher, 1-256
+	// @param offset		the offset of the data written
+	void CountWrite(int PublisherID, uint16_t offset);
+
+	// add an element
+	// @param PublisherName	the name of the shared element
+	// @param size			the size of the shared element
+	// @param kind			SHM_ELEMENT_PUBLISHER, SHM_ELEMENT_ATOMIC or SHM_ELEMENT_VERSIONED
+	// @return				the publisher ID, positive for success, negtive for error code
+	int AddElement(const string& PublisherName, int size, uint8_t kind);
+
+	// copy the data into an element of which the sequence is turned odd by this writer
+	// @param PublisherID	the ID of the shared element or publisher, 1-256
+	// @param ptr			the pointer to the data, the pointer to a string for a string element
+	// @param seq			the even sequence before the writing
+	// @return				the actual bytes of data written
+	int WriteClaimed(int PublisherID, const void* ptr, uint32_t seq);
+
+	// wait for another writer to release a versioned element, the claim of a writer that died is broken
+	// @param PublisherID	the ID of the shared element, 1-256
+	// @param seq			the odd sequence of the claim
+	// @return				0 when the element is released, -5 when its writer is alive and holds it for SHM_CLAIM_TIMEOUT
+	int WaitClaim(int PublisherID, uint32_t seq);
+
+	// copy an element consistently, the copying is repeated while a write overlapped it
+	// @param PublisherID	the ID of the shared element or publisher, 1-256
+	// @param ptr (out)		the pointer to the data read, the pointer to a string for a string element
+	// @param size			the size of the element, 0 for string
+	// @param version (out)	the version of the copy, NULL for not needed
+	// @return				0 for success, negtive for error code
+	int CopyElement(int PublisherID, void* ptr, size_t size, uint32_t* version = NULL);
+
+	// set the areas of a mapped segment
+	// @param base			the address of the segment
+	void SetAreas(void* base);
+
+	shm_segment* m_segment = NULL; // the segment header, with the sequence of every element
 	shm_header* m_headers; // the header area, each has an offset and a size. [0] is the header of headers
-	char(*m_names)[16];  // the element names area, each name has upto 15 characters
+	char(*m_names)[16] = NULL;  // the element names area, each name has upto 15 characters
 	void* m_data = NULL;	// the data area
 	bool m_publishers[MAX_PUBLISHERS];
+	ipc_element_stats* m_stats[MAX_PUBLISHERS]; // the live counters of the elements, NULL for not found yet
+	bool m_noStats[MAX_PUBLISHERS]; // the statistics table was found full for the element, it is not probed again
 
 	string m_title = "Roswell"; // the title of the shared memory
 	int m_fd = -1; // the desciber id of the shared memory
 	int m_size = 0; // the total size of the shared memory
+	bool m_readonly = false; // the segment is mapped for reading only
 
 	int m_err = 0;
-	string m_message = "";
+	ipc_message m_message;
+};
+
+// the type of a typed message, taken from the msg_type member of its struct, for example
+//	struct gps_fix
+//	{
+//		static const int msg_type = MSG_USER + 1;
+//		double latitude;
+//		double longitude;
+//	};
+// A struct that cannot have the member is given its type by IPC_MESSAGE_TYPE(struct, type) out of any namespace.
+template<typename T> struct ipc_message_type
+{
+	static const int value = T::msg_type;
+};
+
+#define IPC_MESSAGE_TYPE(T, type) template<> struct ipc_message_type<T> {static const int value = (type);}
+
+// the checks of a typed message at compile time
+template<typename T> struct ipc_message_check
+{
+	static_assert(ipc_message_type<T>::value > 0 && ipc_message_type<T>::value <= 255, "the type of a message shall be 1-255");
+	static_assert(is_trivially_copyable<T>::value, "a typed message is sent by its bytes, it shall be trivially copyable");
+	static_assert(sizeof(T) <= MAX_FRAGMENTEDLENGTH, "a typed message shall be no longer than MAX_FRAGMENTEDLENGTH");
+	static_assert(alignof(T) <= alignof(max_align_t), "a typed message shall be aligned as the heap");
+	static const int type = ipc_message_type<T>::value;
 };
 
 class MsgQ
@@ -212,21 +961,64 @@ public:
 	// open new a channel for messages receiving with specified timeout
 	// @param	my_chn_name	the name of my channel, 1-8 characters
 	// @param	timeout_usec	timeout in microseconds, 10-1,000,000, 10us - 1s
-	MsgQ(string my_chn_name, long timeout_usec=10);
+	// @param	max_msgs	the max number of messages in my queue when it is created, limited by /proc/sys/fs/mqueue/msg_max
+	// @param	msg_size	the max size of a message in my queue when it is created, 128-65536, limited by /proc/sys/fs/mqueue/msgsize_max
+	//						An existing queue keeps its geometry. Check GetErrorMessage() for the geometry actually applied.
+	MsgQ(string my_chn_name, long timeout_usec=10, long max_msgs=MQ_DEFAULT_MAXMSG, long msg_size=MQ_DEFAULT_MSGSIZE);
 	~MsgQ();
 
-	// receive a message sent to me
+	// a MsgQ owns its descriptors and mappings, it is not copyable
+	MsgQ(const MsgQ&) = delete;
+	MsgQ& operator=(const MsgQ&) = delete;
+
+	// receive a message sent to me. Fragmented messages are returned after all fragments are reassembled.
 	// @param SenderName (out)	the sender name in string, 1-15 characters
 	// @param type (out)		the type of the message, can be MSG_NULL (0), MSG_DATA (1), MSG_COMMAND (6), ...
-	// @param len (out)			the length of the message data, 0-1024
+	// @param len (out)			the length of the message data, 0-1MB
+	// @param data (out)		the pointer to the received data without message header
+	// @param size				the size of the data buffer. A longer message is dropped with its length reported in len
+	// @return					the sender channel, positive for success, negtive for error code. -6 for a message of another MQ_WIRE_VERSION, which is dropped
+	int ReceiveMsg(string* SenderName, int* type, int* len, void* data, int size = MAX_MESSAGELENGTH);
+
+	// receive a message sent to me without blocking. It is the same as ReceiveMsg() with a zero timeout.
+	// @param SenderName (out)	the sender name in string, 1-15 characters
+	// @param type (out)		the type of the message
+	// @param len (out)			the length of the message data, 0-1MB
 	// @param data (out)		the pointer to the received data without message header
-	// @return					the sender channel, positive for success, negtive for error code
-	int ReceiveMsg(string* SenderName, int* type, int* len, void* data);
+	// @param size				the size of the data buffer. A longer message is dropped with its length reported in len
+	// @return					the sender channel, 0 for no message, negtive for error code
+	int PollMsg(string* SenderName, int* type, int* len, void* data, int size = MAX_MESSAGELENGTH);
+
+	// send a typed message, its type and its length are taken from its struct at compile time
+	// @param DestChn	the destnation channel, 0 for the last sender, 1 for main
+	// @param msg		the message, a struct with its type, see ipc_message_type
+	// @param priority	the priority of the message, MSG_PRIORITY_LOW to MSG_PRIORITY_URGENT, or MSG_PRIORITY_DEFAULT
+	// @return			the same as SendMsg()
+	template<typename T> int Send(int DestChn, const T& msg, int priority = MSG_PRIORITY_DEFAULT)
+	{
+		return SendMsg(DestChn, ipc_message_check<T>::type, sizeof(T), const_cast<T*>(&msg), priority);
+	}
+
+	// send a typed message to a destnation by its name
+	// @param DestName	the destnation name
+	// @param msg		the message, a struct with its type, see ipc_message_type
+	// @param priority	the priority of the message, MSG_PRIORITY_LOW to MSG_PRIORITY_URGENT, or MSG_PRIORITY_DEFAULT
+	// @return			the same as SendMsg()
+	template<typename T> int Send(const char* DestName, const T& msg, int priority = MSG_PRIORITY_DEFAULT)
+	{
+		return SendMsg(DestName, ipc_message_check<T>::type, sizeof(T), const_cast<T*>(&msg), priority);
+	}
+	template<typename T> int Send(const string& DestName, const T& msg, int priority = MSG_PRIORITY_DEFAULT)
+	{
+		return Send(DestName.c_str(), msg, priority);
+	}
 
 	// get the channel of destnation by its name. 
 	// @param DestName	the destnation name, empty for the last sender
-	// @return			the channel of  ID	number greater than 1, 1 is reserved for main, negtive for error code
+	// @return			the channel of  ID	number greater than 1, 1 is reserved for main, negtive for error code.
+	//					-2 when the receiver registered in the directory has gone, checked at most every MQ_ALIVE_INTERVAL for a known channel
 	int GetDestChannel(string DestName);
+	int GetDestChannel(const char* DestName);
 
 	// get the name of the channel
 	// @param channel	the channel number
@@ -236,18 +1028,50 @@ public:
 	// send a message to the destnation
 	// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
 	// @param type		the type of the message, for example MSG_COMMAND (6)
-	// @param len		the length of the message net data, can be 0 or positive
+	// @param len		the length of the message net data, 0-1MB. Data longer than a queue message is sent in fragments
 	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
 	// @return			bytes of data actually sent, positive for success, negtive for error code.
-	int SendMsg(int DestChn, int type, int len, void* data);
+	int SendMsg(int DestChn, int type, int len, void* data, int priority = MSG_PRIORITY_DEFAULT);
+
+	// send a message to the destnation without waiting for its credits or queue space, see ipc-coro.h
+	// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+	// @param type		the type of the message, for example MSG_COMMAND (6)
+	// @param len		the length of the message net data, 0-1MB. The fragments after the first one still wait for queue space
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+	// @return			the same as SendMsg(), -1 with errno EAGAIN or ETIMEDOUT when the destnation has no credits or space
+	int TrySendMsg(int DestChn, int type, int len, void* data, int priority = MSG_PRIORITY_DEFAULT);
 
 	// send a message to the destnation
 	// @param DestName	the destnation name, empty for reply to the last sender
 	// @param type		the type of the message, for example MSG_COMMAND (6)
-	// @param len		the length of the message net data, can be 0 or positive
+	// @param len		the length of the message net data, 0-1MB. Data longer than a queue message is sent in fragments
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+	// @return			the destnation channel, positive for success, negtive for error code
+	int SendMsg(string DestName, int type, int len, void* data, int priority = MSG_PRIORITY_DEFAULT);
+	int SendMsg(const char* DestName, int type, int len, void* data, int priority = MSG_PRIORITY_DEFAULT);
+
+	// send a message with a time to live. The receiver drops it unread once it is older than the TTL.
+	// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+	// @param type		the type of the message, for example MSG_COMMAND (6)
+	// @param len		the length of the message net data, 0-1MB
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @param ttl_usec	the time to live in microseconds, 0 for no expiry
+	// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+	// @return			bytes of data actually sent, positive for success, negtive for error code.
+	int SendMsgTTL(int DestChn, int type, int len, void* data, long ttl_usec, int priority = MSG_PRIORITY_DEFAULT);
+
+	// send a message with a time to live. The receiver drops it unread once it is older than the TTL.
+	// @param DestName	the destnation name, empty for reply to the last sender
+	// @param type		the type of the message, for example MSG_COMMAND (6)
+	// @param len		the length of the message net data, 0-1MB
 	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @param ttl_usec	the time to live in microseconds, 0 for no expiry
+	// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
 	// @return			the destnation channel, positive for success, negtive for error code
-	int SendMsg(string DestName, int type, int len, void* data);
+	int SendMsgTTL(string DestName, int type, int len, void* data, long ttl_usec, int priority = MSG_PRIORITY_DEFAULT);
 
 	// send a command to the destnation
 	// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
@@ -261,32 +1085,836 @@ public:
 	// @return			the destnation channel, positive for success, negtive for error code
 	int SendCmd(string DestName, string s);
 
+	// send a request to the destnation, the reply shall carry the same correlation ID. RpcClient makes it easier.
+	// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+	// @param corr		the correlation ID of the request, not 0
+	// @param type		the type of the message, for example MSG_QUERY (15)
+	// @param len		the length of the message net data, 0-1MB
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+	// @return			bytes of data actually sent, positive for success, negtive for error code.
+	int SendRequest(int DestChn, uint32_t corr, int type, int len, void* data, int priority = MSG_PRIORITY_DEFAULT);
+
+	// send a reply of a request to the destnation
+	// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+	// @param corr		the correlation ID of the request, GetMsgCorrelation() when the request is received
+	// @param type		the type of the message, for example MSG_DATA (17)
+	// @param len		the length of the message net data, 0-1MB
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+	// @return			bytes of data actually sent, positive for success, negtive for error code.
+	int SendReply(int DestChn, uint32_t corr, int type, int len, void* data, int priority = MSG_PRIORITY_DEFAULT);
+
+	// send a blob handle to the destnation. One reference of the blob is transferred to the receiver.
+	// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+	// @param handle	the handle of the blob allocated in BlobPool
+	// @param type		the type of the message, MSG_BLOB by default
+	// @return			bytes of data actually sent, positive for success, negtive for error code. The caller keeps the reference on error.
+	int SendBlob(int DestChn, uint64_t handle, int type = MSG_BLOB);
+
+	// send a blob handle to the destnation. One reference of the blob is transferred to the receiver.
+	// @param DestName	the destnation name, empty for reply to the last sender
+	// @param handle	the handle of the blob allocated in BlobPool
+	// @param type		the type of the message, MSG_BLOB by default
+	// @return			the destnation channel, positive for success, negtive for error code. The caller keeps the reference on error.
+	int SendBlob(string DestName, uint64_t handle, int type = MSG_BLOB);
+
+	// enable the conflation of my channel. A conflated message replaces the not yet received one with the same key in place,
+	// so that the queue holds at most one doorbell for each key and a slow receiver gets only the latest values.
+	// The table is initialized only when it is created, a receiver started again keeps the table and the keys of its senders.
+	// @param keys		the max number of keys of a new table, rounded up to power of 2
+	// @return			0 on success, negtive for error code
+	int EnableConflation(int keys = MQ_CONFLATION_KEYS);
+
+	// send a latest-state message to a conflating destnation. An unreceived message with the same key is replaced.
+	// @param DestChn	the destnation channel, 0 for the last sender, 1 for main
+	// @param key		the key of the state, for example the ID of the updated element
+	// @param type		the type of the message, for example MSG_UPDATE (16)
+	// @param len		the length of the message net data, 0-984
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @return			bytes of data sent or conflated, positive for success, negtive for error code.
+	//					-6 when another sender has been writing the slot for MQ_CONFLATION_TIMEOUT
+	int SendConflated(int DestChn, uint64_t key, int type, int len, void* data);
+
+	// send a latest-state message to a conflating destnation. An unreceived message with the same key is replaced.
+	// @param DestName	the destnation name in string, 1-8 characters
+	// @param key		the key of the state, for example the ID of the updated element
+	// @param type		the type of the message, for example MSG_UPDATE (16)
+	// @param len		the length of the message net data, 0-984
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @return			the destnation channel, positive for success, negtive for error code
+	int SendConflated(string DestName, uint64_t key, int type, int len, void* data);
+
+	// subscribe a topic, the messages published after the subscribing will be received by ReceiveTopic()
+	// @param TopicName	the name of the topic, 1-8 characters
+	// @return			the topic ID, positive for success, negtive for error code
+	int Subscribe(string TopicName);
+
+	// publish a message to all subscribers of a topic. The message is written once in shared memory.
+	// @param TopicName	the name of the topic, 1-8 characters
+	// @param type		the type of the message, for example MSG_UPDATE (16)
+	// @param len		the length of the message net data, 0-2016
+	// @param data		the pointer to the data to be published, can be NULL in case len is 0
+	// @return			the topic ID, positive for success, negtive for error code.
+	//					-6 when the slot of the message is held by an older publisher alive for MQ_TOPIC_CLAIM_TIMEOUT
+	int Publish(string TopicName, int type, int len, void* data);
+
+	// receive a message of a subscribed topic. It blocks until a message is published or the timeout expires.
+	// @param TopicID			the topic ID returned by Subscribe()
+	// @param SenderName (out)	the publisher name in string, 1-8 characters
+	// @param type (out)		the type of the message
+	// @param len (out)			the length of the message data
+	// @param data (out)		the pointer to the received data without message header
+	// @param size				the size of the data buffer. A longer message is dropped with its length reported in len
+	// @return					the topic ID for a message, 0 for no message, negtive for error code
+	int ReceiveTopic(int TopicID, string* SenderName, int* type, int* len, void* data, int size = MAX_MESSAGELENGTH);
+
+	// get the number of messages lost by falling behind the publishers of a subscribed topic
+	// @param TopicID	the topic ID returned by Subscribe()
+	// @return			the number of messages lost
+	uint64_t GetTopicLost(int TopicID) {return TopicID > 0 && TopicID <= m_totalTopics ? m_Topics[TopicID].lost : 0;};
+
+	// join a consumer group as one of its workers. Every message sent to the group is received by exactly one worker.
+	// Workers may be in one or several processes, each of them uses its own MsgQ.
+	// @param GroupName	the name of the group, 1-8 characters
+	// @return			the group ID, positive for success, negtive for error code
+	int JoinGroup(string GroupName);
+
+	// leave a consumer group. The messages left in the group are received by the other workers.
+	// @param GroupID	the group ID returned by JoinGroup()
+	// @return			0 on success, negtive for error code
+	int LeaveGroup(int GroupID);
+
+	// send a message to a consumer group, it is received by the first idle worker. It blocks while the group is full or the timeout expires.
+	// A slot claimed by a sender or a worker that has gone is taken back by the others, its message is lost.
+	// @param GroupName	the name of the group, 1-8 characters
+	// @param type		the type of the message, for example MSG_UPDATE (16)
+	// @param len		the length of the message net data, 0-2016
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @return			the group ID, positive for success, negtive for error code
+	int SendGroup(string GroupName, int type, int len, void* data);
+
+	// receive a message of a joined group. It blocks until a message is sent to the group or the timeout expires.
+	// @param GroupID			the group ID returned by JoinGroup()
+	// @param SenderName (out)	the sender name in string, 1-8 characters
+	// @param type (out)		the type of the message
+	// @param len (out)			the length of the message data
+	// @param data (out)		the pointer to the received data without message header
+	// @param size				the size of the data buffer. A longer message is dropped with its length reported in len
+	// @return					the group ID for a message, 0 for no message, negtive for error code
+	int ReceiveGroup(int GroupID, string* SenderName, int* type, int* len, void* data, int size = MAX_MESSAGELENGTH);
+
+	// get the number of messages waiting in a consumer group
+	// @param GroupID	the group ID returned by JoinGroup() or SendGroup()
+	// @return			the number of messages not received yet
+	int GetGroupPending(int GroupID);
+
+	// get the number of workers joined a consumer group
+	// @param GroupID	the group ID returned by JoinGroup() or SendGroup()
+	// @return			the number of workers
+	int GetGroupWorkers(int GroupID) {return GroupID > 0 && GroupID <= m_totalGroups ? static_cast<int>(__atomic_load_n(&m_Groups[GroupID].ring->workers, __ATOMIC_RELAXED)) : 0;};
+
+	// enable the bounded send queue. The sending never blocks, messages without credits are queued and retried in order.
+	// @param depth		the max number of messages in the send queue, 0 to send without the queue
+	// @param async		true to retry the queue by a thread of this MsgQ, false to retry it by FlushSendQueue() and the sending
+	// @return			0 on success, negtive for error code
+	int EnableSendQueue(int depth, bool async = true);
+
+	// retry the messages in the send queue
+	// @return			the number of messages remained in the send queue
+	int FlushSendQueue();
+
+	// get the number of messages waiting in the send queue
+	// @return			the number of messages in the send queue
+	int GetPendingSends();
+
+	// get the credits of a destnation, the number of messages it can take without blocking
+	// @param DestChn	the destnation channel, 0 for the last sender, 1 for main
+	// @param priority	the priority of the messages, those below MSG_PRIORITY_HIGH do not get the reserved credits
+	// @return			the credits, negtive for unknown
+	int GetCredits(int DestChn, int priority = MSG_PRIORITY_URGENT);
+
+	// check the backpressure of a destnation
+	// @param DestChn	the destnation channel, 0 for the last sender, 1 for main
+	// @return			true when the destnation has no credit or messages to it are waiting in the send queue
+	bool IsBackpressured(int DestChn);
+
+	// open the descriptors of all known channels that have not been opened yet. 
+	// Call it off the hot path, for example after the first messages from new senders, to avoid the mq_open in next sending.
+	// @return			the number of channels opened, negtive for error code
+	int OpenChannels();
+
+	// get the descriptor of my queue. It can be polled by epoll for incoming messages, see ipc-coro.h
+	// @return			the descriptor of my queue
+	int GetReceiveFd() {return m_myChn;};
+
+	// get the descriptor of a destnation queue, it is opened when not yet. It can be polled by epoll for queue space
+	// @param DestChn	the destnation channel, 0 for the last sender, 1 for main
+	// @return			the descriptor, negtive for error code
+	int GetChannelFd(int DestChn);
+
 	// get the error message of last operation
 	// @return 		the error message of last operation
-	string GetErrorMessage() {return m_message;};
+	string GetErrorMessage() {return m_message.str();};
+
+	// get the status of last operation
+	// @return		the status, IPC_STATUS_TEXT when the error message is a text
+	ipc_status GetStatus() {return m_message.GetStatus();};
 	
 	// get the timestamp of last received message
 	// @return 		the time stamp of last received message, it is actually the remain microsecond of the moment the message was sent
-	int GetMsgTimestamp() {return m_ts;};
+	int GetMsgTimestamp() {return static_cast<int>(m_ts / 1000 % 1000000);};
+
+	// get the correlation ID of last received message
+	// @return 		the correlation ID of the request or the reply, 0 for a plain message
+	uint32_t GetMsgCorrelation() {return m_corr;};
+
+	// get the flags of last received message
+	// @return 		MQ_FLAG_REQUEST for a request, MQ_FLAG_REPLY for a reply, 0 for a plain message
+	int GetMsgFlags() {return m_flags;};
+
+	// get the sending time of last received message
+	// @return 		the CLOCK_MONOTONIC time in nanoseconds when the last received message was sent
+	uint64_t GetMsgSendTime() {return m_ts;};
+
+	// get the latency of last received message
+	// @return 		the nanoseconds from the sending to the receiving of the last received message
+	int64_t GetMsgLatency() {return static_cast<int64_t>(m_receiveTime - m_ts);};
+
+	// get the number of messages dropped unread for their expired TTL
+	// @param chn		the sender channel, 0 for all channels
+	// @return			the number of expired messages
+	uint64_t GetExpired(int chn = 0);
+
+	// set the receiving mode. The default mode blocks in mq_timedreceive with a deadline of CLOCK_REALTIME_COARSE, which is 
+	// cheap but has a granularity of some milliseconds. The precise mode waits with ppoll on the monotonic clock, so that the 
+	// timeouts of 10us-1s hold. It can busy poll my directory counters before blocking, for receivers pinned to isolated cores.
+	// The precise mode sets the timer slack of the calling thread to 1ns, call it from the receiving thread.
+	// @param precise	true for the precise mode on the monotonic clock
+	// @param spin_usec	the max microseconds to busy poll before blocking in the precise mode, 0 for blocking at once
+	void SetReceiveMode(bool precise, long spin_usec = 0);
+
+	// enable or disable the latency histograms of received messages per sender channel and per message type
+	// @param enable	true to record the latency of every received message
+	void EnableLatencyStats(bool enable = true) {m_latencyStats = enable;};
+
+	// get the latency histogram of a sender channel
+	// @param channel	the sender channel
+	// @return			the histogram, empty when no message from the channel has been recorded
+	shared_ptr<LatencyHistogram> GetChannelLatency(int channel);
+
+	// get the latency histogram of a message type
+	// @param type		the type of the message, 1-255
+	// @return			the histogram, empty when no message of the type has been recorded
+	shared_ptr<LatencyHistogram> GetTypeLatency(int type);
+
+	// dump all latency histograms, one line for each sender channel and each message type
+	// @return			the lines in format of LatencyHistogram::Dump()
+	string DumpLatencyStats();
+
+	// get the priority of last received message
+	// @return 		the priority of last received message, 0-3
+	int GetMsgPriority() {return m_prio;};
+
+	// get the max number of messages in my queue
+	// @return		the depth of my queue
+	int GetMaxMsgs() {return m_maxMsgs;};
+
+	// get the max size of a message in my queue
+	// @return		the max message size of my queue, including the message header
+	int GetMsgSize() {return m_msgSize;};
 
 protected:
-	mq_buffer send_buf;
-	mq_buffer receive_buf;
+	vector<char> m_sendBuffer; // the buffer for sending, in size of my message size
+	vector<char> m_receiveBuffer; // the buffer for receiving, in size of my message size
+	vector<char> m_held; // the message taken from my kernel queue and held while my in-process queue has higher ones
+	int m_heldLen = 0; // the length of the message held, 0 for none
+	unsigned int m_heldPrio = 0; // the priority of the message held
+	mq_reassembly m_Reassembly[MAX_MESSAGECHANNELS]; // the reassembly states of fragmented messages from each sender
+	int m_ChnMsgSize[MAX_MESSAGECHANNELS]; // the message size of each destnation queue, 0 for unknown
+	uint32_t m_seq = 0; // the sequence number of the last sent message
+	uint32_t m_sendLock = 0; // the futex lock of the sending threads on the send buffer and of the channel table, 0 when free
+	int m_maxMsgs = MQ_DEFAULT_MAXMSG;
+	int m_msgSize = MQ_DEFAULT_MSGSIZE;
 	uint64_t m_myChnName = 0;
 	int m_myChn = 0;
 	int m_totalChannels = 0;
-	uint32_t m_ts = 0;
-	mqd_t m_Channels[MAX_MESSAGECHANNELS];
+	uint64_t m_ts = 0;
+	uint64_t m_receiveTime = 0;
+	uint32_t m_corr = 0;
+	uint16_t m_flags = 0;
+	unsigned int m_prio = 0;
+	bool m_latencyStats = false;
+	shared_ptr<LatencyHistogram> m_ChnLatency[MAX_MESSAGECHANNELS]; // created by the receiving thread and published atomically
+	shared_ptr<LatencyHistogram> m_TypeLatency[256];
+	mqd_t m_Channels[MAX_MESSAGECHANNELS]; // the descriptors for sending, -1 for not opened yet
 	int m_timeout = 10;
+	bool m_precise = false; // receive in the precise mode on the monotonic clock
+	long m_spin = 0; // the microseconds to busy poll before blocking in the precise mode
 	uint64_t m_ChnNames[MAX_MESSAGECHANNELS];
+	int16_t m_ChnHash[MQ_HASHSIZE]; // hash table of channel names, 0 for empty slot
+	mq_topic_state m_Topics[MAX_TOPICS + 1]; // the topics published or subscribed, [0] is not used
+	int m_totalTopics = 0;
+	mq_group_state m_Groups[MAX_GROUPS + 1]; // the consumer groups joined or sent to, [0] is not used
+	int m_totalGroups = 0;
+	int m_lastChn = 0; // the channel of the last sender
+	mq_directory* m_directory = NULL; // the shared channel directory
+	mq_directory_entry* m_myEntry = NULL; // my entry in the directory
+	mq_directory_entry* m_ChnEntry[MAX_MESSAGECHANNELS]; // the directory entries of the channels, NULL for not found yet
+	uint64_t m_ChnAlive[MAX_MESSAGECHANNELS]; // the CLOCK_MONOTONIC time the receiver of each channel was last seen alive
+	ipc_channel_stats* m_myStats = NULL; // the live counters of my channel
+	ipc_channel_stats* m_ChnStats[MAX_MESSAGECHANNELS]; // the live counters of the channels, NULL for not found yet
+	uint64_t m_ChnExpired[MAX_MESSAGECHANNELS]; // the messages dropped for their expired TTL from each sender channel
+	shared_ptr<mq_send_queue> m_sendQueue;
+	shared_ptr<mq_conflation_state> m_conflation; // my conflation table, NULL for not conflating
+	shared_ptr<mq_local_queue> m_local; // my in-process queue, registered by my channel name
+	shared_ptr<mq_local_queue> m_ChnLocal[MAX_MESSAGECHANNELS]; // the in-process queues of the channels in the same process
+	uint8_t m_ChnLocalState[MAX_MESSAGECHANNELS]; // 0 for not looked up yet, 1 for in-process, 2 for another process
+	mq_conflation* m_ChnConflation[MAX_MESSAGECHANNELS]; // the conflation tables of the channels, NULL for not mapped yet
 
 	int m_err = 0;
-	string m_message = "";
+	ipc_message m_message;
 
 	// clear a message queue
 	// @param DestName	the destnation name, empty for my channel name
 	// @return 			0 on success, negtive for error code
 	int ClearQueue(string DestName = "");
+
+	// find a channel by its name in the local hash table
+	// @param name		the channel name in uint64_t style
+	// @return			the channel, 0 for not found
+	int FindChannel(uint64_t name);
+
+	// add a channel to the local list without opening it
+	// @param name		the channel name in uint64_t style
+	// @return			the channel, negtive for error code
+	int AddChannel(uint64_t name);
+
+	// open the descriptor of a channel for sending
+	// @param channel	the channel number
+	// @return			0 on success, negtive for error code
+	int OpenChannel(int channel);
+
+	// send a message to the destnation with the correlation ID and flags in its header
+	// @param DestChn	the destnation channel, 0 for reply to last sender, 1 for main
+	// @param type		the type of the message
+	// @param len		the length of the message net data, 0-1MB
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+	// @param corr		the correlation ID, 0 for none
+	// @param flags		the flags of the message, MQ_FLAG_REQUEST or MQ_FLAG_REPLY
+	// @param deadline	the CLOCK_MONOTONIC time in nanoseconds after which the message expires, 0 for none
+	// @return			bytes of data actually sent, positive for success, negtive for error code.
+	int Send(int DestChn, int type, int len, void* data, int priority, uint32_t corr, uint16_t flags, uint64_t deadline = 0);
+
+	// receive a message sent to me
+	// @param SenderName (out)	the sender name in string
+	// @param type (out)		the type of the message
+	// @param len (out)			the length of the message data
+	// @param data (out)		the pointer to the received data without message header
+	// @param size				the size of the data buffer
+	// @param timeout_usec		the timeout in microseconds, 0 for no blocking
+	// @return					the sender channel, 0 for no message, negtive for error code
+	int Receive(string* SenderName, int* type, int* len, void* data, int size, long timeout_usec);
+
+	// get the in-process queue of a channel owned by the same process
+	// @param channel	the channel number
+	// @return			the in-process queue, NULL for a channel of another process
+	mq_local_queue* GetLocalQueue(int channel);
+
+	// send a message through the in-process queue of the destnation
+	// @param DestChn	the destnation channel
+	// @param type		the type of the message
+	// @param len		the length of the message net data, 0-1MB
+	// @param data		the pointer to the data to be sent
+	// @param priority	the priority of the message, 0-3
+	// @param corr		the correlation ID, 0 for none
+	// @param flags		the flags of the message
+	// @param deadline	the CLOCK_MONOTONIC time in nanoseconds after which the message expires, 0 for none
+	// @return			bytes of data actually sent, positive for success, negtive for error code.
+	int SendLocal(int DestChn, int type, int len, void* data, int priority, uint32_t corr, uint16_t flags, uint64_t deadline);
+
+	// receive a message from my in-process queue without blocking
+	// @param msg		the buffer for the message header and its inline data
+	// @param payload (out)	the pointer to the message data
+	// @return			true for a message received
+	bool ReceiveLocal(mq_buffer* msg, char** payload);
+
+	// get the highest priority of the messages in my in-process queue
+	// @return			the priority, -1 for empty
+	int PeekLocal();
+
+	// take the head of my kernel queue without blocking and hold it, so that it is received after the higher in-process messages
+	void HoldKernelMessage();
+
+	// grant a credit back to the senders for a message received from my kernel queue
+	void GrantCredit();
+
+	// hand the messages left in my in-process queue and the one held back to my kernel queue, so that the next receiver
+	// of my channel gets them. The ones that do not fit are counted as send failures of my channel
+	void ForwardLocal();
+
+	// receive a message of my queue in the precise mode, busy polling for the spin budget then blocking in ppoll
+	// @param buffer	the receiving buffer
+	// @param size		the size of the receiving buffer
+	// @param deadline	the deadline in CLOCK_MONOTONIC nanoseconds
+	// @return			the size of the message received, -1 for error with errno ETIMEDOUT at the deadline
+	int ReceivePrecise(char* buffer, size_t size, uint64_t deadline);
+
+	// get the directory entry of a channel
+	// @param channel	the channel number
+	// @return			the directory entry, NULL for not found
+	mq_directory_entry* GetChannelEntry(int channel);
+
+	// check the receiver of a known channel is alive, at most once every MQ_ALIVE_INTERVAL
+	// @param channel	the channel number
+	// @return			the channel, -2 when its receiver has gone
+	int CheckChannelAlive(int channel);
+
+	// count a failed sending to a channel by its errno
+	// @param channel	the destnation channel
+	// @param err		the errno of the sending
+	void CountSendFailure(int channel, int err);
+
+	// send a message through the send queue, it is queued when the destnation has no credits
+	// @param DestChn	the destnation channel
+	// @param buffer	the message with its header
+	// @param size		the size of the message
+	// @param priority	the priority of the message
+	// @return			0 for sent, 1 for queued, negtive for error code
+	int QueueSend(int DestChn, const char* buffer, int size, unsigned int priority);
+
+	// map the conflation table of a channel
+	// @param name		the channel name in uint64_t style
+	// @param keys		the number of slots to create the table, 0 to map an existing one
+	// @return			the table, NULL for not conflating
+	mq_conflation* MapConflation(uint64_t name, uint32_t keys);
+
+	// read the latest value of the slot rung by a doorbell into the conflation buffer
+	// @param msg		the doorbell, its header is updated to the conflated message
+	// @return			true for a new value, false for one received already
+	bool ReadConflated(mq_buffer* msg);
+
+	// find a topic by its name, map its ring if it is new
+	// @param TopicName	the name of the topic, 1-8 characters
+	// @return			the topic ID, positive for success, negtive for error code
+	int OpenTopic(string TopicName);
+
+	// find a consumer group by its name, map its ring if it is new
+	// @param GroupName	the name of the group, 1-8 characters
+	// @return			the group ID, positive for success, negtive for error code
+	int OpenGroup(string GroupName);
+
+	// record the latency of a received message
+	// @param channel	the sender channel
+	// @param type		the type of the message
+	// @param ns		the latency in nanoseconds
+	void RecordLatency(int channel, int type, uint64_t ns);
+
+	// look up or register a channel name in the shared directory
+	// @param name		the channel name in uint64_t style
+	// @param create	true to claim an entry for the name when not found
+	// @return			the directory entry, NULL for not found
+	mq_directory_entry* LookupDirectory(uint64_t name, bool create);
 };
 
-string GetDateTime(time_t sec, time_t usec);
\ No newline at end of file
+class BlobPool
+{
+public:
+	// attach the blob pool, create it if not existing
+	// @param title		the name of the pool, the shared memory is named as /title-blobs
+	BlobPool(string title = "Roswell");
+	~BlobPool();
+
+	// allocate a blob with one reference
+	// @param size		the size of the blob, 1 to 8MB
+	// @return			the handle of the blob, 0 for error
+	uint64_t Alloc(int size);
+
+	// add a reference to a blob
+	// @param handle	the handle of the blob
+	// @return			the reference count after adding, negtive for error code
+	int AddRef(uint64_t handle);
+
+	// release a reference of a blob. The blob is returned to the pool when its last reference is released.
+	// @param handle	the handle of the blob
+	// @return			the reference count remained, 0 when the blob is returned to the pool, negtive for error code
+	int Release(uint64_t handle);
+
+	// get the pointer to the data of a blob
+	// @param handle	the handle of the blob
+	// @return			the pointer to the data, NULL for an invalid or stale handle
+	void* GetPtr(uint64_t handle);
+
+	// get the size of a blob
+	// @param handle	the handle of the blob
+	// @return			the size requested at the allocation, negtive for error code
+	int GetSize(uint64_t handle);
+
+	// get the error message of last operation
+	// @return		the error message
+	string GetErrorMessage() {return m_message;};
+
+protected:
+	blob_pool* m_pool = NULL;
+	string m_title = "Roswell";
+
+	int m_err = 0;
+	string m_message = "";
+
+	// get the header of a blob by its handle
+	// @param handle	the handle of the blob
+	// @param gen		true to check the generation of the handle
+	// @return			the header of the blob, NULL for an invalid handle
+	blob_header* GetHeader(uint64_t handle, bool gen = true);
+};
+
+#define RPC_ERR_TIMEOUT -1 // the request timed out before its reply was received
+#define RPC_ERR_CANCELLED -2 // the request was cancelled
+#define RPC_ERR_SEND -3 // the request could not be sent
+#define RPC_ERR_DEST -4 // the destnation name is unknown
+
+// the completion of a request
+struct RpcReply
+{
+	int status; // the sender channel of the reply, positive for success, RPC_ERR_* for failure
+	int type; // the type of the reply
+	vector<char> data; // the data of the reply
+};
+
+typedef function<void(const RpcReply& reply)> RpcCallback;
+
+// a request waiting for its reply
+struct rpc_pending
+{
+	uint64_t deadline; // the CLOCK_MONOTONIC time in nanoseconds when the request times out
+	RpcCallback callback; // the callback, or empty for the promise
+	shared_ptr<promise<RpcReply>> result;
+};
+
+class RpcClient
+{
+public:
+	// create a request/reply client over a message queue
+	// @param queue		the message queue to send requests and receive replies, owned by the caller
+	RpcClient(MsgQ* queue);
+	~RpcClient();
+
+	// send a request, its completion is notified by the future
+	// @param DestChn	the destnation channel, 1 for main
+	// @param type		the type of the message, for example MSG_QUERY (15)
+	// @param len		the length of the message net data, 0-1MB
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @param timeout_usec	the timeout of the request in microseconds
+	// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+	// @return			the future of the reply. Its status is RPC_ERR_SEND when the request could not be sent
+	future<RpcReply> Call(int DestChn, int type, int len, void* data, long timeout_usec = 1000000L, int priority = MSG_PRIORITY_DEFAULT);
+
+	// send a request, its completion is notified by the future
+	// @param DestName	the destnation name
+	// @return			the future of the reply. Its status is RPC_ERR_DEST for an unknown destnation, RPC_ERR_SEND when the request could not be sent
+	future<RpcReply> Call(string DestName, int type, int len, void* data, long timeout_usec = 1000000L, int priority = MSG_PRIORITY_DEFAULT);
+
+	// send a request, its completion is notified by the callback in Poll()
+	// @param DestChn	the destnation channel, 1 for main
+	// @param type		the type of the message, for example MSG_QUERY (15)
+	// @param len		the length of the message net data, 0-1MB
+	// @param data		the pointer to the data to be sent, can be NULL in case len is 0
+	// @param timeout_usec	the timeout of the request in microseconds
+	// @param callback	the callback with the reply
+	// @param priority	the priority of the message, 0-3, MSG_PRIORITY_DEFAULT for the default of the type
+	// @return			the ID of the request, 0 when the request could not be sent and the callback has been called
+	uint32_t Call(int DestChn, int type, int len, void* data, long timeout_usec, RpcCallback callback, int priority = MSG_PRIORITY_DEFAULT);
+
+	// send a request, its completion is notified by the callback in Poll()
+	// @param DestName	the destnation name
+	// @return			the ID of the request, 0 when the destnation is unknown or the request could not be sent, and the callback has been called
+	uint32_t Call(string DestName, int type, int len, void* data, long timeout_usec, RpcCallback callback, int priority = MSG_PRIORITY_DEFAULT);
+
+	// cancel a request, it is completed with RPC_ERR_CANCELLED
+	// @param id		the ID of the request
+	// @return			0 on success, negtive for no such a pending request
+	int Cancel(uint32_t id);
+
+	// receive a message, dispatch the replies and expire the requests timed out
+	// @param SenderName (out)	the sender name of other messages
+	// @param type (out)		the type of other messages
+	// @param len (out)			the length of other messages
+	// @param data (out)		the data of other messages
+	// @param size				the size of the data buffer
+	// @return					the sender channel of other messages, 0 for no message or a reply dispatched, negtive for error code
+	int Poll(string* SenderName, int* type, int* len, void* data, int size = MAX_MESSAGELENGTH);
+
+	// get the number of requests waiting for their replies
+	// @return			the number of pending requests
+	int GetPending();
+
+	// get the error message of last operation
+	// @return		the error message
+	string GetErrorMessage() {return m_message;};
+
+protected:
+	MsgQ* m_queue;
+	atomic<uint32_t> m_lastId{0}; // the requests are sent by any threads
+	map<uint32_t, rpc_pending> m_pending;
+	mutex m_mutex; // guards m_pending, so that the requests can be cancelled by other threads
+	vector<char> m_buffer; // the buffer for receiving
+
+	int m_err = 0;
+	string m_message = "";
+
+	// send a request and add it to the pending list
+	// @return			the ID of the request, 0 when the request could not be sent
+	uint32_t Send(int DestChn, int type, int len, void* data, long timeout_usec, int priority, rpc_pending& pending);
+
+	// fail a request that was not sent, it is completed with the failure
+	// @param pending	the request
+	// @param status	the failure, RPC_ERR_*
+	// @param message	the error message
+	// @return			0 for no request ID
+	uint32_t Fail(rpc_pending& pending, int status, string message);
+
+	// complete a request, called outside the lock
+	// @param pending	the pending request
+	// @param reply		the reply or the failure
+	void Complete(rpc_pending& pending, RpcReply& reply);
+
+	// complete the requests timed out
+	void Expire();
+};
+
+#define DISPATCH_NOHANDLER -10 // no handler for the type of the message
+#define DISPATCH_BADLENGTH -11 // the length of the message is not the size of its struct
+
+class MsgDispatcher
+{
+public:
+	// the handler of the raw messages, for the messages without the handler of their struct
+	// @param type		the type of the message
+	// @param len		the length of the message data
+	// @param data		the message data
+	// @param q			the queue the message was received by, to reply the last sender
+	typedef function<void(int type, int len, const void* data, MsgQ& q)> RawHandler;
+
+	MsgDispatcher();
+
+	// register the handler of a typed message, it replaces the handler of the same type
+	// @param h			the handler, void(const T& msg, MsgQ& q)
+	template<typename T> void On(function<void(const T&, MsgQ&)> h)
+	{
+		Register(ipc_message_check<T>::type, sizeof(T), [h](int, int, const void* data, MsgQ& q) {h(*static_cast<const T*>(data), q);});
+	}
+
+	// register the handler of the messages of the types without a handler
+	// @param h			the handler, an empty one to refuse them
+	void OnUnknown(RawHandler h) {m_unknown = h;};
+
+	// receive a message and dispatch it
+	// @param q			the queue to receive
+	// @param wait		true to wait for a message by the timeout of the queue, false to return at once
+	// @return			the sender channel when the message is dispatched, 0 for no message, negtive for error code
+	//					DISPATCH_NOHANDLER or DISPATCH_BADLENGTH when the message is refused
+	int Dispatch(MsgQ& q, bool wait = true);
+
+	// dispatch a message received
+	// @param type		the type of the message
+	// @param len		the length of the message data
+	// @param data		the message data, aligned as the heap
+	// @param q			the queue the message was received by
+	// @return			0 when the message is dispatched, DISPATCH_NOHANDLER or DISPATCH_BADLENGTH when it is refused
+	int Dispatch(int type, int len, const void* data, MsgQ& q);
+
+	// get the number of messages refused
+	// @return			the messages without a handler or of a wrong length
+	uint64_t GetRefused() {return m_refused;};
+
+private:
+	// register the handler of a type
+	// @param type		the type of the message, 1-255
+	// @param size		the size of the message
+	// @param h			the handler
+	void Register(int type, int size, RawHandler h);
+
+	// the handler of a type
+	struct dispatch_entry
+	{
+		int size = -1; // the size of the message, -1 for no handler
+		RawHandler handler;
+	};
+
+	dispatch_entry m_table[256]; // the handlers indexed by the message types
+	RawHandler m_unknown;
+	vector<char> m_buf; // the data received, as large as the largest message registered
+	string m_sender;
+	uint64_t m_refused = 0;
+};
+
+// format a date and time, the date and time of a second is formatted once by each thread
+// @param sec		the seconds since the epoch
+// @param usec		the microseconds in the second
+// @return			the local date and time, for example 2019-10-26 13:45:02.123456
+string GetDateTime(time_t sec, time_t usec);
+
+// start the asynchronous logger of this process. Log() keeps the lines in binary in a ring of the calling thread,
+// a background writer formats them and appends them to a file, or sends them as MSG_LOG messages
+// @param file		the file the lines are appended to, "" for stderr unless the lines are sent
+// @param dest		the destnation channel the lines are sent to as MSG_LOG, "" for none
+// @param my_chn_name	the channel name of the writer, required when the lines are sent
+// @return			0 for success, negtive for error code
+int StartLogger(string file = "", string dest = "", string my_chn_name = "");
+
+// stop the logger after the lines logged are written. It is stopped at the exit of the process as well
+void StopLogger();
+
+// get the number of lines dropped for the log ring of the thread was full
+// @return			the lines dropped by all the threads
+uint64_t GetLogDropped();
+
+// reserve a record in the log ring of the current thread
+// @param size		the size of the record with its arguments, multiple of 8
+// @return			the record, NULL when the logger is not started or the ring is full
+log_record* LogBegin(uint32_t size);
+
+// publish the record reserved to the background writer
+void LogCommit();
+
+// the size and the encoding of the log arguments
+inline uint32_t LogArgSize(const char* s)
+{
+	return 8 + ((strnlen(s, LOG_MAXSTRING) + 7) & ~7U);
+}
+
+inline uint32_t LogArgSize(char* s)
+{
+	return LogArgSize(const_cast<const char*>(s));
+}
+
+inline uint32_t LogArgSize(const string& s)
+{
+	return 8 + (((s.length() < LOG_MAXSTRING ? s.length() : LOG_MAXSTRING) + 7) & ~7U);
+}
+
+template<typename T> inline uint32_t LogArgSize(const T&)
+{
+	return 8;
+}
+
+inline char* LogArg(char* p, char* tag, const char* s, size_t len)
+{
+	uint64_t n = len < LOG_MAXSTRING ? len : LOG_MAXSTRING;
+	*tag = 's';
+	memcpy(p, &n, 8);
+	memcpy(p + 8, s, n);
+	return p + 8 + ((n + 7) & ~7U);
+}
+
+inline char* LogArg(char* p, char* tag, const char* s)
+{
+	return LogArg(p, tag, s, strnlen(s, LOG_MAXSTRING));
+}
+
+inline char* LogArg(char* p, char* tag, char* s)
+{
+	return LogArg(p, tag, s, strnlen(s, LOG_MAXSTRING));
+}
+
+inline char* LogArg(char* p, char* tag, const string& s)
+{
+	return LogArg(p, tag, s.data(), s.length());
+}
+
+inline char* LogArg(char* p, char* tag, double v)
+{
+	*tag = 'd';
+	memcpy(p, &v, 8);
+	return p + 8;
+}
+
+template<typename T> inline char* LogArg(char* p, char* tag, const T* v)
+{
+	*tag = 'p';
+	uint64_t n = reinterpret_cast<uintptr_t>(v);
+	memcpy(p, &n, 8);
+	return p + 8;
+}
+
+template<typename T> inline typename enable_if<is_integral<T>::value || is_enum<T>::value, char*>::type LogArg(char* p, char* tag, T v)
+{
+	*tag = is_signed<T>::value || is_enum<T>::value ? 'i' : 'u';
+	uint64_t n = is_signed<T>::value || is_enum<T>::value ? static_cast<uint64_t>(static_cast<int64_t>(v)) : static_cast<uint64_t>(v);
+	memcpy(p, &n, 8);
+	return p + 8;
+}
+
+inline uint32_t LogSize()
+{
+	return 0;
+}
+
+template<typename T, typename... Args> inline uint32_t LogSize(const T& v, const Args&... args)
+{
+	return LogArgSize(v) + LogSize(args...);
+}
+
+inline void LogEncode(char*, char*)
+{
+}
+
+template<typename T, typename... Args> inline void LogEncode(char* p, char* tag, const T& v, const Args&... args)
+{
+	LogEncode(LogArg(p, tag, v), tag + 1, args...);
+}
+
+// log a line by the asynchronous logger. It takes tens of nanoseconds, the line is formatted later by the background writer
+// @param format	the format of printf, it shall be kept till the line is written, for example a string literal.
+//					The length modifiers are not required, %d prints any integer and %f prints float or double
+// @param args		the arguments, integers, floats, doubles, strings or pointers. A string is kept up to 255 characters
+template<typename... Args> void Log(const char* format, const Args&... args)
+{
+	static_assert(sizeof...(Args) <= LOG_MAXARGS, "too many log arguments");
+	log_record* r = LogBegin(sizeof(log_record) + LogSize(args...));
+	if (!r)
+	{
+		return;
+	}
+
+	timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	r->ts = static_cast<uint64_t>(t.tv_sec) * 1000000000ULL + t.tv_nsec;
+	r->format = format;
+	r->nargs = sizeof...(Args);
+	LogEncode(reinterpret_cast<char*>(r + 1), r->tags, args...);
+	LogCommit();
+}
+
+// create a new trace ID, for example for a new sensor sample. It is unique among all processes
+// @return			the trace ID, never 0
+uint64_t NewTraceID();
+
+// set the trace ID of the current thread. It is carried by the messages sent by the thread.
+// The library sets it to the trace ID of a traced message received or a traced element read.
+// The tracepoints are recorded only when the library is built with IPC_TRACE, "make TRACE=1".
+// @param trace		the trace ID, 0 to stop carrying it
+void SetTraceID(uint64_t trace);
+
+// get the trace ID of the current thread
+// @return			the trace ID, 0 for none
+uint64_t GetTraceID();
+
+// get the live statistics shared by all processes, it is mapped once in a process
+// @return			the statistics, NULL when it is not available
+ipc_stats* GetStats();
+
+// look up or claim the live counters of a channel
+// @param name		the channel name in uint64_t style
+// @return			the counters, NULL when the statistics is not available or full
+ipc_channel_stats* GetChannelStats(uint64_t name);
+
+// get the CLOCK_MONOTONIC time
+// @return			the monotonic time in nanoseconds, same in all processes
+uint64_t GetMonotonicTime();
+
+// get the default priority of a message type
+// @param type		the type of the message, for example MSG_COMMAND (6)
+// @return			the priority of the type, MSG_PRIORITY_LOW to MSG_PRIORITY_URGENT
+int GetDefaultPriority(int type);
\ No newline at end of file
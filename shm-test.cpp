@@ -49,8 +49,8 @@ int main(void)
 
 	// define two message queues
 	printf("Message queues: \n");
-	MsgQ server = MsgQ("main", 1000000L);
-	MsgQ client = MsgQ("client", 1000);
+	MsgQ server("main", 1000000L);
+	MsgQ client("client", 1000);
 
 	printf("Now create publishers in shared memory.\n");
 	int sh_position = myShMem.CreatePublisher("GPS-position", 0);  // demo a publisher in string. 0 is used for string type